@@ -0,0 +1,414 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "provenance.h"
+#include "provenanceW3CJSON.h"
+#include "provenanceSPADEJSON.h"
+#include "provenanceBinary.h"
+#include "workload.h"
+
+/*
+ * Drives synthetic workloads through provenance_relay_replay, i.e. the
+ * relay callbacks, prov_record/long_prov_record, the serialisers and their
+ * append and flush paths, and reports throughput and per element latency.
+ * The latency of an element is the time spent in the callback serialising
+ * and appending it, it is not measured without serialiser.
+ */
+
+/* log-linear histogram, 8 sub-buckets per power of two nanoseconds */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  (64 << HIST_SUB_BITS)
+
+struct histogram {
+  uint64_t count[HIST_BUCKETS];
+  struct histogram* next;
+};
+
+static struct histogram* histograms = NULL;
+static pthread_mutex_t histograms_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct histogram* hist = NULL;
+static _Atomic uint64_t output_bytes = 0;
+static _Atomic uint64_t errors = 0;
+
+static inline uint64_t now_ns(void){
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static inline uint32_t hist_bucket(uint64_t ns){
+  uint32_t msb;
+
+  if(ns < (1 << HIST_SUB_BITS))
+    return ns;
+  msb = 63 - __builtin_clzll(ns);
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+         | ((ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/* lowest value falling in a bucket */
+static inline uint64_t hist_value(uint32_t bucket){
+  uint32_t shift = bucket >> HIST_SUB_BITS;
+
+  if(shift == 0)
+    return bucket;
+  return ((uint64_t)((1 << HIST_SUB_BITS) | (bucket & ((1 << HIST_SUB_BITS) - 1))))
+         << (shift - 1);
+}
+
+/* per replay thread */
+static void init(void){
+  hist = (struct histogram*)calloc(1, sizeof(struct histogram));
+  if(!hist)
+    exit(-1);
+  pthread_mutex_lock(&histograms_lock);
+  hist->next = histograms;
+  histograms = hist;
+  pthread_mutex_unlock(&histograms_lock);
+}
+
+static inline void record_latency(uint64_t start){
+  hist->count[hist_bucket(now_ns() - start)]++;
+}
+
+static void log_error(char* error){
+  if(atomic_fetch_add(&errors, 1) < 10)
+    fprintf(stderr, "libprovenance: %s\n", error);
+}
+
+static void count_iov(const struct iovec* iov, int iovcnt){
+  uint64_t len = 0;
+  int i;
+
+  for(i=0; i<iovcnt; i++)
+    len += iov[i].iov_len;
+  atomic_fetch_add_explicit(&output_bytes, len, memory_order_relaxed);
+}
+
+/* no serialisation, measures the relay and record paths alone */
+#define declare_none(fcn, type) static void fcn##_none(type* e){}
+
+#define declare_w3c(fcn, type, append) static void fcn##_w3c(type* e){\
+  uint64_t start = now_ns();\
+  append(fcn##_to_json(e));\
+  record_latency(start);\
+}
+
+#define declare_spade(fcn, type) static void fcn##_spade(type* e){\
+  uint64_t start = now_ns();\
+  spade_json_append(fcn##_to_spade_json(e));\
+  record_latency(start);\
+}
+
+#define declare_all(fcn, type, append) declare_none(fcn, type) declare_w3c(fcn, type, append) declare_spade(fcn, type)
+
+declare_all(used, struct relation_struct, append_used);
+declare_all(generated, struct relation_struct, append_generated);
+declare_all(informed, struct relation_struct, append_informed);
+declare_all(influenced, struct relation_struct, append_influenced);
+declare_all(associated, struct relation_struct, append_associated);
+declare_all(derived, struct relation_struct, append_derived);
+declare_all(proc, struct proc_prov_struct, append_entity);
+declare_all(task, struct task_prov_struct, append_activity);
+declare_all(inode, struct inode_prov_struct, append_entity);
+declare_all(str_msg, struct str_struct, append_entity);
+declare_all(disc, struct disc_node_struct, append_entity);
+declare_all(msg, struct msg_msg_struct, append_entity);
+declare_all(shm, struct shm_struct, append_entity);
+declare_all(packet, struct pck_struct, append_entity);
+declare_all(addr, struct address_struct, append_entity);
+declare_all(pathname, struct file_name_struct, append_entity);
+declare_all(iattr, struct iattr_prov_struct, append_entity);
+declare_all(xattr, struct xattr_prov_struct, append_entity);
+declare_all(pckcnt, struct pckcnt_struct, append_entity);
+declare_all(arg, struct arg_struct, append_entity);
+declare_all(machine, struct machine_struct, append_agent);
+
+#define set_ops(ops, suffix) do{\
+  (ops)->log_used = used_##suffix;\
+  (ops)->log_generated = generated_##suffix;\
+  (ops)->log_informed = informed_##suffix;\
+  (ops)->log_influenced = influenced_##suffix;\
+  (ops)->log_associated = associated_##suffix;\
+  (ops)->log_derived = derived_##suffix;\
+  (ops)->log_proc = proc_##suffix;\
+  (ops)->log_task = task_##suffix;\
+  (ops)->log_inode = inode_##suffix;\
+  (ops)->log_str = str_msg_##suffix;\
+  (ops)->log_act_disc = disc_##suffix;\
+  (ops)->log_agt_disc = disc_##suffix;\
+  (ops)->log_ent_disc = disc_##suffix;\
+  (ops)->log_msg = msg_##suffix;\
+  (ops)->log_shm = shm_##suffix;\
+  (ops)->log_packet = packet_##suffix;\
+  (ops)->log_address = addr_##suffix;\
+  (ops)->log_file_name = pathname_##suffix;\
+  (ops)->log_iattr = iattr_##suffix;\
+  (ops)->log_xattr = xattr_##suffix;\
+  (ops)->log_packet_content = pckcnt_##suffix;\
+  (ops)->log_arg = arg_##suffix;\
+  (ops)->log_machine = machine_##suffix;\
+}while(0)
+
+/* the binary format works on the raw elements, records run the no-op callbacks */
+static void received_binary(union prov_elt* msg){
+  uint64_t start = now_ns();
+  binary_append(msg);
+  record_latency(start);
+}
+
+static void received_long_binary(union long_prov_elt* msg){
+  uint64_t start = now_ns();
+  binary_append_long(msg);
+  record_latency(start);
+}
+
+#define FORMAT_NONE   0
+#define FORMAT_W3C    1
+#define FORMAT_SPADE  2
+#define FORMAT_BINARY 3
+#define FORMATS       4
+
+static const char* format_names[FORMATS] = {"none", "w3c", "spade", "binary"};
+
+static void format_ops(int format, struct provenance_ops* ops){
+  memset(ops, 0, sizeof(struct provenance_ops));
+  ops->init = init;
+  ops->log_error = log_error;
+  switch(format){
+    case FORMAT_W3C:
+      set_ops(ops, w3c);
+      break;
+    case FORMAT_SPADE:
+      set_ops(ops, spade);
+      break;
+    case FORMAT_BINARY:
+      set_ops(ops, none);
+      ops->received_prov = received_binary;
+      ops->received_long_prov = received_long_binary;
+      break;
+    default:
+      set_ops(ops, none);
+      break;
+  }
+}
+
+static void format_flush(int format){
+  switch(format){
+    case FORMAT_W3C:
+      flush_json();
+      break;
+    case FORMAT_SPADE:
+      flush_spade_json();
+      break;
+    case FORMAT_BINARY:
+      flush_binary();
+      break;
+    default:
+      break;
+  }
+}
+
+/* merge and free the histograms of the last run */
+static uint64_t percentiles(const double* p, uint64_t* values, size_t n){
+  static uint64_t merged[HIST_BUCKETS];
+  struct histogram* h;
+  uint64_t total = 0;
+  uint64_t seen = 0;
+  size_t i = 0;
+  uint32_t b;
+
+  memset(merged, 0, sizeof(merged));
+  while(histograms){
+    h = histograms;
+    histograms = h->next;
+    for(b=0; b<HIST_BUCKETS; b++)
+      merged[b] += h->count[b];
+    free(h);
+  }
+  for(b=0; b<HIST_BUCKETS; b++)
+    total += merged[b];
+  for(i=0; i<n; i++)
+    values[i] = 0;
+  i = 0;
+  for(b=0; b<HIST_BUCKETS && i<n; b++){
+    seen += merged[b];
+    while(i<n && total>0 && seen >= p[i]*total)
+      values[i++] = hist_value(b);
+  }
+  return total;
+}
+
+static void cleanup(const char* dir){
+  char path[PATH_MAX];
+  struct dirent* d;
+  DIR* dp = opendir(dir);
+
+  if(dp){
+    while((d = readdir(dp))){
+      if(d->d_name[0] == '.')
+        continue;
+      snprintf(path, PATH_MAX, "%s/%s", dir, d->d_name);
+      unlink(path);
+    }
+    closedir(dp);
+  }
+  rmdir(dir);
+}
+
+static int parse_list(char* arg, int* values, int max, int (*parse)(const char*)){
+  char* save = NULL;
+  char* tok;
+  int n = 0;
+
+  for(tok=strtok_r(arg, ",", &save); tok && n<max; tok=strtok_r(NULL, ",", &save)){
+    values[n] = parse(tok);
+    if(values[n] < 0){
+      fprintf(stderr, "unknown value %s\n", tok);
+      exit(-1);
+    }
+    n++;
+  }
+  return n;
+}
+
+static int parse_format(const char* name){
+  int i;
+
+  for(i=0; i<FORMATS; i++){
+    if(!strcmp(format_names[i], name))
+      return i;
+  }
+  return -1;
+}
+
+static int parse_threads(const char* s){
+  int n = atoi(s);
+
+  return n > 0 ? n : -1;
+}
+
+static void usage(const char* name){
+  fprintf(stderr, "usage: %s [-w inode,path,packet,all] [-f none,w3c,spade,binary]"
+                  " [-t 1,2,4] [-n elements per cpu] [-s seed] [-d directory]\n", name);
+  exit(-1);
+}
+
+int main(int argc, char** argv){
+  static const double p[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+  char workloads_arg[256] = "inode,path,packet";
+  char formats_arg[256] = "none,w3c,spade,binary";
+  char threads_arg[256] = "1,2,4";
+  const char* tmp = "/tmp";
+  int workloads[WORKLOADS*4];
+  int formats[FORMATS*4];
+  int threads[64];
+  int nworkloads, nformats, nthreads;
+  size_t elements = 100000;
+  uint64_t seed = 88172645463325252ULL;
+  struct workload_stats stats;
+  struct provenance_ops ops;
+  uint64_t lat[5];
+  char lats[5][24];
+  uint64_t start, ns;
+  char dir[PATH_MAX];
+  uint64_t measured;
+  int w, f, t, i, opt, rc;
+  double total, secs;
+
+  while((opt = getopt(argc, argv, "w:f:t:n:s:d:h")) != -1){
+    switch(opt){
+      case 'w': snprintf(workloads_arg, sizeof(workloads_arg), "%s", optarg); break;
+      case 'f': snprintf(formats_arg, sizeof(formats_arg), "%s", optarg); break;
+      case 't': snprintf(threads_arg, sizeof(threads_arg), "%s", optarg); break;
+      case 'n': elements = strtoull(optarg, NULL, 10); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      case 'd': tmp = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  nworkloads = parse_list(workloads_arg, workloads, WORKLOADS*4, workload_parse);
+  nformats = parse_list(formats_arg, formats, FORMATS*4, parse_format);
+  nthreads = parse_list(threads_arg, threads, 64, parse_threads);
+
+  workload_seed_caches();
+  set_W3CJSON_iov_callback(count_iov);
+  set_SPADEJSON_iov_callback(count_iov);
+  set_binary_callback(count_iov);
+
+  printf("%-8s %-7s %4s %10s %12s %9s %9s %8s %8s %8s %8s %8s\n",
+         "workload", "format", "cpus", "elements", "elements/s", "in MB/s", "out MB/s",
+         "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+  for(w=0; w<nworkloads; w++){
+    for(t=0; t<nthreads; t++){
+      snprintf(dir, PATH_MAX, "%s/provbench.XXXXXX", tmp);
+      if(!mkdtemp(dir)){
+        perror("mkdtemp");
+        return -1;
+      }
+      rc = workload_generate(dir, workloads[w], threads[t], elements, seed, &stats);
+      if(rc){
+        fprintf(stderr, "failed generating workload (%d)\n", rc);
+        cleanup(dir);
+        return -1;
+      }
+      for(f=0; f<nformats; f++){
+        format_ops(formats[f], &ops);
+        atomic_store(&output_bytes, 0);
+        start = now_ns();
+        rc = provenance_relay_replay(&ops, dir);
+        format_flush(formats[f]);
+        ns = now_ns() - start;
+        if(rc){
+          fprintf(stderr, "replay failed (%d)\n", rc);
+          cleanup(dir);
+          return -1;
+        }
+        measured = percentiles(p, lat, 5);
+        for(i=0; i<5; i++){
+          if(measured)
+            snprintf(lats[i], sizeof(lats[i]), "%llu", (unsigned long long)lat[i]);
+          else
+            snprintf(lats[i], sizeof(lats[i]), "-");
+        }
+        total = stats.elements + stats.long_elements;
+        secs = ns / 1e9;
+        printf("%-8s %-7s %4d %10.0f %12.0f %9.1f %9.1f %8s %8s %8s %8s %8s\n",
+               workload_name(workloads[w]), format_names[formats[f]], threads[t],
+               total, total/secs, stats.bytes/secs/1e6, output_bytes/secs/1e6,
+               lats[0], lats[1], lats[2], lats[3], lats[4]);
+        fflush(stdout);
+      }
+      cleanup(dir);
+    }
+  }
+  if(errors > 0)
+    fprintf(stderr, "%llu library errors\n", (unsigned long long)errors);
+  return 0;
+}
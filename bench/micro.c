@@ -0,0 +1,374 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "provenance.h"
+#include "provenanceutils.h"
+#include "provenanceformat.h"
+#include "provenanceJSONcommon.h"
+
+/*
+ * Microbenchmarks of the serialisation kernels against the implementations
+ * they replaced, copied below as ref_*. Each case formats the same inputs
+ * with both, checks the outputs are identical and reports ns per call.
+ */
+
+#define INPUTS 4096 /* power of two */
+
+static uint64_t values[INPUTS]; /* magnitudes spread over 1 to 20 digits */
+static uint8_t bytes[INPUTS][16];
+static uint8_t ids[INPUTS][PROV_IDENTIFIER_BUFFER_LENGTH];
+#define HOT_IDS 64 /* identifiers the id-cache case cycles through */
+
+static inline uint64_t now_ns(void){
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint64_t rand64(uint64_t* s){
+  uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static char* ref_ulltoa(uint64_t value, char* string, int radix){
+  char* dst = string;
+  char digits[65];
+  int i = 0;
+  int n;
+
+  do{
+    n = value % radix;
+    digits[i++] = (n < 10 ? (char)n+'0' : (char)n-10+'a');
+    value /= radix;
+  }while(value != 0);
+  while(i > 0)
+    *dst++ = digits[--i];
+  *dst = 0;
+  return string;
+}
+
+static size_t ref_hexify(uint8_t* in, size_t in_size, char* out, size_t out_size){
+  static const char map[16+1] = "0123456789ABCDEF";
+  size_t bytes_written = 0;
+  size_t i = 0;
+
+  while(i < in_size && (i*2 + (2+1)) <= out_size){
+    *out++ = map[(in[i] & 0xF0) >> 4];
+    *out++ = map[in[i] & 0x0F];
+    i++;
+    bytes_written += 2;
+  }
+  *out = '\0';
+  return bytes_written;
+}
+
+static int ref_base64encode(const void* data_buf, size_t dataLength, char* result, size_t resultSize){
+  static const char base64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const uint8_t* data = (const uint8_t*)data_buf;
+  size_t resultIndex = 0;
+  size_t x;
+  uint32_t n = 0;
+  int padCount = dataLength % 3;
+
+  for(x = 0; x < dataLength; x += 3){
+    n = ((uint32_t)data[x]) << 16;
+    if((x+1) < dataLength)
+      n += ((uint32_t)data[x+1]) << 8;
+    if((x+2) < dataLength)
+      n += data[x+2];
+    if(resultIndex >= resultSize)
+      return 1;
+    result[resultIndex++] = base64chars[(uint8_t)(n >> 18) & 63];
+    if(resultIndex >= resultSize)
+      return 1;
+    result[resultIndex++] = base64chars[(uint8_t)(n >> 12) & 63];
+    if((x+1) < dataLength){
+      if(resultIndex >= resultSize)
+        return 1;
+      result[resultIndex++] = base64chars[(uint8_t)(n >> 6) & 63];
+    }
+    if((x+2) < dataLength){
+      if(resultIndex >= resultSize)
+        return 1;
+      result[resultIndex++] = base64chars[(uint8_t)n & 63];
+    }
+  }
+  if(padCount > 0){
+    for(; padCount < 3; padCount++){
+      if(resultIndex >= resultSize)
+        return 1;
+      result[resultIndex++] = '=';
+    }
+  }
+  if(resultIndex >= resultSize)
+    return -1;
+  result[resultIndex] = 0;
+  return 0;
+}
+
+/* each kernel formats input i, into out or the serialiser buffer, and returns it NUL terminated */
+typedef const char* (*kernel_t)(char* out, size_t i);
+
+static const char* ref_u64_dec(char* out, size_t i){ ref_ulltoa(values[i], out, DECIMAL); return out; }
+static const char* new_u64_dec(char* out, size_t i){ ulltoa(values[i], out, DECIMAL); return out; }
+static const char* ref_u64_hex(char* out, size_t i){ ref_ulltoa(values[i], out, HEX); return out; }
+static const char* new_u64_hex(char* out, size_t i){ ulltoa(values[i], out, HEX); return out; }
+static const char* ref_u32_dec(char* out, size_t i){ ref_ulltoa((uint32_t)values[i], out, DECIMAL); return out; }
+static const char* new_u32_dec(char* out, size_t i){ utoa((uint32_t)values[i], out, DECIMAL); return out; }
+static const char* ref_hex16(char* out, size_t i){ ref_hexify(bytes[i], 16, out, hexifyBound(16)); return out; }
+static const char* new_hex16(char* out, size_t i){ hexify(bytes[i], 16, out, hexifyBound(16)); return out; }
+
+static const char* ref_uuid(char* out, size_t i){
+  const uint8_t* u = bytes[i];
+
+  snprintf(out, 37, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+           u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+           u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+  return out;
+}
+
+static const char* new_uuid(char* out, size_t i){ out[fmt_uuid(out, bytes[i])] = '\0'; return out; }
+
+static const char* ref_id(char* out, size_t i){ ref_base64encode(ids[i], PROV_IDENTIFIER_BUFFER_LENGTH, out, PROV_ID_STR_LEN); return out; }
+static const char* new_id(char* out, size_t i){ base64encode_id(ids[i], PROV_IDENTIFIER_BUFFER_LENGTH, out, PROV_ID_STR_LEN); return out; }
+static const char* ref_id_hot(char* out, size_t i){ return ref_id(out, i % HOT_IDS); }
+static const char* new_id_hot(char* out, size_t i){ return new_id(out, i % HOT_IDS); }
+
+/*
+ * Attribute appends as the serialisers did before the cursor: strncat
+ * bounded by what strnlen finds left, so that each append rescans the
+ * element written so far.
+ */
+static char ref_buffer[MAX_JSON_BUFFER_LENGTH];
+#define REF_BUFFER_LENGTH (MAX_JSON_BUFFER_LENGTH-strnlen(ref_buffer, MAX_JSON_BUFFER_LENGTH))
+
+static char* ref_lltoa(int64_t value, char* result){
+  char* ptr = result;
+  char* ptr1 = result;
+  char tmp_char;
+  int64_t tmp_value;
+
+  do{
+    tmp_value = value;
+    value /= 10;
+    *ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz"[35 + (tmp_value - value * 10)];
+  }while(value);
+  if(tmp_value < 0)
+    *ptr++ = '-';
+  *ptr-- = '\0';
+  while(ptr1 < ptr){
+    tmp_char = *ptr;
+    *ptr-- = *ptr1;
+    *ptr1++ = tmp_char;
+  }
+  return result;
+}
+
+static void ref_add_attribute(const char* name, bool comma){
+  strncat(ref_buffer, comma ? ",\"" : "\"", REF_BUFFER_LENGTH);
+  strncat(ref_buffer, name, REF_BUFFER_LENGTH);
+  strncat(ref_buffer, "\":", REF_BUFFER_LENGTH);
+}
+
+static void ref_add_uint32_attribute(const char* name, const uint32_t value, bool comma){
+  char tmp[32];
+
+  ref_add_attribute(name, comma);
+  strncat(ref_buffer, ref_ulltoa(value, tmp, DECIMAL), REF_BUFFER_LENGTH);
+}
+
+static void ref_add_uint32hex_attribute(const char* name, const uint32_t value, bool comma){
+  char tmp[32];
+
+  ref_add_attribute(name, comma);
+  strncat(ref_buffer, "\"0x", REF_BUFFER_LENGTH);
+  strncat(ref_buffer, ref_ulltoa(value, tmp, HEX), REF_BUFFER_LENGTH);
+  strncat(ref_buffer, "\"", REF_BUFFER_LENGTH);
+}
+
+static void ref_add_int64_attribute(const char* name, const int64_t value, bool comma){
+  char tmp[64];
+
+  ref_add_attribute(name, comma);
+  strncat(ref_buffer, "\"", REF_BUFFER_LENGTH);
+  strncat(ref_buffer, ref_lltoa(value, tmp), REF_BUFFER_LENGTH);
+  strncat(ref_buffer, "\"", REF_BUFFER_LENGTH);
+}
+
+static void ref_add_string_attribute(const char* name, const char* value, bool comma){
+  ref_add_attribute(name, comma);
+  strncat(ref_buffer, "\"", REF_BUFFER_LENGTH);
+  strncat(ref_buffer, value, REF_BUFFER_LENGTH);
+  strncat(ref_buffer, "\"", REF_BUFFER_LENGTH);
+}
+
+/* the attributes of iattr_to_json, groups times over, as an element of growing size */
+static const char* ref_json(size_t i, int groups){
+  const uint64_t v = values[i];
+  int g;
+
+  ref_buffer[0] = '\0';
+  for(g = 0; g < groups; g++){
+    ref_add_uint32hex_attribute("cf:valid", v, g > 0);
+    ref_add_uint32hex_attribute("cf:mode", v >> 16, true);
+    ref_add_uint32_attribute("cf:uid", v >> 8, true);
+    ref_add_uint32_attribute("cf:gid", v >> 24, true);
+    ref_add_int64_attribute("cf:size", v, true);
+    ref_add_int64_attribute("cf:atime", -(int64_t)(v >> 4), true);
+    ref_add_int64_attribute("cf:ctime", v >> 12, true);
+    ref_add_int64_attribute("cf:mtime", v >> 20, true);
+    ref_add_string_attribute("cf:name", "security.selinux", true);
+  }
+  return ref_buffer;
+}
+
+static const char* new_json(size_t i, int groups){
+  const uint64_t v = values[i];
+  int g;
+
+  __buffer_reset();
+  for(g = 0; g < groups; g++){
+    __add_uint32hex_attribute("cf:valid", v, g > 0);
+    __add_uint32hex_attribute("cf:mode", v >> 16, true);
+    __add_uint32_attribute("cf:uid", v >> 8, true);
+    __add_uint32_attribute("cf:gid", v >> 24, true);
+    __add_int64_attribute("cf:size", v, true);
+    __add_int64_attribute("cf:atime", -(int64_t)(v >> 4), true);
+    __add_int64_attribute("cf:ctime", v >> 12, true);
+    __add_int64_attribute("cf:mtime", v >> 20, true);
+    __add_string_attribute("cf:name", "security.selinux", true);
+  }
+  return buffer;
+}
+
+static const char* ref_json_node(char* out, size_t i){ return ref_json(i, 1); }
+static const char* new_json_node(char* out, size_t i){ return new_json(i, 1); }
+static const char* ref_json_large(char* out, size_t i){ return ref_json(i, 32); }
+static const char* new_json_large(char* out, size_t i){ return new_json(i, 32); }
+
+struct kernel_case {
+  const char* name;
+  kernel_t before;
+  kernel_t after;
+  bool id_cache; /* base64encode_id_cache while it runs */
+  unsigned slower; /* runs n/slower calls, for the cases that do more work per call */
+};
+
+static const struct kernel_case cases[] = {
+  {"u64-dec", ref_u64_dec, new_u64_dec},
+  {"u64-hex", ref_u64_hex, new_u64_hex},
+  {"u32-dec", ref_u32_dec, new_u32_dec},
+  {"hexify16", ref_hex16, new_hex16},
+  {"uuid", ref_uuid, new_uuid},
+  {"base64-id", ref_id, new_id},
+  {"id-cache", ref_id_hot, new_id_hot, true},
+  {"json-node", ref_json_node, new_json_node, false, 10},
+  {"json-large", ref_json_large, new_json_large, false, 1000},
+};
+
+#define NCASES (sizeof(cases)/sizeof(cases[0]))
+
+static volatile char sink;
+
+static double run(kernel_t k, uint64_t n){
+  char out[256];
+  uint64_t start = now_ns();
+  uint64_t i;
+
+  for(i = 0; i < n; i++)
+    sink = k(out, i & (INPUTS - 1))[0];
+  return (double)(now_ns() - start) / n;
+}
+
+static int check(const struct kernel_case* c){
+  static char a[MAX_JSON_BUFFER_LENGTH];
+  char b[256];
+  size_t i;
+
+  for(i = 0; i < INPUTS; i++){
+    snprintf(a, sizeof(a), "%s", c->before(b, i));
+    if(strcmp(a, c->after(b, i))){
+      fprintf(stderr, "%s: input %zu differs from \"%s\"\n", c->name, i, a);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void usage(const char* name){
+  fprintf(stderr, "usage: %s [-n calls per case] [-s seed] [case ...]\n", name);
+  exit(-1);
+}
+
+int main(int argc, char** argv){
+  uint64_t n = 10000000;
+  uint64_t seed = 1;
+  double before, after;
+  uint64_t calls;
+  uint64_t r;
+  size_t i, j;
+  int opt;
+  int rc = 0;
+  int k;
+
+  while((opt = getopt(argc, argv, "n:s:h")) != -1){
+    switch(opt){
+      case 'n': n = strtoull(optarg, NULL, 10); break;
+      case 's': seed = strtoull(optarg, NULL, 0); break;
+      default: usage(argv[0]);
+    }
+  }
+  if(n == 0)
+    usage(argv[0]);
+  for(i = 0; i < INPUTS; i++){
+    values[i] = rand64(&seed) >> (rand64(&seed) % 64);
+    for(j = 0; j < 16; j += 8){
+      r = rand64(&seed);
+      memcpy(&bytes[i][j], &r, 8);
+    }
+    for(j = 0; j < PROV_IDENTIFIER_BUFFER_LENGTH; j++)
+      ids[i][j] = rand64(&seed);
+  }
+
+  printf("%-10s %10s %10s %8s\n", "case", "before-ns", "after-ns", "speedup");
+  for(i = 0; i < NCASES; i++){
+    for(k = optind; k < argc && strcmp(argv[k], cases[i].name); k++);
+    if(optind < argc && k == argc)
+      continue;
+    base64encode_id_cache(cases[i].id_cache);
+    if(check(&cases[i])){
+      rc = -1;
+      continue;
+    }
+    calls = cases[i].slower ? n / cases[i].slower + 1 : n;
+    before = run(cases[i].before, calls);
+    after = run(cases[i].after, calls);
+    printf("%-10s %10.2f %10.2f %7.2fx\n", cases[i].name, before, after, before / after);
+  }
+  return rc;
+}
@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/provenance.h>
+#include <linux/provenance_types.h>
+
+#include "provenance.h"
+#include "provenancecache.h"
+#include "workload.h"
+
+enum kind {
+  K_USED, K_GENERATED, K_INFORMED, K_DERIVED, K_INFLUENCED, K_ASSOCIATED,
+  K_TASK, K_PROC, K_INODE, K_DIRECTORY, K_IATTR, K_MSG, K_SHM, K_PACKET,
+  K_PATH, K_ARG, K_STR, K_ADDR, K_XATTR, K_PCKCNT, K_DISC, K_MACHINE,
+  KINDS
+};
+
+struct mix {
+  const char* name;
+  uint8_t weight[KINDS]; /* percent */
+};
+
+static const struct mix mixes[WORKLOADS] = {
+  [WORKLOAD_INODE] = {"inode", {
+    [K_USED]=22, [K_GENERATED]=15, [K_INFORMED]=8, [K_DERIVED]=7,
+    [K_TASK]=15, [K_PROC]=5, [K_INODE]=20, [K_DIRECTORY]=5, [K_IATTR]=3}},
+  [WORKLOAD_PATH] = {"path", {
+    [K_USED]=15, [K_GENERATED]=10, [K_DERIVED]=10, [K_TASK]=5,
+    [K_INODE]=20, [K_PATH]=30, [K_ARG]=10}},
+  [WORKLOAD_PACKET] = {"packet", {
+    [K_USED]=15, [K_GENERATED]=15, [K_INFORMED]=10, [K_TASK]=10,
+    [K_PACKET]=30, [K_ADDR]=10, [K_PCKCNT]=10}},
+  [WORKLOAD_ALL] = {"all", {
+    [K_USED]=5, [K_GENERATED]=5, [K_INFORMED]=5, [K_DERIVED]=5,
+    [K_INFLUENCED]=4, [K_ASSOCIATED]=4, [K_TASK]=5, [K_PROC]=5, [K_INODE]=5,
+    [K_DIRECTORY]=4, [K_IATTR]=4, [K_MSG]=4, [K_SHM]=4, [K_PACKET]=5,
+    [K_PATH]=5, [K_ARG]=4, [K_STR]=4, [K_ADDR]=4, [K_XATTR]=4, [K_PCKCNT]=4,
+    [K_DISC]=4, [K_MACHINE]=3}},
+};
+
+struct type_name {
+  uint64_t id;
+  const char* name;
+};
+
+#define RL(w3c, n) ((w3c) | (1ULL << (n)))
+
+static const struct type_name relation_names[] = {
+  {RL(RL_USED, 0), "read"}, {RL(RL_USED, 1), "open"}, {RL(RL_USED, 2), "exec"},
+  {RL(RL_USED, 3), "mmap_read"}, {RL(RL_USED, 4), "receive_packet"},
+  {RL(RL_GENERATED, 0), "write"}, {RL(RL_GENERATED, 1), "mmap_write"},
+  {RL(RL_GENERATED, 2), "send_packet"},
+  {RL(RL_INFORMED, 0), "clone"}, {RL(RL_INFORMED, 1), "terminate_task"},
+  {RL(RL_DERIVED, 0), "version_entity"}, {RL(RL_DERIVED, 1), "named"},
+  {RL(RL_INFLUENCED, 0), "terminate_proc"},
+  {RL(RL_ASSOCIATED, 0), "setuid"},
+};
+
+static const struct type_name node_names[] = {
+  {ACT_TASK, "task"}, {ENT_PROC, "process_memory"}, {ENT_INODE_FILE, "file"},
+  {ENT_INODE_DIRECTORY, "directory"}, {ENT_IATTR, "iattr"}, {ENT_MSG, "msg"},
+  {ENT_SHM, "shm"}, {ENT_PACKET, "packet"}, {ENT_PATH, "path"},
+  {ENT_ARG, "argv"}, {ENT_STR, "string"}, {ENT_ADDR, "address"},
+  {ENT_XATTR, "xattr"}, {ENT_PCKCNT, "packet_content"},
+  {ENT_DISC, "entity_disc"}, {AGT_MACHINE, "machine"},
+};
+
+#define SECIDS 48
+#define RECENT 64  /* nodes relations are drawn between */
+#define NAMES  4096 /* path names per cpu */
+
+int workload_parse(const char* name){
+  int i;
+
+  for(i=0; i<WORKLOADS; i++){
+    if(!strcmp(mixes[i].name, name))
+      return i;
+  }
+  return -1;
+}
+
+const char* workload_name(int mix){
+  return mixes[mix].name;
+}
+
+void workload_seed_caches(void){
+  char secctx[64];
+  size_t i;
+
+  for(i=0; i<sizeof(relation_names)/sizeof(struct type_name); i++)
+    type_add_entry(relation_names[i].id, relation_names[i].name);
+  for(i=0; i<sizeof(node_names)/sizeof(struct type_name); i++)
+    type_add_entry(node_names[i].id, node_names[i].name);
+  for(i=1; i<=SECIDS; i++){
+    snprintf(secctx, sizeof(secctx), "system_u:object_r:bench%zu_t:s0", i);
+    sec_add_entry(i, secctx);
+  }
+}
+
+struct generator {
+  uint64_t rng;
+  uint32_t cpu;
+  uint64_t next_id;
+  union prov_identifier recent[RECENT];
+  size_t nrecent;
+  union prov_identifier names[NAMES];
+  size_t nnames;
+  FILE* out;
+  FILE* long_out;
+  struct workload_stats* stats;
+};
+
+static inline uint64_t rnd(struct generator* g){
+  g->rng ^= g->rng << 13;
+  g->rng ^= g->rng >> 7;
+  g->rng ^= g->rng << 17;
+  return g->rng;
+}
+
+static inline enum kind pick(struct generator* g, const struct mix* mix){
+  uint32_t r = rnd(g) % 100;
+  int k;
+
+  for(k=0; k<KINDS; k++){
+    if(r < mix->weight[k])
+      return (enum kind)k;
+    r -= mix->weight[k];
+  }
+  return K_USED;
+}
+
+static void node_header(struct generator* g, struct node_struct* n, uint64_t type){
+  n->identifier.node_id.type = type;
+  n->identifier.node_id.id = ((uint64_t)g->cpu << 40) | g->next_id++;
+  n->identifier.node_id.boot_id = 1;
+  n->identifier.node_id.machine_id = 0xCAFE;
+  n->identifier.node_id.version = rnd(g) % 4;
+  n->jiffies = 4294967296ULL + g->next_id * 250;
+  n->epoch = 1;
+  if(g->nrecent < RECENT)
+    g->recent[g->nrecent++] = n->identifier;
+  else
+    g->recent[rnd(g) % RECENT] = n->identifier;
+}
+
+static void relation(struct generator* g, struct relation_struct* r, uint64_t type){
+  r->identifier.relation_id.type = type;
+  r->identifier.relation_id.id = ((uint64_t)g->cpu << 40) | g->next_id++;
+  r->identifier.relation_id.boot_id = 1;
+  r->identifier.relation_id.machine_id = 0xCAFE;
+  r->jiffies = 4294967296ULL + g->next_id * 250;
+  r->epoch = 1;
+  r->allowed = FLOW_ALLOWED;
+  if(g->nrecent > 0){
+    r->snd = g->recent[rnd(g) % g->nrecent];
+    r->rcv = g->recent[rnd(g) % g->nrecent];
+  }
+  r->task_id = ((uint64_t)g->cpu << 40) | (rnd(g) % 1024);
+  if(rnd(g) % 2){
+    r->set = FILE_INFO_SET;
+    r->offset = rnd(g) % (1 << 20);
+  }
+  r->flags = rnd(g) % 64;
+}
+
+static const char* dirs[] = {"/usr/lib/x86_64-linux-gnu", "/etc", "/home/alice/src/project",
+                             "/var/log", "/tmp", "/proc/self", "/usr/share/locale/en_GB"};
+
+static size_t fill_path(struct generator* g, char* buf, size_t index){
+  return snprintf(buf, PATH_MAX, "%s/file%zu.%s", dirs[index % 7], index,
+                  index % 3 ? "so" : "conf");
+}
+
+static void fill_long(struct generator* g, union long_prov_elt* e, enum kind k){
+  struct sockaddr_in* in;
+  struct sockaddr_in6* in6;
+  struct sockaddr_un* un;
+  size_t i;
+
+  switch(k){
+    case K_PATH:
+      node_header(g, &e->node_info, ENT_PATH);
+      e->file_name_info.length = fill_path(g, e->file_name_info.name, rnd(g) % NAMES);
+      if(g->nnames < NAMES)
+        g->names[g->nnames++] = e->file_name_info.identifier;
+      else
+        g->names[rnd(g) % NAMES] = e->file_name_info.identifier;
+      break;
+    case K_ARG:
+      node_header(g, &e->node_info, ENT_ARG);
+      e->arg_info.length = snprintf(e->arg_info.value, PATH_MAX,
+                                    "--config=/etc/service%u.d/options --verbose --threads=%u",
+                                    (unsigned)(rnd(g) % 100), (unsigned)(rnd(g) % 64));
+      break;
+    case K_STR:
+      node_header(g, &e->node_info, ENT_STR);
+      e->str_info.length = snprintf(e->str_info.str, PATH_MAX,
+                                    "user log \"%u\": operation completed\n", (unsigned)rnd(g));
+      break;
+    case K_ADDR:
+      node_header(g, &e->node_info, ENT_ADDR);
+      switch(rnd(g) % 4){
+        case 0:
+        case 1:
+          in = (struct sockaddr_in*)&e->address_info.addr;
+          in->sin_family = AF_INET;
+          in->sin_port = htons(rnd(g) % 65536);
+          in->sin_addr.s_addr = htonl(0x0A000000 | (rnd(g) % 65536));
+          e->address_info.length = sizeof(struct sockaddr_in);
+          break;
+        case 2:
+          in6 = (struct sockaddr_in6*)&e->address_info.addr;
+          in6->sin6_family = AF_INET6;
+          in6->sin6_port = htons(443);
+          in6->sin6_addr.s6_addr[0] = 0x20;
+          in6->sin6_addr.s6_addr[1] = 0x01;
+          in6->sin6_addr.s6_addr[15] = rnd(g) % 256;
+          e->address_info.length = sizeof(struct sockaddr_in6);
+          break;
+        default:
+          un = (struct sockaddr_un*)&e->address_info.addr;
+          un->sun_family = AF_UNIX;
+          snprintf(un->sun_path, sizeof(un->sun_path), "/run/service%u.sock", (unsigned)(rnd(g) % 16));
+          e->address_info.length = sizeof(struct sockaddr_un);
+          break;
+      }
+      break;
+    case K_XATTR:
+      node_header(g, &e->node_info, ENT_XATTR);
+      snprintf(e->xattr_info.name, PROV_XATTR_NAME_SIZE, "security.selinux");
+      e->xattr_info.size = 32;
+      for(i=0; i<e->xattr_info.size; i++)
+        e->xattr_info.value[i] = rnd(g);
+      break;
+    case K_PCKCNT:
+      node_header(g, &e->node_info, ENT_PCKCNT);
+      e->pckcnt_info.length = 64 + rnd(g) % 128;
+      for(i=0; i<e->pckcnt_info.length; i++)
+        e->pckcnt_info.content[i] = rnd(g);
+      break;
+    case K_DISC:
+      node_header(g, &e->node_info, ENT_DISC);
+      e->disc_node_info.length = snprintf(e->disc_node_info.content, PATH_MAX,
+                                          "application disclosed value %u", (unsigned)rnd(g));
+      break;
+    default: /* K_MACHINE */
+      node_header(g, &e->node_info, AGT_MACHINE);
+      snprintf(e->machine_info.utsname.sysname, 65, "Linux");
+      snprintf(e->machine_info.utsname.nodename, 65, "bench%u", g->cpu);
+      snprintf(e->machine_info.utsname.release, 65, "6.1.0-camflow");
+      snprintf(e->machine_info.utsname.version, 65, "#1 SMP PREEMPT_DYNAMIC");
+      snprintf(e->machine_info.utsname.machine, 65, "x86_64");
+      snprintf(e->machine_info.commit, PROV_COMMIT_MAX_LENGTH, "0123456789abcdef");
+      break;
+  }
+}
+
+static void fill_short(struct generator* g, union prov_elt* e, enum kind k){
+  switch(k){
+    case K_USED:
+      relation(g, &e->relation_info, relation_names[rnd(g) % 5].id);
+      break;
+    case K_GENERATED:
+      relation(g, &e->relation_info, relation_names[5 + rnd(g) % 3].id);
+      break;
+    case K_INFORMED:
+      relation(g, &e->relation_info, relation_names[8 + rnd(g) % 2].id);
+      break;
+    case K_DERIVED:
+      relation(g, &e->relation_info, relation_names[10 + rnd(g) % 2].id);
+      break;
+    case K_INFLUENCED:
+      relation(g, &e->relation_info, relation_names[12].id);
+      break;
+    case K_ASSOCIATED:
+      relation(g, &e->relation_info, relation_names[13].id);
+      break;
+    case K_TASK:
+      node_header(g, &e->node_info, ACT_TASK);
+      e->task_info.pid = 1000 + rnd(g) % 30000;
+      e->task_info.vpid = e->task_info.pid;
+      e->task_info.utime = rnd(g) % 1000000;
+      e->task_info.stime = rnd(g) % 1000000;
+      e->task_info.vm = 1 << 20;
+      e->task_info.rss = rnd(g) % (1 << 18);
+      e->task_info.secid = 1 + rnd(g) % SECIDS;
+      e->task_info.utsns = e->task_info.ipcns = e->task_info.mntns = 4026531838U;
+      e->task_info.pidns = e->task_info.netns = e->task_info.cgroupns = 4026531836U;
+      break;
+    case K_PROC:
+      node_header(g, &e->node_info, ENT_PROC);
+      e->proc_info.uid = rnd(g) % 2 ? 0 : 1000;
+      e->proc_info.gid = e->proc_info.uid;
+      e->proc_info.tgid = 1000 + rnd(g) % 30000;
+      e->proc_info.secid = 1 + rnd(g) % SECIDS;
+      break;
+    case K_INODE:
+    case K_DIRECTORY:
+      node_header(g, &e->node_info, k == K_INODE ? ENT_INODE_FILE : ENT_INODE_DIRECTORY);
+      e->inode_info.ino = rnd(g) % 10000000;
+      e->inode_info.uid = 1000;
+      e->inode_info.gid = 1000;
+      e->inode_info.mode = k == K_INODE ? 0100644 : 040755;
+      e->inode_info.secid = 1 + rnd(g) % SECIDS;
+      memset(e->inode_info.sb_uuid, 0x5A, sizeof(e->inode_info.sb_uuid));
+      if(g->nnames > 0) // name an already emitted path
+        e->inode_info.name_id = g->names[rnd(g) % g->nnames];
+      break;
+    case K_IATTR:
+      node_header(g, &e->node_info, ENT_IATTR);
+      e->iattr_info.valid = 0x7;
+      e->iattr_info.mode = 0100600;
+      e->iattr_info.size = rnd(g) % (1 << 20);
+      e->iattr_info.atime = e->iattr_info.mtime = e->iattr_info.ctime = 1700000000;
+      break;
+    case K_MSG:
+      node_header(g, &e->node_info, ENT_MSG);
+      e->msg_msg_info.type = 1 + rnd(g) % 8;
+      break;
+    case K_SHM:
+      node_header(g, &e->node_info, ENT_SHM);
+      e->shm_info.mode = 0600;
+      break;
+    default: /* K_PACKET */
+      node_header(g, &e->node_info, ENT_PACKET);
+      e->pck_info.identifier.packet_id.id = rnd(g) % 65536;
+      e->pck_info.identifier.packet_id.snd_ip = htonl(0x0A000001);
+      e->pck_info.identifier.packet_id.rcv_ip = htonl(0x0A000000 | (rnd(g) % 65536));
+      e->pck_info.identifier.packet_id.snd_port = htons(40000 + rnd(g) % 20000);
+      e->pck_info.identifier.packet_id.rcv_port = htons(443);
+      e->pck_info.identifier.packet_id.protocol = 6;
+      e->pck_info.identifier.packet_id.seq = rnd(g);
+      e->pck_info.len = 64 + rnd(g) % 1400;
+      break;
+  }
+}
+
+static inline bool is_long(enum kind k){
+  return k >= K_PATH;
+}
+
+static FILE* open_capture(const char* dir, const char* name, uint32_t cpu){
+  char path[PATH_MAX];
+  FILE* f;
+
+  snprintf(path, PATH_MAX, "%s/%s%u", dir, name, cpu);
+  f = fopen(path, "w");
+  if(f)
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+  return f;
+}
+
+static int generate_cpu(const char* dir, const struct mix* mix, uint32_t cpu,
+                        size_t elements, uint64_t seed, struct workload_stats* stats){
+  struct generator* g;
+  union long_prov_elt* e;
+  enum kind k;
+  size_t i;
+  int rc = 0;
+
+  g = (struct generator*)calloc(1, sizeof(struct generator));
+  e = (union long_prov_elt*)malloc(sizeof(union long_prov_elt));
+  if(!g || !e){
+    rc = -ENOMEM;
+    goto out;
+  }
+  g->rng = (seed ^ (0x9E3779B97F4A7C15ULL * (cpu + 1))) | 1;
+  g->cpu = cpu;
+  g->out = open_capture(dir, "provenance", cpu);
+  g->long_out = open_capture(dir, "long_provenance", cpu);
+  if(!g->out || !g->long_out){
+    rc = -errno;
+    goto out;
+  }
+  for(i=0; i<elements; i++){
+    k = pick(g, mix);
+    if(is_long(k)){
+      memset(e, 0, sizeof(union long_prov_elt));
+      fill_long(g, e, k);
+      fwrite(e, sizeof(union long_prov_elt), 1, g->long_out);
+      stats->long_elements++;
+      stats->bytes += sizeof(union long_prov_elt);
+    }else{
+      memset(e, 0, sizeof(union prov_elt));
+      fill_short(g, (union prov_elt*)e, k);
+      fwrite(e, sizeof(union prov_elt), 1, g->out);
+      stats->elements++;
+      stats->bytes += sizeof(union prov_elt);
+    }
+  }
+  if(ferror(g->out) || ferror(g->long_out))
+    rc = -EIO;
+out:
+  if(g && g->out)
+    fclose(g->out);
+  if(g && g->long_out)
+    fclose(g->long_out);
+  free(g);
+  free(e);
+  return rc;
+}
+
+/**
+ * @brief Writes the capture files of a workload.
+ *
+ * @param dir directory the capture files are written to.
+ * @param mix one of WORKLOAD_INODE...
+ * @param cpus number of cpus, i.e. relay channel pairs, to generate.
+ * @param elements number of elements per cpu, short and long together.
+ * @param seed generation is deterministic for a given seed.
+ * @param stats set to what was written.
+ * @return 0 on success, a negative error otherwise.
+ */
+int workload_generate(const char* dir, int mix, int cpus, size_t elements,
+                      uint64_t seed, struct workload_stats* stats){
+  int cpu;
+  int rc;
+
+  memset(stats, 0, sizeof(struct workload_stats));
+  if(mix < 0 || mix >= WORKLOADS)
+    return -EINVAL;
+  for(cpu=0; cpu<cpus; cpu++){
+    rc = generate_cpu(dir, &mixes[mix], cpu, elements, seed, stats);
+    if(rc)
+      return rc;
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __BENCH_WORKLOAD_H
+#define __BENCH_WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Synthetic relay streams. A workload is written as capture files, one
+ * provenance<cpu> and one long_provenance<cpu> per cpu, that
+ * provenance_relay_replay feeds through the usual callbacks.
+ */
+#define WORKLOAD_INODE  0 /* inode, task and relation heavy */
+#define WORKLOAD_PATH   1 /* path names, arguments and the inodes they name */
+#define WORKLOAD_PACKET 2 /* packets, addresses and packet content */
+#define WORKLOAD_ALL    3 /* every element type, evenly */
+#define WORKLOADS       4
+
+struct workload_stats {
+  uint64_t elements;      /* union prov_elt written */
+  uint64_t long_elements; /* union long_prov_elt written */
+  uint64_t bytes;         /* total size of the capture files */
+};
+
+int workload_parse(const char* name);
+const char* workload_name(int mix);
+
+/* give names to the types and secids the workloads use, as the kernel would */
+void workload_seed_caches(void);
+
+int workload_generate(const char* dir, int mix, int cpus, size_t elements,
+                      uint64_t seed, struct workload_stats* stats);
+
+#endif /* __BENCH_WORKLOAD_H */
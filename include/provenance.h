@@ -37,11 +37,55 @@
 
 #define PROVLIB_COMMIT ""
 
+/*
+* Overload control. Every interval ms the relay checks the fill of the
+* pipeline rings, the mean time the callbacks take on a chunk read and the
+* kernel drop counters, see provenance_dropped. While a threshold is
+* crossed, load is shed one level further at each check. Once all are below
+* half their threshold for recover consecutive checks, it steps back a level.
+* - PROV_OVERLOAD_SHED: ENT_PCKCNT packet contents are dropped;
+* - PROV_OVERLOAD_SAMPLE: only one in sample relations of the sampled types
+*   is kept as well.
+* Nodes, e.g. ENT_PATH, AGT_MACHINE and tasks, are never shed. Every level
+* change is disclosed as an ENT_DISC node carrying the level and the number
+* of elements shed so far, see provenance_disclose_node, so that the graph
+* tells it is incomplete. Zeroed fields select the defaults, a threshold of
+* UINT32_MAX is never crossed.
+*/
+#define PROV_OVERLOAD_NONE   0
+#define PROV_OVERLOAD_SHED   1
+#define PROV_OVERLOAD_SAMPLE 2
+
+#define PROV_OVERLOAD_INTERVAL     1000
+#define PROV_OVERLOAD_RING_HIGH    75 /* percent */
+#define PROV_OVERLOAD_LATENCY_HIGH 10000 /* us */
+#define PROV_OVERLOAD_RECOVER      5
+#define PROV_OVERLOAD_SAMPLE_RATE  10
+#define PROV_OVERLOAD_TYPES        16 /* sampled relation types at most */
+
+struct prov_overload_policy {
+  uint32_t interval; /* ms between checks */
+  uint32_t ring_high; /* percent of the fullest pipeline ring in use */
+  uint32_t latency_high; /* us, mean time of the callbacks on a chunk read */
+  bool ignore_kernel_drops; /* kernel drops shed load unless set */
+  uint32_t recover; /* checks below half the thresholds before stepping back */
+  uint32_t sample; /* one in sample relations of the sampled types is kept */
+  const uint64_t* sampled; /* relation types sampled, default reads, writes, sends and receives */
+  size_t nsampled;
+};
+
 struct provenance_ops{
   void (*init)(void);
   bool (*filter)(prov_entry_t* msg);
   void (*received_prov)(union prov_elt*);
   void (*received_long_prov)(union long_prov_elt*);
+  /* batch callbacks (optional), receive a whole relay read at once */
+  void (*received_prov_batch)(union prov_elt* msgs, size_t n);
+  void (*received_long_prov_batch)(union long_prov_elt* msgs, size_t n);
+  /* batch filters (optional), set filtered[i] to discard msgs[i] */
+  /* elements dropped by provenance_filter_set rules do not reach the filters, msgs only holds the others */
+  void (*filter_prov_batch)(union prov_elt* msgs, size_t n, bool* filtered);
+  void (*filter_long_prov_batch)(union long_prov_elt* msgs, size_t n, bool* filtered);
   /* relation callback */
   void (*log_derived)(struct relation_struct*);
   void (*log_generated)(struct relation_struct*);
@@ -71,8 +115,87 @@ struct provenance_ops{
   void (*log_error)(char*);
   /* is it filter only? for query framework */
   bool is_query;
+  /* relay reader configuration, zeroed fields select the defaults */
+  uint8_t reader_engine; /* PROV_READER_POLL or PROV_READER_EPOLL */
+  uint32_t reactors; /* number of epoll reactors, default one per PROV_REACTOR_CPUS cpus of each node */
+  uint32_t pipeline_workers; /* if not 0, callbacks run on that many threads, see PROV_RING_DEPTH */
+  uint32_t ring_depth; /* union prov_elt per cpu ring, default PROV_RING_DEPTH */
+  uint32_t long_ring_depth; /* union long_prov_elt per cpu ring, default PROV_LONG_RING_DEPTH */
+  uint64_t name_cache_size; /* bytes of file names kept, default PROV_NAME_CACHE_SIZE */
+  const char* capture_dir; /* if set, relay reads are also appended to files there, see provenance_relay_replay */
+  uint32_t coalesce_window; /* ms, if not 0 repeated relations are merged, see provenance_relation_coalesced */
+  uint32_t coalesce_count; /* relations merged into one at most, default PROV_COALESCE_COUNT */
+  uint32_t hotplug_interval; /* ms between checks of the online cpus, default PROV_HOTPLUG_INTERVAL */
+  uint32_t stop_timeout; /* ms allowed to drain the channels on stop, default PROV_STOP_TIMEOUT */
+  const struct prov_overload_policy* overload; /* if set, load is shed when overloaded, copied on register */
+};
+
+/* one thread per relay channel, sleeping then polling its channel */
+#define PROV_READER_POLL  0
+/* relay channels shared between a few epoll reactors with adaptive backoff */
+#define PROV_READER_EPOLL 1
+#define PROV_REACTOR_CPUS 16
+
+/*
+* There is a pair of relay channels per online cpu. Readers are bound to the
+* cpu of their channel, reactors and pipeline workers to the cpus of a NUMA
+* node and given the channels of the cpus of that node. Channels are opened
+* and closed as cpus come online and go offline.
+*/
+#define PROV_HOTPLUG_INTERVAL 1000
+
+/*
+* pipeline mode: readers only drain relay channels into per cpu lock-free
+* rings, callbacks are run by pipeline_workers threads consuming the rings.
+* A full ring leaves the data in relayfs until the workers catch up.
+* Depths are in elements and rounded up to a power of two.
+*/
+#define PROV_RING_DEPTH      16384
+#define PROV_LONG_RING_DEPTH 1024
+
+/* memory cap of the ENT_PATH name cache, least recently used names are evicted */
+#define PROV_NAME_CACHE_SIZE (64UL*1024*1024)
+
+/* maximum number of elements delivered to a batch callback */
+#define PROV_RELAY_BATCH_LENGTH 1000
+
+/*
+* Relation coalescing: relations with the same type, sender, receiver, flags
+* and allowed flag seen within coalesce_window ms of the first one are merged
+* into it, e.g. those of a read or write loop. The first relation is recorded,
+* with the taint of all of them, once the window expires or coalesce_count
+* relations were merged. While it
+* is being recorded, provenance_relation_coalesced returns the number of
+* relations it stands for and the jiffies of the last one, the serialisers
+* add them as cf:count and cf:last_jiffies (count and last_jiffies for SPADE),
+* the binary format in a COALESCED record.
+*/
+#define PROV_COALESCE_COUNT 1024
+
+struct prov_coalesced {
+  uint64_t count;
+  uint64_t first_jiffies;
+  uint64_t last_jiffies;
+};
+
+/* return true if rel is being recorded for count>1 merged relations */
+bool provenance_relation_coalesced(const struct relation_struct* rel, struct prov_coalesced* info);
+
+/*
+* Scratch memory used while serialising, and the strings of the type and
+* security context caches, are carved from arenas made of 64KB or larger
+* chunks. Chunks are mapped anonymously by default, alloc and free can be
+* replaced, e.g. by numa_alloc_local and numa_free so that the chunks of a
+* thread arena sit on its node. Chunks are freed with the ops that
+* allocated them, NULL restores the defaults.
+*/
+struct prov_arena_ops {
+  void* (*alloc)(size_t size);
+  void (*free)(void* ptr, size_t size);
 };
 
+void provenance_set_arena_ops(const struct prov_arena_ops* ops);
+
 void prov_record(union prov_elt* msg);
 void long_prov_record(union long_prov_elt* msg);
 
@@ -92,6 +215,11 @@ bool provenance_was_written(void);
 * @ops structure containing audit callbacks
 * start and register callback. Note that there is no concurrency guarantee made.
 * The application developper is expected to deal with concurrency issue.
+* If any of the *_batch callbacks is set, elements read from a relay channel
+* are delivered as an array (up to PROV_RELAY_BATCH_LENGTH elements) instead of
+* one callback per element. Elements not filtered out are then recorded as usual.
+* return -EBUSY while a replay or a receiver runs in the process, the callbacks
+* being shared.
 */
 int provenance_relay_register(struct provenance_ops* ops);
 
@@ -103,9 +231,61 @@ int provenance_relay_start(uint32_t prov_boot_id,
 
 /*
 * shutdown tightly the things that are running behind the scene.
+* The kernel is asked to flush its buffers, the relay channels are drained
+* and the callbacks run on what was read, for at most stop_timeout ms;
+* workers still busy then are abandoned. Nodes and relations held are then
+* recorded and the W3C, SPADE, binary, compression, sink and transport
+* buffers flushed, for at most stop_timeout ms more.
 */
+#define PROV_STOP_TIMEOUT 2000
 void provenance_relay_stop(void);
 
+/*
+* Capture files hold the raw bytes read from the relay channels, one file per
+* channel named after it, e.g. provenance0 and long_provenance0 for cpu 0.
+* @ops structure containing audit callbacks, as for provenance_relay_register
+* @dir directory the capture files are in
+* feed the capture files found in dir through the callbacks, one thread per
+* file, at disk speed. Neither root nor the kernel module is needed.
+* return 0 once everything has been replayed, -EBUSY while the relay or a
+* receiver runs in the process, the callbacks being shared, -1 on error.
+*/
+int provenance_relay_replay(struct provenance_ops* ops, const char* dir);
+
+/*
+* Receive the binary streams other hosts send with transport_connect, see
+* provenancetransport.h, and feed them through the callbacks as if read from
+* the relay, filters included. Elements of a frame are delivered in batches
+* of up to PROV_RELAY_BATCH_LENGTH, from the thread of the connection.
+* @ops structure containing audit callbacks, as for provenance_relay_register
+* @address @port to listen on, address NULL for any
+* @conf receiver configuration, NULL for the defaults
+* return 0 once listening, -EBUSY while the relay runs in the process, the
+* callbacks being shared, another negative error code otherwise.
+* provenance_relay_receive_stop closes the connections, then records the nodes
+* and relations held and flushes the output.
+*/
+struct prov_transport_conf;
+int provenance_relay_receive(struct provenance_ops* ops, const char* address,
+                             const char* port, const struct prov_transport_conf* conf);
+void provenance_relay_receive_stop(void);
+
+struct prov_ring_stats {
+  uint32_t cpu;
+  bool is_long; /* ring of union long_prov_elt */
+  uint64_t depth; /* elements currently queued */
+  uint64_t capacity; /* elements the ring can hold */
+  uint64_t high_water; /* highest depth observed */
+  uint64_t overflows; /* times a reader found the ring full */
+};
+
+/*
+* @stats array to fill, one entry per ring (two per cpu)
+* @n number of entries in stats
+* return the number of entries filled, -1 if the pipeline mode is not in use.
+*/
+int provenance_relay_ring_stats(struct prov_ring_stats* stats, size_t n);
+
 /* security file manipulation */
 
 /*
@@ -377,6 +557,8 @@ int provenance_egress_ipv4_delete(const char* param);
 int provenance_egress_ipv4( struct prov_ipv4_filter* filters, size_t length );
 
 int provenance_secid_to_secctx( uint32_t secid, char* secctx, uint32_t len);
+/* resolve secids ahead of provenance_secid_to_secctx, returns how many were queried */
+int provenance_secctx_prefetch(const uint32_t* secids, size_t count);
 
 int provenance_secctx_track(const char* secctx);
 int provenance_secctx_propagate(const char* secctx);
@@ -406,9 +588,134 @@ int provenance_policy_hash(uint8_t* buffer, size_t length);
 
 char* relation_id_to_str(uint64_t id);
 char* node_id_to_str(uint64_t id);
+/* the name is valid until the next name_id_to_str call of the thread */
 char* name_id_to_str(union prov_identifier* name_id);
+/* copies the name, name must be at least PATH_MAX long, false if not known */
+bool name_find_entry(union prov_identifier* name_id, char* name);
 int nash_init(void);
 
+struct prov_name_stats {
+  uint64_t entries; /* names currently cached */
+  uint64_t bytes; /* memory used by the cached names */
+  uint64_t capacity; /* memory cap */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+void provenance_name_stats(struct prov_name_stats* stats);
+
+/*
+* Log-linear latency histogram, in ns: four buckets per power of two, i.e.
+* values are known within 25%. Bucket i holds the values from
+* provenance_histogram_lower(i) to provenance_histogram_lower(i+1)-1, the
+* last one everything above.
+*/
+#define PROV_HISTOGRAM_BUCKETS 156
+
+struct prov_histogram {
+  uint64_t count;
+  uint64_t sum; /* ns */
+  uint64_t max; /* ns */
+  uint64_t buckets[PROV_HISTOGRAM_BUCKETS];
+};
+
+uint64_t provenance_histogram_lower(size_t bucket);
+/* @p percentile, e.g. 99.9, return the upper bound of its bucket in ns */
+uint64_t provenance_histogram_percentile(const struct prov_histogram* h, double p);
+
+/* indices of prov_relay_stats.records, one per log_* callback */
+#define PROV_LOG_DERIVED         0
+#define PROV_LOG_GENERATED       1
+#define PROV_LOG_USED            2
+#define PROV_LOG_INFORMED        3
+#define PROV_LOG_INFLUENCED      4
+#define PROV_LOG_ASSOCIATED      5
+#define PROV_LOG_PROC            6
+#define PROV_LOG_TASK            7
+#define PROV_LOG_INODE           8
+#define PROV_LOG_STR             9
+#define PROV_LOG_ACT_DISC        10
+#define PROV_LOG_AGT_DISC        11
+#define PROV_LOG_ENT_DISC        12
+#define PROV_LOG_MSG             13
+#define PROV_LOG_SHM             14
+#define PROV_LOG_PACKET          15
+#define PROV_LOG_ADDRESS         16
+#define PROV_LOG_FILE_NAME       17
+#define PROV_LOG_IATTR           18
+#define PROV_LOG_XATTR           19
+#define PROV_LOG_PACKET_CONTENT  20
+#define PROV_LOG_ARG             21
+#define PROV_LOG_MACHINE         22
+#define PROV_LOG_CALLBACKS       23
+
+struct prov_channel_stats {
+  uint32_t cpu;
+  bool is_long; /* channel of union long_prov_elt */
+  uint64_t elements; /* elements read */
+  uint64_t bytes; /* bytes read */
+  uint64_t reads; /* read calls */
+  uint64_t eagain; /* reads retried on EAGAIN */
+  uint64_t errors; /* reads failed */
+  uint64_t overflows; /* pipeline mode, times the ring was found full */
+  struct prov_histogram drain; /* channel drains that read data, callbacks included unless in pipeline mode */
+};
+
+struct prov_relay_stats {
+  /* sums over the channels */
+  uint64_t elements;
+  uint64_t bytes;
+  uint64_t reads;
+  uint64_t eagain;
+  uint64_t errors;
+  uint64_t overflows;
+  struct prov_histogram drain;
+  /* callbacks, over all threads */
+  uint64_t filtered; /* elements discarded by the filters */
+  uint64_t records[PROV_LOG_CALLBACKS]; /* log_* callbacks called */
+  uint64_t unknown; /* elements of unknown type */
+  struct prov_histogram callback; /* callbacks run on a chunk read, per chunk */
+  /* serialisers, a flush hands a staged buffer to the output callback */
+  uint64_t flushes;
+  uint64_t flushed_bytes;
+  struct prov_histogram flush;
+  /* name lookups, nodes parked waiting for their ENT_PATH */
+  struct prov_name_stats names;
+  uint64_t parked;
+  uint64_t released; /* recorded once their name arrived */
+  uint64_t expired; /* recorded without name, it did not arrive in time */
+  uint64_t coalesced; /* relations merged into one recorded, see coalesce_window */
+  /* overload control, see prov_overload_policy */
+  uint8_t overload; /* current level */
+  uint64_t shed_packets; /* ENT_PCKCNT dropped */
+  uint64_t shed_relations; /* relations sampled out */
+  /* elements the kernel dropped, see provenance_dropped */
+  bool kernel; /* false if the kernel counters could not be read */
+  uint64_t kernel_dropped;
+  uint64_t kernel_long_dropped;
+};
+
+/*
+* Counters are kept per thread and per channel, without locks, and summed
+* when read. Channel counters are only available once the relay is
+* registered.
+* @stats filled with the totals
+* @channels array to fill, one entry per channel (two per cpu), may be NULL
+* @n number of entries in channels
+* return the number of entries filled.
+*/
+int provenance_relay_stats(struct prov_relay_stats* stats, struct prov_channel_stats* channels, size_t n);
+
+/*
+* @buf filled with the relay statistics in the Prometheus text exposition
+* format, e.g. to be served on a /metrics endpoint or written for the
+* node_exporter textfile collector.
+* @len size of buf
+* return the length of the text, as snprintf, or -1 on error.
+*/
+int provenance_relay_metrics(char* buf, size_t len);
+
 uint64_t relation_str_to_id(const char* name, uint32_t len);
 uint64_t node_str_to_id(const char* name, uint32_t len);
 
@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCEBINARY_H
+#define __PROVENANCEBINARY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Compact binary record stream.
+ *
+ * A stream is a sequence of records, each a 32 bits little endian payload
+ * length, a one byte kind and the payload. Integers in payloads are LEB128
+ * varints. The stream is cut in blocks, each starting with a BLOCK record
+ * carrying the magic, the format version and the size of the kernel
+ * structures, so that a block can be decoded on its own. Within a block:
+ * - TYPE, NAME and SECCTX records define, once, the type names, paths and
+ *   security contexts the elements that follow refer to;
+ * - ELT and LONG_ELT records hold the element bytes with trailing zeros
+ *   trimmed, the identifier and jiffies being delta encoded against the
+ *   previous element of the block;
+ * - a COALESCED record precedes the ELT of a relation standing for several
+ *   merged ones, see provenance_relation_coalesced: the count and the last
+ *   jiffies, delta encoded against those of the relation. Readers that
+ *   predate it skip it.
+ *
+ * Elements appended are batched per thread as with the JSON serialisers,
+ * each batch delivered to the callback is a whole number of blocks.
+ */
+#define PROV_BINARY_MAGIC   "CFPB"
+#define PROV_BINARY_VERSION 1
+
+#define PROV_BINARY_BLOCK     0
+#define PROV_BINARY_TYPE      1
+#define PROV_BINARY_NAME      2
+#define PROV_BINARY_SECCTX    3
+#define PROV_BINARY_ELT       4
+#define PROV_BINARY_LONG_ELT  5
+#define PROV_BINARY_COALESCED 6
+
+/* default and minimum batch size */
+#define PROV_BINARY_BUFFER_LENGTH (64*1024)
+
+void set_binary_callback( void (*fcn)(const struct iovec* iov, int iovcnt) );
+void set_binary_buffer_size( size_t size );
+void binary_append(union prov_elt* msg);
+void binary_append_long(union long_prov_elt* msg);
+void flush_binary( void );
+
+/*
+ * Streaming decoder. Data can be fed in chunks of any size, the callback
+ * is called for every element decoded. Type names, paths and security
+ * contexts recorded in the stream are fed to the lookup caches of the
+ * calling thread, so that the callback can use the JSON serialisers, e.g.
+ * binary_to_w3c or binary_to_spade, off the capture host. While the
+ * callback runs for a coalesced relation, provenance_relation_coalesced
+ * answers for it.
+ * binary_read returns 0, or -EINVAL if the stream is malformed or was
+ * recorded with different kernel structures.
+ */
+struct binary_reader;
+
+struct binary_reader* binary_reader_create( void (*fcn)(prov_entry_t* msg, bool is_long) );
+void binary_reader_free(struct binary_reader* reader);
+int binary_read(struct binary_reader* reader, const void* data, size_t len);
+
+/* append the element to the W3C or SPADE JSON output */
+void binary_to_w3c(prov_entry_t* msg, bool is_long);
+void binary_to_spade(prov_entry_t* msg, bool is_long);
+
+#endif /* __PROVENANCEBINARY_H */
@@ -16,6 +16,9 @@
 #ifndef __PROVENANCESPADEJSON_H
 #define __PROVENANCESPADEJSON_H
 
+#include <stddef.h>
+#include <sys/uio.h>
+
 /* struct to spade functions */
 char* used_to_spade_json(struct relation_struct* e);
 char* generated_to_spade_json(struct relation_struct* e);
@@ -40,8 +43,17 @@ char* pckcnt_to_spade_json(struct pckcnt_struct* n);
 char* arg_to_spade_json(struct arg_struct* n);
 char* machine_to_spade_json(struct machine_struct *m);
 
+/*
+ * Appended elements are batched per thread, a batch is handed to the
+ * callback when full or on flush_spade_json. The iov callback receives the
+ * batch in place, only valid for the duration of the call. Callbacks are
+ * never run concurrently. set_SPADEJSON_buffer_size sets the batch capacity
+ * (default 8KiB), for threads that have not appended yet.
+ */
 void spade_json_append(char* buff);
 void set_SPADEJSON_callback( void (*fcn)(char* json) );
+void set_SPADEJSON_iov_callback( void (*fcn)(const struct iovec* iov, int iovcnt) );
+void set_SPADEJSON_buffer_size( size_t size );
 void flush_spade_json();
 
 #endif
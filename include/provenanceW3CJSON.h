@@ -16,7 +16,21 @@
 #ifndef __PROVENANCEW3CJSON_H
 #define __PROVENANCEW3CJSON_H
 
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Appended elements are aggregated per thread and handed to the callback
+ * as a W3C PROV-JSON document when a section is full or on flush_json.
+ * Documents are passed either as a single string or, with the iov
+ * callback, as a vector of buffers pointing into the aggregation buffers
+ * (e.g. for writev), only valid for the duration of the call. Callbacks are
+ * never run concurrently. set_W3CJSON_buffer_size sets the capacity of
+ * each section (default 8KiB), for threads that have not appended yet.
+ */
 void set_W3CJSON_callback( void (*fcn)(char* json) );
+void set_W3CJSON_iov_callback( void (*fcn)(const struct iovec* iov, int iovcnt) );
+void set_W3CJSON_buffer_size( size_t size );
 void flush_json( void );
 void append_activity(char* json_element);
 void append_agent(char* json_element);
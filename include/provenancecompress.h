@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCECOMPRESS_H
+#define __PROVENANCECOMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Streaming compression between the serialisers and the final sink.
+ * compress_write and compress_write_str have the signature of the iov and
+ * string callbacks, e.g. set_W3CJSON_iov_callback(compress_write). Data is
+ * gathered in blocks of block_size bytes, compressed on a dedicated thread
+ * and handed to sink as one continuous stream: gzip for zlib, a zstd or an
+ * lz4 frame otherwise. Every block is flushed so that what has been handed
+ * to sink can be decompressed as it arrives. Writers only block when all
+ * the blocks are waiting to be compressed.
+ * zstd and lz4 are only available when built with HAVE_ZSTD and HAVE_LZ4,
+ * i.e. make ZSTD=1 LZ4=1, compress_start returns -ENOTSUP otherwise.
+ */
+#define PROV_COMPRESS_ZLIB 1
+#define PROV_COMPRESS_ZSTD 2
+#define PROV_COMPRESS_LZ4  3
+
+#define PROV_COMPRESS_LEVEL       -1 /* the default of the algorithm */
+#define PROV_COMPRESS_BLOCK_SIZE  (256*1024)
+#define PROV_COMPRESS_BLOCKS      4
+
+struct prov_compress_stats {
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t blocks;
+  uint64_t stalls; /* writes that waited for a free block */
+  uint64_t errors; /* blocks the codec failed on, dropped */
+};
+
+int compress_start(uint32_t algorithm, int level, size_t block_size,
+                   void (*sink)(const struct iovec* iov, int iovcnt));
+void compress_write(const struct iovec* iov, int iovcnt);
+void compress_write_str(char* str);
+/* returns once what has been written so far is compressed and handed to sink */
+void compress_flush(void);
+/* as compress_flush, for at most ms, returns 0 or -ETIMEDOUT */
+int compress_flush_timeout(uint32_t ms);
+void compress_stop(void);
+void compress_stats(struct prov_compress_stats* stats);
+
+#endif /* __PROVENANCECOMPRESS_H */
@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCECONTROL_H
+#define __PROVENANCECONTROL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <linux/provenance.h>
+#include <linux/provenance_fs.h>
+
+/*
+ * Control handle. The securityfs files used through a handle are opened
+ * once and kept open until provenance_control_close, so that pushing a
+ * policy costs one write per rule rather than an open, a write and a close.
+ * A handle can be used by several threads at once.
+ */
+#define PROV_CTL_ENABLE                     0
+#define PROV_CTL_ALL                        1
+#define PROV_CTL_COMPRESS_NODE              2
+#define PROV_CTL_COMPRESS_EDGE              3
+#define PROV_CTL_VERSION_NODES              4
+#define PROV_CTL_DUPLICATE                  5
+#define PROV_CTL_BOOLEANS                   6 /* number of boolean files */
+
+#define PROV_CTL_NODE_FILTER                6
+#define PROV_CTL_DERIVED_FILTER             7
+#define PROV_CTL_GENERATED_FILTER           8
+#define PROV_CTL_USED_FILTER                9
+#define PROV_CTL_INFORMED_FILTER            10
+#define PROV_CTL_PROPAGATE_NODE_FILTER      11
+#define PROV_CTL_PROPAGATE_DERIVED_FILTER   12
+#define PROV_CTL_PROPAGATE_GENERATED_FILTER 13
+#define PROV_CTL_PROPAGATE_USED_FILTER      14
+#define PROV_CTL_PROPAGATE_INFORMED_FILTER  15
+#define PROV_CTL_FILTERS                    10 /* number of type filter files */
+
+#define PROV_CTL_IPV4_INGRESS               16 /* struct prov_ipv4_filter */
+#define PROV_CTL_IPV4_EGRESS                17 /* struct prov_ipv4_filter */
+#define PROV_CTL_SECCTX                     18 /* struct secinfo */
+#define PROV_CTL_UID                        19 /* struct userinfo */
+#define PROV_CTL_GID                        20 /* struct groupinfo */
+#define PROV_CTL_NS                         21 /* struct nsinfo */
+#define PROV_CTL_FILES                      22
+
+struct prov_control;
+
+struct prov_control* provenance_control_open(void);
+void provenance_control_close(struct prov_control* ctl);
+
+int provenance_control_set_boolean(struct prov_control* ctl, uint32_t file, bool value);
+int provenance_control_get_boolean(struct prov_control* ctl, uint32_t file, bool* value);
+
+/* add or remove types from a filter, the masks are those of provenancefilter.h */
+int provenance_control_filter(struct prov_control* ctl, uint32_t file, bool add, uint64_t filter);
+
+/*
+ * Writes count rules of size bytes each, e.g. an array of struct secinfo
+ * for PROV_CTL_SECCTX with op and len set. Stops at the first rule the
+ * kernel rejects and returns its error. applied, if not NULL, is set to
+ * the number of rules written.
+ */
+int provenance_control_apply(struct prov_control* ctl, uint32_t file,
+                             const void* rules, size_t size, size_t count,
+                             size_t* applied);
+
+/* read the rules of a rule file, returns the number of bytes read */
+int provenance_control_read(struct prov_control* ctl, uint32_t file, void* buffer, size_t length);
+
+struct prov_control_state {
+  bool booleans[PROV_CTL_BOOLEANS];    /* indexed by PROV_CTL_ENABLE... */
+  uint64_t filters[PROV_CTL_FILTERS];  /* indexed from PROV_CTL_NODE_FILTER */
+};
+
+/* read every boolean and type filter, returns 0 or the first error */
+int provenance_control_state(struct prov_control* ctl, struct prov_control_state* state);
+
+static inline int provenance_control_ipv4(struct prov_control* ctl, bool egress,
+                                          const struct prov_ipv4_filter* filters,
+                                          size_t count, size_t* applied){
+  return provenance_control_apply(ctl, egress ? PROV_CTL_IPV4_EGRESS : PROV_CTL_IPV4_INGRESS,
+                                  filters, sizeof(struct prov_ipv4_filter), count, applied);
+}
+
+static inline int provenance_control_secctx(struct prov_control* ctl,
+                                            const struct secinfo* filters,
+                                            size_t count, size_t* applied){
+  return provenance_control_apply(ctl, PROV_CTL_SECCTX, filters,
+                                  sizeof(struct secinfo), count, applied);
+}
+
+static inline int provenance_control_user(struct prov_control* ctl,
+                                          const struct userinfo* filters,
+                                          size_t count, size_t* applied){
+  return provenance_control_apply(ctl, PROV_CTL_UID, filters,
+                                  sizeof(struct userinfo), count, applied);
+}
+
+static inline int provenance_control_group(struct prov_control* ctl,
+                                           const struct groupinfo* filters,
+                                           size_t count, size_t* applied){
+  return provenance_control_apply(ctl, PROV_CTL_GID, filters,
+                                  sizeof(struct groupinfo), count, applied);
+}
+
+static inline int provenance_control_ns(struct prov_control* ctl,
+                                        const struct nsinfo* filters,
+                                        size_t count, size_t* applied){
+  return provenance_control_apply(ctl, PROV_CTL_NS, filters,
+                                  sizeof(struct nsinfo), count, applied);
+}
+
+#endif /* __PROVENANCECONTROL_H */
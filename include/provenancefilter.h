@@ -169,4 +169,50 @@ static inline int provenance_reset_propagate_relation_filter( void ) {
   provenance_reset_propagate_informed_filter();
 }
 
+/*
+* Userspace filter engine.
+* A rule matches an element when every criterion it sets holds, a criterion
+* left to zero matches anything:
+* - type: the W3C type bits (TYPE_MASK) must all be set in the element type
+*   and, if any subtype bit (SUBTYPE_MASK) is given, one of them must match,
+*   as for the kernel filters, e.g. ENT_INODE_FILE|ENT_INODE_DIRECTORY, RL_USED
+*   or DM_ACTIVITY;
+* - taint: one of the bits must be set in the element taint;
+* - machine_id, boot_id: equal to the identifier ones, never match packets;
+* - allowed: PROV_FILTER_ALLOWED or PROV_FILTER_DISALLOWED, relations only.
+* The first matching rule decides whether the element is dropped, elements
+* no rule matches are dropped if drop_default is true.
+* Rules are compiled into lookup tables, provenance_filter_set replaces the
+* rule set in use atomically, readers never wait for it.
+* The relay applies the rule set before prov_ops.filter or filter_prov_batch,
+* provenance_filter and provenance_filter_batch can also be used directly.
+*/
+#define PROV_FILTER_MAX_RULES 64
+
+#define PROV_FILTER_KEEP 0
+#define PROV_FILTER_DROP 1
+
+#define PROV_FILTER_ALLOWED_ANY 0
+#define PROV_FILTER_ALLOWED     1
+#define PROV_FILTER_DISALLOWED  2
+
+struct prov_filter_rule {
+  uint8_t action;
+  uint8_t allowed;
+  uint32_t machine_id;
+  uint32_t boot_id;
+  uint64_t type;
+  uint64_t taint;
+};
+
+/* n==0 removes the rule set, returns -EINVAL for invalid rules */
+int provenance_filter_set(const struct prov_filter_rule* rules, size_t n, bool drop_default);
+void provenance_filter_clear( void );
+/* whether a rule set is in use */
+bool provenance_filter_active( void );
+/* return true if the element is dropped, false when no rule set is in use */
+bool provenance_filter(prov_entry_t* msg);
+void provenance_filter_batch(union prov_elt* msgs, size_t n, bool* filtered);
+void provenance_filter_long_batch(union long_prov_elt* msgs, size_t n, bool* filtered);
+
 #endif
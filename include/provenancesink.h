@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCESINK_H
+#define __PROVENANCESINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Asynchronous output sink. sink_write and sink_write_str have the
+ * signature of the iov and string callbacks, e.g.
+ * set_W3CJSON_iov_callback(sink_write), set_binary_callback(sink_write) or
+ * compress_start(..., sink_write). Data is copied in blocks of block_size
+ * bytes, written in order by a dedicated thread: through io_uring, the
+ * blocks being registered buffers, or with plain writes when io_uring is
+ * not available. Writers never wait for the disk or the network, a write
+ * that does not fit in the free blocks is dropped whole and counted.
+ * A partially filled block is written after flush_interval ms.
+ *
+ * Files opened with sink_open are rotated once rotate_size bytes were
+ * written to them, or on sink_rotate, at the next write boundary: path is
+ * renamed path.1, path.1 path.2 and so on, up to rotate_keep files.
+ */
+#define PROV_SINK_URING  0 /* io_uring, plain writes if not available */
+#define PROV_SINK_THREAD 1 /* plain writes */
+
+#define PROV_SINK_BLOCK_SIZE     (256*1024)
+#define PROV_SINK_BLOCKS         16
+#define PROV_SINK_FLUSH_INTERVAL 1000
+#define PROV_SINK_KEEP           4
+
+/* zeroed fields select the defaults */
+struct prov_sink_conf {
+  uint32_t engine;
+  size_t block_size;
+  uint32_t blocks;
+  uint32_t flush_interval; /* ms */
+  uint64_t rotate_size; /* bytes, 0 to only rotate on sink_rotate */
+  uint32_t rotate_keep;
+};
+
+struct prov_sink_stats {
+  bool uring; /* writes go through io_uring */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t blocks;
+  uint64_t dropped; /* bytes of writes that did not fit */
+  uint64_t errors; /* blocks that failed to be written, lost */
+  uint64_t rotations;
+};
+
+/*
+ * Start the sink thread, writing to a file created or appended to, or to
+ * an open file descriptor, e.g. a socket, that is not closed by the sink.
+ * conf may be NULL for the defaults.
+ * return 0 on success, -EBUSY if already started, -EINVAL, -ENOMEM or the
+ * error opening path.
+ */
+int sink_open(const char* path, const struct prov_sink_conf* conf);
+int sink_open_fd(int fd, const struct prov_sink_conf* conf);
+void sink_write(const struct iovec* iov, int iovcnt);
+void sink_write_str(char* str);
+/* write what has been written so far, returns once it has been */
+void sink_flush(void);
+/* as sink_flush, for at most ms, returns 0 or -ETIMEDOUT */
+int sink_flush_timeout(uint32_t ms);
+/* sink_open only, rotate the file at the next write boundary */
+int sink_rotate(void);
+/* write what is left and stop the thread */
+void sink_close(void);
+void sink_stats(struct prov_sink_stats* stats);
+
+#endif /* __PROVENANCESINK_H */
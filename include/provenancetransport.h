@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCETRANSPORT_H
+#define __PROVENANCETRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Shipping provenance to a collector over TCP, optionally with TLS.
+ *
+ * transport_write and transport_write_str have the signature of the iov
+ * and string callbacks, e.g. set_binary_callback(transport_write) or
+ * compress_start(..., transport_write). Data is copied into frames of up
+ * to frame_size bytes, a write only spanning frames if it is larger than
+ * one, and sent in order by a dedicated thread. Frames are numbered and
+ * kept until the receiver acknowledges them. On reconnection the receiver
+ * says which frame it expects next and the sender resends from there, so
+ * that nothing is lost nor duplicated over a broken connection. Writers
+ * wait, or drop their write with PROV_TRANSPORT_DROP, once frames frames
+ * are waiting to be acknowledged: a slow collector pushes back to the
+ * relay, where data is held in relayfs. A writer waits timeout ms at most
+ * before dropping its write, so that an unreachable collector does not
+ * stall the relay for ever; writes are dropped while closing.
+ *
+ * A stream is identified by the machine_id and boot_id of the sender, as
+ * in its AGT_MACHINE node, and by a random identifier drawn when it is
+ * opened. Streams are independent: the receiver runs one thread per
+ * connection, binary streams being decoded in it, see
+ * provenance_relay_receive to feed them to provenance_ops callbacks.
+ * Binary frames that do not start at a write boundary are flagged, so that
+ * a receiver that lost track of a stream, e.g. after a restart, resumes
+ * decoding at the next binary block.
+ *
+ * TLS is only available when built with HAVE_OPENSSL, i.e. make OPENSSL=1.
+ */
+#define PROV_TRANSPORT_BINARY 0 /* binary records, decoded by the receiver */
+#define PROV_TRANSPORT_RAW    1 /* anything else, e.g. compressed JSON, handed over as received */
+
+#define PROV_TRANSPORT_BLOCK 0 /* writers wait for room in the window, up to timeout ms */
+#define PROV_TRANSPORT_DROP  1 /* writes that do not fit are dropped whole */
+
+#define PROV_TRANSPORT_FRAME_SIZE     (256*1024)
+#define PROV_TRANSPORT_FRAMES         16
+#define PROV_TRANSPORT_FLUSH_INTERVAL 1000
+#define PROV_TRANSPORT_RECONNECT_MAX  30000
+#define PROV_TRANSPORT_TIMEOUT        30000
+#define PROV_TRANSPORT_CONNECTIONS    1024
+
+/* zeroed fields select the defaults */
+struct prov_transport_conf {
+  uint32_t kind; /* PROV_TRANSPORT_BINARY or PROV_TRANSPORT_RAW, of what is sent */
+  uint32_t policy; /* PROV_TRANSPORT_BLOCK or PROV_TRANSPORT_DROP */
+  size_t frame_size; /* bytes, the receiver rejects frames larger than its own */
+  uint32_t frames; /* frames sent and not acknowledged at most */
+  uint32_t flush_interval; /* ms, a partially filled frame is sent after it */
+  uint32_t reconnect_max; /* ms, reconnection attempts back off up to it */
+  uint32_t timeout; /* ms, to connect, handshake, wait for an acknowledgement or for room */
+  uint32_t machine_id; /* 0 for provenance_get_machine_id */
+  uint32_t boot_id; /* 0 for provenance_get_boot_id */
+  uint32_t connections; /* receiver, concurrent connections at most */
+  bool tls;
+  const char* tls_cert; /* PEM, required to listen, optional to connect */
+  const char* tls_key;
+  const char* tls_ca; /* if set, the peer certificate must be signed by it */
+  const char* tls_server_name; /* sender, name the receiver certificate must match, host if NULL */
+};
+
+struct prov_transport_stats {
+  bool connected;
+  uint64_t connects; /* connections established */
+  uint64_t bytes_in; /* written to the transport */
+  uint64_t bytes_out; /* payload sent, resent frames included */
+  uint64_t frames; /* acknowledged */
+  uint64_t resent; /* frames sent again after a reconnection */
+  uint64_t stalls; /* writes that waited for the window, dropped if it did not open in time */
+  uint64_t dropped; /* bytes of writes dropped */
+};
+
+/*
+ * Start the sender thread, connecting to host and port, by name or number.
+ * Frames are kept while the receiver cannot be reached and connection
+ * attempts go on in the background. conf may be NULL for the defaults.
+ * return 0 on success, -EBUSY if already started, -EINVAL, -ENOMEM or
+ * -ENOTSUP if TLS is asked for and not built in.
+ */
+int transport_connect(const char* host, const char* port, const struct prov_transport_conf* conf);
+void transport_write(const struct iovec* iov, int iovcnt);
+void transport_write_str(char* str);
+/* send the partially filled frame now, does not wait for it to be acknowledged */
+void transport_flush(void);
+/*
+ * writers waiting for room, and those to come, drop their write ms from
+ * now at the latest, e.g. while the relay stops; PROV_TRANSPORT_NO_DEADLINE
+ * goes back to waiting timeout ms
+ */
+#define PROV_TRANSPORT_NO_DEADLINE UINT32_MAX
+void transport_deadline(uint32_t ms);
+/* waits up to timeout ms for what has been written to be acknowledged */
+void transport_close(void);
+void transport_stats(struct prov_transport_stats* stats);
+
+/* sender of the stream a frame comes from */
+struct prov_transport_peer {
+  const char* address; /* host:port of the connection */
+  uint32_t machine_id;
+  uint32_t boot_id;
+  uint64_t stream_id;
+  uint32_t kind;
+};
+
+/*
+ * Receiver callbacks, called from the thread of the connection. Frames of
+ * a given stream are delivered in order, one at a time, those of different
+ * streams concurrently.
+ */
+struct prov_transport_receiver {
+  void (*element)(const struct prov_transport_peer* peer, prov_entry_t* msg, bool is_long); /* binary streams */
+  void (*data)(const struct prov_transport_peer* peer, const void* data, size_t len); /* raw streams, a frame at a time */
+  void (*frame)(const struct prov_transport_peer* peer); /* after the elements of a frame */
+  void (*closed)(const struct prov_transport_peer* peer); /* the connection is done, last call from its thread */
+};
+
+struct prov_transport_stream {
+  uint32_t machine_id;
+  uint32_t boot_id;
+  uint64_t stream_id;
+  uint32_t kind;
+  bool connected;
+  uint64_t next; /* frame expected next */
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t duplicates; /* frames received again, ignored */
+  uint64_t lost; /* frames never received */
+  uint64_t skipped; /* binary frames ignored until the next block, after a loss or an error */
+  uint64_t errors; /* binary frames that failed to decode */
+};
+
+/*
+ * Accept senders on address, NULL for any, and port, delivering what they
+ * send to receiver, which is copied. conf may be NULL for the defaults.
+ * return 0 on success, -EBUSY if already listening, -EINVAL, -ENOMEM,
+ * -ENOTSUP or the error binding the address.
+ */
+int transport_listen(const char* address, const char* port,
+                     const struct prov_transport_conf* conf,
+                     const struct prov_transport_receiver* receiver);
+/* close every connection and wait for their threads */
+void transport_listen_stop(void);
+/* fill streams, up to n entries, return the number of streams known */
+int transport_streams(struct prov_transport_stream* streams, size_t n);
+
+#endif /* __PROVENANCETRANSPORT_H */
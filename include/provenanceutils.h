@@ -33,7 +33,11 @@ int base64encode(const void* data_buf, size_t dataLength, char* result, size_t r
 int compress64encode(const char* in, size_t inlen, char* out, size_t outlen);
 
 #define PROV_ID_STR_LEN encode64Bound(PROV_IDENTIFIER_BUFFER_LENGTH)
-#define ID_ENCODE base64encode
+/* base64encode specialised for identifiers, same output */
+int base64encode_id(const void* data_buf, size_t dataLength, char* result, size_t resultSize);
+/* enable or disable a per thread cache of the last identifiers encoded */
+void base64encode_id_cache(bool enable);
+#define ID_ENCODE base64encode_id
 #define TAINT_ENCODE hexify
 #define TAINT_STR_LEN hexifyBound(PROV_N_BYTES)
 
@@ -21,6 +21,11 @@ cp -f %{SOURCEURL0}/include/provenancefilter.h ./usr/include/provenancefilter.h
 cp -f %{SOURCEURL0}/include/provenanceutils.h ./usr/include/provenanceutils.h
 cp -f %{SOURCEURL0}/include/provenanceW3CJSON.h ./usr/include/provenanceW3CJSON.h
 cp -f %{SOURCEURL0}/include/provenanceSPADEJSON.h ./usr/include/provenanceSPADEJSON.h
+cp -f %{SOURCEURL0}/include/provenanceBinary.h ./usr/include/provenanceBinary.h
+cp -f %{SOURCEURL0}/include/provenancecompress.h ./usr/include/provenancecompress.h
+cp -f %{SOURCEURL0}/include/provenancecontrol.h ./usr/include/provenancecontrol.h
+cp -f %{SOURCEURL0}/include/provenancesink.h ./usr/include/provenancesink.h
+cp -f %{SOURCEURL0}/include/provenancetransport.h ./usr/include/provenancetransport.h
 
 %clean
 rm -r -f "$RPM_BUILD_ROOT"
@@ -33,5 +38,10 @@ rm -r -f "$RPM_BUILD_ROOT"
 /usr/include/provenanceutils.h
 /usr/include/provenanceW3CJSON.h
 /usr/include/provenanceSPADEJSON.h
+/usr/include/provenanceBinary.h
+/usr/include/provenancecompress.h
+/usr/include/provenancecontrol.h
+/usr/include/provenancesink.h
+/usr/include/provenancetransport.h
 
 %post -p /sbin/ldconfig
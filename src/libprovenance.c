@@ -26,12 +26,15 @@
 #include <sys/xattr.h>
 #include <linux/xattr.h>
 #include <pwd.h>
+#include <stdatomic.h>
 #include <grp.h>
 #include <linux/provenance_types.h>
 #include <uthash.h>
 
 #include "provenance.h"
 #include "provenanceutils.h"
+#include "provenancecache.h"
+#include "provenancearena.h"
 
 
 static inline int __set_boolean(bool value, const char* name){
@@ -522,152 +525,303 @@ declare_set_ipv4_fcn(provenance_egress_ipv4_delete, PROV_IPV4_EGRESS_FILE, PROV_
 declare_get_ipv4_fcn(provenance_ingress_ipv4, PROV_IPV4_INGRESS_FILE);
 declare_get_ipv4_fcn(provenance_egress_ipv4, PROV_IPV4_EGRESS_FILE);
 
-#define NAME_BUFFER 400
+/*
+ * Security contexts are shared by every thread, as type names are below.
+ * Keys are the secid with bit 32 set so that 0 marks an empty slot.
+ * Contexts are allocated to their length. When the table is full lookups
+ * still work, they just go to the kernel.
+ */
+#define SEC_TABLE_BITS 12
+#define SEC_TABLE_SIZE (1 << SEC_TABLE_BITS)
+#define SEC_KEY(secid) ((uint64_t)(secid) | (1ULL << 32))
+
 struct secentry {
-    int id;            /* we'll use this field as the key */
-    char name[NAME_BUFFER];
-    UT_hash_handle hh; /* makes this structure hashable */
+  _Atomic uint64_t key;
+  const char* secctx;
 };
 
-static __thread struct secentry *hash = NULL;
+static struct secentry sec_table[SEC_TABLE_SIZE];
+static pthread_mutex_t sec_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena sec_arena = ARENA_INIT; /* the strings, under sec_lock */
 
-bool sec_exists_entry(uint32_t secid) {
-  struct secentry *se=NULL;
-  HASH_FIND_INT(hash, &secid, se);
-  if(!se)
-    return false;
-  return true;
+static inline uint32_t __sec_slot(uint32_t secid){
+  return (uint32_t)((secid * 0x9E3779B97F4A7C15ULL) >> (64 - SEC_TABLE_BITS));
 }
 
-static void sec_add_entry(uint32_t secid, const char* secctx){
-  struct secentry *se;
-  if( sec_exists_entry(secid) )
-    return;
-  se = malloc(sizeof(struct secentry));
-  se->id=secid;
-  strncpy(se->name, secctx, NAME_BUFFER);
-  HASH_ADD_INT(hash, id, se);
+static inline const char* __sec_find(uint32_t secid){
+  uint32_t slot = __sec_slot(secid);
+  uint64_t key;
+  uint32_t i;
+
+  for(i=0; i<SEC_TABLE_SIZE; i++){
+    key = atomic_load_explicit(&sec_table[slot].key, memory_order_acquire);
+    if(key == SEC_KEY(secid))
+      return sec_table[slot].secctx;
+    if(key == 0)
+      return NULL;
+    slot = (slot + 1) & (SEC_TABLE_SIZE - 1);
+  }
+  return NULL;
+}
+
+static void __sec_add(uint32_t secid, const char* secctx){
+  uint32_t slot = __sec_slot(secid);
+  const char* str;
+  uint64_t key;
+  uint32_t i;
+
+  pthread_mutex_lock(&sec_lock);
+  for(i=0; i<SEC_TABLE_SIZE; i++){
+    key = atomic_load_explicit(&sec_table[slot].key, memory_order_relaxed);
+    if(key == SEC_KEY(secid))
+      break;
+    if(key == 0){
+      str = arena_strndup(&sec_arena, secctx, PATH_MAX - 1);
+      if(!str)
+        break;
+      sec_table[slot].secctx = str;
+      atomic_store_explicit(&sec_table[slot].key, SEC_KEY(secid), memory_order_release);
+      break;
+    }
+    slot = (slot + 1) & (SEC_TABLE_SIZE - 1);
+  }
+  pthread_mutex_unlock(&sec_lock);
 }
 
-bool sec_find_entry(uint32_t secid, char* secctx) {
-  struct secentry *se=NULL;
-  HASH_FIND_INT(hash, &secid, se);
-  if(!se)
-    return false;
-  strncpy(secctx, se->name, NAME_BUFFER);
-  return true;
+void sec_add_entry(uint32_t secid, const char* secctx){
+  if( !__sec_find(secid) )
+    __sec_add(secid, secctx);
+}
+
+/* every answer of the kernel is cached, read errors may be transient and are not */
+static inline void __sec_query(int fd, uint32_t secid, struct secinfo* info){
+  int rc;
+
+  memset(info, 0, sizeof(struct secinfo));
+  info->secid=secid;
+  rc = read(fd, info, sizeof(struct secinfo));
+  info->secctx[sizeof(info->secctx) - 1] = '\0';
+  if(rc <= 0 || info->secctx[0] == '\0')
+    utoa(secid, info->secctx, HEX); // hexadecimal fallback
+  if(rc > 0)
+    __sec_add(secid, info->secctx);
+}
+
+/**
+ * @brief Resolves a set of secids in one go.
+ *
+ * Secids not already cached are queried through a single file descriptor.
+ * Meant to be called ahead of serialisation, on a batch of elements or at
+ * startup, so that provenance_secid_to_secctx does not have to.
+ * @param secids the secids to resolve, duplicates are fine.
+ * @param count number of secids.
+ * @return the number of secids queried, or a negative value if the kernel
+ * interface could not be opened.
+ */
+int provenance_secctx_prefetch(const uint32_t* secids, size_t count){
+  struct secinfo info;
+  int fd = -1;
+  int n = 0;
+  size_t i;
+
+  for(i=0; i<count; i++){
+    if( __sec_find(secids[i]) )
+      continue;
+    if(fd < 0){
+      fd = open(PROV_SECCTX, O_RDONLY);
+      if( fd < 0 )
+        return fd;
+    }
+    __sec_query(fd, secids[i], &info);
+    n++;
+  }
+  if(fd >= 0)
+    close(fd);
+  return n;
 }
 
 int provenance_secid_to_secctx( uint32_t secid, char* secctx, uint32_t len){
   struct secinfo info;
-  int rc = 0;
+  const char* str;
   int fd;
 
-  // make sure empty string is returned on error
-  secctx[0]='\0';
-
-  if( sec_find_entry(secid, secctx) )
-    return 0;
-  fd = open(PROV_SECCTX, O_RDONLY);
-  if( fd < 0 )
-    goto out;
-  memset(&info, 0, sizeof(struct secinfo));
-  info.secid=secid;
-  rc = read(fd, &info, sizeof(struct secinfo));
-  close(fd);
-  if(rc<0){
-    goto out;
+  str = __sec_find(secid);
+  if(!str){
+    fd = open(PROV_SECCTX, O_RDONLY);
+    if( fd < 0 ){
+      // hexadecimal fallback, as when the kernel cannot resolve it
+      utoa(secid, info.secctx, HEX);
+    }else{
+      __sec_query(fd, secid, &info);
+      close(fd);
+    }
+    str = info.secctx;
   }
-  if(len<strlen(info.secctx))
+  if(len<=strlen(str)){
+    secctx[0]='\0';
     return -ENOMEM;
-  strncpy(secctx, info.secctx, len);
-  sec_add_entry(secid, secctx);
-out:
-  if(secctx[0]=='\0') {
-    utoa(secid, secctx, HEX);
   }
-  return rc;
+  strcpy(secctx, str);
+  return 0;
 }
 
+/*
+ * Type names are shared by every thread. The table is filled once by
+ * type_cache_fill, later additions are rare and serialised by type_lock.
+ * Lookups do not lock: a slot id is published, with release semantics, only
+ * once its string is set and neither changes afterwards.
+ */
+#define TYPE_TABLE_BITS 10
+#define TYPE_TABLE_SIZE (1 << TYPE_TABLE_BITS)
+#define TYPE_NAME_LENGTH 256
+
 struct typeentry {
-    uint64_t id;
-    char str[256];
-    UT_hash_handle hh; /* makes this structure hashable */
+  _Atomic uint64_t id;
+  const char* str;
 };
 
-static __thread struct typeentry *thash = NULL;
+static struct typeentry type_table[TYPE_TABLE_SIZE];
+static pthread_mutex_t type_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arena type_arena = ARENA_INIT; /* the strings, under type_lock */
 
-bool type_exists_entry(uint64_t typeid) {
-  struct typeentry *te=NULL;
-  HASH_FIND(hh, thash, &typeid, sizeof(uint64_t), te);
-  if(!te)
-    return false;
-  return true;
+/* identifiers are one bit in the type and one in the subtype, fold them */
+static inline uint32_t __type_slot(uint64_t id){
+  id ^= id >> 32;
+  return (uint32_t)((id * 0x9E3779B97F4A7C15ULL) >> (64 - TYPE_TABLE_BITS));
 }
 
-static void type_add_entry(uint64_t typeid, const char* name){
-  struct typeentry *te;
-  if( type_exists_entry(typeid) )
-    return;
-  te = malloc(sizeof(struct typeentry));
-  te->id=typeid;
-  strncpy(te->str, name, 256);
-  HASH_ADD(hh, thash, id, sizeof(uint64_t), te);
+static inline const char* __type_find(uint64_t typeid){
+  uint32_t slot = __type_slot(typeid);
+  uint32_t i;
+  uint64_t id;
+
+  for(i=0; i<TYPE_TABLE_SIZE; i++){
+    id = atomic_load_explicit(&type_table[slot].id, memory_order_acquire);
+    if(id == typeid)
+      return type_table[slot].str;
+    if(id == 0)
+      return NULL;
+    slot = (slot + 1) & (TYPE_TABLE_SIZE - 1);
+  }
+  return NULL;
 }
 
-bool type_find_entry(uint64_t typeid, char* name) {
-  struct typeentry *te=NULL;
-  HASH_FIND(hh, thash, &typeid, sizeof(uint64_t), te);
-  if(!te)
-    return false;
-  strncpy(name, te->str, 256);
-  return true;
+static const char* __type_add(uint64_t typeid, const char* name){
+  uint32_t slot = __type_slot(typeid);
+  const char* str = NULL;
+  uint32_t i;
+  uint64_t id;
+
+  if(typeid == 0)
+    return NULL;
+  pthread_mutex_lock(&type_lock);
+  for(i=0; i<TYPE_TABLE_SIZE; i++){
+    id = atomic_load_explicit(&type_table[slot].id, memory_order_relaxed);
+    if(id == typeid){
+      str = type_table[slot].str;
+      break;
+    }
+    if(id == 0){
+      str = arena_strndup(&type_arena, name, TYPE_NAME_LENGTH - 1);
+      if(!str)
+        break;
+      type_table[slot].str = str;
+      atomic_store_explicit(&type_table[slot].id, typeid, memory_order_release);
+      break;
+    }
+    slot = (slot + 1) & (TYPE_TABLE_SIZE - 1);
+  }
+  pthread_mutex_unlock(&type_lock);
+  return str;
 }
 
-static inline int provenance_type_id_to_str(uint64_t id,
-                                char* name,
-                                uint32_t len,
-                                uint8_t is_relation){
+void type_add_entry(uint64_t typeid, const char* name){
+  __type_add(typeid, name);
+}
+
+static inline int __type_query(int fd, uint64_t id, uint8_t is_relation, struct prov_type* info){
+  memset(info, 0, sizeof(struct prov_type));
+  info->id = id;
+  info->is_relation = is_relation;
+  return read(fd, info, sizeof(struct prov_type));
+}
+
+/**
+ * @brief Fills the type table from the kernel.
+ *
+ * Every node and relation type is one bit of the subtype under one of the
+ * W3C types, the whole space is queried through a single file descriptor
+ * so that worker threads never have to.
+ * @return 0 on success, a negative value if the kernel could not be queried.
+ */
+int type_cache_fill(void){
+  static const uint64_t w3c_types[] = {DM_ACTIVITY, DM_AGENT, DM_ENTITY,
+                                       RL_DERIVED, RL_GENERATED, RL_USED,
+                                       RL_INFORMED, RL_INFLUENCED, RL_ASSOCIATED};
   struct prov_type info;
-  int rc;
+  uint64_t id;
+  size_t i;
+  int bit;
   int fd;
 
-  name[0]='\0';
-
-  if( type_find_entry(id, name) )
-    return 0;
   fd = open(PROV_TYPE, O_RDONLY);
   if( fd < 0 )
-    goto out;
-  memset(&info, 0, sizeof(struct prov_type));
-  info.id=id;
-  info.is_relation = is_relation;
-  rc = read(fd, &info, sizeof(struct prov_type));
-  close(fd);
-  if(rc<0)
-    goto out;
-  if(len<strlen(info.str))
-    return -ENOMEM;
-  strncpy(name, info.str, len);
-  type_add_entry(id, name);
-out:
-  if(name[0]=='\0') {
-      ulltoa(id, name, HEX);
+    return fd;
+  for(i=0; i<sizeof(w3c_types)/sizeof(uint64_t); i++){
+    for(bit=0; bit<64 && (1ULL<<bit) & SUBTYPE_MASK; bit++){
+      id = w3c_types[i] | (1ULL<<bit);
+      if(__type_find(id))
+        continue;
+      if(__type_query(fd, id, (w3c_types[i] & DM_RELATION) != 0, &info) < 0)
+        continue;
+      info.str[sizeof(info.str) - 1] = '\0';
+      if(info.str[0] != '\0')
+        __type_add(id, info.str);
+    }
   }
-  return rc;
+  close(fd);
+  return 0;
 }
 
-static __thread char name_buff[256];
-char* relation_id_to_str(uint64_t id){
+/* types missed by type_cache_fill, e.g. recorded with another kernel */
+static const char* __type_lookup(uint64_t id, uint8_t is_relation){
+  struct prov_type info;
   int rc;
-  provenance_type_id_to_str(id, name_buff, 256, 1);
+  int fd;
+
+  fd = open(PROV_TYPE, O_RDONLY);
+  if( fd < 0 )
+    return NULL;
+  rc = __type_query(fd, id, is_relation, &info);
+  close(fd);
+  if(rc < 0)
+    return NULL;
+  info.str[sizeof(info.str) - 1] = '\0';
+  // types the kernel does not know are shown in hexadecimal
+  if(info.str[0] == '\0')
+    ulltoa(id, info.str, HEX);
+  return __type_add(id, info.str);
+}
+
+static __thread char name_buff[TYPE_NAME_LENGTH];
+static inline char* provenance_type_id_to_str(uint64_t id, uint8_t is_relation){
+  const char* str = __type_find(id);
+
+  if(!str)
+    str = __type_lookup(id, is_relation);
+  if(str)
+    return (char*)str;
+  ulltoa(id, name_buff, HEX);
   return name_buff;
 }
 
+/* the string returned is shared and must not be modified */
+char* relation_id_to_str(uint64_t id){
+  return provenance_type_id_to_str(id, 1);
+}
+
 char* node_id_to_str(uint64_t id){
-  int rc;
-  provenance_type_id_to_str(id, name_buff, 256, 0);
-  return name_buff;
+  return provenance_type_id_to_str(id, 0);
 }
 
 static inline int provenance_type_str_to_id(uint64_t *id,
@@ -0,0 +1,716 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <linux/provenance_types.h>
+
+#include "provenance.h"
+#include "provenanceBinary.h"
+#include "provenanceW3CJSON.h"
+#include "provenanceSPADEJSON.h"
+#include "provenancecache.h"
+#include "provenancestage.h"
+
+#define RECORD_HEADER   5
+#define VARINT_MAX      10
+#define TYPE_NAME_MAX   256
+#define BLOCK_PAYLOAD   16
+
+#define TYPE_RECORD_MAX   (RECORD_HEADER + 1 + VARINT_MAX + TYPE_NAME_MAX)
+#define NAME_RECORD_MAX   (RECORD_HEADER + PROV_IDENTIFIER_BUFFER_LENGTH + PATH_MAX)
+#define SECCTX_RECORD_MAX (RECORD_HEADER + VARINT_MAX + PATH_MAX)
+#define ELT_RECORD_MAX    (RECORD_HEADER + 2*VARINT_MAX + sizeof(union long_prov_elt))
+#define COALESCED_RECORD_MAX (RECORD_HEADER + 2*VARINT_MAX)
+/* an element and everything it may need defined, in a new block */
+#define ENCODED_MAX       (RECORD_HEADER + BLOCK_PAYLOAD + 3*TYPE_RECORD_MAX\
+                          + NAME_RECORD_MAX + SECCTX_RECORD_MAX + COALESCED_RECORD_MAX\
+                          + ELT_RECORD_MAX)
+#define PAYLOAD_MAX       (ELT_RECORD_MAX > NAME_RECORD_MAX ? ELT_RECORD_MAX : NAME_RECORD_MAX)
+
+static inline void put_u32(uint8_t* p, uint32_t v){
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t get_u32(const uint8_t* p){
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline size_t put_varint(uint8_t* p, uint64_t v){
+  size_t n = 0;
+  while(v >= 0x80){
+    p[n++] = (uint8_t)v | 0x80;
+    v >>= 7;
+  }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+static inline int get_varint(const uint8_t** p, const uint8_t* end, uint64_t* v){
+  const uint8_t* q = *p;
+  unsigned shift = 0;
+
+  *v = 0;
+  while(q < end && shift < 64){
+    *v |= (uint64_t)(*q & 0x7f) << shift;
+    if(!(*q++ & 0x80)){
+      *p = q;
+      return 0;
+    }
+    shift += 7;
+  }
+  return -EINVAL;
+}
+
+static inline uint64_t zigzag(int64_t v){
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v){
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* the payload has been written after the header, len is the payload length */
+static inline uint8_t* end_record(uint8_t* record, size_t len, uint8_t kind){
+  put_u32(record, (uint32_t)len);
+  record[4] = kind;
+  return record + RECORD_HEADER + len;
+}
+
+/*
+ * Writer side, the state is per thread as is the batch it appends to. The
+ * definitions already written in the current block are remembered in small
+ * direct mapped tables, a collision only means a definition is repeated.
+ */
+#define SEEN_TYPES_BITS  6
+#define SEEN_NAMES_BITS  8
+#define SEEN_SECIDS_BITS 6
+#define SEEN_TYPES  (1 << SEEN_TYPES_BITS)
+#define SEEN_NAMES  (1 << SEEN_NAMES_BITS)
+#define SEEN_SECIDS (1 << SEEN_SECIDS_BITS)
+
+struct binary_state {
+  uint64_t gen; /* of the current block, entries of older blocks are stale */
+  uint64_t prev_id;
+  uint64_t prev_jiffies;
+  struct {
+    uint64_t id;
+    uint64_t gen;
+  } types[SEEN_TYPES];
+  struct {
+    union prov_identifier id;
+    uint64_t gen;
+  } names[SEEN_NAMES];
+  struct {
+    uint32_t id;
+    uint64_t gen;
+  } secids[SEEN_SECIDS];
+};
+
+static __thread struct binary_state state;
+static __thread uint8_t scratch[ENCODED_MAX];
+static __thread char secctx[PATH_MAX];
+
+/* types differ in their top bits, fold them before multiplying */
+static inline size_t seen_slot(uint64_t key, unsigned bits){
+  key ^= key >> 32;
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static inline uint8_t* put_block(uint8_t* p){
+  uint8_t* q = p + RECORD_HEADER;
+
+  memcpy(q, PROV_BINARY_MAGIC, 4);
+  q[4] = PROV_BINARY_VERSION;
+  q[5] = 0;
+  q[6] = 0;
+  q[7] = 0;
+  put_u32(q + 8, sizeof(union prov_elt));
+  put_u32(q + 12, sizeof(union long_prov_elt));
+  return end_record(p, BLOCK_PAYLOAD, PROV_BINARY_BLOCK);
+}
+
+static inline uint8_t* define_type(uint8_t* p, uint64_t type, bool is_relation){
+  size_t slot = seen_slot(type, SEEN_TYPES_BITS);
+  uint8_t* q = p + RECORD_HEADER;
+  const char* name;
+  size_t len;
+
+  if(state.types[slot].gen == state.gen && state.types[slot].id == type)
+    return p;
+  name = is_relation ? relation_id_to_str(type) : node_id_to_str(type);
+  len = strnlen(name, TYPE_NAME_MAX-1);
+  *q++ = is_relation;
+  q += put_varint(q, type);
+  memcpy(q, name, len);
+  q += len;
+  state.types[slot].id = type;
+  state.types[slot].gen = state.gen;
+  return end_record(p, q - p - RECORD_HEADER, PROV_BINARY_TYPE);
+}
+
+static inline uint8_t* define_name(uint8_t* p, union prov_identifier* name_id){
+  size_t slot = seen_slot(name_id->node_id.id ^ name_id->node_id.type, SEEN_NAMES_BITS);
+  uint8_t* q = p + RECORD_HEADER;
+  const char* name;
+  size_t len;
+
+  if(state.names[slot].gen == state.gen
+    && !memcmp(&state.names[slot].id, name_id, sizeof(union prov_identifier)))
+    return p;
+  name = name_id_to_str(name_id);
+  if(!name) // not known yet, may be defined by a later element
+    return p;
+  len = strnlen(name, PATH_MAX-1);
+  memcpy(q, name_id->buffer, PROV_IDENTIFIER_BUFFER_LENGTH);
+  q += PROV_IDENTIFIER_BUFFER_LENGTH;
+  memcpy(q, name, len);
+  q += len;
+  memcpy(&state.names[slot].id, name_id, sizeof(union prov_identifier));
+  state.names[slot].gen = state.gen;
+  return end_record(p, q - p - RECORD_HEADER, PROV_BINARY_NAME);
+}
+
+static inline uint8_t* define_secctx(uint8_t* p, uint32_t secid){
+  size_t slot = seen_slot(secid, SEEN_SECIDS_BITS);
+  uint8_t* q = p + RECORD_HEADER;
+  size_t len;
+
+  if(state.secids[slot].gen == state.gen && state.secids[slot].id == secid)
+    return p;
+  provenance_secid_to_secctx(secid, secctx, PATH_MAX);
+  len = strnlen(secctx, PATH_MAX-1);
+  q += put_varint(q, secid);
+  memcpy(q, secctx, len);
+  q += len;
+  state.secids[slot].id = secid;
+  state.secids[slot].gen = state.gen;
+  return end_record(p, q - p - RECORD_HEADER, PROV_BINARY_SECCTX);
+}
+
+/* count and last jiffies of a relation standing for merged ones, if it is */
+static inline uint8_t* put_coalesced(uint8_t* p, struct relation_struct* rel){
+  uint8_t* q = p + RECORD_HEADER;
+  struct prov_coalesced c;
+
+  if(!provenance_relation_coalesced(rel, &c))
+    return p;
+  q += put_varint(q, c.count);
+  q += put_varint(q, zigzag((int64_t)(c.last_jiffies - rel->jiffies)));
+  return end_record(p, q - p - RECORD_HEADER, PROV_BINARY_COALESCED);
+}
+
+/* trailing zeros, most of a union for all but its largest members */
+static inline size_t trim_zeros(const uint8_t* data, size_t len){
+  uint64_t w;
+
+  while(len >= sizeof(uint64_t)){
+    memcpy(&w, data + len - sizeof(uint64_t), sizeof(uint64_t));
+    if(w)
+      break;
+    len -= sizeof(uint64_t);
+  }
+  while(len > 0 && data[len-1] == 0)
+    len--;
+  return len;
+}
+
+/* fields carried as deltas are zeroed in the copy, if it covers them */
+static inline void clear_field(uint8_t* copy, size_t len, size_t offset, size_t size){
+  if(offset >= len)
+    return;
+  if(offset + size > len)
+    size = len - offset;
+  memset(copy + offset, 0, size);
+}
+
+#define ID_OFFSET       offsetof(union long_prov_elt, msg_info.identifier.node_id.id)
+#define JIFFIES_OFFSET  offsetof(union long_prov_elt, msg_info.jiffies)
+
+/**
+ * @brief Encodes an element and the definitions it needs.
+ *
+ * @param out where to write, at least ENCODED_MAX bytes.
+ * @param msg the element.
+ * @param size sizeof(union prov_elt) or sizeof(union long_prov_elt).
+ * @param is_long whether msg is a long element.
+ * @param fresh whether this starts a block.
+ * @return the number of bytes written.
+ */
+static size_t binary_encode(uint8_t* out, prov_entry_t* msg, size_t size, bool is_long, bool fresh){
+  uint64_t type = prov_type(msg);
+  uint64_t id = msg->msg_info.identifier.node_id.id;
+  uint64_t jiffies = msg->msg_info.jiffies;
+  uint8_t* p = out;
+  uint8_t* q;
+  size_t len;
+
+  if(fresh){
+    state.gen++;
+    state.prev_id = 0;
+    state.prev_jiffies = 0;
+    p = put_block(p);
+  }
+  if(!is_long && prov_is_relation(msg)){
+    p = define_type(p, type, true);
+    p = define_type(p, msg->relation_info.snd.node_id.type, false);
+    p = define_type(p, msg->relation_info.rcv.node_id.type, false);
+    p = put_coalesced(p, &(msg->relation_info));
+  }else{
+    p = define_type(p, type, false);
+    if(type != ENT_PACKET && msg->node_info.name_id.node_id.type != 0)
+      p = define_name(p, &(msg->node_info.name_id));
+    if(!is_long){
+      switch(type){
+        case ENT_PROC:
+          p = define_secctx(p, msg->proc_info.secid);
+          break;
+        case ACT_TASK:
+          p = define_secctx(p, msg->task_info.secid);
+          break;
+        case ENT_INODE_UNKNOWN:
+        case ENT_INODE_LINK:
+        case ENT_INODE_FILE:
+        case ENT_INODE_DIRECTORY:
+        case ENT_INODE_CHAR:
+        case ENT_INODE_BLOCK:
+        case ENT_INODE_PIPE:
+        case ENT_INODE_SOCKET:
+          p = define_secctx(p, msg->inode_info.secid);
+          break;
+      }
+    }
+  }
+
+  q = p + RECORD_HEADER;
+  q += put_varint(q, zigzag((int64_t)(id - state.prev_id)));
+  q += put_varint(q, zigzag((int64_t)(jiffies - state.prev_jiffies)));
+  len = trim_zeros((const uint8_t*)msg, size);
+  memcpy(q, msg, len);
+  clear_field(q, len, ID_OFFSET, sizeof(uint64_t));
+  clear_field(q, len, JIFFIES_OFFSET, sizeof(uint64_t));
+  q += len;
+  state.prev_id = id;
+  state.prev_jiffies = jiffies;
+  p = end_record(p, q - p - RECORD_HEADER, is_long ? PROV_BINARY_LONG_ELT : PROV_BINARY_ELT);
+  return p - out;
+}
+
+static void binary_emit(struct stage_pool* pool, const struct stage_buffer* buf){
+  struct iovec iov;
+
+  iov.iov_base = buf->sections[0].data;
+  iov.iov_len = buf->sections[0].len;
+  stage_deliver(pool, &iov, 1);
+}
+
+static struct stage_pool binary_pool = STAGE_POOL_INIT(1, "", PROV_BINARY_BUFFER_LENGTH, binary_emit);
+
+void set_binary_callback( void (*fcn)(const struct iovec* iov, int iovcnt) ){
+  stage_pool_init(&binary_pool);
+  binary_pool.sink_iov = fcn;
+}
+
+void set_binary_buffer_size(size_t size){
+  if(size < PROV_BINARY_BUFFER_LENGTH)
+    size = PROV_BINARY_BUFFER_LENGTH;
+  stage_set_capacity(&binary_pool, size);
+}
+
+/*
+ * The element is encoded against the state of the current block. If it
+ * turns out to start a new block, i.e. the batch has been flushed in the
+ * meantime, it is encoded again in place with a fresh state.
+ */
+static inline void __binary_append(prov_entry_t* msg, size_t size, bool is_long){
+  uint8_t* area;
+  size_t len;
+  size_t room;
+  bool empty;
+
+  len = binary_encode(scratch, msg, size, is_long, false);
+  area = (uint8_t*)stage_reserve(&binary_pool, 0, len, &room, &empty);
+  if(!area)
+    return;
+  if(empty)
+    len = binary_encode(area, msg, size, is_long, true);
+  else
+    memcpy(area, scratch, len);
+  stage_commit(&binary_pool, 0, len);
+}
+
+void binary_append(union prov_elt* msg){
+  __binary_append((prov_entry_t*)msg, sizeof(union prov_elt), false);
+}
+
+void binary_append_long(union long_prov_elt* msg){
+  __binary_append((prov_entry_t*)msg, sizeof(union long_prov_elt), true);
+}
+
+void flush_binary(){
+  stage_flush(&binary_pool);
+}
+
+/* reader side */
+struct binary_reader {
+  void (*fcn)(prov_entry_t* msg, bool is_long);
+  bool in_block;
+  bool coalesced; /* the next relation stands for merged ones */
+  struct prov_coalesced info;
+  uint64_t prev_id;
+  uint64_t prev_jiffies;
+  uint8_t* pending; /* incomplete record carried to the next call */
+  size_t pending_len;
+  size_t pending_size;
+  prov_entry_t msg;
+  char str[PATH_MAX];
+};
+
+struct binary_reader* binary_reader_create( void (*fcn)(prov_entry_t* msg, bool is_long) ){
+  struct binary_reader* reader = (struct binary_reader*)calloc(1, sizeof(struct binary_reader));
+  if(!reader)
+    return NULL;
+  reader->fcn = fcn;
+  return reader;
+}
+
+void binary_reader_free(struct binary_reader* reader){
+  free(reader->pending);
+  free(reader);
+}
+
+static inline const char* reader_str(struct binary_reader* reader, const uint8_t* p, const uint8_t* end, size_t max){
+  size_t len = end - p;
+  if(len > max - 1)
+    len = max - 1;
+  memcpy(reader->str, p, len);
+  reader->str[len] = '\0';
+  return reader->str;
+}
+
+static int binary_record(struct binary_reader* reader, uint8_t kind, const uint8_t* p, size_t len){
+  const uint8_t* end = p + len;
+  union prov_identifier name_id;
+  uint64_t v;
+  uint64_t jiffies;
+  size_t size;
+  bool coalesced;
+
+  if(kind == PROV_BINARY_BLOCK){
+    if(len != BLOCK_PAYLOAD || memcmp(p, PROV_BINARY_MAGIC, 4) || p[4] != PROV_BINARY_VERSION
+      || get_u32(p + 8) != sizeof(union prov_elt) || get_u32(p + 12) != sizeof(union long_prov_elt))
+      return -EINVAL;
+    reader->in_block = true;
+    reader->coalesced = false;
+    reader->prev_id = 0;
+    reader->prev_jiffies = 0;
+    return 0;
+  }
+  if(!reader->in_block)
+    return -EINVAL;
+
+  switch(kind){
+    case PROV_BINARY_TYPE:
+      if(len < 1)
+        return -EINVAL;
+      p++;
+      if(get_varint(&p, end, &v))
+        return -EINVAL;
+      type_add_entry(v, reader_str(reader, p, end, TYPE_NAME_MAX));
+      break;
+    case PROV_BINARY_NAME:
+      if(len < PROV_IDENTIFIER_BUFFER_LENGTH)
+        return -EINVAL;
+      memset(&name_id, 0, sizeof(union prov_identifier));
+      memcpy(name_id.buffer, p, PROV_IDENTIFIER_BUFFER_LENGTH);
+      p += PROV_IDENTIFIER_BUFFER_LENGTH;
+      name_add_entry(&name_id, reader_str(reader, p, end, PATH_MAX));
+      break;
+    case PROV_BINARY_SECCTX:
+      if(get_varint(&p, end, &v))
+        return -EINVAL;
+      sec_add_entry((uint32_t)v, reader_str(reader, p, end, PATH_MAX));
+      break;
+    case PROV_BINARY_COALESCED:
+      if(get_varint(&p, end, &reader->info.count) || get_varint(&p, end, &v))
+        return -EINVAL;
+      reader->info.last_jiffies = unzigzag(v); // relative until the relation is read
+      reader->coalesced = true;
+      break;
+    case PROV_BINARY_ELT:
+    case PROV_BINARY_LONG_ELT:
+      size = (kind == PROV_BINARY_ELT) ? sizeof(union prov_elt) : sizeof(union long_prov_elt);
+      if(get_varint(&p, end, &v) || get_varint(&p, end, &jiffies))
+        return -EINVAL;
+      if((size_t)(end - p) > size)
+        return -EINVAL;
+      memset(&reader->msg, 0, size);
+      memcpy(&reader->msg, p, end - p);
+      reader->prev_id += unzigzag(v);
+      reader->prev_jiffies += unzigzag(jiffies);
+      reader->msg.msg_info.identifier.node_id.id = reader->prev_id;
+      reader->msg.msg_info.jiffies = reader->prev_jiffies;
+      coalesced = reader->coalesced && kind == PROV_BINARY_ELT && prov_is_relation(&reader->msg);
+      reader->coalesced = false;
+      if(coalesced){
+        reader->info.first_jiffies = reader->prev_jiffies;
+        reader->info.last_jiffies += reader->prev_jiffies;
+        relation_coalesced_seed(&(reader->msg.relation_info), &reader->info);
+      }
+      if(reader->fcn)
+        reader->fcn(&reader->msg, kind == PROV_BINARY_LONG_ELT);
+      if(coalesced)
+        relation_coalesced_seed(NULL, NULL);
+      break;
+    default: // from a later version, ignored
+      break;
+  }
+  return 0;
+}
+
+/* decode the complete records of data, @used set to the bytes consumed */
+static int binary_parse(struct binary_reader* reader, const uint8_t* data, size_t len, size_t* used){
+  size_t off = 0;
+  uint32_t plen;
+  int rc;
+
+  while(len - off >= RECORD_HEADER){
+    plen = get_u32(data + off);
+    if(plen > PAYLOAD_MAX)
+      return -EINVAL;
+    if(len - off < RECORD_HEADER + plen)
+      break;
+    rc = binary_record(reader, data[off + 4], data + off + RECORD_HEADER, plen);
+    if(rc)
+      return rc;
+    off += RECORD_HEADER + plen;
+  }
+  *used = off;
+  return 0;
+}
+
+static inline int reader_keep(struct binary_reader* reader, const uint8_t* data, size_t len){
+  uint8_t* p;
+
+  if(reader->pending_len + len > reader->pending_size){
+    p = (uint8_t*)realloc(reader->pending, reader->pending_len + len);
+    if(!p)
+      return -ENOMEM;
+    reader->pending = p;
+    reader->pending_size = reader->pending_len + len;
+  }
+  memcpy(reader->pending + reader->pending_len, data, len);
+  reader->pending_len += len;
+  return 0;
+}
+
+int binary_read(struct binary_reader* reader, const void* data, size_t len){
+  size_t used;
+  int rc;
+
+  if(reader->pending_len == 0){
+    rc = binary_parse(reader, (const uint8_t*)data, len, &used);
+    if(rc)
+      return rc;
+    return reader_keep(reader, (const uint8_t*)data + used, len - used);
+  }
+  rc = reader_keep(reader, (const uint8_t*)data, len);
+  if(rc)
+    return rc;
+  rc = binary_parse(reader, reader->pending, reader->pending_len, &used);
+  if(rc)
+    return rc;
+  memmove(reader->pending, reader->pending + used, reader->pending_len - used);
+  reader->pending_len -= used;
+  return 0;
+}
+
+/* same dispatch as relation_record, node_record and long_prov_record */
+void binary_to_w3c(prov_entry_t* msg, bool is_long){
+  uint64_t type = prov_type(msg);
+
+  if(is_long){
+    switch(type){
+      case ENT_STR:
+        append_message(str_msg_to_json(&(msg->str_info)));
+        break;
+      case ENT_PATH:
+        append_entity(pathname_to_json(&(msg->file_name_info)));
+        break;
+      case ENT_ADDR:
+        append_entity(addr_to_json(&(msg->address_info)));
+        break;
+      case ENT_XATTR:
+        append_entity(xattr_to_json(&(msg->xattr_info)));
+        break;
+      case ENT_DISC:
+        append_entity(disc_to_json(&(msg->disc_node_info)));
+        break;
+      case ACT_DISC:
+        append_activity(disc_to_json(&(msg->disc_node_info)));
+        break;
+      case AGT_DISC:
+        append_agent(disc_to_json(&(msg->disc_node_info)));
+        break;
+      case ENT_PCKCNT:
+        append_entity(pckcnt_to_json(&(msg->pckcnt_info)));
+        break;
+      case ENT_ARG:
+      case ENT_ENV:
+        append_entity(arg_to_json(&(msg->arg_info)));
+        break;
+      case AGT_MACHINE:
+        append_agent(machine_to_json(&(msg->machine_info)));
+        break;
+    }
+    return;
+  }
+  if(prov_is_relation(msg)){
+    if(prov_is_used(type))
+      append_used(used_to_json(&(msg->relation_info)));
+    else if(prov_is_informed(type))
+      append_informed(informed_to_json(&(msg->relation_info)));
+    else if(prov_is_generated(type))
+      append_generated(generated_to_json(&(msg->relation_info)));
+    else if(prov_is_derived(type))
+      append_derived(derived_to_json(&(msg->relation_info)));
+    else if(prov_is_influenced(type))
+      append_influenced(influenced_to_json(&(msg->relation_info)));
+    else if(prov_is_associated(type))
+      append_associated(associated_to_json(&(msg->relation_info)));
+    return;
+  }
+  switch(type){
+    case ENT_PROC:
+      append_entity(proc_to_json(&(msg->proc_info)));
+      break;
+    case ACT_TASK:
+      append_activity(task_to_json(&(msg->task_info)));
+      break;
+    case ENT_INODE_UNKNOWN:
+    case ENT_INODE_LINK:
+    case ENT_INODE_FILE:
+    case ENT_INODE_DIRECTORY:
+    case ENT_INODE_CHAR:
+    case ENT_INODE_BLOCK:
+    case ENT_INODE_PIPE:
+    case ENT_INODE_SOCKET:
+      append_entity(inode_to_json(&(msg->inode_info)));
+      break;
+    case ENT_MSG:
+      append_entity(msg_to_json(&(msg->msg_msg_info)));
+      break;
+    case ENT_SHM:
+      append_entity(shm_to_json(&(msg->shm_info)));
+      break;
+    case ENT_PACKET:
+      append_entity(packet_to_json(&(msg->pck_info)));
+      break;
+    case ENT_IATTR:
+      append_entity(iattr_to_json(&(msg->iattr_info)));
+      break;
+  }
+}
+
+void binary_to_spade(prov_entry_t* msg, bool is_long){
+  uint64_t type = prov_type(msg);
+
+  if(is_long){
+    switch(type){
+      case ENT_STR:
+        spade_json_append(str_msg_to_spade_json(&(msg->str_info)));
+        break;
+      case ENT_PATH:
+        spade_json_append(pathname_to_spade_json(&(msg->file_name_info)));
+        break;
+      case ENT_ADDR:
+        spade_json_append(addr_to_spade_json(&(msg->address_info)));
+        break;
+      case ENT_XATTR:
+        spade_json_append(xattr_to_spade_json(&(msg->xattr_info)));
+        break;
+      case ENT_DISC:
+      case ACT_DISC:
+      case AGT_DISC:
+        spade_json_append(disc_to_spade_json(&(msg->disc_node_info)));
+        break;
+      case ENT_PCKCNT:
+        spade_json_append(pckcnt_to_spade_json(&(msg->pckcnt_info)));
+        break;
+      case ENT_ARG:
+      case ENT_ENV:
+        spade_json_append(arg_to_spade_json(&(msg->arg_info)));
+        break;
+      case AGT_MACHINE:
+        spade_json_append(machine_to_spade_json(&(msg->machine_info)));
+        break;
+    }
+    return;
+  }
+  if(prov_is_relation(msg)){
+    if(prov_is_used(type))
+      spade_json_append(used_to_spade_json(&(msg->relation_info)));
+    else if(prov_is_informed(type))
+      spade_json_append(informed_to_spade_json(&(msg->relation_info)));
+    else if(prov_is_generated(type))
+      spade_json_append(generated_to_spade_json(&(msg->relation_info)));
+    else if(prov_is_derived(type))
+      spade_json_append(derived_to_spade_json(&(msg->relation_info)));
+    else if(prov_is_influenced(type))
+      spade_json_append(influenced_to_spade_json(&(msg->relation_info)));
+    else if(prov_is_associated(type))
+      spade_json_append(associated_to_spade_json(&(msg->relation_info)));
+    return;
+  }
+  switch(type){
+    case ENT_PROC:
+      spade_json_append(proc_to_spade_json(&(msg->proc_info)));
+      break;
+    case ACT_TASK:
+      spade_json_append(task_to_spade_json(&(msg->task_info)));
+      break;
+    case ENT_INODE_UNKNOWN:
+    case ENT_INODE_LINK:
+    case ENT_INODE_FILE:
+    case ENT_INODE_DIRECTORY:
+    case ENT_INODE_CHAR:
+    case ENT_INODE_BLOCK:
+    case ENT_INODE_PIPE:
+    case ENT_INODE_SOCKET:
+      spade_json_append(inode_to_spade_json(&(msg->inode_info)));
+      break;
+    case ENT_MSG:
+      spade_json_append(msg_to_spade_json(&(msg->msg_msg_info)));
+      break;
+    case ENT_SHM:
+      spade_json_append(shm_to_spade_json(&(msg->shm_info)));
+      break;
+    case ENT_PACKET:
+      spade_json_append(packet_to_spade_json(&(msg->pck_info)));
+      break;
+    case ENT_IATTR:
+      spade_json_append(iattr_to_spade_json(&(msg->iattr_info)));
+      break;
+  }
+}
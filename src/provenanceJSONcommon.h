@@ -14,81 +14,265 @@
  * or (at your option) any later version.
  */
 
+#include <stdatomic.h>
+#include <time.h>
 #include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "provenanceformat.h"
+#include "provenancearena.h"
 
 #define MAX_JSON_BUFFER_EXP     13
 #define MAX_JSON_BUFFER_LENGTH  ((1 << MAX_JSON_BUFFER_EXP)*sizeof(uint8_t))
-#define BUFFER_LENGTH (MAX_JSON_BUFFER_LENGTH-strnlen(buffer, MAX_JSON_BUFFER_LENGTH))
 
 extern __thread char buffer[MAX_JSON_BUFFER_LENGTH];
-extern char date[256];
-extern pthread_rwlock_t  date_lock;
+extern __thread size_t buffer_len;
 
-// ideally should be derived from jiffies
-static void update_time( void ){
+/*
+ * cf:date is formatted at most once per second of CLOCK_REALTIME_COARSE,
+ * by whichever thread first sees the second change, and copied lock-free
+ * by every element. The string is held in atomic words, in two slots under
+ * a seqlock: a refresh writes the slot not published, so that readers copy
+ * the last complete one meanwhile rather than wait. A reader only retries if
+ * a second refresh started while it copied, i.e. may have overwritten its
+ * slot.
+ */
+#define JSON_DATE_LEN   19 /* YYYY:MM:DDTHH:MM:SS */
+#define JSON_DATE_WORDS 3
+
+struct json_date {
+  _Atomic uint32_t seq; /* odd while refreshing, seq/2 (rounded down) %2 is the slot published */
+  _Atomic int64_t sec; /* second formatted */
+  _Atomic uint64_t words[2][JSON_DATE_WORDS];
+};
+
+union json_date_str {
+  char str[JSON_DATE_WORDS*sizeof(uint64_t)];
+  uint64_t words[JSON_DATE_WORDS];
+};
+
+extern struct json_date json_date;
+
+/*
+ * buffer is written through a cursor, buffer_len, so that appending does
+ * not rescan what has already been written. The content is always NUL
+ * terminated and silently truncated to MAX_JSON_BUFFER_LENGTH-1 characters.
+ */
+static inline void __buffer_reset(void){
+  buffer_len = 0;
+  buffer[0] = '\0';
+}
+
+static inline void __buffer_append(const char* str, size_t len){
+  size_t room = MAX_JSON_BUFFER_LENGTH - 1 - buffer_len;
+  if(len > room)
+    len = room;
+  memcpy(buffer + buffer_len, str, len);
+  buffer_len += len;
+  buffer[buffer_len] = '\0';
+}
+
+static inline void __buffer_append_str(const char* str){
+  __buffer_append(str, strnlen(str, MAX_JSON_BUFFER_LENGTH));
+}
+
+/* for string literals, the length is known at compile time */
+#define __buffer_append_lit(str) __buffer_append(str, sizeof(str)-1)
+
+/*
+ * numbers are formatted in place when there is room for the longest
+ * representation, through a temporary near the end of the buffer
+ */
+#define __buffer_append_fmt(fmt, maxlen, value) do{\
+  char __tmp[maxlen];\
+  if(MAX_JSON_BUFFER_LENGTH - 1 - buffer_len >= maxlen){\
+    buffer_len += fmt(buffer + buffer_len, value);\
+    buffer[buffer_len] = '\0';\
+  }else\
+    __buffer_append(__tmp, fmt(__tmp, value));\
+}while(0)
+
+static inline void __buffer_append_u64(const uint64_t value){
+  __buffer_append_fmt(fmt_u64_dec, FMT_U64_DEC_LEN, value);
+}
+
+static inline void __buffer_append_i64(const int64_t value){
+  __buffer_append_fmt(fmt_i64_dec, FMT_I64_DEC_LEN, value);
+}
+
+static inline void __buffer_append_hex(const uint64_t value){
+  __buffer_append_fmt(fmt_u64_hex, FMT_U64_HEX_LEN, value);
+}
+
+/* the kernels below read str and write straight to the cursor */
+static inline void __buffer_append_sanitized(const char* str, size_t len){
+  size_t room = MAX_JSON_BUFFER_LENGTH - 1 - buffer_len;
+  if(len > room)
+    len = room;
+  fmt_sanitize(buffer + buffer_len, str, len);
+  buffer_len += len;
+  buffer[buffer_len] = '\0';
+}
+
+#define ESCAPE_CHUNK 64
+
+static inline void __buffer_append_escaped(const char* str, size_t len){
+  char tmp[fmt_json_escape_len(ESCAPE_CHUNK)];
+  size_t n;
+
+  if(MAX_JSON_BUFFER_LENGTH - 1 - buffer_len >= fmt_json_escape_len(len)){
+    buffer_len += fmt_json_escape(buffer + buffer_len, str, len);
+    buffer[buffer_len] = '\0';
+    return;
+  }
+  // close to the end, truncated as any other append
+  for(; len > 0; str += n, len -= n){
+    n = (len < ESCAPE_CHUNK) ? len : ESCAPE_CHUNK;
+    __buffer_append(tmp, fmt_json_escape(tmp, str, n));
+  }
+}
+
+#define BASE64_CHUNK 48 /* a multiple of 3, chunks encode as the whole */
+
+static inline void __buffer_append_base64(const uint8_t* data, size_t len){
+  char tmp[fmt_base64_len(BASE64_CHUNK)];
+  size_t n;
+
+  if(MAX_JSON_BUFFER_LENGTH - 1 - buffer_len >= fmt_base64_len(len)){
+    buffer_len += fmt_base64(buffer + buffer_len, data, len);
+    buffer[buffer_len] = '\0';
+    return;
+  }
+  for(; len > 0; data += n, len -= n){
+    n = (len < BASE64_CHUNK) ? len : BASE64_CHUNK;
+    __buffer_append(tmp, fmt_base64(tmp, data, n));
+  }
+}
+
+static inline void __date_format(union json_date_str* date, const time_t sec){
   struct tm tm;
-  struct timeval tv;
 
-  pthread_rwlock_wrlock(&date_lock);
-  gettimeofday(&tv, NULL);
-  gmtime_r(&tv.tv_sec, &tm);
-  strftime(date, 30,"%Y:%m:%dT%H:%M:%S", &tm);
-  pthread_rwlock_unlock(&date_lock);
+  memset(date, 0, sizeof(*date));
+  gmtime_r(&sec, &tm);
+  strftime(date->str, sizeof(date->str), "%Y:%m:%dT%H:%M:%S", &tm);
+}
+
+// ideally should be derived from jiffies
+static void __date_refresh(const time_t sec){
+  uint32_t seq = atomic_load_explicit(&json_date.seq, memory_order_relaxed);
+  union json_date_str date;
+  int slot;
+  int i;
+
+  // another thread is already refreshing, the previous second is used
+  if((seq&1) || !atomic_compare_exchange_strong_explicit(&json_date.seq, &seq, seq+1,
+                                                         memory_order_acquire, memory_order_relaxed))
+    return;
+  atomic_thread_fence(memory_order_release);
+  if(atomic_load_explicit(&json_date.sec, memory_order_relaxed) < sec){
+    __date_format(&date, sec);
+    slot = ((seq>>1)+1)&1; // not published
+    for(i=0; i<JSON_DATE_WORDS; i++)
+      atomic_store_explicit(&json_date.words[slot][i], date.words[i], memory_order_relaxed);
+    atomic_store_explicit(&json_date.sec, sec, memory_order_relaxed);
+    seq += 2; // publishes slot
+  }
+  atomic_store_explicit(&json_date.seq, seq, memory_order_release);
+}
+
+static inline void __date_copy(union json_date_str* date){
+  struct timespec t;
+  uint32_t seq;
+  int i;
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &t);
+  if(t.tv_sec > atomic_load_explicit(&json_date.sec, memory_order_relaxed))
+    __date_refresh(t.tv_sec);
+  do{
+    // last complete refresh, even if one is in progress
+    seq = atomic_load_explicit(&json_date.seq, memory_order_acquire) & ~1U;
+    // first refresh still in progress, no slot has been written yet
+    if(seq==0){
+      __date_format(date, t.tv_sec);
+      return;
+    }
+    for(i=0; i<JSON_DATE_WORDS; i++)
+      date->words[i] = atomic_load_explicit(&json_date.words[(seq>>1)&1][i], memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+  }while(atomic_load_explicit(&json_date.seq, memory_order_relaxed)-seq >= 3); // the refresh after next writes this slot
+}
+
+/* str with its double quotes escaped, in arena, NULL if out of memory */
+static inline char* __escape_quotes(struct arena* arena, const char* str){
+  const char* p;
+  char* out;
+  char* q;
+  size_t quotes = 0;
+
+  for(p=str; *p; p++){
+    if(*p=='"')
+      quotes++;
+  }
+  out = (char*)arena_alloc(arena, (p-str)+quotes+1);
+  if(!out)
+    return NULL;
+  for(p=str, q=out; *p; p++){
+    if(*p=='"')
+      *q++ = '\\';
+    *q++ = *p;
+  }
+  *q = '\0';
+  return out;
 }
 
 static inline void __add_attribute(const char* name, bool comma){
   if(comma){
-    strncat(buffer, ",\"", BUFFER_LENGTH);
+    __buffer_append_lit(",\"");
   }else{
-    strncat(buffer, "\"", BUFFER_LENGTH);
+    __buffer_append_lit("\"");
   }
-  strncat(buffer, name, BUFFER_LENGTH);
-  strncat(buffer, "\":", BUFFER_LENGTH);
+  __buffer_append_str(name);
+  __buffer_append_lit("\":");
 }
 
 static inline void __add_uint32_attribute(const char* name, const uint32_t value, bool comma){
-  char tmp[32];
   __add_attribute(name, comma);
-  strncat(buffer, utoa(value, tmp, DECIMAL), BUFFER_LENGTH);
+  __buffer_append_u64(value);
 }
 
 
 static inline void __add_int32_attribute(const char* name, const int32_t value, bool comma){
-  char tmp[32];
   __add_attribute(name, comma);
-  strncat(buffer, itoa(value, tmp, DECIMAL), BUFFER_LENGTH);
+  __buffer_append_i64(value);
 }
 
 static inline void __add_uint32hex_attribute(const char* name, const uint32_t value, bool comma){
-  char tmp[32];
   __add_attribute(name, comma);
-  strncat(buffer, "\"0x", BUFFER_LENGTH);
-  strncat(buffer, utoa(value, tmp, HEX), BUFFER_LENGTH);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"0x");
+  __buffer_append_hex(value);
+  __buffer_append_lit("\"");
 }
 
 static inline void __add_uint64_attribute(const char* name, const uint64_t value, bool comma){
-  char tmp[64];
   __add_attribute(name, comma);
-  strncat(buffer, "\"", BUFFER_LENGTH);
-  strncat(buffer, ulltoa(value, tmp, DECIMAL), BUFFER_LENGTH);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"");
+  __buffer_append_u64(value);
+  __buffer_append_lit("\"");
 }
 
 static inline void __add_uint64hex_attribute(const char* name, const uint64_t value, bool comma){
-  char tmp[64];
   __add_attribute(name, comma);
-  strncat(buffer, "\"", BUFFER_LENGTH);
-  strncat(buffer, ulltoa(value, tmp, HEX), BUFFER_LENGTH);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"");
+  __buffer_append_hex(value);
+  __buffer_append_lit("\"");
 }
 
 static inline void __add_int64_attribute(const char* name, const int64_t value, bool comma){
-  char tmp[64];
   __add_attribute(name, comma);
-  strncat(buffer, "\"", BUFFER_LENGTH);
-  strncat(buffer, lltoa(value, tmp, DECIMAL), BUFFER_LENGTH);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"");
+  __buffer_append_i64(value);
+  __buffer_append_lit("\"");
 }
 
 static inline void __add_string_attribute(const char* name, const char* value, bool comma){
@@ -96,18 +280,47 @@ static inline void __add_string_attribute(const char* name, const char* value, b
     return;
   }
   __add_attribute(name, comma);
-  strncat(buffer, "\"", BUFFER_LENGTH);
-  strncat(buffer, value, BUFFER_LENGTH);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"");
+  __buffer_append_str(value);
+  __buffer_append_lit("\"");
+}
+
+/* as __add_string_attribute, for the len first characters of value */
+static inline void __add_sanitized_attribute(const char* name, const char* value, size_t len, bool comma){
+  if(len==0)
+    return;
+  __add_attribute(name, comma);
+  __buffer_append_lit("\"");
+  __buffer_append_sanitized(value, len);
+  __buffer_append_lit("\"");
+}
+
+static inline void __add_escaped_attribute(const char* name, const char* value, size_t len, bool comma){
+  if(len==0)
+    return;
+  __add_attribute(name, comma);
+  __buffer_append_lit("\"");
+  __buffer_append_escaped(value, len);
+  __buffer_append_lit("\"");
+}
+
+static inline void __add_base64_attribute(const char* name, const uint8_t* data, size_t len, bool comma){
+  if(len==0)
+    return;
+  __add_attribute(name, comma);
+  __buffer_append_lit("\"");
+  __buffer_append_base64(data, len);
+  __buffer_append_lit("\"");
 }
 
 static inline void __add_date_attribute(bool comma){
+  union json_date_str date;
+
+  __date_copy(&date);
   __add_attribute("cf:date", comma);
-  strncat(buffer, "\"", BUFFER_LENGTH);
-  pthread_rwlock_rdlock(&date_lock);
-  strncat(buffer, date, BUFFER_LENGTH);
-  pthread_rwlock_unlock(&date_lock);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"");
+  __buffer_append(date.str, JSON_DATE_LEN);
+  __buffer_append_lit("\"");
 }
 
 #define UUID_STR_SIZE 37
@@ -116,49 +329,62 @@ static inline char* uuid_to_str(uint8_t* uuid, char* str, size_t size){
     snprintf(str, size, "UUID-ERROR");
     return str;
   }
-  snprintf(str, size, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-    uuid[0], uuid[1], uuid[2], uuid[3]
-    , uuid[4], uuid[5]
-    , uuid[6], uuid[7]
-    , uuid[8], uuid[9]
-    , uuid[10], uuid[11], uuid[12], uuid[13], uuid[14], uuid[15]);
-    return str;
+  str[fmt_uuid(str, uuid)] = '\0';
+  return str;
 }
 
 static inline void __add_ipv4(uint32_t ip, uint32_t port){
-    char tmp[8];
-    strncat(buffer, uint32_to_ipv4str(ip), BUFFER_LENGTH);
-    strncat(buffer, ":", BUFFER_LENGTH);
-    strncat(buffer, utoa(htons(port), tmp, DECIMAL), BUFFER_LENGTH);
+    __buffer_append_str(uint32_to_ipv4str(ip));
+    __buffer_append_lit(":");
+    __buffer_append_u64(htons(port));
+}
+
+/*
+ * Numeric host and service of addr, as getnameinfo with NI_NUMERICHOST |
+ * NI_NUMERICSERV. IPv4 and unscoped IPv6 addresses are formatted here,
+ * anything else, such as a scope to resolve, goes through getnameinfo.
+ * host must hold NI_MAXHOST characters and serv NI_MAXSERV.
+ */
+static inline int __sockaddr_numeric(const struct sockaddr_storage* addr, size_t length, char* host, char* serv){
+  const struct sockaddr_in* in4 = (const struct sockaddr_in*)addr;
+  const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+
+  if(addr->ss_family == AF_INET){
+    host[fmt_ipv4(host, (const uint8_t*)&in4->sin_addr)] = '\0';
+    serv[fmt_u64_dec(serv, ntohs(in4->sin_port))] = '\0';
+    return 0;
+  }
+  if(addr->ss_family == AF_INET6){
+    if(in6->sin6_scope_id == 0){
+      host[fmt_ipv6(host, in6->sin6_addr.s6_addr)] = '\0';
+      serv[fmt_u64_dec(serv, ntohs(in6->sin6_port))] = '\0';
+      return 0;
+    }
+    length = sizeof(struct sockaddr_in6);
+  }
+  return getnameinfo((const struct sockaddr*)addr, length, host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
 }
 
 static inline void __add_ipv4_attribute(const char* name, const uint32_t ip, const uint32_t port, bool comma){
-  char tmp[64];
   __add_attribute(name, comma);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"");
   __add_ipv4(ip, port);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"");
 }
 
 static inline void __add_machine_id(uint32_t value, bool comma){
-  char tmp[32];
   __add_attribute("cf:machine_id", comma);
-  strncat(buffer, "\"cf:", BUFFER_LENGTH);
-  strncat(buffer, utoa(value, tmp, DECIMAL), BUFFER_LENGTH);
-  strncat(buffer, "\"", BUFFER_LENGTH);
+  __buffer_append_lit("\"cf:");
+  __buffer_append_u64(value);
+  __buffer_append_lit("\"");
 }
 
+/* nodes are held back by the relay until their name is known, no need to wait */
 static inline void __add_name_id(union prov_identifier* name_id, bool comma){
   char *name;
-  int i;
   if (name_id->node_id.type == 0)
     return;
-  for (i = 0; i < 5; i++) {
-    name = name_id_to_str(name_id);
-    if (name != NULL)
-      break;
-    usleep(50000);
-  }
+  name = name_id_to_str(name_id);
   if (name != NULL)
     __add_string_attribute("cf:name", name, comma);
 }
@@ -40,22 +40,21 @@
 #include "provenanceutils.h"
 
 #include "provenanceJSONcommon.h"
+#include "provenancestage.h"
 
 __thread char buffer[MAX_JSON_BUFFER_LENGTH];
-#define BUFFER_LENGTH (MAX_JSON_BUFFER_LENGTH-strnlen(buffer, MAX_JSON_BUFFER_LENGTH))
+__thread size_t buffer_len=0;
 static __thread char id[PROV_ID_STR_LEN];
 static __thread char from[PROV_ID_STR_LEN];
 static __thread char to[PROV_ID_STR_LEN];
-char date[256];
-pthread_rwlock_t  date_lock = PTHREAD_RWLOCK_INITIALIZER;
+struct json_date json_date;
 
 static inline void __init_node(char* type, char* id, const struct node_identifier* n){
-  buffer[0]='\0';
-  update_time();
-  strncat(buffer, "{", BUFFER_LENGTH);
+  __buffer_reset();
+  __buffer_append_lit("{");
   __add_string_attribute("type", type, false);
   __add_string_attribute("id", id, true);
-  strncat(buffer, ",\"annotations\": {", BUFFER_LENGTH);
+  __buffer_append_lit(",\"annotations\": {");
   __add_uint64_attribute("object_id", n->id, false);
   __add_string_attribute("object_type", node_id_to_str(n->type), true);
   __add_uint32_attribute("boot_id", n->boot_id, true);
@@ -65,7 +64,7 @@ static inline void __init_node(char* type, char* id, const struct node_identifie
 }
 
 static inline void __close_node( void ){
-  strncat(buffer, "}}\n", BUFFER_LENGTH);
+  __buffer_append_lit("}}\n");
 }
 
 static inline void __init_relation(char* type,
@@ -74,13 +73,12 @@ static inline void __init_relation(char* type,
                     char* id,
                     const struct relation_identifier* e
                   ) {
-  buffer[0]='\0';
-  update_time();
-  strncat(buffer, "{", BUFFER_LENGTH);
+  __buffer_reset();
+  __buffer_append_lit("{");
   __add_string_attribute("type", type, false);
   __add_string_attribute("from", from, true);
   __add_string_attribute("to", to, true);
-  strncat(buffer, ",\"annotations\": {", BUFFER_LENGTH);
+  __buffer_append_lit(",\"annotations\": {");
   __add_string_attribute("id", id, false);
   __add_uint64_attribute("relation_id", e->id, true);
   __add_string_attribute("relation_type", relation_id_to_str(e->type), true);
@@ -107,7 +105,12 @@ static inline void __init_relation(char* type,
 #define RELATION_END() __close_node()
 
 static inline void __relation_to_spade_json(struct relation_struct* e) {
+  struct prov_coalesced c;
   __add_uint64_attribute("jiffies", e->jiffies, true);
+  if(provenance_relation_coalesced(e, &c)){
+    __add_uint64_attribute("count", c.count, true);
+    __add_uint64_attribute("last_jiffies", c.last_jiffies, true);
+  }
   if(e->allowed==FLOW_ALLOWED)
     __add_string_attribute("allowed", "true", true);
   else
@@ -242,12 +245,11 @@ char* shm_to_spade_json(struct shm_struct* n) {
 
 char* packet_to_spade_json(struct pck_struct* n) {
   ID_ENCODE(n->identifier.buffer, PROV_IDENTIFIER_BUFFER_LENGTH, id, PROV_ID_STR_LEN);
-  buffer[0]='\0';
-  update_time();
-  strncat(buffer, "{", BUFFER_LENGTH);
+  __buffer_reset();
+  __buffer_append_lit("{");
   __add_string_attribute("type", "Entity", false);
   __add_string_attribute("id", id, true);
-  strncat(buffer, ",\"annotations\": {", BUFFER_LENGTH);
+  __buffer_append_lit(",\"annotations\": {");
   __add_string_attribute("object_type", "packet", false);
   __add_date_attribute(true);
   __add_uint32_attribute("packet_id", n->identifier.packet_id.id, true);
@@ -275,7 +277,7 @@ char* addr_to_spade_json(struct address_struct* n) {
 
   NODE_START("Entity");
   if(ad->sa_family == AF_INET){
-    err = getnameinfo(ad, sizeof(struct sockaddr_in), host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(&(n->addr), n->length, host, serv);
     __add_string_attribute("type", "AF_INET", true);
     if (err < 0) {
       __add_string_attribute("host", "could not resolve", true);
@@ -286,7 +288,7 @@ char* addr_to_spade_json(struct address_struct* n) {
       __add_string_attribute("service", serv, true);
     }
   }else if(ad->sa_family == AF_INET6){
-    err = getnameinfo(ad, sizeof(struct sockaddr_in6), host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(&(n->addr), n->length, host, serv);
     __add_string_attribute("type", "AF_INET6", true);
     if (err < 0) {
       __add_string_attribute("host", "could not resolve", true);
@@ -298,9 +300,10 @@ char* addr_to_spade_json(struct address_struct* n) {
     }
   }else if(ad->sa_family == AF_UNIX){
     __add_string_attribute("type", "AF_UNIX", true);
-    __add_string_attribute("path", ((struct sockaddr_un*)ad)->sun_path, true);
+    __add_escaped_attribute("path", ((struct sockaddr_un*)ad)->sun_path,
+                            strnlen(((struct sockaddr_un*)ad)->sun_path, sizeof(((struct sockaddr_un*)ad)->sun_path)), true);
   }else{
-    err = getnameinfo(ad, n->length, host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(&(n->addr), n->length, host, serv);
     __add_int32_attribute("type", ad->sa_family, true);
     if (err < 0) {
       __add_string_attribute("host", "could not resolve", true);
@@ -354,12 +357,8 @@ char* xattr_to_spade_json(struct xattr_prov_struct* n) {
 }
 
 char* pckcnt_to_spade_json(struct pckcnt_struct* n) {
-  char* cntenc;
   NODE_START("Entity");
-  cntenc = malloc( encode64Bound(n->length) );
-  base64encode(n->content, n->length, cntenc, encode64Bound(n->length));
-  __add_string_attribute("content", cntenc, true);
-  free(cntenc);
+  __add_base64_attribute("content", n->content, n->length, true);
   __add_uint32_attribute("length", n->length, true);
   if(n->truncated==PROV_TRUNCATED)
     __add_string_attribute("truncated", "true", true);
@@ -370,6 +369,8 @@ char* pckcnt_to_spade_json(struct pckcnt_struct* n) {
 }
 
 char* arg_to_spade_json(struct arg_struct* n) {
+  struct arena* arena = arena_self();
+  struct arena_mark mark;
   int i;
   char* tmp;
   NODE_START("Entity");
@@ -381,7 +382,8 @@ char* arg_to_spade_json(struct arg_struct* n) {
     if(n->value[i]=='\t')
       n->value[i]=' ';
   }
-  tmp = repl_str(n->value, "\"", "\\\"");
+  mark = arena_mark(arena);
+  tmp = __escape_quotes(arena, n->value);
   if(tmp==NULL)
     tmp = n->value;
   __add_string_attribute("value", tmp, true);
@@ -390,8 +392,7 @@ char* arg_to_spade_json(struct arg_struct* n) {
   else
     __add_string_attribute("truncated", "false", true);
   NODE_END();
-  if(tmp != n->value)
-    free(tmp);
+  arena_release(arena, mark);
   return buffer;
 }
 
@@ -415,70 +416,38 @@ char* machine_to_spade_json(struct machine_struct* n){
   return buffer;
 }
 
-static char* json;
-static inline void init_buffer( void ){
-  json = (char*)malloc(MAX_JSON_BUFFER_LENGTH);
-  memset(buffer, 0, MAX_JSON_BUFFER_LENGTH);
-  memset(json, 0, MAX_JSON_BUFFER_LENGTH);
+static void spade_emit(struct stage_pool* pool, const struct stage_buffer* buf){
+  struct iovec iov;
+
+  iov.iov_base = buf->sections[0].data;
+  iov.iov_len = buf->sections[0].len;
+  stage_deliver(pool, &iov, 1);
 }
 
-static void (*print_json)(char* json);
+static struct stage_pool spade_pool = STAGE_POOL_INIT(1, "", MAX_JSON_BUFFER_LENGTH, spade_emit);
 
 void set_SPADEJSON_callback( void (*fcn)(char* json) ){
-  init_buffer();
-  print_json = fcn;
+  stage_pool_init(&spade_pool);
+  spade_pool.sink_iov = NULL;
+  spade_pool.sink_str = fcn;
 }
 
-static pthread_mutex_t l_json =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-
-static inline bool __append(char* buff){
-  pthread_mutex_lock(&l_json);
-  if (strlen(buff) + 2 > MAX_JSON_BUFFER_LENGTH - strlen(json) - 1){ // not enough space
-    pthread_mutex_unlock(&l_json);
-    return false;
-  }
-  strncat(json, buff, MAX_JSON_BUFFER_LENGTH - strlen(json) - 1); // copy up to free space
-  pthread_mutex_unlock(&l_json);
-  return true;
+void set_SPADEJSON_iov_callback( void (*fcn)(const struct iovec* iov, int iovcnt) ){
+  stage_pool_init(&spade_pool);
+  spade_pool.sink_str = NULL;
+  spade_pool.sink_iov = fcn;
 }
 
+void set_SPADEJSON_buffer_size(size_t size){
+  stage_set_capacity(&spade_pool, size);
+}
 
 void spade_json_append(char* buff){
-  // we cannot append buffer is full, need to print json out
-  if(!__append(buff)){
-    flush_spade_json();
-    spade_json_append(buff);
-    return;
-  }
+  // elements straight out of a *_to_spade_json call already have their length
+  size_t len = (buff == buffer) ? buffer_len : strlen(buff);
+  stage_append(&spade_pool, 0, buff, len);
 }
 
-static bool writing_out = false;
-static pthread_mutex_t l_flush =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-
 void flush_spade_json(){
-  bool should_flush=false;
-  char* tmp;
-
-  pthread_mutex_lock(&l_flush);
-  if(!writing_out){
-    writing_out = true;
-    should_flush = true;
-    update_time(); // we update the time
-  }
-  pthread_mutex_unlock(&l_flush);
-
-  if(should_flush){
-    pthread_mutex_lock(&l_json);
-    if (json[0]==0) {
-      pthread_mutex_unlock(&l_json);
-      writing_out = false;
-      return;
-    }
-    print_json(json);
-    memset(json, 0, MAX_JSON_BUFFER_LENGTH);
-    pthread_mutex_unlock(&l_json);
-    pthread_mutex_lock(&l_flush);
-    writing_out = false;
-    pthread_mutex_unlock(&l_flush);
-  }
+  stage_flush(&spade_pool);
 }
@@ -40,247 +40,139 @@
 #include "provenanceutils.h"
 
 #include "provenanceJSONcommon.h"
+#include "provenancestage.h"
 
 const static char prefix[] = "\"prov\" : \"http://www.w3.org/ns/prov\", \"cf\":\"http://www.camflow.org\"";
 const char* prefix_json(){
   return prefix;
 }
 
-static pthread_mutex_t l_flush =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_activity =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_agent =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_entity =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_used =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_generated =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_informed =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_influenced =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_associated =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_derived =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-static pthread_mutex_t l_message =  PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
-
-static char* activity;
-static char* agent;
-static char* entity;
-static char* used;
-static char* generated;
-static char* informed;
-static char* influenced;
-static char* associated;
-static char* derived;
-static char* message;
-
-static inline void init_buffer(char **buffer){
-  *buffer = (char*)malloc(MAX_JSON_BUFFER_LENGTH);
-  memset(*buffer, 0, MAX_JSON_BUFFER_LENGTH);
-}
-
-void init_buffers(void){
-  init_buffer(&activity);
-  init_buffer(&agent);
-  init_buffer(&entity);
-  init_buffer(&used);
-  init_buffer(&generated);
-  init_buffer(&informed);
-  init_buffer(&influenced);
-  init_buffer(&associated);
-  init_buffer(&derived);
-  init_buffer(&message);
-}
-
-static bool writing_out = false;
-
-static void (*print_json)(char* json);
+#define JSON_START "{\"prefix\":{"
+#define JSON_END "}}"
 
-void set_W3CJSON_callback( void (*fcn)(char* json) ){
-  init_buffers();
-  print_json = fcn;
-}
+/* sections in the order they appear in a document */
+enum w3c_section {
+  W3C_ACTIVITY,
+  W3C_AGENT,
+  W3C_ENTITY,
+  W3C_MESSAGE,
+  W3C_USED,
+  W3C_GENERATED,
+  W3C_INFORMED,
+  W3C_ASSOCIATED,
+  W3C_INFLUENCED,
+  W3C_DERIVED,
+  W3C_SECTIONS
+};
+
+#define JSON_SECTION(str) {str, sizeof(str)-1}
+static const struct {
+  const char* str;
+  size_t len;
+} section_header[W3C_SECTIONS] = {
+  [W3C_ACTIVITY] = JSON_SECTION("}, \"activity\":{"),
+  [W3C_AGENT] = JSON_SECTION("}, \"agent\":{"),
+  [W3C_ENTITY] = JSON_SECTION("}, \"entity\":{"),
+  [W3C_MESSAGE] = JSON_SECTION("}, \"message\":{"),
+  [W3C_USED] = JSON_SECTION("}, \"used\":{"),
+  [W3C_GENERATED] = JSON_SECTION("}, \"wasGeneratedBy\":{"),
+  [W3C_INFORMED] = JSON_SECTION("}, \"wasInformedBy\":{"),
+  [W3C_ASSOCIATED] = JSON_SECTION("}, \"wasAssociatedWith\":{"),
+  [W3C_INFLUENCED] = JSON_SECTION("}, \"wasInfluencedBy\":{"),
+  [W3C_DERIVED] = JSON_SECTION("}, \"wasDerivedFrom\":{"),
+};
+
+// we assemble the JSON document handed to the callback, without copying
+static void w3c_emit(struct stage_pool* pool, const struct stage_buffer* buf){
+  struct iovec iov[2*W3C_SECTIONS+3];
+  int n = 0;
+  int i;
 
-static inline bool __append(char destination[MAX_JSON_BUFFER_LENGTH], char* source){
-  if (strlen(source) + 2 > MAX_JSON_BUFFER_LENGTH - strlen(destination) - 1){ // not enough space
-    return false;
+  iov[n].iov_base = JSON_START;
+  iov[n++].iov_len = sizeof(JSON_START)-1;
+  iov[n].iov_base = (void*)prefix;
+  iov[n++].iov_len = sizeof(prefix)-1;
+  for(i=0; i<W3C_SECTIONS; i++){
+    if(buf->sections[i].len == 0)
+      continue;
+    iov[n].iov_base = (void*)section_header[i].str;
+    iov[n++].iov_len = section_header[i].len;
+    iov[n].iov_base = buf->sections[i].data;
+    iov[n++].iov_len = buf->sections[i].len;
   }
-  // add the comma
-  if(destination[0]!='\0')
-    strncat(destination, ",", MAX_JSON_BUFFER_LENGTH - strlen(destination) - 1);
-  strncat(destination, source, MAX_JSON_BUFFER_LENGTH - strlen(destination) - 1); // copy up to free space
-  return true;
+  iov[n].iov_base = JSON_END;
+  iov[n++].iov_len = sizeof(JSON_END)-1;
+  stage_deliver(pool, iov, n);
 }
 
-#define JSON_START "{\"prefix\":{"
-#define JSON_ACTIVITY "}, \"activity\":{"
-#define JSON_AGENT "}, \"agent\":{"
-#define JSON_ENTITY "}, \"entity\":{"
-#define JSON_MESSAGE "}, \"message\":{"
-#define JSON_USED "}, \"used\":{"
-#define JSON_GENERATED "}, \"wasGeneratedBy\":{"
-#define JSON_INFORMED "}, \"wasInformedBy\":{"
-#define JSON_INFLUENCED "}, \"wasInfluencedBy\":{"
-#define JSON_ASSOCIATED "}, \"wasAssociatedWith\":{"
-#define JSON_DERIVED "}, \"wasDerivedFrom\":{"
-#define JSON_END "}}"
+static struct stage_pool w3c_pool = STAGE_POOL_INIT(W3C_SECTIONS, ",", MAX_JSON_BUFFER_LENGTH, w3c_emit);
 
-#define JSON_LENGTH (strlen(JSON_START)\
-                      +strlen(JSON_ACTIVITY)\
-                      +strlen(JSON_AGENT)\
-                      +strlen(JSON_ENTITY)\
-                      +strlen(JSON_MESSAGE)\
-                      +strlen(JSON_USED)\
-                      +strlen(JSON_GENERATED)\
-                      +strlen(JSON_INFORMED)\
-                      +strlen(JSON_INFLUENCED)\
-                      +strlen(JSON_ASSOCIATED)\
-                      +strlen(JSON_DERIVED)\
-                      +strlen(JSON_END)\
-                      +strlen(prefix_json())\
-                      +strlen(activity)\
-                      +strlen(agent)\
-                      +strlen(entity)\
-                      +strlen(message)\
-                      +strlen(used)\
-                      +strlen(generated)\
-                      +strlen(derived)\
-                      +strlen(informed)\
-                      +strlen(influenced)\
-                      +strlen(associated)\
-                      +1)
-
-#define str_is_empty(str) (str[0]=='\0')
-
-static inline bool cat_prov(char *json,
-                            const char *prefix,
-                            char *data,
-                            pthread_mutex_t *lock){
-  bool rc = false;
-  if(!str_is_empty(data)){
-    strncat(json, prefix, MAX_JSON_BUFFER_LENGTH);
-    strncat(json, data, MAX_JSON_BUFFER_LENGTH);
-    memset(data, 0, MAX_JSON_BUFFER_LENGTH);
-    rc = true;
-  }
-  pthread_mutex_unlock(lock);
-  return rc;
-}
-
-// we create the JSON string to be sent to the call back
-static inline char* ready_to_print(){
-  char* json;
-  bool content=false;
-
-  pthread_mutex_lock(&l_derived);
-  pthread_mutex_lock(&l_influenced);
-  pthread_mutex_lock(&l_associated);
-  pthread_mutex_lock(&l_informed);
-  pthread_mutex_lock(&l_generated);
-  pthread_mutex_lock(&l_used);
-  pthread_mutex_lock(&l_message);
-  pthread_mutex_lock(&l_entity);
-  pthread_mutex_lock(&l_agent);
-  pthread_mutex_lock(&l_activity);
-
-  json = (char*)malloc(JSON_LENGTH * sizeof(char));
-  json[0]='\0';
-
-  strncat(json, JSON_START, JSON_LENGTH);
-  strncat(json, prefix_json(), JSON_LENGTH);
-
-  content |= cat_prov(json, JSON_ACTIVITY, activity, &l_activity);
-  content |= cat_prov(json, JSON_AGENT, agent, &l_agent);
-  content |= cat_prov(json, JSON_ENTITY, entity, &l_entity);
-  content |= cat_prov(json, JSON_MESSAGE, message, &l_message);
-  content |= cat_prov(json, JSON_USED, used, &l_used);
-  content |= cat_prov(json, JSON_GENERATED, generated, &l_generated);
-  content |= cat_prov(json, JSON_INFORMED, informed, &l_informed);
-  content |= cat_prov(json, JSON_ASSOCIATED, associated, &l_associated);
-  content |= cat_prov(json, JSON_INFLUENCED, influenced, &l_influenced);
-  content |= cat_prov(json, JSON_DERIVED, derived, &l_derived);
-
-  if(!content){
-    free(json);
-    return NULL;
-  }
+void set_W3CJSON_callback( void (*fcn)(char* json) ){
+  stage_pool_init(&w3c_pool);
+  w3c_pool.sink_iov = NULL;
+  w3c_pool.sink_str = fcn;
+}
+
+void set_W3CJSON_iov_callback( void (*fcn)(const struct iovec* iov, int iovcnt) ){
+  stage_pool_init(&w3c_pool);
+  w3c_pool.sink_str = NULL;
+  w3c_pool.sink_iov = fcn;
+}
 
-  strncat(json, JSON_END, JSON_LENGTH);
-  return json;
+void set_W3CJSON_buffer_size(size_t size){
+  stage_set_capacity(&w3c_pool, size);
 }
 
 void flush_json(){
-  bool should_flush=false;
-  char* json;
-
-  pthread_mutex_lock(&l_flush);
-  if(!writing_out){
-    writing_out = true;
-    should_flush = true;
-    update_time(); // we update the time
-  }
-  pthread_mutex_unlock(&l_flush);
-
-  if(should_flush){
-    json = ready_to_print();
-    if(json!=NULL){
-      print_json(json);
-      free(json);
-    }
-    pthread_mutex_lock(&l_flush);
-    writing_out = false;
-    pthread_mutex_unlock(&l_flush);
-  }
+  stage_flush(&w3c_pool);
 }
 
-static inline void json_append(pthread_mutex_t* l, char destination[MAX_JSON_BUFFER_LENGTH], char* source){
-  pthread_mutex_lock(l);
-  // we cannot append buffer is full, need to print json out
-  if(!__append(destination, source)){
-    flush_json();
-    pthread_mutex_unlock(l);
-    json_append(l, destination, source);
-    return;
-  }
-  pthread_mutex_unlock(l);
+static inline void json_append(enum w3c_section section, char* source){
+  // elements straight out of a *_to_json call already have their length
+  size_t len = (source == buffer) ? buffer_len : strlen(source);
+  stage_append(&w3c_pool, section, source, len);
 }
 
 void append_activity(char* json_element){
-  json_append(&l_activity, activity, json_element);
+  json_append(W3C_ACTIVITY, json_element);
 }
 
 void append_agent(char* json_element){
-  json_append(&l_agent, agent, json_element);
+  json_append(W3C_AGENT, json_element);
 }
 
 void append_entity(char* json_element){
-  json_append(&l_entity, entity, json_element);
+  json_append(W3C_ENTITY, json_element);
 }
 
 void append_message(char* json_element){
-  json_append(&l_message, message, json_element);
+  json_append(W3C_MESSAGE, json_element);
 }
 
 void append_used(char* json_element){
-  json_append(&l_used, used, json_element);
+  json_append(W3C_USED, json_element);
 }
 
 void append_generated(char* json_element){
-  json_append(&l_generated, generated, json_element);
+  json_append(W3C_GENERATED, json_element);
 }
 
 void append_informed(char* json_element){
-  json_append(&l_informed, informed, json_element);
+  json_append(W3C_INFORMED, json_element);
 }
 
 void append_influenced(char* json_element){
-  json_append(&l_influenced, influenced, json_element);
+  json_append(W3C_INFLUENCED, json_element);
 }
 
 void append_associated(char* json_element){
-  json_append(&l_associated, associated, json_element);
+  json_append(W3C_ASSOCIATED, json_element);
 }
 
 void append_derived(char* json_element){
-  json_append(&l_derived, derived, json_element);
+  json_append(W3C_DERIVED, json_element);
 }
 
-#define BUFFER_LENGTH (MAX_JSON_BUFFER_LENGTH-strnlen(buffer, MAX_JSON_BUFFER_LENGTH))
 
 static __thread char id[PROV_ID_STR_LEN];
 static __thread char sender[PROV_ID_STR_LEN];
@@ -300,10 +192,10 @@ static __thread char parent_id[PROV_ID_STR_LEN];
 
 static inline void __init_json_entry(const char* id)
 {
-  buffer[0]='\0';
-  strncat(buffer, "\"cf:", BUFFER_LENGTH-1);
-  strncat(buffer, id, BUFFER_LENGTH-1);
-  strncat(buffer, "\":{", BUFFER_LENGTH-1);
+  __buffer_reset();
+  __buffer_append_lit("\"cf:");
+  __buffer_append_str(id);
+  __buffer_append_lit("\":{");
 }
 
 static inline void __add_reference(const char* name, const char* id, bool comma){
@@ -311,34 +203,34 @@ static inline void __add_reference(const char* name, const char* id, bool comma)
     return;
   }
   __add_attribute(name, comma);
-  strncat(buffer, "\"cf:", BUFFER_LENGTH-1);
-  strncat(buffer, id, BUFFER_LENGTH-1);
-  strncat(buffer, "\"", BUFFER_LENGTH-1);
+  __buffer_append_lit("\"cf:");
+  __buffer_append_str(id);
+  __buffer_append_lit("\"");
 }
 
 
 static inline void __add_json_attribute(const char* name, const char* value, bool comma){
   __add_attribute(name, comma);
-  strncat(buffer, value, BUFFER_LENGTH-1);
+  __buffer_append_str(value);
 }
 
 static inline void __add_label_attribute(const char* type, const char* text, bool comma){
   __add_attribute("prov:label", comma);
   if(type!=NULL){
-    strncat(buffer, "\"[", BUFFER_LENGTH-1);
-    strncat(buffer, type, BUFFER_LENGTH-1);
-    strncat(buffer, "] ", BUFFER_LENGTH-1);
+    __buffer_append_lit("\"[");
+    __buffer_append_str(type);
+    __buffer_append_lit("] ");
   }else{
-    strncat(buffer, "\"", BUFFER_LENGTH-1);
+    __buffer_append_lit("\"");
   }
   if(text!=NULL)
-    strncat(buffer, text, BUFFER_LENGTH-1);
-  strncat(buffer, "\"", BUFFER_LENGTH-1);
+    __buffer_append_str(text);
+  __buffer_append_lit("\"");
 }
 
 static inline void __close_json_entry(char* buffer)
 {
-  strncat(buffer, "}", BUFFER_LENGTH-1);
+  __buffer_append_lit("}");
 }
 
 static inline void __node_identifier(const struct node_identifier* n){
@@ -370,11 +262,16 @@ static inline void __relation_identifier(const struct relation_identifier* e){
 }
 
 static char* __relation_to_json(struct relation_struct* e, const char* snd, const char* rcv){
+  struct prov_coalesced c;
   RELATION_PREP_IDs(e);
   __init_json_entry(id);
   __relation_identifier(&(e->identifier.relation_id));
   __add_date_attribute(true);
   __add_uint64_attribute("cf:jiffies", e->jiffies, true);
+  if(provenance_relation_coalesced(e, &c)){
+    __add_uint64_attribute("cf:count", c.count, true);
+    __add_uint64_attribute("cf:last_jiffies", c.last_jiffies, true);
+  }
   __add_uint32_attribute("cf:epoch", e->epoch, true);
   __add_label_attribute(NULL, relation_id_to_str(e->identifier.relation_id.type), true);
   if(e->allowed==FLOW_ALLOWED)
@@ -421,8 +318,8 @@ char* disc_to_json(struct disc_node_struct* n){
   __node_start(id, &(n->identifier.node_id), n->taint, n->jiffies, n->epoch);
   __add_reference("cf:hasParent", parent_id, true);
   if(n->length > 0){
-    strncat(buffer, ",", BUFFER_LENGTH-1);
-    strncat(buffer, n->content, BUFFER_LENGTH-1);
+    __buffer_append_lit(",");
+    __buffer_append_str(n->content);
   }
   __close_json_entry(buffer);
   return buffer;
@@ -532,13 +429,9 @@ char* xattr_to_json(struct xattr_prov_struct* n){
 }
 
 char* pckcnt_to_json(struct pckcnt_struct* n){
-  char* cntenc;
   NODE_PREP_IDs(n);
   __node_start(id, &(n->identifier.node_id), n->taint, n->jiffies, n->epoch);
-  cntenc = malloc( encode64Bound(n->length) );
-  base64encode(n->content, n->length, cntenc, encode64Bound(n->length));
-  __add_string_attribute("cf:content", cntenc, true);
-  free(cntenc);
+  __add_base64_attribute("cf:content", n->content, n->length, true);
   __add_uint32_attribute("cf:length", n->length, true);
   if(n->truncated==PROV_TRUNCATED)
     __add_string_attribute("cf:truncated", "true", true);
@@ -585,29 +478,28 @@ char* packet_to_json(struct pck_struct* p){
   __add_uint64hex_attribute("cf:taint", p->taint, true);
   __add_uint64_attribute("cf:jiffies", p->jiffies, true);
   __add_uint32_attribute("cf:len", p->len, true);
-  strncat(buffer, ",\"prov:label\":\"[packet] ", BUFFER_LENGTH-1);
+  __buffer_append_lit(",\"prov:label\":\"[packet] ");
   __add_ipv4(p->identifier.packet_id.snd_ip, p->identifier.packet_id.snd_port);
-  strncat(buffer, "->", BUFFER_LENGTH-1);
+  __buffer_append_lit("->");
   __add_ipv4(p->identifier.packet_id.rcv_ip, p->identifier.packet_id.rcv_port);
-  strncat(buffer, " (", BUFFER_LENGTH-1);
-  strncat(buffer, utoa(p->identifier.packet_id.id, tmp, DECIMAL), BUFFER_LENGTH-1);
-  strncat(buffer, ")\"", BUFFER_LENGTH-1);
+  __buffer_append_lit(" (");
+  __buffer_append_str(utoa(p->identifier.packet_id.id, tmp, DECIMAL));
+  __buffer_append_lit(")\"");
   __close_json_entry(buffer);
   return buffer;
 }
 
 char* str_msg_to_json(struct str_struct* n){
-  int i=0;
+  // all length bytes, embedded NULs come out as '_'
+  size_t len = (n->length < sizeof(n->str)) ? n->length : sizeof(n->str);
   NODE_PREP_IDs(n);
   __node_start(id, &(n->identifier.node_id), n->taint, n->jiffies, n->epoch);
-  for(i=0; i < n->length; i++){
-    if(n->str[i]=='"')
-      n->str[i]=' ';
-    if(n->str[i]<32 || n->str[i]>125)
-      n->str[i]='_';
-  }
-  __add_string_attribute("cf:log", n->str, true);
-  __add_label_attribute("log", n->str, true);
+  // sanitised on the way out, n is left as is
+  __add_sanitized_attribute("cf:log", n->str, len, true);
+  __add_attribute("prov:label", true);
+  __buffer_append_lit("\"[log] ");
+  __buffer_append_sanitized(n->str, len);
+  __buffer_append_lit("\"");
   __close_json_entry(buffer);
   return buffer;
 }
@@ -617,24 +509,23 @@ char* sockaddr_to_json(char* buf, size_t blen, struct sockaddr_storage* addr, si
   char serv[NI_MAXSERV];
   int err;
   struct sockaddr *ad = (struct sockaddr*)addr;
-  memset(buf, 0, PATH_MAX+1024);
 
   if(ad->sa_family == AF_INET){
-    err = getnameinfo(ad, sizeof(struct sockaddr_in), host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(addr, length, host, serv);
     if (err < 0)
       snprintf(buf, blen, "{\"type\":\"AF_INET\", \"host\":\"%s\", \"service\":\"%s\", \"error\":\"%s\"}", "could not resolve", "could not resolve", gai_strerror(err));
     else
       snprintf(buf, blen, "{\"type\":\"AF_INET\", \"host\":\"%s\", \"service\":\"%s\"}", host, serv);
   }else if(ad->sa_family == AF_INET6){
-    err = getnameinfo(ad, sizeof(struct sockaddr_in6), host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(addr, length, host, serv);
     if (err < 0)
       snprintf(buf, blen, "{\"type\":\"AF_INET6\", \"host\":\"%s\", \"service\":\"%s\", \"error\":\"%s\"}", "could not resolve", "could not resolve", gai_strerror(err));
     else
       snprintf(buf, blen, "{\"type\":\"AF_INET6\", \"host\":\"%s\", \"service\":\"%s\"}", host, serv);
   }else if(ad->sa_family == AF_UNIX){
-    snprintf(buf, blen, "{\"type\":\"AF_UNIX\", \"path\":\"%s\"}", ((struct sockaddr_un*)addr)->sun_path);
+    snprintf(buf, blen, "{\"type\":\"AF_UNIX\", \"path\":\"%.*s\"}", (int)sizeof(((struct sockaddr_un*)addr)->sun_path), ((struct sockaddr_un*)addr)->sun_path);
   }else{
-    err = getnameinfo(ad, length, host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(addr, length, host, serv);
     if (err < 0)
       snprintf(buf, blen, "{\"type\":%d, \"host\":\"%s\", \"service\":\"%s\", \"error\":\"%s\"}", ad->sa_family, "could not resolve", "could not resolve", gai_strerror(err));
     else
@@ -650,21 +541,21 @@ char* sockaddr_to_label(char* buf, size_t blen, struct sockaddr_storage* addr, s
   struct sockaddr *ad = (struct sockaddr*)addr;
 
   if(ad->sa_family == AF_INET){
-    err = getnameinfo(ad, sizeof(struct sockaddr_in), host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(addr, length, host, serv);
     if (err < 0)
       snprintf(buf, blen, "IPV4 could not resolve (%s)", gai_strerror(err));
     else
       snprintf(buf, blen, "IPV4 %s (%s)", host, serv);
   }else if(ad->sa_family == AF_INET6){
-    err = getnameinfo(ad, sizeof(struct sockaddr_in6), host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(addr, length, host, serv);
     if (err < 0)
       snprintf(buf, blen, "IPV6 could not resolve (%s)", gai_strerror(err));
     else
       snprintf(buf, blen, "IPV6 %s (%s)", host, serv);
   }else if(ad->sa_family == AF_UNIX){
-    snprintf(buf, blen, "UNIX %s", ((struct sockaddr_un*)addr)->sun_path);
+    snprintf(buf, blen, "UNIX %.*s", (int)sizeof(((struct sockaddr_un*)addr)->sun_path), ((struct sockaddr_un*)addr)->sun_path);
   }else{
-    err = getnameinfo(ad, length, host, NI_MAXHOST, serv, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV);
+    err = __sockaddr_numeric(addr, length, host, serv);
     if (err < 0)
       snprintf(buf, blen, "%d could not resolve (%s)", ad->sa_family, gai_strerror(err));
     else
@@ -674,12 +565,74 @@ char* sockaddr_to_label(char* buf, size_t blen, struct sockaddr_storage* addr, s
   return buf;
 }
 
+/* cf:address and its label, as sockaddr_to_json and sockaddr_to_label but straight to buffer */
+static void __add_address_attributes(struct sockaddr_storage* addr, size_t length){
+  char host[NI_MAXHOST];
+  char serv[NI_MAXSERV];
+  const char* path;
+  size_t plen;
+  int err;
+
+  if(addr->ss_family == AF_UNIX){
+    path = ((struct sockaddr_un*)addr)->sun_path;
+    plen = strnlen(path, sizeof(((struct sockaddr_un*)addr)->sun_path));
+    __add_attribute("cf:address", true);
+    __buffer_append_lit("{\"type\":\"AF_UNIX\", \"path\":\"");
+    __buffer_append_escaped(path, plen);
+    __buffer_append_lit("\"}");
+    __add_attribute("prov:label", true);
+    __buffer_append_lit("\"[address] UNIX ");
+    __buffer_append_escaped(path, plen);
+    __buffer_append_lit("\"");
+    return;
+  }
+
+  err = __sockaddr_numeric(addr, length, host, serv);
+  __add_attribute("cf:address", true);
+  if(addr->ss_family == AF_INET){
+    __buffer_append_lit("{\"type\":\"AF_INET\"");
+  }else if(addr->ss_family == AF_INET6){
+    __buffer_append_lit("{\"type\":\"AF_INET6\"");
+  }else{
+    __buffer_append_lit("{\"type\":");
+    __buffer_append_u64(addr->ss_family);
+  }
+  if(err < 0){
+    __buffer_append_lit(", \"host\":\"could not resolve\", \"service\":\"could not resolve\", \"error\":\"");
+    __buffer_append_str(gai_strerror(err));
+  }else{
+    __buffer_append_lit(", \"host\":\"");
+    __buffer_append_str(host);
+    __buffer_append_lit("\", \"service\":\"");
+    __buffer_append_str(serv);
+  }
+  __buffer_append_lit("\"}");
+
+  __add_attribute("prov:label", true);
+  if(addr->ss_family == AF_INET){
+    __buffer_append_lit("\"[address] IPV4 ");
+  }else if(addr->ss_family == AF_INET6){
+    __buffer_append_lit("\"[address] IPV6 ");
+  }else{
+    __buffer_append_lit("\"[address] ");
+    __buffer_append_u64(addr->ss_family);
+    __buffer_append_lit(" ");
+  }
+  if(err < 0){
+    __buffer_append_lit("could not resolve (");
+    __buffer_append_str(gai_strerror(err));
+  }else{
+    __buffer_append_str(host);
+    __buffer_append_lit(" (");
+    __buffer_append_str(serv);
+  }
+  __buffer_append_lit(")\"");
+}
+
 char* addr_to_json(struct address_struct* n){
-  char addr_info[PATH_MAX+1024];
   NODE_PREP_IDs(n);
   __node_start(id, &(n->identifier.node_id), n->taint, n->jiffies, n->epoch);
-  __add_json_attribute("cf:address", sockaddr_to_json(addr_info, PATH_MAX+1024, &n->addr, n->length), true);
-  __add_label_attribute("address", sockaddr_to_label(addr_info, PATH_MAX+1024, &n->addr, n->length), true);
+  __add_address_attributes(&n->addr, n->length);
   __close_json_entry(buffer);
   return buffer;
 }
@@ -700,6 +653,8 @@ char* pathname_to_json(struct file_name_struct* n){
 }
 
 char* arg_to_json(struct arg_struct* n){
+  struct arena* arena = arena_self();
+  struct arena_mark mark;
   int i;
   char* tmp;
   NODE_PREP_IDs(n);
@@ -712,7 +667,8 @@ char* arg_to_json(struct arg_struct* n){
     if(n->value[i]=='\t')
       n->value[i]=' ';
   }
-  tmp = repl_str(n->value, "\"", "\\\"");
+  mark = arena_mark(arena);
+  tmp = __escape_quotes(arena, n->value);
   if(tmp==NULL)
     tmp = n->value;
   __add_string_attribute("cf:value", tmp, true);
@@ -725,8 +681,7 @@ char* arg_to_json(struct arg_struct* n){
   else
     __add_label_attribute("envp", tmp, true);
   __close_json_entry(buffer);
-  if(tmp != n->value)
-    free(tmp);
+  arena_release(arena, mark);
   return buffer;
 }
 
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "provenance.h"
+#include "provenancearena.h"
+
+struct arena_chunk {
+  struct arena_chunk* next;
+  void (*free)(void* ptr, size_t size); /* of the ops the chunk came from */
+  size_t size; /* of the whole chunk, header included */
+  size_t used; /* bytes of data allocated */
+  char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+static void* __chunk_mmap(size_t size){
+  void* p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  return p==MAP_FAILED ? NULL : p;
+}
+
+static void __chunk_munmap(void* ptr, size_t size){
+  munmap(ptr, size);
+}
+
+static struct prov_arena_ops arena_ops = {
+  .alloc = __chunk_mmap,
+  .free = __chunk_munmap,
+};
+static pthread_mutex_t arena_ops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* chunks already allocated are freed through the ops they came from */
+void provenance_set_arena_ops(const struct prov_arena_ops* ops){
+  pthread_mutex_lock(&arena_ops_lock);
+  if(ops && ops->alloc && ops->free)
+    arena_ops = *ops;
+  else{
+    arena_ops.alloc = __chunk_mmap;
+    arena_ops.free = __chunk_munmap;
+  }
+  pthread_mutex_unlock(&arena_ops_lock);
+}
+
+static struct arena_chunk* __chunk_alloc(size_t size){
+  struct arena_chunk* chunk;
+  struct prov_arena_ops ops;
+
+  pthread_mutex_lock(&arena_ops_lock);
+  ops = arena_ops;
+  pthread_mutex_unlock(&arena_ops_lock);
+  size += sizeof(struct arena_chunk);
+  if(size < ARENA_CHUNK_SIZE)
+    size = ARENA_CHUNK_SIZE;
+  chunk = (struct arena_chunk*)ops.alloc(size);
+  if(!chunk)
+    return NULL;
+  chunk->next = NULL;
+  chunk->free = ops.free;
+  chunk->size = size;
+  chunk->used = 0;
+  return chunk;
+}
+
+static inline size_t __chunk_room(const struct arena_chunk* chunk){
+  return chunk->size - sizeof(struct arena_chunk) - chunk->used;
+}
+
+/**
+ * @brief Allocates size bytes, aligned on ARENA_ALIGN, from an arena.
+ *
+ * The current chunk is used if it has room, then the next free chunk if
+ * the allocation fits an empty one. Otherwise a chunk large enough is
+ * obtained from the arena ops and inserted after the current one.
+ * @return the memory, NULL if arena is NULL or no chunk could be obtained.
+ */
+void* arena_alloc(struct arena* arena, size_t size){
+  struct arena_chunk* chunk;
+  struct arena_chunk* next;
+  void* p;
+
+  if(!arena)
+    return NULL;
+  size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+  chunk = arena->current;
+  if(!chunk || __chunk_room(chunk) < size){
+    next = chunk ? chunk->next : arena->head;
+    if(next && next->size - sizeof(struct arena_chunk) >= size){
+      chunk = next;
+    }else{
+      next = __chunk_alloc(size);
+      if(!next)
+        return NULL;
+      if(chunk){
+        next->next = chunk->next;
+        chunk->next = next;
+      }else{
+        next->next = arena->head;
+        arena->head = next;
+      }
+      chunk = next;
+    }
+    chunk->used = 0;
+    arena->current = chunk;
+  }
+  p = chunk->data + chunk->used;
+  chunk->used += size;
+  return p;
+}
+
+char* arena_strndup(struct arena* arena, const char* str, size_t n){
+  size_t len = strnlen(str, n);
+  char* p = (char*)arena_alloc(arena, len + 1);
+
+  if(!p)
+    return NULL;
+  memcpy(p, str, len);
+  p[len] = '\0';
+  return p;
+}
+
+struct arena_mark arena_mark(struct arena* arena){
+  struct arena_mark mark = { .chunk = NULL, .used = 0 };
+
+  if(arena && arena->current){
+    mark.chunk = arena->current;
+    mark.used = arena->current->used;
+  }
+  return mark;
+}
+
+void arena_release(struct arena* arena, struct arena_mark mark){
+  if(!arena)
+    return;
+  arena->current = mark.chunk;
+  if(mark.chunk)
+    mark.chunk->used = mark.used;
+}
+
+void arena_reset(struct arena* arena){
+  if(arena)
+    arena->current = NULL;
+}
+
+void arena_destroy(struct arena* arena){
+  struct arena_chunk* chunk;
+
+  while(arena->head){
+    chunk = arena->head;
+    arena->head = chunk->next;
+    chunk->free(chunk, chunk->size);
+  }
+  arena->current = NULL;
+}
+
+/* thread arenas, created on first use and destroyed at thread exit */
+static __thread struct arena thread_arena = ARENA_INIT;
+static __thread bool thread_arena_ready = false;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+static void __arena_destructor(void* arg){
+  arena_destroy((struct arena*)arg);
+  thread_arena_ready = false;
+}
+
+static void __arena_init(void){
+  pthread_key_create(&arena_key, __arena_destructor);
+}
+
+struct arena* arena_self(void){
+  if(__builtin_expect(thread_arena_ready, 1))
+    return &thread_arena;
+  pthread_once(&arena_once, __arena_init);
+  if(pthread_setspecific(arena_key, &thread_arena))
+    return NULL;
+  thread_arena_ready = true;
+  return &thread_arena;
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCEARENA_H
+#define __PROVENANCEARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for the hot paths. An arena is a list of chunks obtained
+ * from the arena ops, see provenance_set_arena_ops, that are kept and
+ * reused once released. Allocations are only given back as a whole:
+ * - scratch memory comes from the arena of the calling thread, released
+ *   to a mark taken beforehand, and in any case once the relay callbacks
+ *   of a chunk read have returned, see arena_reset;
+ * - memory that lives as long as the library, e.g. interned strings, comes
+ *   from a static arena the caller serialises access to.
+ * An arena is not thread safe, thread arenas are freed at thread exit.
+ */
+#define ARENA_CHUNK_SIZE (64*1024)
+#define ARENA_ALIGN      16
+
+struct arena_chunk;
+
+struct arena {
+  struct arena_chunk* head;
+  struct arena_chunk* current; /* chunks after current are free */
+};
+
+struct arena_mark {
+  struct arena_chunk* chunk;
+  size_t used;
+};
+
+#define ARENA_INIT { .head = NULL, .current = NULL }
+
+/* scratch arena of the calling thread, NULL if it could not be set up */
+struct arena* arena_self(void);
+void* arena_alloc(struct arena* arena, size_t size);
+char* arena_strndup(struct arena* arena, const char* str, size_t n);
+struct arena_mark arena_mark(struct arena* arena);
+/* frees everything allocated since mark was taken */
+void arena_release(struct arena* arena, struct arena_mark mark);
+/* frees everything, the chunks are kept for reuse */
+void arena_reset(struct arena* arena);
+void arena_destroy(struct arena* arena);
+
+#endif /* __PROVENANCEARENA_H */
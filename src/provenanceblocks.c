@@ -0,0 +1,130 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "provenanceblocks.h"
+
+static void block_ring_free(struct block_ring* ring){
+  if(ring->area)
+    munmap(ring->area, ring->nblocks * ring->block_size);
+  ring->area = NULL;
+  free(ring->blocks);
+  ring->blocks = NULL;
+}
+
+int __block_ring_start(struct block_ring* ring, size_t nblocks, size_t block_size,
+                       void* (*consumer)(void*)){
+  size_t i;
+  int rc;
+
+  if(ring->running)
+    return -EBUSY;
+  if(nblocks < 2 || block_size == 0)
+    return -EINVAL;
+  ring->nblocks = nblocks;
+  ring->block_size = block_size;
+  ring->blocks = (struct block*)calloc(nblocks, sizeof(struct block));
+  ring->area = (uint8_t*)mmap(NULL, nblocks * block_size, PROT_READ|PROT_WRITE,
+                              MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(ring->area == MAP_FAILED)
+    ring->area = NULL;
+  if(!ring->blocks || !ring->area){
+    block_ring_free(ring);
+    return -ENOMEM;
+  }
+  for(i=0; i<nblocks; i++)
+    ring->blocks[i].data = ring->area + i * block_size;
+  ring->head = 0;
+  ring->count = 0;
+  ring->queued = 0;
+  ring->released = 0;
+  ring->stopping = false;
+  rc = -pthread_create(&ring->thread, NULL, consumer, NULL);
+  if(rc){
+    block_ring_free(ring);
+    return rc;
+  }
+  ring->running = true;
+  return 0;
+}
+
+void block_ring_stop(struct block_ring* ring, void (*cleanup)(void)){
+  pthread_mutex_lock(&ring->lock);
+  ring->stopping = true;
+  pthread_cond_signal(&ring->ready);
+  pthread_mutex_unlock(&ring->lock);
+
+  pthread_join(ring->thread, NULL);
+
+  pthread_mutex_lock(&ring->lock);
+  if(cleanup)
+    cleanup();
+  block_ring_free(ring);
+  ring->running = false;
+  ring->stopping = false;
+  pthread_mutex_unlock(&ring->lock);
+}
+
+void __block_queue(struct block_ring* ring){
+  ring->count++;
+  ring->queued++;
+  __block_filling(ring)->len = 0;
+  pthread_cond_signal(&ring->ready);
+}
+
+void __block_release(struct block_ring* ring){
+  ring->blocks[ring->head].len = 0;
+  ring->head = (ring->head + 1) % ring->nblocks;
+  ring->count--;
+  ring->released++;
+  pthread_cond_broadcast(&ring->done);
+}
+
+static int __block_wait(struct block_ring* ring, const struct timespec* deadline){
+  if(!deadline)
+    return -pthread_cond_wait(&ring->done, &ring->lock);
+  return -pthread_cond_timedwait(&ring->done, &ring->lock, deadline);
+}
+
+int __block_wait_room(struct block_ring* ring, const struct timespec* deadline){
+  while(__block_free(ring) == 0){
+    if(__block_wait(ring, deadline) == -ETIMEDOUT)
+      return __block_free(ring) > 0 ? 0 : -ETIMEDOUT;
+  }
+  return 0;
+}
+
+int __block_wait_released(struct block_ring* ring, uint64_t target, const struct timespec* deadline){
+  while(ring->released < target){
+    if(__block_wait(ring, deadline) == -ETIMEDOUT)
+      return ring->released < target ? -ETIMEDOUT : 0;
+  }
+  return 0;
+}
+
+void block_deadline(struct timespec* t, uint32_t ms){
+  clock_gettime(CLOCK_REALTIME, t);
+  t->tv_sec += ms / 1000;
+  t->tv_nsec += (ms % 1000) * 1000000L;
+  if(t->tv_nsec >= 1000000000L){
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000L;
+  }
+}
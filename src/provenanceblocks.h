@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCEBLOCKS_H
+#define __PROVENANCEBLOCKS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Ring of fixed size blocks between writers and the thread consuming them,
+ * shared by the compression and the sink threads. count blocks starting at
+ * head are queued, the one after them is being filled by writers; one
+ * block is always left for filling. The consumer releases blocks in order,
+ * once done with them. Functions prefixed with __ expect lock held, waits
+ * give up at deadline, NULL to wait for ever.
+ */
+struct block {
+  uint8_t* data;
+  size_t len;
+};
+
+struct block_ring {
+  pthread_mutex_t lock;
+  pthread_cond_t ready; /* blocks were queued, or stopping */
+  pthread_cond_t done; /* blocks were released */
+  struct block* blocks;
+  uint8_t* area; /* data of all the blocks, one mapping */
+  size_t nblocks;
+  size_t block_size;
+  size_t head;
+  size_t count;
+  uint64_t queued; /* since started, blocks flushes wait for */
+  uint64_t released;
+  bool running;
+  bool stopping; /* the consumer drains the ring and exits */
+  pthread_t thread;
+};
+
+#define BLOCK_RING_INIT { .lock = PTHREAD_MUTEX_INITIALIZER, \
+                          .ready = PTHREAD_COND_INITIALIZER, \
+                          .done = PTHREAD_COND_INITIALIZER }
+
+/* lock held, allocate the blocks and start the consumer thread, returns 0 or -errno */
+int __block_ring_start(struct block_ring* ring, size_t nblocks, size_t block_size,
+                       void* (*consumer)(void*));
+/*
+ * lock not held, the consumer drains the ring and exits, cleanup, if not
+ * NULL, is then called with lock held before the blocks are freed
+ */
+void block_ring_stop(struct block_ring* ring, void (*cleanup)(void));
+
+static inline struct block* __block_at(struct block_ring* ring, size_t i){
+  return &ring->blocks[(ring->head + i) % ring->nblocks];
+}
+
+static inline struct block* __block_filling(struct block_ring* ring){
+  return __block_at(ring, ring->count);
+}
+
+/* blocks neither queued nor being filled */
+static inline size_t __block_free(const struct block_ring* ring){
+  return ring->nblocks - 1 - ring->count;
+}
+
+/* queue the block being filled, there must be a free block */
+void __block_queue(struct block_ring* ring);
+/* the consumer is done with the block at head */
+void __block_release(struct block_ring* ring);
+/* returns 0 once a block is free, -ETIMEDOUT */
+int __block_wait_room(struct block_ring* ring, const struct timespec* deadline);
+/* returns 0 once the blocks queued up to target are released, -ETIMEDOUT */
+int __block_wait_released(struct block_ring* ring, uint64_t target, const struct timespec* deadline);
+
+/* deadline ms from now, for the waits */
+void block_deadline(struct timespec* t, uint32_t ms);
+
+#endif /* __PROVENANCEBLOCKS_H */
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCECACHE_H
+#define __PROVENANCECACHE_H
+
+#include <stdint.h>
+
+/*
+ * Lookup caches behind node_id_to_str/relation_id_to_str,
+ * provenance_secid_to_secctx and name_id_to_str. Seeding them lets data
+ * recorded on another host be serialised without the kernel interface.
+ */
+void type_add_entry(uint64_t typeid, const char* name);
+/* query the kernel for every type once, done at relay registration */
+int type_cache_fill(void);
+void sec_add_entry(uint32_t secid, const char* secctx);
+void name_add_entry(union prov_identifier *nameid, const char* name);
+/* what provenance_relation_coalesced answers for rel on this thread until
+ * seeded again, a NULL rel clears it */
+void relation_coalesced_seed(const struct relation_struct* rel, const struct prov_coalesced* info);
+
+#endif /* __PROVENANCECACHE_H */
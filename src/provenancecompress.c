@@ -0,0 +1,445 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "provenancecompress.h"
+#include "provenanceblocks.h"
+
+/* the block being compressed stays queued until it is done */
+static struct block_ring c_blocks = BLOCK_RING_INIT;
+static struct prov_compress_stats c_stats;
+static bool c_writing; /* a write larger than the ring is being copied */
+
+static uint32_t c_algorithm;
+static int c_level;
+static size_t c_block_size;
+static void (*c_sink)(const struct iovec* iov, int iovcnt);
+
+/* only used by the compression thread once started */
+static uint8_t* c_out;
+static size_t c_out_size;
+static z_stream c_zs;
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx* c_zstd;
+#endif
+#ifdef HAVE_LZ4
+static LZ4F_cctx* c_lz4;
+static LZ4F_preferences_t c_lz4_prefs;
+#endif
+
+static void deliver(const uint8_t* data, size_t len){
+  struct iovec iov;
+
+  if(len == 0)
+    return;
+  iov.iov_base = (void*)data;
+  iov.iov_len = len;
+  c_sink(&iov, 1);
+  pthread_mutex_lock(&c_blocks.lock);
+  c_stats.bytes_out += len;
+  pthread_mutex_unlock(&c_blocks.lock);
+}
+
+static void codec_error(void){
+  pthread_mutex_lock(&c_blocks.lock);
+  c_stats.errors++;
+  pthread_mutex_unlock(&c_blocks.lock);
+}
+
+static void codec_free(void){
+  switch(c_algorithm){
+    case PROV_COMPRESS_ZLIB:
+      deflateEnd(&c_zs);
+      break;
+#ifdef HAVE_ZSTD
+    case PROV_COMPRESS_ZSTD:
+      ZSTD_freeCCtx(c_zstd);
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case PROV_COMPRESS_LZ4:
+      LZ4F_freeCompressionContext(c_lz4);
+      break;
+#endif
+  }
+  free(c_out);
+  c_out = NULL;
+}
+
+static int codec_init(void){
+  switch(c_algorithm){
+    case PROV_COMPRESS_ZLIB:
+      memset(&c_zs, 0, sizeof(z_stream));
+      // 15+16 window bits, i.e. 32KiB window and a gzip wrapper
+      if(deflateInit2(&c_zs, c_level < 0 ? Z_DEFAULT_COMPRESSION : c_level,
+                      Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -EINVAL;
+      c_out_size = deflateBound(&c_zs, c_block_size);
+      break;
+#ifdef HAVE_ZSTD
+    case PROV_COMPRESS_ZSTD:
+      c_zstd = ZSTD_createCCtx();
+      if(!c_zstd)
+        return -ENOMEM;
+      if(ZSTD_isError(ZSTD_CCtx_setParameter(c_zstd, ZSTD_c_compressionLevel,
+                                             c_level < 0 ? ZSTD_CLEVEL_DEFAULT : c_level))){
+        ZSTD_freeCCtx(c_zstd);
+        return -EINVAL;
+      }
+      c_out_size = ZSTD_CStreamOutSize();
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case PROV_COMPRESS_LZ4:
+      if(LZ4F_isError(LZ4F_createCompressionContext(&c_lz4, LZ4F_VERSION)))
+        return -ENOMEM;
+      memset(&c_lz4_prefs, 0, sizeof(LZ4F_preferences_t));
+      c_lz4_prefs.compressionLevel = c_level < 0 ? 0 : c_level;
+      c_out_size = LZ4F_compressBound(c_block_size, &c_lz4_prefs) + LZ4F_HEADER_SIZE_MAX;
+      break;
+#endif
+    default:
+      return -ENOTSUP;
+  }
+  c_out = (uint8_t*)malloc(c_out_size);
+  if(!c_out){
+    codec_free();
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+static void codec_block(const uint8_t* data, size_t len){
+#ifdef HAVE_ZSTD
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t remaining;
+#endif
+#ifdef HAVE_LZ4
+  size_t n;
+#endif
+
+  switch(c_algorithm){
+    case PROV_COMPRESS_ZLIB:
+      c_zs.next_in = (Bytef*)data;
+      c_zs.avail_in = len;
+      do{
+        c_zs.next_out = c_out;
+        c_zs.avail_out = c_out_size;
+        if(deflate(&c_zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR){
+          codec_error();
+          return;
+        }
+        deliver(c_out, c_out_size - c_zs.avail_out);
+      }while(c_zs.avail_out == 0);
+      break;
+#ifdef HAVE_ZSTD
+    case PROV_COMPRESS_ZSTD:
+      in.src = data;
+      in.size = len;
+      in.pos = 0;
+      do{
+        out.dst = c_out;
+        out.size = c_out_size;
+        out.pos = 0;
+        remaining = ZSTD_compressStream2(c_zstd, &out, &in, ZSTD_e_flush);
+        if(ZSTD_isError(remaining)){
+          codec_error();
+          return;
+        }
+        deliver(c_out, out.pos);
+      }while(remaining != 0);
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case PROV_COMPRESS_LZ4:
+      n = LZ4F_compressUpdate(c_lz4, c_out, c_out_size, data, len, NULL);
+      if(LZ4F_isError(n)){
+        codec_error();
+        return;
+      }
+      deliver(c_out, n);
+      n = LZ4F_flush(c_lz4, c_out, c_out_size, NULL);
+      if(LZ4F_isError(n)){
+        codec_error();
+        return;
+      }
+      deliver(c_out, n);
+      break;
+#endif
+  }
+}
+
+/* terminates the stream, from the compression thread */
+static void codec_end(void){
+#ifdef HAVE_ZSTD
+  ZSTD_inBuffer in = {NULL, 0, 0};
+  ZSTD_outBuffer out;
+  size_t remaining;
+#endif
+#ifdef HAVE_LZ4
+  size_t n;
+#endif
+  int rc;
+
+  switch(c_algorithm){
+    case PROV_COMPRESS_ZLIB:
+      c_zs.avail_in = 0;
+      do{
+        c_zs.next_out = c_out;
+        c_zs.avail_out = c_out_size;
+        rc = deflate(&c_zs, Z_FINISH);
+        deliver(c_out, c_out_size - c_zs.avail_out);
+      }while(rc == Z_OK);
+      break;
+#ifdef HAVE_ZSTD
+    case PROV_COMPRESS_ZSTD:
+      do{
+        out.dst = c_out;
+        out.size = c_out_size;
+        out.pos = 0;
+        remaining = ZSTD_compressStream2(c_zstd, &out, &in, ZSTD_e_end);
+        if(ZSTD_isError(remaining))
+          break;
+        deliver(c_out, out.pos);
+      }while(remaining != 0);
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case PROV_COMPRESS_LZ4:
+      n = LZ4F_compressEnd(c_lz4, c_out, c_out_size, NULL);
+      if(!LZ4F_isError(n))
+        deliver(c_out, n);
+      break;
+#endif
+  }
+  codec_free();
+}
+
+static void* compress_thread(void* arg){
+  struct block* b;
+#ifdef HAVE_LZ4
+  size_t n;
+
+  if(c_algorithm == PROV_COMPRESS_LZ4){
+    n = LZ4F_compressBegin(c_lz4, c_out, c_out_size, &c_lz4_prefs);
+    if(LZ4F_isError(n))
+      codec_error();
+    else
+      deliver(c_out, n);
+  }
+#endif
+
+  pthread_mutex_lock(&c_blocks.lock);
+  for(;;){
+    while(c_blocks.count == 0 && !c_blocks.stopping)
+      pthread_cond_wait(&c_blocks.ready, &c_blocks.lock);
+    if(c_blocks.count == 0) // stopping and drained
+      break;
+    b = __block_at(&c_blocks, 0);
+    pthread_mutex_unlock(&c_blocks.lock);
+    codec_block(b->data, b->len);
+    pthread_mutex_lock(&c_blocks.lock);
+    __block_release(&c_blocks);
+    c_stats.blocks++;
+  }
+  pthread_mutex_unlock(&c_blocks.lock);
+  codec_end();
+  return NULL;
+}
+
+/* c_blocks.lock held, queue the block being filled, waiting for room if needed */
+static void __compress_submit(void){
+  if(__block_free(&c_blocks) == 0){
+    c_stats.stalls++;
+    __block_wait_room(&c_blocks, NULL);
+  }
+  __block_queue(&c_blocks);
+}
+
+/**
+ * @brief Starts the compression thread.
+ *
+ * @param algorithm PROV_COMPRESS_ZLIB, PROV_COMPRESS_ZSTD or PROV_COMPRESS_LZ4.
+ * @param level compression level of the algorithm, PROV_COMPRESS_LEVEL for its default.
+ * @param block_size amount of data compressed at once, 0 for PROV_COMPRESS_BLOCK_SIZE.
+ * @param sink receives the compressed stream, from the compression thread.
+ * @return 0 on success, -EBUSY if already started, -ENOTSUP if the algorithm
+ * is not available, -EINVAL for an invalid level, -ENOMEM.
+ */
+int compress_start(uint32_t algorithm, int level, size_t block_size,
+                   void (*sink)(const struct iovec* iov, int iovcnt)){
+  int rc = 0;
+
+  pthread_mutex_lock(&c_blocks.lock);
+  if(c_blocks.running){
+    rc = -EBUSY;
+    goto out;
+  }
+  c_algorithm = algorithm;
+  c_level = level;
+  c_block_size = block_size ? block_size : PROV_COMPRESS_BLOCK_SIZE;
+  c_sink = sink;
+  rc = codec_init();
+  if(rc)
+    goto out;
+  memset(&c_stats, 0, sizeof(struct prov_compress_stats));
+  rc = __block_ring_start(&c_blocks, PROV_COMPRESS_BLOCKS, c_block_size, compress_thread);
+  if(rc)
+    codec_free();
+out:
+  pthread_mutex_unlock(&c_blocks.lock);
+  return rc;
+}
+
+/* c_blocks.lock held, total bytes can be copied without waiting */
+static inline bool __compress_fits(size_t total){
+  return total <= c_block_size - __block_filling(&c_blocks)->len + __block_free(&c_blocks) * c_block_size;
+}
+
+/**
+ * @brief Copies a write into the blocks.
+ *
+ * A write that fits in the ring waits for room before being copied, so
+ * that writers waiting for the compression thread do not interleave
+ * their data with it. Larger writes are copied a block at a time, other
+ * writers waiting until they are done.
+ */
+void compress_write(const struct iovec* iov, int iovcnt){
+  struct block* b;
+  const uint8_t* p;
+  size_t total = 0;
+  size_t len;
+  size_t n;
+  bool large;
+  int i;
+
+  for(i=0; i<iovcnt; i++)
+    total += iov[i].iov_len;
+  pthread_mutex_lock(&c_blocks.lock);
+  while(c_writing)
+    pthread_cond_wait(&c_blocks.done, &c_blocks.lock);
+  if(!c_blocks.running || c_blocks.stopping)
+    goto out;
+  c_stats.bytes_in += total;
+  if(total <= (c_blocks.nblocks - 1) * c_block_size && !__compress_fits(total)){
+    c_stats.stalls++;
+    while(!__compress_fits(total) || c_writing)
+      pthread_cond_wait(&c_blocks.done, &c_blocks.lock);
+  }
+  // the lock is dropped while waiting for room part way through
+  large = !__compress_fits(total);
+  if(large)
+    c_writing = true;
+  for(i=0; i<iovcnt; i++){
+    p = (const uint8_t*)iov[i].iov_base;
+    len = iov[i].iov_len;
+    while(len > 0){
+      b = __block_filling(&c_blocks);
+      n = c_block_size - b->len;
+      if(n > len)
+        n = len;
+      memcpy(b->data + b->len, p, n);
+      b->len += n;
+      p += n;
+      len -= n;
+      if(b->len == c_block_size)
+        __compress_submit();
+    }
+  }
+  if(large){
+    c_writing = false;
+    pthread_cond_broadcast(&c_blocks.done);
+  }
+out:
+  pthread_mutex_unlock(&c_blocks.lock);
+}
+
+void compress_write_str(char* str){
+  struct iovec iov;
+
+  iov.iov_base = str;
+  iov.iov_len = strlen(str);
+  compress_write(&iov, 1);
+}
+
+/* compress what has been written so far, returns once the sink has it or at deadline */
+static int compress_flush_until(const struct timespec* deadline){
+  int rc = 0;
+
+  pthread_mutex_lock(&c_blocks.lock);
+  if(c_blocks.running && !c_blocks.stopping){
+    if(__block_filling(&c_blocks)->len > 0){
+      if(__block_free(&c_blocks) == 0){
+        c_stats.stalls++;
+        rc = __block_wait_room(&c_blocks, deadline);
+      }
+      if(rc == 0)
+        __block_queue(&c_blocks);
+    }
+    if(rc == 0)
+      rc = __block_wait_released(&c_blocks, c_blocks.queued, deadline);
+  }
+  pthread_mutex_unlock(&c_blocks.lock);
+  return rc;
+}
+
+void compress_flush(void){
+  compress_flush_until(NULL);
+}
+
+int compress_flush_timeout(uint32_t ms){
+  struct timespec deadline;
+
+  block_deadline(&deadline, ms);
+  return compress_flush_until(&deadline);
+}
+
+/* compress what is left, terminate the stream and stop the thread */
+void compress_stop(void){
+  pthread_mutex_lock(&c_blocks.lock);
+  if(!c_blocks.running || c_blocks.stopping){
+    pthread_mutex_unlock(&c_blocks.lock);
+    return;
+  }
+  while(c_writing) // the blocks must outlive its copy
+    pthread_cond_wait(&c_blocks.done, &c_blocks.lock);
+  if(__block_filling(&c_blocks)->len > 0)
+    __compress_submit();
+  pthread_mutex_unlock(&c_blocks.lock);
+  block_ring_stop(&c_blocks, NULL);
+}
+
+void compress_stats(struct prov_compress_stats* stats){
+  pthread_mutex_lock(&c_blocks.lock);
+  memcpy(stats, &c_stats, sizeof(struct prov_compress_stats));
+  pthread_mutex_unlock(&c_blocks.lock);
+}
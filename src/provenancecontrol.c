@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/provenance_types.h>
+
+#include "provenance.h"
+#include "provenancecontrol.h"
+
+struct prov_control_file {
+  const char* path;
+  size_t rule_size; /* 0 if not a rule file */
+};
+
+static const struct prov_control_file control_files[PROV_CTL_FILES] = {
+  [PROV_CTL_ENABLE] = {PROV_ENABLE_FILE, 0},
+  [PROV_CTL_ALL] = {PROV_ALL_FILE, 0},
+  [PROV_CTL_COMPRESS_NODE] = {PROV_COMPRESS_NODE_FILE, 0},
+  [PROV_CTL_COMPRESS_EDGE] = {PROV_COMPRESS_EDGE_FILE, 0},
+  [PROV_CTL_VERSION_NODES] = {PROV_SHOULD_VERSION_FILE, 0},
+  [PROV_CTL_DUPLICATE] = {PROV_DUPLICATE_FILE, 0},
+  [PROV_CTL_NODE_FILTER] = {PROV_NODE_FILTER_FILE, 0},
+  [PROV_CTL_DERIVED_FILTER] = {PROV_DERIVED_FILTER_FILE, 0},
+  [PROV_CTL_GENERATED_FILTER] = {PROV_GENERATED_FILTER_FILE, 0},
+  [PROV_CTL_USED_FILTER] = {PROV_USED_FILTER_FILE, 0},
+  [PROV_CTL_INFORMED_FILTER] = {PROV_INFORMED_FILTER_FILE, 0},
+  [PROV_CTL_PROPAGATE_NODE_FILTER] = {PROV_PROPAGATE_NODE_FILTER_FILE, 0},
+  [PROV_CTL_PROPAGATE_DERIVED_FILTER] = {PROV_PROPAGATE_DERIVED_FILTER_FILE, 0},
+  [PROV_CTL_PROPAGATE_GENERATED_FILTER] = {PROV_PROPAGATE_GENERATED_FILTER_FILE, 0},
+  [PROV_CTL_PROPAGATE_USED_FILTER] = {PROV_PROPAGATE_USED_FILTER_FILE, 0},
+  [PROV_CTL_PROPAGATE_INFORMED_FILTER] = {PROV_PROPAGATE_INFORMED_FILTER_FILE, 0},
+  [PROV_CTL_IPV4_INGRESS] = {PROV_IPV4_INGRESS_FILE, sizeof(struct prov_ipv4_filter)},
+  [PROV_CTL_IPV4_EGRESS] = {PROV_IPV4_EGRESS_FILE, sizeof(struct prov_ipv4_filter)},
+  [PROV_CTL_SECCTX] = {PROV_SECCTX_FILTER, sizeof(struct secinfo)},
+  [PROV_CTL_UID] = {PROV_UID_FILTER, sizeof(struct userinfo)},
+  [PROV_CTL_GID] = {PROV_GID_FILTER, sizeof(struct groupinfo)},
+  [PROV_CTL_NS] = {PROV_NS_FILTER, sizeof(struct nsinfo)},
+};
+
+#define CTL_READ  0
+#define CTL_WRITE 1
+
+struct prov_control {
+  pthread_mutex_t lock;
+  int fd[PROV_CTL_FILES][2]; /* opened on first use, -1 until then */
+};
+
+static inline bool __is_boolean(uint32_t file){
+  return file < PROV_CTL_BOOLEANS;
+}
+
+static inline bool __is_filter(uint32_t file){
+  return file >= PROV_CTL_NODE_FILTER && file < PROV_CTL_NODE_FILTER + PROV_CTL_FILTERS;
+}
+
+struct prov_control* provenance_control_open(void){
+  struct prov_control* ctl;
+  int i;
+
+  ctl = (struct prov_control*)malloc(sizeof(struct prov_control));
+  if(!ctl)
+    return NULL;
+  pthread_mutex_init(&ctl->lock, NULL);
+  for(i=0; i<PROV_CTL_FILES; i++){
+    ctl->fd[i][CTL_READ] = -1;
+    ctl->fd[i][CTL_WRITE] = -1;
+  }
+  return ctl;
+}
+
+void provenance_control_close(struct prov_control* ctl){
+  int i;
+
+  if(!ctl)
+    return;
+  for(i=0; i<PROV_CTL_FILES; i++){
+    if(ctl->fd[i][CTL_READ] >= 0)
+      close(ctl->fd[i][CTL_READ]);
+    if(ctl->fd[i][CTL_WRITE] >= 0)
+      close(ctl->fd[i][CTL_WRITE]);
+  }
+  pthread_mutex_destroy(&ctl->lock);
+  free(ctl);
+}
+
+/* files are opened separately for reading and writing, some are read only */
+static int __control_fd(struct prov_control* ctl, uint32_t file, int mode){
+  int fd;
+
+  pthread_mutex_lock(&ctl->lock);
+  fd = ctl->fd[file][mode];
+  if(fd < 0){
+    fd = open(control_files[file].path, mode == CTL_READ ? O_RDONLY : O_WRONLY);
+    if(fd >= 0)
+      ctl->fd[file][mode] = fd;
+    else
+      fd = -errno;
+  }
+  pthread_mutex_unlock(&ctl->lock);
+  return fd;
+}
+
+/* a persistent descriptor is read from the start every time */
+static inline int __control_read(int fd, void* buffer, size_t length){
+  int rc = pread(fd, buffer, length, 0);
+
+  if(rc < 0 && errno == ESPIPE){
+    if(lseek(fd, 0, SEEK_SET) < 0 && errno != ESPIPE)
+      return -errno;
+    rc = read(fd, buffer, length);
+  }
+  if(rc < 0)
+    return -errno;
+  return rc;
+}
+
+static inline int __control_write(int fd, const void* buffer, size_t length){
+  int rc = write(fd, buffer, length);
+
+  if(rc < 0)
+    return -errno;
+  return rc;
+}
+
+int provenance_control_set_boolean(struct prov_control* ctl, uint32_t file, bool value){
+  int fd;
+  int rc;
+
+  if(!__is_boolean(file))
+    return -EINVAL;
+  fd = __control_fd(ctl, file, CTL_WRITE);
+  if(fd < 0)
+    return fd;
+  rc = __control_write(fd, value ? "1" : "0", 2*sizeof(char));
+  if(rc < 0)
+    return rc;
+  return 0;
+}
+
+int provenance_control_get_boolean(struct prov_control* ctl, uint32_t file, bool* value){
+  int fd;
+  int rc;
+  char c;
+
+  if(!__is_boolean(file))
+    return -EINVAL;
+  fd = __control_fd(ctl, file, CTL_READ);
+  if(fd < 0)
+    return fd;
+  rc = __control_read(fd, &c, sizeof(char));
+  if(rc < 0)
+    return rc;
+  if(rc == 0)
+    return -EIO;
+  *value = (c != '0');
+  return 0;
+}
+
+int provenance_control_filter(struct prov_control* ctl, uint32_t file, bool add, uint64_t filter){
+  struct prov_filter f;
+  int fd;
+  int rc;
+
+  if(!__is_filter(file))
+    return -EINVAL;
+  fd = __control_fd(ctl, file, CTL_WRITE);
+  if(fd < 0)
+    return fd;
+  memset(&f, 0, sizeof(struct prov_filter));
+  f.filter = filter;
+  f.mask = SUBTYPE_MASK;
+  f.add = add ? 1 : 0;
+  rc = __control_write(fd, &f, sizeof(struct prov_filter));
+  if(rc < 0)
+    return rc;
+  return 0;
+}
+
+/**
+ * @brief Writes an array of rules to a rule file.
+ *
+ * The kernel takes one rule per write, the saving is in the descriptor
+ * being reused.
+ * @param ctl the control handle.
+ * @param file one of the rule files, PROV_CTL_IPV4_INGRESS to PROV_CTL_NS.
+ * @param rules the rules.
+ * @param size the size of a rule, checked against the file.
+ * @param count the number of rules.
+ * @param applied if not NULL, set to the number of rules written.
+ * @return 0 on success, a negative error otherwise.
+ */
+int provenance_control_apply(struct prov_control* ctl, uint32_t file,
+                             const void* rules, size_t size, size_t count,
+                             size_t* applied){
+  const char* rule = (const char*)rules;
+  size_t i = 0;
+  int rc = 0;
+  int fd;
+
+  if(file >= PROV_CTL_FILES || !control_files[file].rule_size
+     || size != control_files[file].rule_size){
+    rc = -EINVAL;
+    goto out;
+  }
+  fd = __control_fd(ctl, file, CTL_WRITE);
+  if(fd < 0){
+    rc = fd;
+    goto out;
+  }
+  for(i=0; i<count; i++){
+    rc = __control_write(fd, rule + i*size, size);
+    if(rc < 0)
+      break;
+    rc = 0;
+  }
+out:
+  if(applied)
+    *applied = i;
+  return rc;
+}
+
+int provenance_control_read(struct prov_control* ctl, uint32_t file, void* buffer, size_t length){
+  int fd;
+
+  if(file >= PROV_CTL_FILES || !control_files[file].rule_size)
+    return -EINVAL;
+  fd = __control_fd(ctl, file, CTL_READ);
+  if(fd < 0)
+    return fd;
+  return __control_read(fd, buffer, length);
+}
+
+int provenance_control_state(struct prov_control* ctl, struct prov_control_state* state){
+  uint32_t file;
+  int fd;
+  int rc;
+
+  memset(state, 0, sizeof(struct prov_control_state));
+  for(file=0; file<PROV_CTL_BOOLEANS; file++){
+    rc = provenance_control_get_boolean(ctl, file, &state->booleans[file]);
+    if(rc < 0)
+      return rc;
+  }
+  for(file=PROV_CTL_NODE_FILTER; file<PROV_CTL_NODE_FILTER+PROV_CTL_FILTERS; file++){
+    fd = __control_fd(ctl, file, CTL_READ);
+    if(fd < 0)
+      return fd;
+    rc = __control_read(fd, &state->filters[file - PROV_CTL_NODE_FILTER], sizeof(uint64_t));
+    if(rc < 0)
+      return rc;
+  }
+  return 0;
+}
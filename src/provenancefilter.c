@@ -23,6 +23,7 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -139,3 +140,311 @@ declare_change_filter_fcn(provenance_add_propagate_informed_filter, true, PROV_P
 declare_change_filter_fcn(provenance_remove_propagate_informed_filter, false, PROV_PROPAGATE_INFORMED_FILTER_FILE, SUBTYPE_MASK);
 declare_get_filter_fcn(provenance_get_propagate_informed_filter, PROV_PROPAGATE_INFORMED_FILTER_FILE);
 declare_reset_filter_fcn(provenance_reset_propagate_informed_filter, PROV_PROPAGATE_INFORMED_FILTER_FILE);
+
+/* userspace filter engine */
+#define FILTER_SUBTYPE  0x1
+#define FILTER_TAINT    0x2
+#define FILTER_IDS      0x4
+
+#define FILTER_ID_SLOTS 128 /* power of two, at least twice PROV_FILTER_MAX_RULES */
+
+struct filter_id {
+  uint32_t id; /* 0 for an empty slot */
+  uint64_t rules;
+};
+
+/*
+* Compiled rule set, bit i of a mask stands for rule i. For each criterion a
+* table gives the rules an element value satisfies, the rules matching the
+* element are the intersection of those.
+*/
+struct filter_set {
+  uint32_t uses; /* FILTER_* criteria at least one rule sets */
+  uint64_t drop; /* rules with PROV_FILTER_DROP */
+  uint64_t drop_default;
+  uint64_t allowed[3]; /* node, disallowed relation, allowed relation */
+  uint64_t class_hi[256]; /* rules whose W3C type bits are included, per byte */
+  uint64_t class_lo[256];
+  uint64_t subtype_any;
+  uint64_t subtype[6][256]; /* rules sharing a subtype bit, per byte */
+  uint64_t taint_any;
+  uint64_t taint[8][256];
+  uint64_t machine_any;
+  uint64_t boot_any;
+  struct filter_id machine[FILTER_ID_SLOTS];
+  struct filter_id boot[FILTER_ID_SLOTS];
+  long refs; /* protected by filter_lock */
+};
+
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct filter_set* filter_current = NULL;
+static _Atomic uint64_t filter_gen = 0; /* incremented when filter_current changes */
+
+static inline size_t __filter_id_slot(uint32_t id){
+  return (id * 2654435761U) >> (32 - 7);
+}
+
+static void __filter_id_add(struct filter_id* table, uint32_t id, uint64_t rule){
+  size_t i = __filter_id_slot(id);
+
+  while(table[i].id!=0 && table[i].id!=id)
+    i = (i + 1) & (FILTER_ID_SLOTS - 1);
+  table[i].id = id;
+  table[i].rules |= rule;
+}
+
+static inline uint64_t __filter_id_rules(const struct filter_id* table, uint32_t id){
+  size_t i = __filter_id_slot(id);
+
+  while(table[i].id!=0){
+    if(table[i].id==id)
+      return table[i].rules;
+    i = (i + 1) & (FILTER_ID_SLOTS - 1);
+  }
+  return 0;
+}
+
+/* rules with at least one of the bits of their byte set in b */
+static void __filter_any_table(uint64_t table[][256], size_t bytes, uint64_t value, uint64_t rule){
+  size_t k, b;
+  uint8_t v;
+
+  for(k=0; k<bytes; k++){
+    v = (value >> (8*k)) & 0xFF;
+    if(!v)
+      continue;
+    for(b=0; b<256; b++){
+      if(b & v)
+        table[k][b] |= rule;
+    }
+  }
+}
+
+/* rules with all the bits of their byte set in b */
+static void __filter_all_table(uint64_t* table, uint8_t v, uint64_t rule){
+  size_t b;
+
+  for(b=0; b<256; b++){
+    if((b & v)==v)
+      table[b] |= rule;
+  }
+}
+
+static struct filter_set* __filter_compile(const struct prov_filter_rule* rules, size_t n, bool drop_default){
+  struct filter_set* set = calloc(1, sizeof(struct filter_set));
+  uint64_t rule, class, subtype;
+  size_t i;
+
+  if(!set)
+    return NULL;
+  set->drop_default = drop_default ? 1 : 0;
+  for(i=0; i<n; i++){
+    rule = 1ULL << i;
+    if(rules[i].action==PROV_FILTER_DROP)
+      set->drop |= rule;
+
+    class = W3C_TYPE(rules[i].type);
+    __filter_all_table(set->class_hi, class >> 56, rule);
+    __filter_all_table(set->class_lo, (class >> 48) & 0xFF, rule);
+    subtype = rules[i].type & SUBTYPE_MASK;
+    if(subtype){
+      set->uses |= FILTER_SUBTYPE;
+      __filter_any_table(set->subtype, 6, subtype, rule);
+    }else
+      set->subtype_any |= rule;
+
+    if(rules[i].taint){
+      set->uses |= FILTER_TAINT;
+      __filter_any_table(set->taint, 8, rules[i].taint, rule);
+    }else
+      set->taint_any |= rule;
+
+    if(rules[i].machine_id){
+      set->uses |= FILTER_IDS;
+      __filter_id_add(set->machine, rules[i].machine_id, rule);
+    }else
+      set->machine_any |= rule;
+    if(rules[i].boot_id){
+      set->uses |= FILTER_IDS;
+      __filter_id_add(set->boot, rules[i].boot_id, rule);
+    }else
+      set->boot_any |= rule;
+
+    if(rules[i].allowed!=PROV_FILTER_ALLOWED)
+      set->allowed[1] |= rule;
+    if(rules[i].allowed!=PROV_FILTER_DISALLOWED)
+      set->allowed[2] |= rule;
+    if(rules[i].allowed==PROV_FILTER_ALLOWED_ANY)
+      set->allowed[0] |= rule;
+  }
+  return set;
+}
+
+/* filter_lock must be held */
+static void __filter_put(struct filter_set* set){
+  if(set && --set->refs==0)
+    free(set);
+}
+
+int provenance_filter_set(const struct prov_filter_rule* rules, size_t n, bool drop_default){
+  struct filter_set* set = NULL;
+  struct filter_set* old;
+  size_t i;
+
+  if(n > PROV_FILTER_MAX_RULES || (n > 0 && !rules))
+    return -EINVAL;
+  for(i=0; i<n; i++){
+    if(rules[i].action > PROV_FILTER_DROP || rules[i].allowed > PROV_FILTER_DISALLOWED)
+      return -EINVAL;
+  }
+  if(n > 0){
+    set = __filter_compile(rules, n, drop_default);
+    if(!set)
+      return -ENOMEM;
+    set->refs = 1;
+  }
+  pthread_mutex_lock(&filter_lock);
+  old = filter_current;
+  filter_current = set;
+  atomic_fetch_add_explicit(&filter_gen, 1, memory_order_release);
+  __filter_put(old);
+  pthread_mutex_unlock(&filter_lock);
+  return 0;
+}
+
+void provenance_filter_clear( void ){
+  provenance_filter_set(NULL, 0, false);
+}
+
+/*
+* Each thread holds a reference on the rule set it last used, and only takes
+* the lock to move to a new one when filter_gen changed. The reference is
+* dropped at thread exit.
+*/
+static __thread struct filter_set* filter_self_set = NULL;
+static __thread uint64_t filter_self_gen = 0;
+static __thread bool filter_self_ready = false;
+static pthread_once_t filter_once = PTHREAD_ONCE_INIT;
+static pthread_key_t filter_key;
+
+static void __filter_destructor(void* arg){
+  pthread_mutex_lock(&filter_lock);
+  __filter_put(filter_self_set);
+  pthread_mutex_unlock(&filter_lock);
+  filter_self_set = NULL;
+  filter_self_gen = 0;
+  filter_self_ready = false;
+}
+
+static void __filter_init(void){
+  pthread_key_create(&filter_key, __filter_destructor);
+}
+
+static struct filter_set* __filter_refresh(void){
+  if(!filter_self_ready){
+    pthread_once(&filter_once, __filter_init);
+    filter_self_ready = pthread_setspecific(filter_key, &filter_self_set)==0;
+  }
+  pthread_mutex_lock(&filter_lock);
+  __filter_put(filter_self_set);
+  filter_self_set = filter_self_ready ? filter_current : NULL;
+  if(filter_self_set)
+    filter_self_set->refs++;
+  filter_self_gen = atomic_load_explicit(&filter_gen, memory_order_relaxed);
+  pthread_mutex_unlock(&filter_lock);
+  return filter_self_set;
+}
+
+static inline struct filter_set* __filter_self(void){
+  if(__builtin_expect(atomic_load_explicit(&filter_gen, memory_order_acquire)==filter_self_gen, 1))
+    return filter_self_set;
+  return __filter_refresh();
+}
+
+bool provenance_filter_active( void ){
+  return __filter_self()!=NULL;
+}
+
+/* rules matching the identifiers and allowed flag of msg */
+static inline uint64_t __filter_rest(const struct filter_set* set, prov_entry_t* msg, uint64_t type){
+  uint64_t m;
+  size_t a;
+
+  if((set->uses & FILTER_IDS) && type!=ENT_PACKET){ // packet identifiers carry no machine or boot id
+    m = set->machine_any | __filter_id_rules(set->machine, msg->msg_info.identifier.node_id.machine_id);
+    m &= set->boot_any | __filter_id_rules(set->boot, msg->msg_info.identifier.node_id.boot_id);
+  }else{
+    m = set->machine_any & set->boot_any;
+  }
+  a = prov_is_relation(msg) ? 1 + (msg->relation_info.allowed==FLOW_ALLOWED) : 0;
+  return m & set->allowed[a];
+}
+
+/* the lowest matching rule decides, the default if none matches */
+static inline bool __filter_decide(const struct filter_set* set, uint64_t m){
+  return (((m & -m) & set->drop) | ((uint64_t)(m==0) & set->drop_default)) != 0;
+}
+
+/**
+ * @brief Evaluates a compiled rule set against an element.
+ *
+ * The rules matching the element are the intersection of the table entries
+ * of its type, subtype, taint, identifiers and allowed flag. The lowest
+ * matching rule decides, criteria no rule sets are skipped.
+ * @return true if the element is dropped.
+ */
+static inline bool __filter_eval(const struct filter_set* set, prov_entry_t* msg){
+  uint64_t type = prov_type(msg);
+  uint64_t taint;
+  uint64_t m;
+
+  m = set->class_hi[type >> 56] & set->class_lo[(type >> 48) & 0xFF];
+  if(set->uses & FILTER_SUBTYPE){
+    m &= set->subtype_any
+      | set->subtype[0][type & 0xFF] | set->subtype[1][(type >> 8) & 0xFF]
+      | set->subtype[2][(type >> 16) & 0xFF] | set->subtype[3][(type >> 24) & 0xFF]
+      | set->subtype[4][(type >> 32) & 0xFF] | set->subtype[5][(type >> 40) & 0xFF];
+  }
+  if(set->uses & FILTER_TAINT){
+    taint = prov_taint(msg);
+    m &= set->taint_any
+      | set->taint[0][taint & 0xFF] | set->taint[1][(taint >> 8) & 0xFF]
+      | set->taint[2][(taint >> 16) & 0xFF] | set->taint[3][(taint >> 24) & 0xFF]
+      | set->taint[4][(taint >> 32) & 0xFF] | set->taint[5][(taint >> 40) & 0xFF]
+      | set->taint[6][(taint >> 48) & 0xFF] | set->taint[7][(taint >> 56) & 0xFF];
+  }
+  m &= __filter_rest(set, msg, type);
+  return __filter_decide(set, m);
+}
+
+bool provenance_filter(prov_entry_t* msg){
+  struct filter_set* set = __filter_self();
+
+  if(!set)
+    return false;
+  return __filter_eval(set, msg);
+}
+
+void provenance_filter_batch(union prov_elt* msgs, size_t n, bool* filtered){
+  const struct filter_set* set = __filter_self();
+  size_t i;
+
+  if(!set){
+    memset(filtered, 0, n*sizeof(bool));
+    return;
+  }
+  for(i=0; i<n; i++)
+    filtered[i] = __filter_eval(set, (prov_entry_t*)&msgs[i]);
+}
+
+void provenance_filter_long_batch(union long_prov_elt* msgs, size_t n, bool* filtered){
+  const struct filter_set* set = __filter_self();
+  size_t i;
+
+  if(!set){
+    memset(filtered, 0, n*sizeof(bool));
+    return;
+  }
+  for(i=0; i<n; i++)
+    filtered[i] = __filter_eval(set, (prov_entry_t*)&msgs[i]);
+}
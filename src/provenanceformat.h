@@ -0,0 +1,470 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCEFORMAT_H
+#define __PROVENANCEFORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Formatting kernels used on the serialisation path. They write to out
+ * without NUL terminating it and return the number of characters written.
+ * Output is identical to the radix 10/16 paths of ulltoa, utoa, itoa and
+ * lltoa, i.e. no leading zeros and lower case hexadecimal.
+ */
+#define FMT_U64_DEC_LEN 20
+#define FMT_I64_DEC_LEN 20
+#define FMT_U64_HEX_LEN 16
+#define FMT_UUID_LEN    36
+#define FMT_IPV4_LEN    15
+#define FMT_IPV6_LEN    45
+
+static const char fmt_digits2[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/*
+ * SSSE3 kernels are built in on x86 whatever -m flags are given, and only
+ * run when the cpu has SSSE3, unless the build already assumes it.
+ */
+#if defined(__SSSE3__)
+#define FMT_SSSE3
+#define FMT_SSSE3_TARGET
+#define fmt_has_ssse3() 1
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FMT_SSSE3
+#define FMT_SSSE3_TARGET __attribute__((target("ssse3")))
+#define fmt_has_ssse3() __builtin_cpu_supports("ssse3")
+#endif
+
+static const char fmt_hex_lower[17] = "0123456789abcdef";
+static const char fmt_hex_upper[17] = "0123456789ABCDEF";
+
+static inline size_t fmt_u64_dec_len(uint64_t v)
+{
+  size_t n = 1;
+  for (;;) {
+    if (v < 10) return n;
+    if (v < 100) return n + 1;
+    if (v < 1000) return n + 2;
+    if (v < 10000) return n + 3;
+    v /= 10000;
+    n += 4;
+  }
+}
+
+/* two digits per table lookup, written from the end */
+static inline size_t fmt_u64_dec(char* out, uint64_t v)
+{
+  size_t len = fmt_u64_dec_len(v);
+  char* p = out + len;
+  unsigned r;
+
+  while (v >= 100) {
+    r = (unsigned)(v % 100);
+    v /= 100;
+    p -= 2;
+    memcpy(p, fmt_digits2 + 2*r, 2);
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, fmt_digits2 + 2*v, 2);
+  } else
+    *--p = (char)('0' + v);
+  return len;
+}
+
+static inline size_t fmt_i64_dec(char* out, int64_t v)
+{
+  if (v < 0) {
+    *out = '-';
+    return 1 + fmt_u64_dec(out + 1, (uint64_t)0 - (uint64_t)v);
+  }
+  return fmt_u64_dec(out, (uint64_t)v);
+}
+
+static inline size_t fmt_u64_hex(char* out, uint64_t v)
+{
+  size_t len = v ? (size_t)(64 - __builtin_clzll(v) + 3)/4 : 1;
+  char* p = out + len;
+
+  do {
+    *--p = fmt_hex_lower[v & 0xf];
+    v >>= 4;
+  } while (v);
+  return len;
+}
+
+#ifdef FMT_SSSE3
+FMT_SSSE3_TARGET static inline void fmt_hex16_ssse3(char* out, const uint8_t* in, const char* table)
+{
+  const __m128i lut = _mm_loadu_si128((const __m128i*)table);
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  __m128i v = _mm_loadu_si128((const __m128i*)in);
+  __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+  __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+  _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+  _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+}
+#endif
+
+/* 16 bytes to 32 hexadecimal characters, table is fmt_hex_lower or fmt_hex_upper */
+static inline void fmt_hex16(char* out, const uint8_t* in, const char* table)
+{
+  int i;
+
+#ifdef FMT_SSSE3
+  if (fmt_has_ssse3()) {
+    fmt_hex16_ssse3(out, in, table);
+    return;
+  }
+#endif
+  for (i = 0; i < 16; i++) {
+    out[2*i] = table[in[i] >> 4];
+    out[2*i+1] = table[in[i] & 0xf];
+  }
+}
+
+/* same as printf("%02x" x4 "-" ...) in 8-4-4-4-12 groups */
+static inline size_t fmt_uuid(char* out, const uint8_t* uuid)
+{
+  char hex[32];
+
+  fmt_hex16(hex, uuid, fmt_hex_lower);
+  memcpy(out, hex, 8);
+  out[8] = '-';
+  memcpy(out + 9, hex + 8, 4);
+  out[13] = '-';
+  memcpy(out + 14, hex + 12, 4);
+  out[18] = '-';
+  memcpy(out + 19, hex + 16, 4);
+  out[23] = '-';
+  memcpy(out + 24, hex + 20, 12);
+  return FMT_UUID_LEN;
+}
+
+/* dotted quad of an address in network order, as inet_ntop */
+static inline size_t fmt_ipv4(char* out, const uint8_t* addr)
+{
+  char* p = out;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (i > 0)
+      *p++ = '.';
+    p += fmt_u64_dec(p, addr[i]);
+  }
+  return p - out;
+}
+
+/*
+ * Text form of an IPv6 address in network order, as glibc inet_ntop: the
+ * first longest run of two or more zero groups is compressed and mapped
+ * or compatible IPv4 addresses end in a dotted quad.
+ */
+static inline size_t fmt_ipv6(char* out, const uint8_t* addr)
+{
+  uint16_t words[8];
+  int best = -1, best_len = 0, cur = -1, cur_len = 0;
+  char* p = out;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    words[i] = (uint16_t)((addr[2*i] << 8) | addr[2*i+1]);
+    if (words[i] != 0) {
+      cur = -1;
+      continue;
+    }
+    if (cur < 0) {
+      cur = i;
+      cur_len = 0;
+    }
+    if (++cur_len > best_len) {
+      best = cur;
+      best_len = cur_len;
+    }
+  }
+  if (best_len < 2)
+    best = -1;
+
+  for (i = 0; i < 8; i++) {
+    if (best >= 0 && i >= best && i < best + best_len) {
+      if (i == best)
+        *p++ = ':';
+      continue;
+    }
+    if (i > 0)
+      *p++ = ':';
+    if (i == 6 && best == 0 && (best_len == 6 || (best_len == 5 && words[5] == 0xffff)))
+      return (p - out) + fmt_ipv4(p, addr + 12);
+    p += fmt_u64_hex(p, words[i]);
+  }
+  if (best >= 0 && best + best_len == 8)
+    *p++ = ':';
+  return p - out;
+}
+
+/*
+ * Log sanitisation, out[i] is in[i] with '"' replaced by ' ' and any byte
+ * outside 32 to 125 by '_'. out must hold len characters, in is untouched.
+ */
+static inline void fmt_sanitize(char* out, const char* in, size_t len)
+{
+  size_t i = 0;
+  unsigned char c;
+
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i low = _mm_set1_epi8(32);
+  const __m128i high = _mm_set1_epi8(125);
+  __m128i v, q, bad;
+
+  for (; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i*)(in + i));
+    q = _mm_cmpeq_epi8(v, quote);
+    /* signed compares, bytes above 127 are negative so below 32 */
+    bad = _mm_or_si128(_mm_cmplt_epi8(v, low), _mm_cmpgt_epi8(v, high));
+    v = _mm_or_si128(_mm_andnot_si128(q, v), _mm_and_si128(q, _mm_set1_epi8(' ')));
+    v = _mm_or_si128(_mm_andnot_si128(bad, v), _mm_and_si128(bad, _mm_set1_epi8('_')));
+    _mm_storeu_si128((__m128i*)(out + i), v);
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  uint8x16_t v, q, bad;
+
+  for (; i + 16 <= len; i += 16) {
+    v = vld1q_u8((const uint8_t*)in + i);
+    q = vceqq_u8(v, vdupq_n_u8('"'));
+    bad = vorrq_u8(vcltq_u8(v, vdupq_n_u8(32)), vcgtq_u8(v, vdupq_n_u8(125)));
+    v = vbslq_u8(q, vdupq_n_u8(' '), v);
+    v = vbslq_u8(bad, vdupq_n_u8('_'), v);
+    vst1q_u8((uint8_t*)out + i, v);
+  }
+#endif
+  for (; i < len; i++) {
+    c = (unsigned char)in[i];
+    if (c == '"')
+      c = ' ';
+    if (c < 32 || c > 125)
+      c = '_';
+    out[i] = (char)c;
+  }
+}
+
+#define fmt_json_escape_len(len) (6 * (len))
+
+/*
+ * in as the content of a JSON string: '"' and '\\' are escaped with a
+ * backslash and control characters written as \u00XX, anything else is
+ * copied. out must hold fmt_json_escape_len(len) characters, runs that need
+ * no escaping are copied 16 bytes at a time.
+ */
+static inline size_t fmt_json_escape(char* out, const char* in, size_t len)
+{
+  size_t i = 0;
+  size_t n;
+  char* p = out;
+  unsigned char c;
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  __m128i v, m;
+  int mask;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  uint8x16_t v, m;
+  uint64_t bits;
+#endif
+
+  while (i < len) {
+#if defined(__SSE2__)
+    if (i + 16 <= len) {
+      v = _mm_loadu_si128((const __m128i*)(in + i));
+      m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+      m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+      /* out has room for 16 more, only the bytes before the first escape count */
+      _mm_storeu_si128((__m128i*)p, v);
+      mask = _mm_movemask_epi8(m);
+      n = mask ? (size_t)__builtin_ctz(mask) : 16;
+      i += n;
+      p += n;
+      if (n == 16)
+        continue;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    if (i + 16 <= len) {
+      v = vld1q_u8((const uint8_t*)in + i);
+      m = vorrq_u8(vceqq_u8(v, vdupq_n_u8('"')), vceqq_u8(v, vdupq_n_u8('\\')));
+      m = vorrq_u8(m, vcleq_u8(v, vdupq_n_u8(0x1f)));
+      vst1q_u8((uint8_t*)p, v);
+      /* 4 bits per byte */
+      bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+      n = bits ? (size_t)__builtin_ctzll(bits) / 4 : 16;
+      i += n;
+      p += n;
+      if (n == 16)
+        continue;
+    }
+#endif
+    c = (unsigned char)in[i++];
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = (char)c;
+    } else if (c < 0x20) {
+      memcpy(p, "\\u00", 4);
+      p[4] = fmt_hex_lower[c >> 4];
+      p[5] = fmt_hex_lower[c & 0xf];
+      p += 6;
+    } else
+      *p++ = (char)c;
+  }
+  return p - out;
+}
+
+static const char fmt_base64_chars[65] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define fmt_base64_len(len) (4 * (((len) + 2) / 3))
+
+#ifdef FMT_SSSE3
+/* 12 bytes to 16 characters, reads 16 bytes from in (W. Mula's method) */
+FMT_SSSE3_TARGET static inline void fmt_base64_block12(char* out, const uint8_t* in)
+{
+  const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                          '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                          '/' - 63, 'A', 0, 0);
+  __m128i v = _mm_loadu_si128((const __m128i*)in);
+  __m128i t0, t1, t2, t3, idx, res, less;
+
+  /* each 32 bits lane gets the 3 bytes it encodes, as b1 b0 b2 b1 */
+  v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+  t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+  t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  idx = _mm_or_si128(t1, t3);
+  /* 6 bits indices to ascii, through the offset of their range */
+  res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+  less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+  res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+  res = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, res), idx);
+  _mm_storeu_si128((__m128i*)out, res);
+}
+
+/* whole 12 bytes blocks while 16 bytes can be read, returns the bytes encoded */
+FMT_SSSE3_TARGET static inline size_t fmt_base64_ssse3(char* out, const uint8_t* in, const size_t len)
+{
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 12, out += 16)
+    fmt_base64_block12(out, in + i);
+  return i;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+/* 24 bytes to 32 characters, reads 32 bytes from in */
+static inline void fmt_base64_block24(char* out, const uint8_t* in)
+{
+  static const uint8_t ia[8] = {0, 3, 6, 9, 12, 15, 18, 21};
+  static const uint8_t ib[8] = {1, 4, 7, 10, 13, 16, 19, 22};
+  static const uint8_t ic[8] = {2, 5, 8, 11, 14, 17, 20, 23};
+  uint8x16x2_t v = {{ vld1q_u8(in), vld1q_u8(in + 16) }};
+  uint8x16x4_t lut = {{ vld1q_u8((const uint8_t*)fmt_base64_chars),
+                        vld1q_u8((const uint8_t*)fmt_base64_chars + 16),
+                        vld1q_u8((const uint8_t*)fmt_base64_chars + 32),
+                        vld1q_u8((const uint8_t*)fmt_base64_chars + 48) }};
+  uint8x8_t a = vqtbl2_u8(v, vld1_u8(ia));
+  uint8x8_t b = vqtbl2_u8(v, vld1_u8(ib));
+  uint8x8_t c = vqtbl2_u8(v, vld1_u8(ic));
+  uint8x8x4_t res;
+
+  res.val[0] = vshr_n_u8(a, 2);
+  res.val[1] = vorr_u8(vand_u8(vshl_n_u8(a, 4), vdup_n_u8(0x30)), vshr_n_u8(b, 4));
+  res.val[2] = vorr_u8(vand_u8(vshl_n_u8(b, 2), vdup_n_u8(0x3c)), vshr_n_u8(c, 6));
+  res.val[3] = vand_u8(c, vdup_n_u8(0x3f));
+  res.val[0] = vqtbl4_u8(lut, res.val[0]);
+  res.val[1] = vqtbl4_u8(lut, res.val[1]);
+  res.val[2] = vqtbl4_u8(lut, res.val[2]);
+  res.val[3] = vqtbl4_u8(lut, res.val[3]);
+  vst4_u8((uint8_t*)out, res);
+}
+#endif
+
+/*
+ * Padded base64, as base64encode but without bound checks nor NUL. Meant
+ * for a compile time constant len, e.g. identifiers, so that it unrolls.
+ * out must hold fmt_base64_len(len) characters.
+ */
+static inline size_t fmt_base64(char* out, const uint8_t* in, const size_t len)
+{
+  size_t i = 0;
+  char* p = out;
+  uint32_t n;
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+  for (; i + 32 <= len; i += 24, p += 32)
+    fmt_base64_block24(p, in + i);
+#elif defined(FMT_SSSE3)
+  if (fmt_has_ssse3()) {
+    i = fmt_base64_ssse3(p, in, len);
+    p += i / 3 * 4;
+  }
+#endif
+  for (; i + 3 <= len; i += 3, p += 4) {
+    n = ((uint32_t)in[i] << 16) | ((uint32_t)in[i+1] << 8) | in[i+2];
+    p[0] = fmt_base64_chars[(n >> 18) & 63];
+    p[1] = fmt_base64_chars[(n >> 12) & 63];
+    p[2] = fmt_base64_chars[(n >> 6) & 63];
+    p[3] = fmt_base64_chars[n & 63];
+  }
+  if (len - i == 1) {
+    n = (uint32_t)in[i] << 16;
+    p[0] = fmt_base64_chars[(n >> 18) & 63];
+    p[1] = fmt_base64_chars[(n >> 12) & 63];
+    p[2] = '=';
+    p[3] = '=';
+    p += 4;
+  } else if (len - i == 2) {
+    n = ((uint32_t)in[i] << 16) | ((uint32_t)in[i+1] << 8);
+    p[0] = fmt_base64_chars[(n >> 18) & 63];
+    p[1] = fmt_base64_chars[(n >> 12) & 63];
+    p[2] = fmt_base64_chars[(n >> 6) & 63];
+    p[3] = '=';
+    p += 4;
+  }
+  return p - out;
+}
+
+#endif /* __PROVENANCEFORMAT_H */
@@ -0,0 +1,617 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "provenancesink.h"
+#include "provenanceblocks.h"
+
+/* state of the write of a block, sblocks[i] is that of s_blocks.blocks[i] */
+struct sblock {
+  size_t written; /* short writes are resumed */
+  uint64_t offset; /* in the file */
+  bool rotate; /* the file is rotated once the block is written */
+  bool done;
+};
+
+/*
+ * The first s_submitted blocks queued have been handed to the writer.
+ * Writes to a file may complete out of order, blocks are released in
+ * order once written.
+ */
+static struct block_ring s_blocks = BLOCK_RING_INIT;
+static struct sblock* sblocks;
+static size_t s_submitted;
+static size_t s_inflight;
+static struct prov_sink_stats s_stats;
+
+static struct prov_sink_conf s_conf;
+static char* s_path; /* NULL when writing to a file descriptor */
+static int s_fd = -1;
+static bool s_stream; /* not seekable, blocks are written one at a time */
+static uint64_t s_file_bytes; /* accepted for the current file, for rotation */
+
+/* only used by the sink thread once started */
+static uint64_t s_offset; /* where the next block goes */
+static bool s_rotating; /* a rotate block was submitted, waiting for the writes in flight */
+
+struct uring {
+  int fd;
+  bool fixed; /* blocks are registered buffers */
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned pending; /* sqes not submitted yet */
+};
+
+static struct uring s_ring = { .fd = -1 };
+
+static void uring_free(void){
+  if(s_ring.fd < 0)
+    return;
+  if(s_ring.sqes)
+    munmap(s_ring.sqes, s_ring.sqes_size);
+  if(s_ring.cq_ring)
+    munmap(s_ring.cq_ring, s_ring.cq_ring_size);
+  if(s_ring.sq_ring)
+    munmap(s_ring.sq_ring, s_ring.sq_ring_size);
+  close(s_ring.fd);
+  memset(&s_ring, 0, sizeof(struct uring));
+  s_ring.fd = -1;
+}
+
+static void* uring_map(size_t size, off_t offset){
+  void* p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, s_ring.fd, offset);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/* one sqe per block is enough, a block has at most one write in flight */
+static int uring_init(void){
+  struct io_uring_params p;
+  struct iovec* iov;
+  size_t i;
+
+  memset(&p, 0, sizeof(struct io_uring_params));
+  s_ring.fd = syscall(__NR_io_uring_setup, s_blocks.nblocks, &p);
+  if(s_ring.fd < 0)
+    return -1;
+  s_ring.sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  s_ring.cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  s_ring.sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+  s_ring.sq_ring = uring_map(s_ring.sq_ring_size, IORING_OFF_SQ_RING);
+  s_ring.cq_ring = uring_map(s_ring.cq_ring_size, IORING_OFF_CQ_RING);
+  s_ring.sqes = (struct io_uring_sqe*)uring_map(s_ring.sqes_size, IORING_OFF_SQES);
+  if(!s_ring.sq_ring || !s_ring.cq_ring || !s_ring.sqes){
+    uring_free();
+    return -1;
+  }
+  s_ring.sq_tail = (unsigned*)((uint8_t*)s_ring.sq_ring + p.sq_off.tail);
+  s_ring.sq_mask = (unsigned*)((uint8_t*)s_ring.sq_ring + p.sq_off.ring_mask);
+  s_ring.sq_array = (unsigned*)((uint8_t*)s_ring.sq_ring + p.sq_off.array);
+  s_ring.cq_head = (unsigned*)((uint8_t*)s_ring.cq_ring + p.cq_off.head);
+  s_ring.cq_tail = (unsigned*)((uint8_t*)s_ring.cq_ring + p.cq_off.tail);
+  s_ring.cq_mask = (unsigned*)((uint8_t*)s_ring.cq_ring + p.cq_off.ring_mask);
+  s_ring.cqes = (struct io_uring_cqe*)((uint8_t*)s_ring.cq_ring + p.cq_off.cqes);
+
+  // plain writes if the blocks cannot be registered, e.g. over RLIMIT_MEMLOCK
+  iov = (struct iovec*)calloc(s_blocks.nblocks, sizeof(struct iovec));
+  if(iov){
+    for(i=0; i<s_blocks.nblocks; i++){
+      iov[i].iov_base = s_blocks.blocks[i].data;
+      iov[i].iov_len = s_conf.block_size;
+    }
+    s_ring.fixed = syscall(__NR_io_uring_register, s_ring.fd, IORING_REGISTER_BUFFERS, iov, s_blocks.nblocks) == 0;
+    free(iov);
+  }
+  return 0;
+}
+
+/* s_blocks.lock held, queue the write of what is left of block idx */
+static void uring_push(size_t idx){
+  struct block* d = &s_blocks.blocks[idx];
+  struct sblock* b = &sblocks[idx];
+  struct io_uring_sqe* sqe;
+  unsigned tail = *s_ring.sq_tail;
+  unsigned i = tail & *s_ring.sq_mask;
+
+  sqe = &s_ring.sqes[i];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = s_ring.fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = s_fd;
+  sqe->addr = (uint64_t)(uintptr_t)(d->data + b->written);
+  sqe->len = d->len - b->written;
+  sqe->off = s_stream ? (uint64_t)-1 : b->offset + b->written;
+  if(s_ring.fixed)
+    sqe->buf_index = idx;
+  sqe->user_data = idx;
+  s_ring.sq_array[i] = i;
+  __atomic_store_n(s_ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  s_ring.pending++;
+}
+
+/* submit the pending sqes, waiting for a completion if wait */
+static int uring_enter(bool wait){
+  int rc;
+
+  do{
+    rc = syscall(__NR_io_uring_enter, s_ring.fd, s_ring.pending, wait ? 1 : 0,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  }while(rc < 0 && errno == EINTR);
+  if(rc > 0)
+    s_ring.pending -= rc;
+  return rc;
+}
+
+/* s_blocks.lock held, write state of the block being filled */
+static inline struct sblock* __sink_filling(void){
+  return &sblocks[(s_blocks.head + s_blocks.count) % s_blocks.nblocks];
+}
+
+/* s_blocks.lock held, release the blocks written at the head of the ring */
+static void __sink_release(void){
+  struct sblock* b;
+
+  while(s_submitted > 0 && sblocks[s_blocks.head].done){
+    b = &sblocks[s_blocks.head];
+    b->written = 0;
+    b->rotate = false;
+    b->done = false;
+    __block_release(&s_blocks);
+    s_submitted--;
+    s_stats.blocks++;
+  }
+  // writers only queue a full block if there is room
+  if(__block_filling(&s_blocks)->len == s_conf.block_size && __block_free(&s_blocks) > 0)
+    __block_queue(&s_blocks);
+}
+
+/* s_blocks.lock held, a write of block idx completed with res */
+static void __sink_complete(size_t idx, int res){
+  struct block* d = &s_blocks.blocks[idx];
+  struct sblock* b = &sblocks[idx];
+
+  if(res == -EINTR || res == -EAGAIN){
+    uring_push(idx);
+    return;
+  }
+  if(res > 0){
+    b->written += res;
+    s_stats.bytes_out += res;
+    if(b->written < d->len){ // short write
+      uring_push(idx);
+      return;
+    }
+  }else
+    s_stats.errors++;
+  b->done = true;
+  s_inflight--;
+  __sink_release();
+}
+
+/* s_blocks.lock held */
+static void uring_reap(void){
+  struct io_uring_cqe* cqe;
+  unsigned head = *s_ring.cq_head;
+  unsigned tail = __atomic_load_n(s_ring.cq_tail, __ATOMIC_ACQUIRE);
+
+  while(head != tail){
+    cqe = &s_ring.cqes[head & *s_ring.cq_mask];
+    __sink_complete((size_t)cqe->user_data, cqe->res);
+    head++;
+  }
+  __atomic_store_n(s_ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* writer thread engine, returns 0 or -errno */
+static int direct_write(const struct block* d, struct sblock* b){
+  struct pollfd pfd;
+  ssize_t rc;
+
+  while(b->written < d->len){
+    if(s_stream)
+      rc = write(s_fd, d->data + b->written, d->len - b->written);
+    else
+      rc = pwrite(s_fd, d->data + b->written, d->len - b->written, b->offset + b->written);
+    if(rc < 0){
+      if(errno == EINTR)
+        continue;
+      if(errno != EAGAIN)
+        return -errno;
+      pfd.fd = s_fd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+    b->written += rc;
+  }
+  return 0;
+}
+
+/* rename path to path.1, path.1 to path.2 and so on, and start a new file */
+static int sink_reopen(void){
+  char from[PATH_MAX];
+  char to[PATH_MAX];
+  uint32_t k;
+  int fd;
+
+  for(k=s_conf.rotate_keep; k>1; k--){
+    snprintf(from, PATH_MAX, "%s.%u", s_path, k-1);
+    snprintf(to, PATH_MAX, "%s.%u", s_path, k);
+    rename(from, to); // might not exist yet
+  }
+  snprintf(to, PATH_MAX, "%s.1", s_path);
+  if(rename(s_path, to) < 0)
+    return -errno;
+  fd = open(s_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if(fd < 0)
+    return -errno; // carry on writing to path.1
+  close(s_fd);
+  s_fd = fd;
+  s_offset = 0;
+  return 0;
+}
+
+/**
+ * @brief Loop of the sink thread.
+ *
+ * Queued blocks are handed to io_uring in one submission, then the thread
+ * waits for a completion, or are written in turn without io_uring. A block
+ * marked for rotation is the last one of its file: the following ones are
+ * held until the writes in flight complete and the file is rotated. When
+ * idle, a partially filled block is queued every flush_interval ms.
+ */
+static void* sink_thread(void* arg){
+  struct timespec deadline;
+  struct block* d;
+  struct sblock* b;
+  size_t idx;
+  int rc;
+
+  pthread_mutex_lock(&s_blocks.lock);
+  for(;;){
+    while(s_submitted < s_blocks.count && !s_rotating && !(s_stream && s_inflight > 0)){
+      idx = (s_blocks.head + s_submitted) % s_blocks.nblocks;
+      d = &s_blocks.blocks[idx];
+      b = &sblocks[idx];
+      b->offset = s_offset;
+      s_offset += d->len;
+      s_submitted++;
+      if(b->rotate && s_path)
+        s_rotating = true;
+      if(d->len == 0){
+        b->done = true;
+        __sink_release();
+        continue;
+      }
+      s_inflight++;
+      if(s_ring.fd >= 0){
+        uring_push(idx);
+        continue;
+      }
+      pthread_mutex_unlock(&s_blocks.lock);
+      rc = direct_write(d, b);
+      pthread_mutex_lock(&s_blocks.lock);
+      s_stats.bytes_out += b->written;
+      if(rc < 0)
+        s_stats.errors++;
+      b->done = true;
+      s_inflight--;
+      __sink_release();
+    }
+    if(s_ring.fd >= 0 && (s_ring.pending > 0 || s_inflight > 0)){
+      pthread_mutex_unlock(&s_blocks.lock);
+      rc = uring_enter(s_inflight > 0);
+      pthread_mutex_lock(&s_blocks.lock);
+      if(rc < 0 && errno != EAGAIN && errno != EBUSY){
+        s_stats.errors++;
+        pthread_mutex_unlock(&s_blocks.lock);
+        usleep(1000);
+        pthread_mutex_lock(&s_blocks.lock);
+      }
+      uring_reap();
+      continue;
+    }
+    if(s_rotating){
+      pthread_mutex_unlock(&s_blocks.lock);
+      rc = sink_reopen();
+      pthread_mutex_lock(&s_blocks.lock);
+      if(rc < 0)
+        s_stats.errors++;
+      else
+        s_stats.rotations++;
+      s_rotating = false;
+      continue;
+    }
+    if(s_submitted < s_blocks.count)
+      continue;
+    if(s_blocks.stopping && s_blocks.count == 0)
+      break;
+    block_deadline(&deadline, s_conf.flush_interval);
+    if(pthread_cond_timedwait(&s_blocks.ready, &s_blocks.lock, &deadline) == ETIMEDOUT){
+      if((__block_filling(&s_blocks)->len > 0 || __sink_filling()->rotate) && __block_free(&s_blocks) > 0)
+        __block_queue(&s_blocks);
+    }
+  }
+  pthread_mutex_unlock(&s_blocks.lock);
+  return NULL;
+}
+
+/* s_blocks.lock held, once the sink thread is done */
+static void sink_release_file(void){
+  uring_free();
+  if(s_path){
+    close(s_fd);
+    free(s_path);
+    s_path = NULL;
+  }else if(!s_stream)
+    lseek(s_fd, s_offset, SEEK_SET); // as if written to the descriptor
+  s_fd = -1;
+  free(sblocks);
+  sblocks = NULL;
+}
+
+/* s_blocks.lock held, s_fd set */
+static int __sink_start(const struct prov_sink_conf* conf){
+  int rc;
+
+  if(conf)
+    memcpy(&s_conf, conf, sizeof(struct prov_sink_conf));
+  else
+    memset(&s_conf, 0, sizeof(struct prov_sink_conf));
+  if(!s_conf.block_size)
+    s_conf.block_size = PROV_SINK_BLOCK_SIZE;
+  if(!s_conf.blocks)
+    s_conf.blocks = PROV_SINK_BLOCKS;
+  if(!s_conf.flush_interval)
+    s_conf.flush_interval = PROV_SINK_FLUSH_INTERVAL;
+  if(!s_conf.rotate_keep)
+    s_conf.rotate_keep = PROV_SINK_KEEP;
+  if(s_conf.blocks < 2 || s_conf.block_size > UINT32_MAX)
+    return -EINVAL;
+  sblocks = (struct sblock*)calloc(s_conf.blocks, sizeof(struct sblock));
+  if(!sblocks)
+    return -ENOMEM;
+  s_submitted = 0;
+  s_inflight = 0;
+  s_file_bytes = 0;
+  s_rotating = false;
+  memset(&s_stats, 0, sizeof(struct prov_sink_stats));
+  // the sink thread waits for s_blocks.lock, io_uring is set up before it runs
+  rc = __block_ring_start(&s_blocks, s_conf.blocks, s_conf.block_size, sink_thread);
+  if(rc){
+    free(sblocks);
+    sblocks = NULL;
+    return rc;
+  }
+  if(s_conf.engine == PROV_SINK_URING && uring_init() == 0)
+    s_stats.uring = true;
+  return 0;
+}
+
+int sink_open(const char* path, const struct prov_sink_conf* conf){
+  off_t end;
+  int rc;
+
+  pthread_mutex_lock(&s_blocks.lock);
+  if(s_blocks.running){
+    rc = -EBUSY;
+    goto out;
+  }
+  s_path = strdup(path);
+  if(!s_path){
+    rc = -ENOMEM;
+    goto out;
+  }
+  s_fd = open(path, O_WRONLY|O_CREAT|O_CLOEXEC, 0600);
+  if(s_fd < 0){
+    rc = -errno;
+    goto out_free;
+  }
+  end = lseek(s_fd, 0, SEEK_END);
+  s_offset = end < 0 ? 0 : end;
+  s_stream = false;
+  rc = __sink_start(conf);
+  if(rc == 0)
+    goto out;
+  close(s_fd);
+  s_fd = -1;
+out_free:
+  free(s_path);
+  s_path = NULL;
+out:
+  pthread_mutex_unlock(&s_blocks.lock);
+  return rc;
+}
+
+int sink_open_fd(int fd, const struct prov_sink_conf* conf){
+  struct stat st;
+  off_t pos;
+  int flags;
+  int rc;
+
+  pthread_mutex_lock(&s_blocks.lock);
+  if(s_blocks.running){
+    rc = -EBUSY;
+    goto out;
+  }
+  flags = fcntl(fd, F_GETFL);
+  if(flags < 0 || fstat(fd, &st) < 0){
+    rc = -errno;
+    goto out;
+  }
+  s_path = NULL;
+  s_fd = fd;
+  // positioned writes need a seekable file not in append mode
+  pos = lseek(fd, 0, SEEK_CUR);
+  s_stream = !S_ISREG(st.st_mode) || (flags & O_APPEND) || pos < 0;
+  s_offset = pos < 0 ? 0 : pos;
+  rc = __sink_start(conf);
+  if(rc)
+    s_fd = -1;
+out:
+  pthread_mutex_unlock(&s_blocks.lock);
+  return rc;
+}
+
+/* s_blocks.lock held, the current block is the last one of the file */
+static void __sink_mark_rotate(void){
+  __sink_filling()->rotate = true;
+  s_file_bytes = 0;
+  if(__block_free(&s_blocks) > 0)
+    __block_queue(&s_blocks);
+}
+
+void sink_write(const struct iovec* iov, int iovcnt){
+  struct block* b;
+  const uint8_t* p;
+  size_t total = 0;
+  size_t len;
+  size_t n;
+  int i;
+
+  for(i=0; i<iovcnt; i++)
+    total += iov[i].iov_len;
+  pthread_mutex_lock(&s_blocks.lock);
+  if(!s_blocks.running || s_blocks.stopping)
+    goto out;
+  s_stats.bytes_in += total;
+  if(s_path && s_conf.rotate_size && s_file_bytes >= s_conf.rotate_size)
+    __sink_mark_rotate();
+  b = __block_filling(&s_blocks);
+  if(total > s_conf.block_size - b->len + __block_free(&s_blocks) * s_conf.block_size){
+    s_stats.dropped += total;
+    goto out;
+  }
+  s_file_bytes += total;
+  for(i=0; i<iovcnt; i++){
+    p = (const uint8_t*)iov[i].iov_base;
+    len = iov[i].iov_len;
+    while(len > 0){
+      b = __block_filling(&s_blocks);
+      n = s_conf.block_size - b->len;
+      if(n > len)
+        n = len;
+      memcpy(b->data + b->len, p, n);
+      b->len += n;
+      p += n;
+      len -= n;
+      // otherwise it is queued when a block is released, see __sink_release
+      if(b->len == s_conf.block_size && __block_free(&s_blocks) > 0)
+        __block_queue(&s_blocks);
+    }
+  }
+out:
+  pthread_mutex_unlock(&s_blocks.lock);
+}
+
+void sink_write_str(char* str){
+  struct iovec iov;
+
+  iov.iov_base = str;
+  iov.iov_len = strlen(str);
+  sink_write(&iov, 1);
+}
+
+/* s_blocks.lock held, queue the block being filled, waiting for room until deadline */
+static int __sink_submit_filling(const struct timespec* deadline){
+  int rc;
+
+  if(__block_filling(&s_blocks)->len == 0 && !__sink_filling()->rotate)
+    return 0;
+  rc = __block_wait_room(&s_blocks, deadline);
+  if(rc == 0)
+    __block_queue(&s_blocks);
+  return rc;
+}
+
+static int sink_flush_until(const struct timespec* deadline){
+  int rc = 0;
+
+  pthread_mutex_lock(&s_blocks.lock);
+  if(s_blocks.running && !s_blocks.stopping){
+    rc = __sink_submit_filling(deadline);
+    if(rc == 0)
+      rc = __block_wait_released(&s_blocks, s_blocks.queued, deadline);
+  }
+  pthread_mutex_unlock(&s_blocks.lock);
+  return rc;
+}
+
+void sink_flush(void){
+  sink_flush_until(NULL);
+}
+
+int sink_flush_timeout(uint32_t ms){
+  struct timespec deadline;
+
+  block_deadline(&deadline, ms);
+  return sink_flush_until(&deadline);
+}
+
+int sink_rotate(void){
+  int rc = 0;
+
+  pthread_mutex_lock(&s_blocks.lock);
+  if(!s_blocks.running || s_blocks.stopping || !s_path)
+    rc = -EINVAL;
+  else
+    __sink_mark_rotate();
+  pthread_mutex_unlock(&s_blocks.lock);
+  return rc;
+}
+
+void sink_close(void){
+  pthread_mutex_lock(&s_blocks.lock);
+  if(!s_blocks.running || s_blocks.stopping){
+    pthread_mutex_unlock(&s_blocks.lock);
+    return;
+  }
+  __sink_submit_filling(NULL);
+  pthread_mutex_unlock(&s_blocks.lock);
+  block_ring_stop(&s_blocks, sink_release_file);
+}
+
+void sink_stats(struct prov_sink_stats* stats){
+  pthread_mutex_lock(&s_blocks.lock);
+  memcpy(stats, &s_stats, sizeof(struct prov_sink_stats));
+  pthread_mutex_unlock(&s_blocks.lock);
+}
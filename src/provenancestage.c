@@ -0,0 +1,336 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "provenancestage.h"
+#include "provenancestats.h"
+
+/**
+ * @brief Hands an assembled document to the pool callback.
+ *
+ * The vector is passed as is to sink_iov. Otherwise it is gathered in the
+ * pool scratch buffer, NUL terminated, and passed to sink_str.
+ * Must be called with sink_lock held, i.e. from the pool emit function.
+ */
+void stage_deliver(struct stage_pool* pool, const struct iovec* iov, int iovcnt){
+  size_t len = 0;
+  char* p;
+  int i;
+
+  if(pool->sink_iov){
+    pool->sink_iov(iov, iovcnt);
+    return;
+  }
+  if(!pool->sink_str)
+    return;
+  for(i=0; i<iovcnt; i++)
+    len += iov[i].iov_len;
+  if(len + 1 > pool->scratch_size){
+    p = (char*)realloc(pool->scratch, len + 1);
+    if(!p)
+      return;
+    pool->scratch = p;
+    pool->scratch_size = len + 1;
+  }
+  p = pool->scratch;
+  for(i=0; i<iovcnt; i++){
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+  *p = '\0';
+  pool->sink_str(pool->scratch);
+}
+
+static inline void __stage_emit_buffer(struct stage_pool* pool, const struct stage_buffer* buf){
+  struct stats_thread* self = stats_self();
+  uint64_t start;
+  size_t len = 0;
+  size_t i;
+
+  for(i=0; i<pool->nsections; i++)
+    len += buf->sections[i].len;
+  pthread_mutex_lock(&pool->sink_lock);
+  start = stats_now();
+  pool->emit(pool, buf);
+  stats_record(&self->flush, stats_now()-start);
+  pthread_mutex_unlock(&pool->sink_lock);
+  stats_add(&self->flushes, 1);
+  stats_add(&self->flushed_bytes, len);
+}
+
+/**
+ * @brief Swaps the active and spare buffers of a stage and emits the spare.
+ *
+ * emit_lock serialises flushes of a stage, the spare buffer is not handed
+ * back until it has been emitted. The stage lock is only held for the swap.
+ */
+static void __stage_flush(struct stage* stage){
+  struct stage_buffer* full;
+  size_t i;
+
+  pthread_mutex_lock(&stage->emit_lock);
+  pthread_mutex_lock(&stage->lock);
+  full = stage->active;
+  if(full->count == 0){
+    pthread_mutex_unlock(&stage->lock);
+    pthread_mutex_unlock(&stage->emit_lock);
+    return;
+  }
+  stage->active = stage->spare;
+  stage->spare = full;
+  pthread_mutex_unlock(&stage->lock);
+
+  __stage_emit_buffer(stage->pool, full);
+  for(i=0; i<stage->pool->nsections; i++)
+    full->sections[i].len = 0;
+  full->count = 0;
+  pthread_mutex_unlock(&stage->emit_lock);
+}
+
+static inline struct stage_buffer* __stage_buffer_alloc(size_t nsections, size_t capacity){
+  struct stage_buffer* buf;
+  char* data;
+  size_t i;
+
+  buf = (struct stage_buffer*)calloc(1, sizeof(struct stage_buffer));
+  if(!buf)
+    return NULL;
+  data = (char*)malloc(nsections*capacity);
+  if(!data){
+    free(buf);
+    return NULL;
+  }
+  for(i=0; i<nsections; i++)
+    buf->sections[i].data = data + i*capacity;
+  return buf;
+}
+
+static inline void __stage_buffer_free(struct stage_buffer* buf){
+  free(buf->sections[0].data);
+  free(buf);
+}
+
+static void __stage_free(struct stage* stage){
+  pthread_mutex_destroy(&stage->lock);
+  pthread_mutex_destroy(&stage->emit_lock);
+  __stage_buffer_free(stage->active);
+  __stage_buffer_free(stage->spare);
+  free(stage);
+}
+
+/* thread exit, whatever the thread staged is emitted before the stage goes */
+static void __stage_destructor(void* arg){
+  struct stage* stage = (struct stage*)arg;
+  struct stage_pool* pool = stage->pool;
+  struct stage** p;
+
+  pthread_mutex_lock(&pool->lock);
+  for(p=&pool->stages; *p; p=&(*p)->next){
+    if(*p == stage){
+      *p = stage->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  __stage_flush(stage);
+  __stage_free(stage);
+}
+
+int stage_pool_init(struct stage_pool* pool){
+  int rc = 0;
+
+  if(atomic_load_explicit(&pool->ready, memory_order_acquire))
+    return 0;
+  pthread_mutex_lock(&pool->lock);
+  if(!pool->ready){
+    rc = -pthread_key_create(&pool->key, __stage_destructor);
+    if(!rc)
+      atomic_store_explicit(&pool->ready, true, memory_order_release);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return rc;
+}
+
+/* only affects threads that have not appended to the pool yet */
+void stage_set_capacity(struct stage_pool* pool, size_t capacity){
+  pthread_mutex_lock(&pool->lock);
+  pool->capacity = capacity;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static struct stage* __stage_create(struct stage_pool* pool){
+  struct stage* stage;
+
+  if(stage_pool_init(pool))
+    return NULL;
+  stage = (struct stage*)calloc(1, sizeof(struct stage));
+  if(!stage)
+    return NULL;
+  pthread_mutex_init(&stage->lock, NULL);
+  pthread_mutex_init(&stage->emit_lock, NULL);
+  stage->pool = pool;
+
+  pthread_mutex_lock(&pool->lock);
+  stage->capacity = pool->capacity;
+  stage->active = __stage_buffer_alloc(pool->nsections, stage->capacity);
+  stage->spare = __stage_buffer_alloc(pool->nsections, stage->capacity);
+  if(!stage->active || !stage->spare){
+    pthread_mutex_unlock(&pool->lock);
+    if(stage->active)
+      __stage_buffer_free(stage->active);
+    if(stage->spare)
+      __stage_buffer_free(stage->spare);
+    free(stage);
+    return NULL;
+  }
+  stage->next = pool->stages;
+  pool->stages = stage;
+  pthread_mutex_unlock(&pool->lock);
+  pthread_setspecific(pool->key, stage);
+  return stage;
+}
+
+static inline struct stage* __stage_self(struct stage_pool* pool, bool create){
+  struct stage* stage = NULL;
+
+  if(atomic_load_explicit(&pool->ready, memory_order_acquire))
+    stage = (struct stage*)pthread_getspecific(pool->key);
+  if(!stage && create)
+    stage = __stage_create(pool);
+  return stage;
+}
+
+/**
+ * @brief Appends an element to a section of the calling thread stage.
+ *
+ * Elements of a section are joined by the pool separator. When the section
+ * is full the stage is flushed first. An element that would not fit an
+ * empty section is emitted on its own, after what was already staged.
+ * @param pool the pool to append to.
+ * @param section index of the section, lower than pool->nsections.
+ * @param data the element, not necessarily NUL terminated.
+ * @param len length of the element.
+ * @return 0 on success, -ENOMEM if the stage could not be allocated.
+ */
+int stage_append(struct stage_pool* pool, size_t section, const char* data, size_t len){
+  struct stage* stage = __stage_self(pool, true);
+  struct stage_section* sec;
+  struct stage_buffer single;
+
+  if(!stage)
+    return -ENOMEM;
+
+  if(len > stage->capacity){
+    __stage_flush(stage);
+    memset(&single, 0, sizeof(struct stage_buffer));
+    single.sections[section].data = (char*)data;
+    single.sections[section].len = len;
+    single.count = 1;
+    __stage_emit_buffer(pool, &single);
+    return 0;
+  }
+
+  pthread_mutex_lock(&stage->lock);
+  sec = &stage->active->sections[section];
+  if(sec->len > 0 && sec->len + pool->separator_len + len > stage->capacity){
+    // not enough space, the stage is flushed and the section is empty
+    pthread_mutex_unlock(&stage->lock);
+    __stage_flush(stage);
+    pthread_mutex_lock(&stage->lock);
+    sec = &stage->active->sections[section];
+  }
+  if(sec->len > 0){
+    memcpy(sec->data + sec->len, pool->separator, pool->separator_len);
+    sec->len += pool->separator_len;
+  }
+  memcpy(sec->data + sec->len, data, len);
+  sec->len += len;
+  stage->active->count++;
+  pthread_mutex_unlock(&stage->lock);
+  return 0;
+}
+
+/**
+ * @brief Reserves room at the end of a section of the calling thread stage.
+ *
+ * Lets an encoder write in place rather than through a copy. The stage
+ * stays locked until stage_commit, which must be called by the same thread
+ * before anything else touches the pool.
+ * @param pool the pool to append to.
+ * @param section index of the section, lower than pool->nsections.
+ * @param len minimum number of bytes needed, the stage is flushed if short.
+ * @param room set to the number of bytes that can be written.
+ * @param empty set to true if the section was empty, i.e. the data will be
+ * the first of a buffer handed to the callback.
+ * @return where to write, NULL if len exceeds the section capacity or the
+ * stage could not be allocated.
+ */
+char* stage_reserve(struct stage_pool* pool, size_t section, size_t len, size_t* room, bool* empty){
+  struct stage* stage = __stage_self(pool, true);
+  struct stage_section* sec;
+
+  if(!stage || len + pool->separator_len > stage->capacity)
+    return NULL;
+  pthread_mutex_lock(&stage->lock);
+  sec = &stage->active->sections[section];
+  if(sec->len > 0 && sec->len + pool->separator_len + len > stage->capacity){
+    pthread_mutex_unlock(&stage->lock);
+    __stage_flush(stage);
+    pthread_mutex_lock(&stage->lock);
+    sec = &stage->active->sections[section];
+  }
+  *empty = (sec->len == 0);
+  if(sec->len > 0){
+    memcpy(sec->data + sec->len, pool->separator, pool->separator_len);
+    sec->len += pool->separator_len;
+  }
+  *room = stage->capacity - sec->len;
+  return sec->data + sec->len;
+}
+
+/* len bytes have been written where stage_reserve pointed, unlocks the stage */
+void stage_commit(struct stage_pool* pool, size_t section, size_t len){
+  struct stage* stage = (struct stage*)pthread_getspecific(pool->key);
+
+  stage->active->sections[section].len += len;
+  stage->active->count++;
+  pthread_mutex_unlock(&stage->lock);
+}
+
+void stage_flush_self(struct stage_pool* pool){
+  struct stage* stage = __stage_self(pool, false);
+
+  if(stage)
+    __stage_flush(stage);
+}
+
+/* flush the stages of every thread, in no particular order */
+void stage_flush(struct stage_pool* pool){
+  struct stage* stage;
+
+  if(!atomic_load_explicit(&pool->ready, memory_order_acquire))
+    return;
+  pthread_mutex_lock(&pool->lock);
+  for(stage=pool->stages; stage; stage=stage->next)
+    __stage_flush(stage);
+  pthread_mutex_unlock(&pool->lock);
+}
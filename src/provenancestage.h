@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCESTAGE_H
+#define __PROVENANCESTAGE_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * Per-thread aggregation of serialised elements before they are handed to
+ * a user callback. Every thread appending to a pool gets its own stage: an
+ * active buffer it appends to and a spare one. Appending only takes the
+ * stage lock, which is uncontended unless a flush is swapping the buffers.
+ * A flush swaps the active and spare pointers and then emits the spare
+ * outside of the stage lock, so that the owner keeps appending while the
+ * callback runs. Callbacks of a pool are never run concurrently.
+ */
+#define STAGE_MAX_SECTIONS 10
+
+struct stage_section {
+  char* data;
+  size_t len;
+};
+
+struct stage_buffer {
+  struct stage_section sections[STAGE_MAX_SECTIONS];
+  size_t count; /* elements staged in all sections */
+};
+
+struct stage_pool;
+
+struct stage {
+  pthread_mutex_t lock;      /* owner appends, flush swaps */
+  pthread_mutex_t emit_lock; /* held while spare is emitted */
+  struct stage_buffer* active;
+  struct stage_buffer* spare;
+  size_t capacity;           /* of each section, fixed at creation */
+  struct stage_pool* pool;
+  struct stage* next;
+};
+
+struct stage_pool {
+  size_t nsections;
+  const char* separator;
+  size_t separator_len;
+  size_t capacity;           /* section capacity of stages created next */
+  /* assemble buf and hand it to stage_deliver, sink_lock is held */
+  void (*emit)(struct stage_pool* pool, const struct stage_buffer* buf);
+  void (*sink_str)(char* str);
+  void (*sink_iov)(const struct iovec* iov, int iovcnt);
+  _Atomic bool ready;
+  pthread_key_t key;
+  pthread_mutex_t lock;      /* key creation and stages list */
+  pthread_mutex_t sink_lock;
+  struct stage* stages;
+  char* scratch;             /* contiguous copy for sink_str */
+  size_t scratch_size;
+};
+
+#define STAGE_POOL_INIT(n, sep, capacity_, emit_) {\
+  .nsections = n,\
+  .separator = sep,\
+  .separator_len = sizeof(sep)-1,\
+  .capacity = capacity_,\
+  .emit = emit_,\
+  .lock = PTHREAD_MUTEX_INITIALIZER,\
+  .sink_lock = PTHREAD_MUTEX_INITIALIZER,\
+}
+
+int stage_pool_init(struct stage_pool* pool);
+void stage_set_capacity(struct stage_pool* pool, size_t capacity);
+int stage_append(struct stage_pool* pool, size_t section, const char* data, size_t len);
+char* stage_reserve(struct stage_pool* pool, size_t section, size_t len, size_t* room, bool* empty);
+void stage_commit(struct stage_pool* pool, size_t section, size_t len);
+void stage_flush_self(struct stage_pool* pool);
+void stage_flush(struct stage_pool* pool);
+void stage_deliver(struct stage_pool* pool, const struct iovec* iov, int iovcnt);
+
+#endif /* __PROVENANCESTAGE_H */
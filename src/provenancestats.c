@@ -0,0 +1,351 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "provenancestats.h"
+
+__thread struct stats_thread* stats_self_thread = NULL;
+
+static struct stats_thread* stats_threads = NULL;
+static struct stats_thread stats_retired; /* threads that exited */
+static struct stats_thread stats_discarded; /* shared by the threads that could not register */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static void __histogram_merge(struct stats_histogram* to, struct stats_histogram* from)
+{
+  size_t i;
+  uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+
+  stats_add(&to->count, atomic_load_explicit(&from->count, memory_order_relaxed));
+  stats_add(&to->sum, atomic_load_explicit(&from->sum, memory_order_relaxed));
+  if(max>atomic_load_explicit(&to->max, memory_order_relaxed))
+    atomic_store_explicit(&to->max, max, memory_order_relaxed);
+  for(i=0; i<PROV_HISTOGRAM_BUCKETS; i++)
+    stats_add(&to->buckets[i], atomic_load_explicit(&from->buckets[i], memory_order_relaxed));
+}
+
+/* must be called with stats_lock held, the retired block is only written then */
+static void __stats_merge(struct stats_thread* to, struct stats_thread* from)
+{
+  size_t i;
+
+  stats_add(&to->filtered, atomic_load_explicit(&from->filtered, memory_order_relaxed));
+  for(i=0; i<PROV_LOG_CALLBACKS; i++)
+    stats_add(&to->records[i], atomic_load_explicit(&from->records[i], memory_order_relaxed));
+  stats_add(&to->unknown, atomic_load_explicit(&from->unknown, memory_order_relaxed));
+  stats_add(&to->flushes, atomic_load_explicit(&from->flushes, memory_order_relaxed));
+  stats_add(&to->flushed_bytes, atomic_load_explicit(&from->flushed_bytes, memory_order_relaxed));
+  stats_add(&to->shed_packets, atomic_load_explicit(&from->shed_packets, memory_order_relaxed));
+  stats_add(&to->shed_relations, atomic_load_explicit(&from->shed_relations, memory_order_relaxed));
+  __histogram_merge(&to->callback, &from->callback);
+  __histogram_merge(&to->flush, &from->flush);
+}
+
+/*
+ * thread exit, the counters are kept in the retired total. Destructors
+ * running after this one, e.g. flushing a stage, register the thread again.
+ */
+static void __stats_destructor(void* arg)
+{
+  struct stats_thread* self = (struct stats_thread*)arg;
+  struct stats_thread** p;
+
+  stats_self_thread = NULL;
+  pthread_mutex_lock(&stats_lock);
+  for(p=&stats_threads; *p; p=&(*p)->next){
+    if(*p == self){
+      *p = self->next;
+      break;
+    }
+  }
+  __stats_merge(&stats_retired, self);
+  pthread_mutex_unlock(&stats_lock);
+  free(self);
+}
+
+static void __stats_init(void)
+{
+  pthread_key_create(&stats_key, __stats_destructor);
+}
+
+struct stats_thread* stats_thread_register(void)
+{
+  struct stats_thread* self;
+
+  pthread_once(&stats_once, __stats_init);
+  self = (struct stats_thread*)calloc(1, sizeof(struct stats_thread));
+  if(!self)
+    return &stats_discarded;
+  pthread_mutex_lock(&stats_lock);
+  self->next = stats_threads;
+  stats_threads = self;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key, self);
+  stats_self_thread = self;
+  return self;
+}
+
+void stats_histogram_sum(struct stats_histogram* h, struct prov_histogram* out)
+{
+  size_t i;
+  uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+
+  out->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+  out->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+  if(max>out->max)
+    out->max = max;
+  for(i=0; i<PROV_HISTOGRAM_BUCKETS; i++)
+    out->buckets[i] += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+}
+
+static void __stats_sum(struct stats_thread* from, struct prov_relay_stats* stats)
+{
+  size_t i;
+
+  stats->filtered += atomic_load_explicit(&from->filtered, memory_order_relaxed);
+  for(i=0; i<PROV_LOG_CALLBACKS; i++)
+    stats->records[i] += atomic_load_explicit(&from->records[i], memory_order_relaxed);
+  stats->unknown += atomic_load_explicit(&from->unknown, memory_order_relaxed);
+  stats->flushes += atomic_load_explicit(&from->flushes, memory_order_relaxed);
+  stats->flushed_bytes += atomic_load_explicit(&from->flushed_bytes, memory_order_relaxed);
+  stats->shed_packets += atomic_load_explicit(&from->shed_packets, memory_order_relaxed);
+  stats->shed_relations += atomic_load_explicit(&from->shed_relations, memory_order_relaxed);
+  stats_histogram_sum(&from->callback, &stats->callback);
+  stats_histogram_sum(&from->flush, &stats->flush);
+}
+
+void stats_collect(struct prov_relay_stats* stats)
+{
+  struct stats_thread* t;
+
+  pthread_mutex_lock(&stats_lock);
+  for(t=stats_threads; t; t=t->next)
+    __stats_sum(t, stats);
+  __stats_sum(&stats_retired, stats);
+  __stats_sum(&stats_discarded, stats);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+uint64_t provenance_histogram_lower(size_t bucket)
+{
+  if(bucket<4)
+    return bucket;
+  if(bucket>PROV_HISTOGRAM_BUCKETS)
+    return UINT64_MAX;
+  return (4ULL+bucket%4) << (bucket/4-1);
+}
+
+uint64_t provenance_histogram_percentile(const struct prov_histogram* h, double p)
+{
+  uint64_t rank;
+  uint64_t seen = 0;
+  uint64_t upper;
+  size_t i;
+
+  if(h->count==0)
+    return 0;
+  rank = (uint64_t)(h->count*p/100.0);
+  if(rank>=h->count)
+    rank = h->count-1;
+  for(i=0; i<PROV_HISTOGRAM_BUCKETS; i++){
+    seen += h->buckets[i];
+    if(seen>rank)
+      break;
+  }
+  if(i>=PROV_HISTOGRAM_BUCKETS-1)
+    return h->max;
+  upper = provenance_histogram_lower(i+1)-1;
+  return upper<h->max ? upper : h->max;
+}
+
+/* Prometheus text exposition */
+
+struct metrics_buffer {
+  char* buf;
+  size_t len;
+  size_t off; /* as snprintf, keeps counting once buf is full */
+};
+
+static void __metrics_printf(struct metrics_buffer* m, const char* fmt, ...)
+{
+  va_list args;
+  int rc;
+
+  va_start(args, fmt);
+  rc = vsnprintf(m->off<m->len ? m->buf+m->off : NULL, m->off<m->len ? m->len-m->off : 0, fmt, args);
+  va_end(args);
+  if(rc>0)
+    m->off += rc;
+}
+
+static inline void __metrics_header(struct metrics_buffer* m, const char* name, const char* type, const char* help)
+{
+  __metrics_printf(m, "# HELP provenance_%s %s\n# TYPE provenance_%s %s\n", name, help, name, type);
+}
+
+static void __metrics_value(struct metrics_buffer* m, const char* name, const char* type, const char* help, uint64_t v)
+{
+  __metrics_header(m, name, type, help);
+  __metrics_printf(m, "provenance_%s %llu\n", name, (unsigned long long)v);
+}
+
+/* buckets are aggregated per power of two, from about 1us to 9min */
+#define METRICS_FIRST_OCTAVE 10
+#define METRICS_LAST_OCTAVE  39
+
+static void __metrics_histogram(struct metrics_buffer* m, const char* name, const char* help, const struct prov_histogram* h)
+{
+  uint64_t cumulative = 0;
+  size_t bucket = 0;
+  int e;
+
+  __metrics_header(m, name, "histogram", help);
+  for(e=METRICS_FIRST_OCTAVE; e<=METRICS_LAST_OCTAVE; e++){
+    /* values below 2^e ns are in the buckets below (e-1)*4 */
+    for(; bucket<(e-1)*4; bucket++)
+      cumulative += h->buckets[bucket];
+    __metrics_printf(m, "provenance_%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ULL<<e)/1e9, (unsigned long long)cumulative);
+  }
+  __metrics_printf(m, "provenance_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+  __metrics_printf(m, "provenance_%s_sum %.9f\n", name, (double)h->sum/1e9);
+  __metrics_printf(m, "provenance_%s_count %llu\n", name, (unsigned long long)h->count);
+}
+
+#define METRICS_CHANNELS 512 /* entries first asked for, doubled until every channel fits */
+
+#define channel_offset(field) offsetof(struct prov_channel_stats, field)
+
+static void __metrics_channels(struct metrics_buffer* m, const char* name, const char* help,
+                               const struct prov_channel_stats* channels, int n, size_t offset)
+{
+  int i;
+
+  __metrics_header(m, name, "counter", help);
+  for(i=0; i<n; i++)
+    __metrics_printf(m, "provenance_%s{cpu=\"%u\",channel=\"%s\"} %llu\n", name, channels[i].cpu,
+                     channels[i].is_long ? "long_provenance" : "provenance",
+                     (unsigned long long)*(const uint64_t*)((const char*)&channels[i]+offset));
+}
+
+static const char* log_names[PROV_LOG_CALLBACKS] = {
+  [PROV_LOG_DERIVED] = "derived",
+  [PROV_LOG_GENERATED] = "generated",
+  [PROV_LOG_USED] = "used",
+  [PROV_LOG_INFORMED] = "informed",
+  [PROV_LOG_INFLUENCED] = "influenced",
+  [PROV_LOG_ASSOCIATED] = "associated",
+  [PROV_LOG_PROC] = "proc",
+  [PROV_LOG_TASK] = "task",
+  [PROV_LOG_INODE] = "inode",
+  [PROV_LOG_STR] = "str",
+  [PROV_LOG_ACT_DISC] = "act_disc",
+  [PROV_LOG_AGT_DISC] = "agt_disc",
+  [PROV_LOG_ENT_DISC] = "ent_disc",
+  [PROV_LOG_MSG] = "msg",
+  [PROV_LOG_SHM] = "shm",
+  [PROV_LOG_PACKET] = "packet",
+  [PROV_LOG_ADDRESS] = "address",
+  [PROV_LOG_FILE_NAME] = "file_name",
+  [PROV_LOG_IATTR] = "iattr",
+  [PROV_LOG_XATTR] = "xattr",
+  [PROV_LOG_PACKET_CONTENT] = "packet_content",
+  [PROV_LOG_ARG] = "arg",
+  [PROV_LOG_MACHINE] = "machine",
+};
+
+/**
+ * @brief Formats the relay statistics in the Prometheus text format.
+ *
+ * Channel counters are labelled with the cpu and the relay channel name.
+ * The kernel drop counters are reported next to the userspace ones: drops
+ * growing while the ring overflows or the drain latency grow point at the
+ * callbacks not keeping up.
+ */
+int provenance_relay_metrics(char* buf, size_t len)
+{
+  struct metrics_buffer m = { .buf = buf, .len = len, .off = 0 };
+  struct prov_relay_stats* stats;
+  struct prov_channel_stats* channels = NULL;
+  struct prov_channel_stats* tmp;
+  size_t size = METRICS_CHANNELS/2;
+  int n;
+  int i;
+
+  stats = (struct prov_relay_stats*)calloc(1, sizeof(struct prov_relay_stats));
+  if(!stats)
+    return -1;
+  do{
+    size *= 2;
+    tmp = (struct prov_channel_stats*)realloc(channels, size*sizeof(struct prov_channel_stats));
+    if(!tmp){
+      free(stats);
+      free(channels);
+      return -1;
+    }
+    channels = tmp;
+    n = provenance_relay_stats(stats, channels, size);
+  }while((size_t)n==size); // it returns at most size, there may be more
+
+  __metrics_channels(&m, "relay_elements_total", "Elements read from the relay channels.", channels, n, channel_offset(elements));
+  __metrics_channels(&m, "relay_bytes_total", "Bytes read from the relay channels.", channels, n, channel_offset(bytes));
+  __metrics_channels(&m, "relay_reads_total", "Read calls on the relay channels.", channels, n, channel_offset(reads));
+  __metrics_channels(&m, "relay_eagain_total", "Relay reads retried on EAGAIN.", channels, n, channel_offset(eagain));
+  __metrics_channels(&m, "relay_errors_total", "Relay reads that failed.", channels, n, channel_offset(errors));
+  __metrics_channels(&m, "relay_ring_overflows_total", "Times a pipeline ring was found full.", channels, n, channel_offset(overflows));
+  __metrics_histogram(&m, "relay_drain_seconds", "Time spent draining a relay channel that had data.", &stats->drain);
+
+  __metrics_value(&m, "filtered_total", "counter", "Elements discarded by the filters.", stats->filtered);
+  __metrics_header(&m, "records_total", "counter", "Elements handed to the log callbacks, per callback.");
+  for(i=0; i<PROV_LOG_CALLBACKS; i++)
+    __metrics_printf(&m, "provenance_records_total{callback=\"%s\"} %llu\n", log_names[i], (unsigned long long)stats->records[i]);
+  __metrics_value(&m, "unknown_total", "counter", "Elements of unknown type.", stats->unknown);
+  __metrics_histogram(&m, "callback_seconds", "Time spent in the callbacks per chunk read.", &stats->callback);
+
+  __metrics_value(&m, "flushes_total", "counter", "Staged buffers handed to the output callbacks.", stats->flushes);
+  __metrics_value(&m, "flushed_bytes_total", "counter", "Bytes handed to the output callbacks.", stats->flushed_bytes);
+  __metrics_histogram(&m, "flush_seconds", "Time spent in the output callbacks per flush.", &stats->flush);
+
+  __metrics_value(&m, "name_cache_entries", "gauge", "File names cached.", stats->names.entries);
+  __metrics_value(&m, "name_cache_bytes", "gauge", "Memory used by the cached file names.", stats->names.bytes);
+  __metrics_value(&m, "name_cache_capacity_bytes", "gauge", "Memory cap of the file name cache.", stats->names.capacity);
+  __metrics_value(&m, "name_cache_hits_total", "counter", "File name lookups that hit.", stats->names.hits);
+  __metrics_value(&m, "name_cache_misses_total", "counter", "File name lookups that missed.", stats->names.misses);
+  __metrics_value(&m, "name_cache_evictions_total", "counter", "File names evicted.", stats->names.evictions);
+  __metrics_value(&m, "name_parked_total", "counter", "Nodes parked until their file name arrives.", stats->parked);
+  __metrics_value(&m, "name_released_total", "counter", "Parked nodes recorded once their name arrived.", stats->released);
+  __metrics_value(&m, "name_expired_total", "counter", "Parked nodes recorded without their name.", stats->expired);
+  __metrics_value(&m, "relations_coalesced_total", "counter", "Relations merged into an identical one recorded.", stats->coalesced);
+  __metrics_value(&m, "overload_level", "gauge", "Overload control level, 0 when no load is shed.", stats->overload);
+  __metrics_value(&m, "shed_packet_content_total", "counter", "Packet contents dropped under overload.", stats->shed_packets);
+  __metrics_value(&m, "shed_relations_total", "counter", "Relations sampled out under overload.", stats->shed_relations);
+
+  if(stats->kernel){
+    __metrics_header(&m, "kernel_dropped_total", "counter", "Elements dropped by the kernel, relay buffers full.");
+    __metrics_printf(&m, "provenance_kernel_dropped_total{channel=\"provenance\"} %llu\n", (unsigned long long)stats->kernel_dropped);
+    __metrics_printf(&m, "provenance_kernel_dropped_total{channel=\"long_provenance\"} %llu\n", (unsigned long long)stats->kernel_long_dropped);
+  }
+
+  free(stats);
+  free(channels);
+  return m.off;
+}
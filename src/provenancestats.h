@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __PROVENANCESTATS_H
+#define __PROVENANCESTATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "provenance.h"
+
+/*
+ * Instrumentation of the relay pipeline. Counters and histograms have a
+ * single writer, a thread or the reader of a channel, and are updated with
+ * relaxed loads and stores rather than atomic additions; readers sum them
+ * concurrently, see provenance_relay_stats. Each thread updating per thread
+ * counters registers a stats_thread, whose values are folded into a
+ * retired total when the thread exits.
+ */
+struct stats_histogram {
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+  _Atomic uint64_t buckets[PROV_HISTOGRAM_BUCKETS];
+};
+
+struct stats_thread {
+  _Atomic uint64_t filtered;
+  _Atomic uint64_t records[PROV_LOG_CALLBACKS];
+  _Atomic uint64_t unknown;
+  _Atomic uint64_t flushes;
+  _Atomic uint64_t flushed_bytes;
+  _Atomic uint64_t shed_packets;
+  _Atomic uint64_t shed_relations;
+  struct stats_histogram callback;
+  struct stats_histogram flush;
+  struct stats_thread* next;
+};
+
+/* per channel, written by the thread draining the channel */
+struct stats_channel {
+  _Atomic uint64_t elements;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t reads;
+  _Atomic uint64_t eagain;
+  _Atomic uint64_t errors;
+  struct stats_histogram drain;
+};
+
+extern __thread struct stats_thread* stats_self_thread;
+
+struct stats_thread* stats_thread_register(void);
+
+/* never NULL, a thread that could not register updates the shared discarded block */
+static inline struct stats_thread* stats_self(void)
+{
+  if(__builtin_expect(stats_self_thread!=NULL, 1))
+    return stats_self_thread;
+  return stats_thread_register();
+}
+
+/*
+ * only the owner of the counter may call this, threads that could not
+ * register share the discarded block and add atomically
+ */
+static inline void stats_add(_Atomic uint64_t* counter, uint64_t v)
+{
+  if(__builtin_expect(stats_self_thread!=NULL, 1))
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed)+v, memory_order_relaxed);
+  else
+    atomic_fetch_add_explicit(counter, v, memory_order_relaxed);
+}
+
+static inline uint64_t stats_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
+static inline size_t stats_bucket(uint64_t ns)
+{
+  int e;
+
+  if(ns<4)
+    return ns;
+  e = 63-__builtin_clzll(ns);
+  if(e>=40) /* from 2^40 ns, about 18 minutes, everything is in the last bucket */
+    return PROV_HISTOGRAM_BUCKETS-1;
+  return (e-1)*4 + ((ns>>(e-2))&3);
+}
+
+static inline void stats_record(struct stats_histogram* h, uint64_t ns)
+{
+  stats_add(&h->count, 1);
+  stats_add(&h->sum, ns);
+  stats_add(&h->buckets[stats_bucket(ns)], 1);
+  if(ns>atomic_load_explicit(&h->max, memory_order_relaxed))
+    atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+}
+
+/* adds the histogram values to out */
+void stats_histogram_sum(struct stats_histogram* h, struct prov_histogram* out);
+/* adds the per thread counters of every thread to stats */
+void stats_collect(struct prov_relay_stats* stats);
+
+#endif /* __PROVENANCESTATS_H */
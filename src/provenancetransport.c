@@ -0,0 +1,1549 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/provenance_types.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#include "provenance.h"
+#include "provenanceBinary.h"
+#include "provenancetransport.h"
+
+/*
+ * Every message is a 16 bytes little endian header: payload length on 32
+ * bits, type, flags, version, a zero byte and a sequence number on 64 bits,
+ * followed by the payload.
+ * - HELLO, sent first by the sender: magic, stream kind, three zero bytes,
+ *   machine_id, boot_id and stream_id, seq is the oldest frame still held;
+ * - WELCOME, the answer: seq is the frame expected next, 0 for a stream the
+ *   receiver does not know;
+ * - DATA: frame seq, frames are numbered from 1;
+ * - ACK: every frame up to seq has been delivered.
+ */
+#define T_MAGIC     "CFPT"
+#define T_VERSION   1
+#define T_HEADER    16
+#define T_HELLO_LEN 24
+
+#define T_HELLO   0
+#define T_WELCOME 1
+#define T_DATA    2
+#define T_ACK     3
+
+#define T_PARTIAL 0x1 /* the payload does not start at a write boundary */
+
+#define T_POLL_INTERVAL 100 /* ms */
+#define T_BACKOFF_MIN   100 /* ms */
+
+struct theader {
+  uint32_t length;
+  uint8_t type;
+  uint8_t flags;
+  uint8_t version;
+  uint64_t seq;
+};
+
+struct thello {
+  uint32_t kind;
+  uint32_t machine_id;
+  uint32_t boot_id;
+  uint64_t stream_id;
+};
+
+static void header_encode(uint8_t* p, uint32_t length, uint8_t type, uint8_t flags, uint64_t seq){
+  uint32_t l = htole32(length);
+  uint64_t s = htole64(seq);
+
+  memcpy(p, &l, sizeof(uint32_t));
+  p[4] = type;
+  p[5] = flags;
+  p[6] = T_VERSION;
+  p[7] = 0;
+  memcpy(p + 8, &s, sizeof(uint64_t));
+}
+
+static void header_decode(const uint8_t* p, struct theader* h){
+  uint32_t l;
+  uint64_t s;
+
+  memcpy(&l, p, sizeof(uint32_t));
+  memcpy(&s, p + 8, sizeof(uint64_t));
+  h->length = le32toh(l);
+  h->type = p[4];
+  h->flags = p[5];
+  h->version = p[6];
+  h->seq = le64toh(s);
+}
+
+static void hello_encode(uint8_t* p, const struct thello* hello){
+  uint32_t machine_id = htole32(hello->machine_id);
+  uint32_t boot_id = htole32(hello->boot_id);
+  uint64_t stream_id = htole64(hello->stream_id);
+
+  memcpy(p, T_MAGIC, 4);
+  p[4] = (uint8_t)hello->kind;
+  memset(p + 5, 0, 3);
+  memcpy(p + 8, &machine_id, sizeof(uint32_t));
+  memcpy(p + 12, &boot_id, sizeof(uint32_t));
+  memcpy(p + 16, &stream_id, sizeof(uint64_t));
+}
+
+static int hello_decode(const uint8_t* p, struct thello* hello){
+  uint32_t machine_id;
+  uint32_t boot_id;
+  uint64_t stream_id;
+
+  if(memcmp(p, T_MAGIC, 4) || p[4] > PROV_TRANSPORT_RAW)
+    return -EINVAL;
+  memcpy(&machine_id, p + 8, sizeof(uint32_t));
+  memcpy(&boot_id, p + 12, sizeof(uint32_t));
+  memcpy(&stream_id, p + 16, sizeof(uint64_t));
+  hello->kind = p[4];
+  hello->machine_id = le32toh(machine_id);
+  hello->boot_id = le32toh(boot_id);
+  hello->stream_id = le64toh(stream_id);
+  return 0;
+}
+
+static inline uint64_t t_now(void){
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* absolute CLOCK_REALTIME time ms from now, for pthread_cond_timedwait */
+static void t_deadline(struct timespec* t, uint32_t ms){
+  clock_gettime(CLOCK_REALTIME, t);
+  t->tv_sec += ms / 1000;
+  t->tv_nsec += (ms % 1000) * 1000000L;
+  if(t->tv_nsec >= 1000000000L){
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000L;
+  }
+}
+
+static inline bool t_before(const struct timespec* a, const struct timespec* b){
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static int conf_init(struct prov_transport_conf* out, const struct prov_transport_conf* conf){
+  if(conf)
+    memcpy(out, conf, sizeof(struct prov_transport_conf));
+  else
+    memset(out, 0, sizeof(struct prov_transport_conf));
+  if(!out->frame_size)
+    out->frame_size = PROV_TRANSPORT_FRAME_SIZE;
+  if(!out->frames)
+    out->frames = PROV_TRANSPORT_FRAMES;
+  if(!out->flush_interval)
+    out->flush_interval = PROV_TRANSPORT_FLUSH_INTERVAL;
+  if(!out->reconnect_max)
+    out->reconnect_max = PROV_TRANSPORT_RECONNECT_MAX;
+  if(!out->timeout)
+    out->timeout = PROV_TRANSPORT_TIMEOUT;
+  if(!out->connections)
+    out->connections = PROV_TRANSPORT_CONNECTIONS;
+  if(out->kind > PROV_TRANSPORT_RAW || out->policy > PROV_TRANSPORT_DROP
+     || out->frames < 2 || out->frame_size > UINT32_MAX)
+    return -EINVAL;
+#ifndef HAVE_OPENSSL
+  if(out->tls)
+    return -ENOTSUP;
+#endif
+  return 0;
+}
+
+/* a TCP connection, TLS being layered on it if ssl is set */
+struct tconn {
+  int fd;
+#ifdef HAVE_OPENSSL
+  SSL* ssl;
+#endif
+};
+
+#ifdef HAVE_OPENSSL
+/* errno of a failed TLS call, EAGAIN when it needs the socket to be ready */
+static ssize_t tls_error(struct tconn* c, int rc){
+  switch(SSL_get_error(c->ssl, rc)){
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      errno = EAGAIN;
+      break;
+    case SSL_ERROR_SYSCALL:
+      if(errno == 0)
+        errno = ECONNRESET;
+      break;
+    default:
+      errno = EPROTO;
+  }
+  ERR_clear_error();
+  return -1;
+}
+
+static SSL_CTX* tls_context(const struct prov_transport_conf* conf, bool server){
+  SSL_CTX* ctx;
+
+  if(server && (!conf->tls_cert || !conf->tls_key))
+    return NULL;
+  ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+  if(!ctx)
+    return NULL;
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  // frames are resent from where they are, partially written or not
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  if(conf->tls_cert && SSL_CTX_use_certificate_chain_file(ctx, conf->tls_cert) != 1)
+    goto err;
+  if(conf->tls_key && SSL_CTX_use_PrivateKey_file(ctx, conf->tls_key, SSL_FILETYPE_PEM) != 1)
+    goto err;
+  if(conf->tls_ca){
+    if(SSL_CTX_load_verify_locations(ctx, conf->tls_ca, NULL) != 1)
+      goto err;
+    SSL_CTX_set_verify(ctx, server ? SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT : SSL_VERIFY_PEER, NULL);
+  }
+  return ctx;
+err:
+  ERR_clear_error();
+  SSL_CTX_free(ctx);
+  return NULL;
+}
+
+/* blocking handshake, the receiver certificate must match name if the sender verifies it */
+static int tls_handshake(struct tconn* c, SSL_CTX* ctx, const char* name){
+  int rc;
+
+  c->ssl = SSL_new(ctx);
+  if(!c->ssl)
+    return -1;
+  SSL_set_fd(c->ssl, c->fd);
+  if(name){
+    SSL_set_tlsext_host_name(c->ssl, name);
+    SSL_set1_host(c->ssl, name);
+    rc = SSL_connect(c->ssl);
+  }else
+    rc = SSL_accept(c->ssl);
+  if(rc != 1){
+    ERR_clear_error();
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* SSL_write uses write, without MSG_NOSIGNAL, a closed peer must not kill the process */
+static void tls_block_sigpipe(sigset_t* old){
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, old);
+}
+#endif
+
+static void conn_close(struct tconn* c){
+#ifdef HAVE_OPENSSL
+  const struct timespec now = {0, 0};
+  sigset_t pipe;
+  sigset_t old;
+
+  if(c->ssl){
+    // may be called from any thread, consume the signal it raises
+    tls_block_sigpipe(&old);
+    SSL_shutdown(c->ssl);
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    if(!sigismember(&old, SIGPIPE))
+      sigtimedwait(&pipe, NULL, &now);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+    ERR_clear_error();
+  }
+#endif
+  if(c->fd >= 0)
+    close(c->fd);
+  c->fd = -1;
+}
+
+/* returns the bytes sent, or -1 with errno set, EAGAIN if the socket is full */
+static ssize_t conn_send(struct tconn* c, const struct iovec* iov, int iovcnt){
+  struct msghdr msg;
+#ifdef HAVE_OPENSSL
+  int i;
+  int rc;
+
+  if(c->ssl){
+    for(i=0; i<iovcnt && iov[i].iov_len == 0; i++);
+    if(i == iovcnt)
+      return 0;
+    rc = SSL_write(c->ssl, iov[i].iov_base, iov[i].iov_len);
+    return rc > 0 ? rc : tls_error(c, rc);
+  }
+#endif
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovcnt;
+  return sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+}
+
+/* returns the bytes received, 0 once the peer closed, or -1 with errno set */
+static ssize_t conn_recv(struct tconn* c, void* buf, size_t len){
+#ifdef HAVE_OPENSSL
+  int rc;
+
+  if(c->ssl){
+    rc = SSL_read(c->ssl, buf, len);
+    if(rc > 0)
+      return rc;
+    if(SSL_get_error(c->ssl, rc) == SSL_ERROR_ZERO_RETURN)
+      return 0;
+    return tls_error(c, rc);
+  }
+#endif
+  return recv(c->fd, buf, len, 0);
+}
+
+/* blocking socket, fails on timeout */
+static int conn_send_all(struct tconn* c, const void* buf, size_t len){
+  struct iovec iov;
+  ssize_t n;
+
+  while(len > 0){
+    iov.iov_base = (void*)buf;
+    iov.iov_len = len;
+    n = conn_send(c, &iov, 1);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    buf = (const uint8_t*)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int conn_recv_all(struct tconn* c, void* buf, size_t len){
+  ssize_t n;
+
+  while(len > 0){
+    n = conn_recv(c, buf, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return -1;
+    buf = (uint8_t*)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+static inline void eventfd_signal(int fd){
+  uint64_t one = 1;
+
+  if(write(fd, &one, sizeof(uint64_t)) < 0)
+    return; // the counter is full, it is readable anyway
+}
+
+static int set_blocking(int fd, bool blocking){
+  int flags = fcntl(fd, F_GETFL);
+
+  if(flags < 0)
+    return -1;
+  flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+  return fcntl(fd, F_SETFL, flags);
+}
+
+/* no delay, keepalive, and ms to wait for a blocking send or receive, 0 for ever */
+static void set_socket_options(int fd, uint32_t timeout){
+  struct timeval tv;
+  int one = 1;
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(int));
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(struct timeval));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(struct timeval));
+}
+
+/*
+ * Sender.
+ * Frames form a ring indexed by sequence number: those from t_acked up to
+ * t_queued, excluded, are complete and wait to be acknowledged, t_queued
+ * is being filled by writers. Complete frames are only read by the sender
+ * thread, which alone moves t_acked, writers only touch the frame being
+ * filled.
+ */
+struct tframe {
+  uint8_t* data;
+  size_t len;
+  bool partial; /* starts in the middle of a write */
+};
+
+static pthread_mutex_t t_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t t_room = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t t_done = PTHREAD_COND_INITIALIZER;
+static struct tframe* frames;
+static uint8_t* t_area; /* data of all the frames, one mapping */
+static size_t t_nframes;
+static uint64_t t_acked;
+static uint64_t t_queued;
+static uint64_t t_filling_since; /* ms, first write to the frame being filled */
+static bool t_running;
+static bool t_stopping; /* closing, acknowledgements are waited for */
+static bool t_abandon; /* closing, the sender thread exits */
+static pthread_t t_thread;
+static int t_wake = -1; /* eventfd, frames were queued or closing */
+static bool t_hurry; /* writers wait until t_hurry_deadline at the latest */
+static struct timespec t_hurry_deadline;
+static struct prov_transport_stats t_stats;
+
+static struct prov_transport_conf t_conf;
+static char* t_host;
+static char* t_port;
+static char* t_server_name;
+static uint64_t t_stream_id;
+#ifdef HAVE_OPENSSL
+static SSL_CTX* t_tls;
+#endif
+
+/* state of the sender thread */
+struct tsender {
+  struct tconn c;
+  uint64_t sent; /* next frame to send */
+  uint64_t sent_max; /* frames below it were sent before, counted as resent */
+  uint64_t last_ack; /* ms, acknowledgements last progressed */
+  bool sending; /* frame sent is partially written */
+  size_t off; /* of frame sent, header included */
+  uint8_t header[T_HEADER];
+  uint8_t ack[T_HEADER]; /* acknowledgement partially read */
+  size_t ack_len;
+};
+
+static inline void t_wakeup(void){
+  eventfd_signal(t_wake);
+}
+
+/* t_lock held */
+static inline struct tframe* __transport_filling(void){
+  return &frames[t_queued % t_nframes];
+}
+
+/* t_lock held, frames neither waiting for an acknowledgement nor being filled */
+static inline size_t __transport_free(void){
+  return t_nframes - 1 - (t_queued - t_acked);
+}
+
+/* t_lock held, total bytes can be copied without waiting */
+static inline bool __transport_fits(size_t total){
+  return total <= t_conf.frame_size - __transport_filling()->len + __transport_free() * t_conf.frame_size;
+}
+
+/* t_lock held, queue the frame being filled, there must be a free frame */
+static void __transport_queue(void){
+  struct tframe* f;
+
+  t_queued++;
+  f = __transport_filling();
+  f->len = 0;
+  f->partial = false;
+  t_wakeup();
+}
+
+/* t_lock held, every frame up to seq was delivered */
+static void __transport_acked(struct tsender* s, uint64_t seq){
+  if(seq < t_acked || seq >= s->sent)
+    return;
+  t_stats.frames += seq + 1 - t_acked;
+  t_acked = seq + 1;
+  s->last_ack = t_now();
+  // writers only queue a full frame if there is room
+  if(__transport_filling()->len == t_conf.frame_size && __transport_free() > 0)
+    __transport_queue();
+  pthread_cond_broadcast(&t_room);
+  pthread_cond_broadcast(&t_done);
+}
+
+static bool transport_done(void){
+  bool done;
+
+  pthread_mutex_lock(&t_lock);
+  done = t_abandon || (t_stopping && t_acked == t_queued);
+  pthread_mutex_unlock(&t_lock);
+  return done;
+}
+
+/* blocks for up to ms, or until t_wake is written to */
+static void transport_sleep(uint32_t ms){
+  struct pollfd pfd = { .fd = t_wake, .events = POLLIN };
+  uint64_t v;
+
+  if(poll(&pfd, 1, ms) > 0 && read(t_wake, &v, sizeof(uint64_t)) < 0)
+    return;
+}
+
+/* connected socket to the first address of host that answers within timeout ms */
+static int tcp_connect(const char* host, const char* port, uint32_t timeout){
+  struct addrinfo hints;
+  struct addrinfo* res;
+  struct addrinfo* ai;
+  struct pollfd pfd;
+  socklen_t len;
+  uint64_t end;
+  int err;
+  int fd = -1;
+  int rc;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(host, port, &hints, &res))
+    return -1;
+  for(ai=res; ai; ai=ai->ai_next){
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if(fd < 0)
+      continue;
+    if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    if(errno == EINPROGRESS){
+      // in slices, so that closing does not wait for the timeout
+      end = t_now() + timeout;
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      do{
+        rc = poll(&pfd, 1, T_POLL_INTERVAL);
+      }while(rc == 0 && t_now() < end && !transport_done());
+      len = sizeof(int);
+      if(rc > 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+        break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+/**
+ * @brief Connects to the receiver and agrees on where to resume.
+ *
+ * The handshake is made on a blocking socket, with timeout. The receiver
+ * answers the frame it expects next: frames before it are acknowledged,
+ * sending resumes from it, or from the oldest frame held if the receiver
+ * does not know the stream. A receiver expecting a frame not queued yet is
+ * refused.
+ *
+ * @param s state of the sender thread, s->c is connected on success
+ * @return 0 on success, -1 on failure
+ */
+static int transport_open(struct tsender* s){
+  uint8_t msg[T_HEADER + T_HELLO_LEN];
+  struct thello hello;
+  struct theader h;
+  uint64_t next;
+
+  s->c.fd = tcp_connect(t_host, t_port, t_conf.timeout);
+  if(s->c.fd < 0)
+    return -1;
+  if(set_blocking(s->c.fd, true) < 0)
+    goto fail;
+  set_socket_options(s->c.fd, t_conf.timeout);
+#ifdef HAVE_OPENSSL
+  if(t_tls && tls_handshake(&s->c, t_tls, t_server_name) < 0)
+    goto fail;
+#endif
+
+  hello.kind = t_conf.kind;
+  hello.machine_id = t_conf.machine_id;
+  hello.boot_id = t_conf.boot_id;
+  hello.stream_id = t_stream_id;
+  header_encode(msg, T_HELLO_LEN, T_HELLO, 0, t_acked);
+  hello_encode(msg + T_HEADER, &hello);
+  if(conn_send_all(&s->c, msg, sizeof(msg)) < 0)
+    goto fail;
+  if(conn_recv_all(&s->c, msg, T_HEADER) < 0)
+    goto fail;
+  header_decode(msg, &h);
+  if(h.type != T_WELCOME || h.version != T_VERSION || h.length != 0)
+    goto fail;
+  if(set_blocking(s->c.fd, false) < 0)
+    goto fail;
+
+  pthread_mutex_lock(&t_lock);
+  next = h.seq;
+  if(next > t_queued){ // frames never sent would be taken as delivered
+    pthread_mutex_unlock(&t_lock);
+    goto fail;
+  }
+  if(next < t_acked) // a receiver that lost track of the stream
+    next = t_acked;
+  s->sent = next;
+  if(next > 0)
+    __transport_acked(s, next - 1);
+  if(s->sent_max < next)
+    s->sent_max = next;
+  s->sending = false;
+  s->ack_len = 0;
+  s->last_ack = t_now();
+  t_stats.connects++;
+  t_stats.connected = true;
+  pthread_mutex_unlock(&t_lock);
+  return 0;
+fail:
+  conn_close(&s->c);
+  return -1;
+}
+
+/* sends frames until the socket is full or every complete frame was sent */
+static int transport_send(struct tsender* s){
+  struct iovec iov[2];
+  struct tframe* f;
+  size_t len;
+  ssize_t n;
+  int cnt;
+
+  for(;;){
+    pthread_mutex_lock(&t_lock);
+    if(s->sent >= t_queued){
+      pthread_mutex_unlock(&t_lock);
+      return 0;
+    }
+    f = &frames[s->sent % t_nframes];
+    len = f->len;
+    if(!s->sending){
+      header_encode(s->header, len, T_DATA, f->partial ? T_PARTIAL : 0, s->sent);
+      s->sending = true;
+      s->off = 0;
+      if(s->sent < s->sent_max)
+        t_stats.resent++;
+      if(t_acked == s->sent) // nothing in flight, the acknowledgement is waited for from now
+        s->last_ack = t_now();
+    }
+    pthread_mutex_unlock(&t_lock);
+
+    cnt = 0;
+    if(s->off < T_HEADER){
+      iov[cnt].iov_base = s->header + s->off;
+      iov[cnt++].iov_len = T_HEADER - s->off;
+      iov[cnt].iov_base = f->data;
+      iov[cnt++].iov_len = len;
+    }else{
+      iov[cnt].iov_base = f->data + (s->off - T_HEADER);
+      iov[cnt++].iov_len = len - (s->off - T_HEADER);
+    }
+    n = conn_send(&s->c, iov, cnt);
+    if(n < 0)
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    s->off += n;
+    if(s->off < T_HEADER + len)
+      continue;
+    s->sending = false;
+    pthread_mutex_lock(&t_lock);
+    t_stats.bytes_out += len;
+    s->sent++;
+    if(s->sent_max < s->sent)
+      s->sent_max = s->sent;
+    pthread_mutex_unlock(&t_lock);
+  }
+}
+
+/* reads the acknowledgements available */
+static int transport_receive(struct tsender* s){
+  struct theader h;
+  ssize_t n;
+
+  for(;;){
+    n = conn_recv(&s->c, s->ack + s->ack_len, T_HEADER - s->ack_len);
+    if(n == 0)
+      return -1;
+    if(n < 0)
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    s->ack_len += n;
+    if(s->ack_len < T_HEADER)
+      continue;
+    s->ack_len = 0;
+    header_decode(s->ack, &h);
+    if(h.type != T_ACK || h.length != 0)
+      return -1;
+    pthread_mutex_lock(&t_lock);
+    __transport_acked(s, h.seq);
+    pthread_mutex_unlock(&t_lock);
+  }
+}
+
+/**
+ * @brief Loop of the sender thread.
+ *
+ * Connects, with exponential backoff up to reconnect_max ms, then sends
+ * the complete frames while reading acknowledgements. A partially filled
+ * frame is queued once flush_interval ms old. The connection is dropped
+ * and made again on error, or when frames have been waiting timeout ms for
+ * an acknowledgement; unacknowledged frames are then resent.
+ */
+static void* transport_thread(void* arg){
+  struct tsender s;
+  struct pollfd pfd[2];
+  struct tframe* f;
+  uint32_t backoff = 0;
+  uint64_t v;
+  bool pending;
+  bool inflight;
+
+#ifdef HAVE_OPENSSL
+  tls_block_sigpipe(NULL);
+#endif
+  memset(&s, 0, sizeof(struct tsender));
+  s.c.fd = -1;
+  for(;;){
+    if(s.c.fd < 0){
+      if(transport_done())
+        break;
+      if(backoff)
+        transport_sleep(backoff);
+      if(transport_done())
+        break;
+      if(transport_open(&s) < 0){
+        backoff = backoff ? 2 * backoff : T_BACKOFF_MIN;
+        if(backoff > t_conf.reconnect_max)
+          backoff = t_conf.reconnect_max;
+        continue;
+      }
+      backoff = 0;
+    }
+
+    pthread_mutex_lock(&t_lock);
+    f = __transport_filling();
+    if(f->len > 0 && t_now() - t_filling_since >= t_conf.flush_interval && __transport_free() > 0)
+      __transport_queue();
+    if(t_abandon || (t_stopping && t_acked == t_queued)){
+      pthread_mutex_unlock(&t_lock);
+      break;
+    }
+    pending = s.sending || s.sent < t_queued;
+    inflight = t_acked < s.sent;
+    pthread_mutex_unlock(&t_lock);
+
+    pfd[0].fd = s.c.fd;
+    pfd[0].events = POLLIN | (pending ? POLLOUT : 0);
+    pfd[1].fd = t_wake;
+    pfd[1].events = POLLIN;
+    if(poll(pfd, 2, T_POLL_INTERVAL) < 0 && errno != EINTR)
+      goto reset;
+    if((pfd[1].revents & POLLIN) && read(t_wake, &v, sizeof(uint64_t)) < 0 && errno != EAGAIN)
+      goto reset;
+    if((pfd[0].revents & (POLLIN | POLLERR | POLLHUP)) && transport_receive(&s) < 0)
+      goto reset;
+    if((pfd[0].revents & POLLOUT) && transport_send(&s) < 0)
+      goto reset;
+    if(inflight && t_now() - s.last_ack >= t_conf.timeout)
+      goto reset;
+    continue;
+reset:
+    conn_close(&s.c);
+    pthread_mutex_lock(&t_lock);
+    t_stats.connected = false;
+    pthread_mutex_unlock(&t_lock);
+    backoff = T_BACKOFF_MIN;
+  }
+  conn_close(&s.c);
+  return NULL;
+}
+
+static void transport_free(void){
+  if(t_area)
+    munmap(t_area, t_nframes * t_conf.frame_size);
+  t_area = NULL;
+  free(frames);
+  frames = NULL;
+  if(t_wake >= 0)
+    close(t_wake);
+  t_wake = -1;
+  free(t_host);
+  free(t_port);
+  free(t_server_name);
+  t_host = t_port = t_server_name = NULL;
+#ifdef HAVE_OPENSSL
+  if(t_tls)
+    SSL_CTX_free(t_tls);
+  t_tls = NULL;
+#endif
+}
+
+int transport_connect(const char* host, const char* port, const struct prov_transport_conf* conf){
+  size_t i;
+  int rc;
+
+  pthread_mutex_lock(&t_lock);
+  if(t_running){
+    rc = -EBUSY;
+    goto out;
+  }
+  rc = conf_init(&t_conf, conf);
+  if(rc)
+    goto out;
+  if(!host || !port){
+    rc = -EINVAL;
+    goto out;
+  }
+  if(!t_conf.machine_id)
+    provenance_get_machine_id(&t_conf.machine_id);
+  if(!t_conf.boot_id)
+    provenance_get_boot_id(&t_conf.boot_id);
+  // sequence numbers restart at 1, so must the stream
+  t_stream_id = 0;
+  while(t_stream_id == 0 && getrandom(&t_stream_id, sizeof(uint64_t), 0) < 0){
+    if(errno != EINTR){
+      t_stream_id = ((uint64_t)getpid() << 32) ^ t_now();
+      break;
+    }
+  }
+
+  t_nframes = t_conf.frames;
+  t_host = strdup(host);
+  t_port = strdup(port);
+  t_server_name = strdup(t_conf.tls_server_name ? t_conf.tls_server_name : host);
+  frames = (struct tframe*)calloc(t_nframes, sizeof(struct tframe));
+  t_area = (uint8_t*)mmap(NULL, t_nframes * t_conf.frame_size, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(t_area == MAP_FAILED)
+    t_area = NULL;
+  t_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(!t_host || !t_port || !t_server_name || !frames || !t_area || t_wake < 0){
+    rc = -ENOMEM;
+    goto fail;
+  }
+  for(i=0; i<t_nframes; i++)
+    frames[i].data = t_area + i * t_conf.frame_size;
+#ifdef HAVE_OPENSSL
+  if(t_conf.tls){
+    t_tls = tls_context(&t_conf, false);
+    if(!t_tls){
+      rc = -EINVAL;
+      goto fail;
+    }
+  }
+#endif
+  // only read while starting
+  t_conf.tls_cert = t_conf.tls_key = t_conf.tls_ca = t_conf.tls_server_name = NULL;
+
+  t_acked = 1;
+  t_queued = 1;
+  t_stopping = false;
+  t_abandon = false;
+  memset(&t_stats, 0, sizeof(struct prov_transport_stats));
+  t_hurry = false;
+  rc = -pthread_create(&t_thread, NULL, transport_thread, NULL);
+  if(rc)
+    goto fail;
+  t_running = true;
+  goto out;
+fail:
+  transport_free();
+out:
+  pthread_mutex_unlock(&t_lock);
+  return rc;
+}
+
+void transport_write(const struct iovec* iov, int iovcnt){
+  struct tframe* f;
+  const uint8_t* p;
+  size_t total = 0;
+  size_t copied = 0;
+  size_t len;
+  size_t n;
+  struct timespec deadline;
+  bool stalled = false;
+  int rc;
+  int i;
+
+  for(i=0; i<iovcnt; i++)
+    total += iov[i].iov_len;
+  if(total == 0)
+    return;
+  pthread_mutex_lock(&t_lock);
+  if(!t_running)
+    goto out;
+  t_stats.bytes_in += total;
+  if(t_stopping || total > t_nframes * t_conf.frame_size)
+    goto drop;
+  while(!__transport_fits(total)){
+    if(t_conf.policy == PROV_TRANSPORT_DROP)
+      goto drop;
+    // an unreachable receiver must not hold writers, e.g. the relay readers, for ever
+    if(!stalled){
+      t_stats.stalls++;
+      stalled = true;
+      t_deadline(&deadline, t_conf.timeout);
+    }
+    if(t_hurry && t_before(&t_hurry_deadline, &deadline))
+      deadline = t_hurry_deadline;
+    rc = pthread_cond_timedwait(&t_room, &t_lock, &deadline);
+    if(!t_running || t_stopping)
+      goto drop;
+    if(rc == ETIMEDOUT && !__transport_fits(total))
+      goto drop;
+  }
+  // a write only spans frames if it cannot fit in one
+  f = __transport_filling();
+  if(f->len > 0 && total > t_conf.frame_size - f->len && total <= t_conf.frame_size)
+    __transport_queue();
+  for(i=0; i<iovcnt; i++){
+    p = (const uint8_t*)iov[i].iov_base;
+    len = iov[i].iov_len;
+    while(len > 0){
+      f = __transport_filling();
+      if(f->len == t_conf.frame_size){
+        __transport_queue();
+        f = __transport_filling();
+      }
+      if(f->len == 0){
+        f->partial = copied > 0;
+        t_filling_since = t_now();
+      }
+      n = t_conf.frame_size - f->len;
+      if(n > len)
+        n = len;
+      memcpy(f->data + f->len, p, n);
+      f->len += n;
+      p += n;
+      len -= n;
+      copied += n;
+    }
+  }
+  // otherwise it is queued once a frame is acknowledged, see __transport_acked
+  f = __transport_filling();
+  if(f->len == t_conf.frame_size && __transport_free() > 0)
+    __transport_queue();
+  goto out;
+drop:
+  t_stats.dropped += total;
+out:
+  pthread_mutex_unlock(&t_lock);
+}
+
+void transport_deadline(uint32_t ms){
+  pthread_mutex_lock(&t_lock);
+  t_hurry = ms != PROV_TRANSPORT_NO_DEADLINE;
+  if(t_hurry)
+    t_deadline(&t_hurry_deadline, ms);
+  pthread_cond_broadcast(&t_room); // waiting writers take it into account
+  pthread_mutex_unlock(&t_lock);
+}
+
+void transport_write_str(char* str){
+  struct iovec iov;
+
+  iov.iov_base = str;
+  iov.iov_len = strlen(str);
+  transport_write(&iov, 1);
+}
+
+void transport_flush(void){
+  pthread_mutex_lock(&t_lock);
+  if(t_running && !t_stopping && __transport_filling()->len > 0 && __transport_free() > 0)
+    __transport_queue();
+  pthread_mutex_unlock(&t_lock);
+}
+
+void transport_close(void){
+  struct timespec deadline;
+
+  pthread_mutex_lock(&t_lock);
+  if(!t_running || t_stopping){
+    pthread_mutex_unlock(&t_lock);
+    return;
+  }
+  t_deadline(&deadline, t_conf.timeout);
+  while(__transport_filling()->len > 0 && __transport_free() == 0){
+    if(pthread_cond_timedwait(&t_done, &t_lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  if(__transport_filling()->len > 0 && __transport_free() > 0)
+    __transport_queue();
+  t_stopping = true;
+  pthread_cond_broadcast(&t_room); // writers waiting for room give up
+  t_wakeup();
+  while(t_acked < t_queued){
+    if(pthread_cond_timedwait(&t_done, &t_lock, &deadline) == ETIMEDOUT)
+      break;
+  }
+  t_abandon = true;
+  t_wakeup();
+  pthread_mutex_unlock(&t_lock);
+
+  pthread_join(t_thread, NULL);
+
+  pthread_mutex_lock(&t_lock);
+  transport_free();
+  t_stats.connected = false;
+  t_running = false;
+  t_stopping = false;
+  pthread_mutex_unlock(&t_lock);
+}
+
+void transport_stats(struct prov_transport_stats* stats){
+  pthread_mutex_lock(&t_lock);
+  memcpy(stats, &t_stats, sizeof(struct prov_transport_stats));
+  pthread_mutex_unlock(&t_lock);
+}
+
+/*
+ * Receiver.
+ * An accept thread starts a thread per connection. Streams outlive their
+ * connections, so that a sender reconnecting resumes where it was: the
+ * latest connection of a stream owns it, previous ones are shut down. A
+ * stream lock is held while one of its frames is delivered.
+ */
+struct rconn;
+
+struct rstream {
+  struct rstream* next;
+  pthread_mutex_t lock;
+  struct prov_transport_stream info;
+  struct rconn* owner; /* connection delivering the stream, NULL if none */
+  size_t users; /* connections referring to the stream */
+  struct binary_reader* reader; /* carries over reconnections, frames resume in order */
+  bool sync; /* binary frames are skipped until one starts at a write boundary */
+};
+
+struct rconn {
+  struct rconn* next;
+  struct tconn c;
+  pthread_t thread;
+  _Atomic bool done;
+  char address[NI_MAXHOST + NI_MAXSERV + 1];
+  struct prov_transport_peer peer;
+  struct rstream* stream;
+  uint8_t* buf;
+  size_t size;
+};
+
+static pthread_mutex_t r_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool r_running;
+static int r_fd = -1;
+static int r_wake = -1; /* eventfd, stopping */
+static pthread_t r_thread;
+static struct rconn* r_conns;
+static size_t r_nconns;
+static struct rstream* r_streams;
+static size_t r_nstreams;
+static struct prov_transport_conf r_conf;
+static struct prov_transport_receiver r_receiver;
+#ifdef HAVE_OPENSSL
+static SSL_CTX* r_tls;
+#endif
+
+/* connection of the calling thread, for the binary reader callback */
+static __thread struct rconn* r_self;
+
+static void receive_element(prov_entry_t* msg, bool is_long){
+  if(r_receiver.element)
+    r_receiver.element(&r_self->peer, msg, is_long);
+}
+
+/* decoding starts again at the next frame that starts a write */
+static int receive_resync(struct rstream* s){
+  if(s->reader)
+    binary_reader_free(s->reader);
+  s->reader = binary_reader_create(receive_element);
+  s->sync = true;
+  return s->reader ? 0 : -ENOMEM;
+}
+
+static void receive_stream_free(struct rstream* s){
+  if(s->reader)
+    binary_reader_free(s->reader);
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+}
+
+/* r_lock held, forget streams no connection refers to once there are too many */
+static void __receive_prune(void){
+  struct rstream** p = &r_streams;
+  struct rstream* s;
+
+  while(*p && r_nstreams >= 2 * (size_t)r_conf.connections){
+    s = *p;
+    if(s->users > 0){
+      p = &s->next;
+      continue;
+    }
+    *p = s->next;
+    receive_stream_free(s);
+    r_nstreams--;
+  }
+}
+
+/* the connection becomes the owner of the stream of hello, returns the frame expected next */
+static int receive_claim(struct rconn* conn, const struct thello* hello, uint64_t* next){
+  struct rstream* s;
+
+  pthread_mutex_lock(&r_lock);
+  for(s=r_streams; s; s=s->next){
+    if(s->info.machine_id == hello->machine_id && s->info.boot_id == hello->boot_id
+       && s->info.stream_id == hello->stream_id)
+      break;
+  }
+  if(!s){
+    __receive_prune();
+    s = (struct rstream*)calloc(1, sizeof(struct rstream));
+    if(!s){
+      pthread_mutex_unlock(&r_lock);
+      return -ENOMEM;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    s->sync = true;
+    s->info.machine_id = hello->machine_id;
+    s->info.boot_id = hello->boot_id;
+    s->info.stream_id = hello->stream_id;
+    s->next = r_streams;
+    r_streams = s;
+    r_nstreams++;
+  }
+  s->users++;
+  pthread_mutex_lock(&s->lock); // the previous owner is not delivering a frame
+  if(s->owner)
+    shutdown(s->owner->c.fd, SHUT_RDWR); // the sender reconnected, that one is dead
+  s->owner = conn;
+  s->info.kind = hello->kind;
+  s->info.connected = true;
+  *next = s->info.next;
+  pthread_mutex_unlock(&s->lock);
+  pthread_mutex_unlock(&r_lock);
+
+  conn->stream = s;
+  conn->peer.address = conn->address;
+  conn->peer.machine_id = hello->machine_id;
+  conn->peer.boot_id = hello->boot_id;
+  conn->peer.stream_id = hello->stream_id;
+  conn->peer.kind = hello->kind;
+  return 0;
+}
+
+static void receive_release(struct rconn* conn){
+  struct rstream* s = conn->stream;
+
+  if(!s)
+    return;
+  pthread_mutex_lock(&r_lock);
+  pthread_mutex_lock(&s->lock);
+  if(s->owner == conn){
+    s->owner = NULL;
+    s->info.connected = false;
+  }
+  pthread_mutex_unlock(&s->lock);
+  s->users--;
+  pthread_mutex_unlock(&r_lock);
+}
+
+/**
+ * @brief Delivers a frame received, in stream order.
+ *
+ * Frames already delivered are ignored, those missing counted as lost.
+ * After a loss, a decoding error or on a new stream, binary frames are
+ * skipped until one starts at a write boundary, where a binary block
+ * starts.
+ *
+ * @param conn the connection, conn->buf holds the payload
+ * @param h header of the frame
+ * @param ack set to the last frame delivered in order
+ * @return 0, or -1 if the connection no longer owns the stream
+ */
+static int receive_frame(struct rconn* conn, const struct theader* h, uint64_t* ack){
+  struct rstream* s = conn->stream;
+  struct prov_transport_stream* info = &s->info;
+  int rc = 0;
+
+  pthread_mutex_lock(&s->lock);
+  if(s->owner != conn){
+    rc = -1;
+    goto out;
+  }
+  if(info->next != 0 && h->seq < info->next){
+    info->duplicates++;
+    goto out;
+  }
+  if(info->next != 0 && h->seq > info->next){
+    info->lost += h->seq - info->next;
+    if(receive_resync(s) < 0){
+      rc = -1;
+      goto out;
+    }
+  }
+  info->next = h->seq + 1;
+  info->frames++;
+  info->bytes += h->length;
+  if(info->kind == PROV_TRANSPORT_RAW){
+    if(r_receiver.data)
+      r_receiver.data(&conn->peer, conn->buf, h->length);
+  }else if(s->sync && (h->flags & T_PARTIAL)){
+    info->skipped++;
+  }else if(!s->reader && receive_resync(s) < 0){
+    rc = -1;
+  }else{
+    s->sync = false;
+    if(binary_read(s->reader, conn->buf, h->length) < 0){
+      info->errors++;
+      if(receive_resync(s) < 0)
+        rc = -1;
+    }
+  }
+  if(r_receiver.frame)
+    r_receiver.frame(&conn->peer);
+out:
+  *ack = info->next > 0 ? info->next - 1 : 0;
+  pthread_mutex_unlock(&s->lock);
+  return rc;
+}
+
+/**
+ * @brief Loop of a connection thread.
+ *
+ * Handshakes, with timeout, then receives frames, delivering and
+ * acknowledging them one at a time until the connection is closed, shut
+ * down by a newer connection of the stream or by transport_listen_stop.
+ *
+ * @param arg the connection
+ */
+static void* receive_thread(void* arg){
+  struct rconn* conn = (struct rconn*)arg;
+  uint8_t msg[T_HEADER + T_HELLO_LEN];
+  struct thello hello;
+  struct theader h;
+  uint64_t next;
+  uint8_t* buf;
+
+  r_self = conn;
+#ifdef HAVE_OPENSSL
+  tls_block_sigpipe(NULL);
+  if(r_tls && tls_handshake(&conn->c, r_tls, NULL) < 0)
+    goto out;
+#endif
+  if(conn_recv_all(&conn->c, msg, T_HEADER) < 0)
+    goto out;
+  header_decode(msg, &h);
+  if(h.type != T_HELLO || h.version != T_VERSION || h.length != T_HELLO_LEN)
+    goto out;
+  if(conn_recv_all(&conn->c, msg + T_HEADER, T_HELLO_LEN) < 0)
+    goto out;
+  if(hello_decode(msg + T_HEADER, &hello) < 0)
+    goto out;
+  if(receive_claim(conn, &hello, &next) < 0)
+    goto out;
+  header_encode(msg, 0, T_WELCOME, 0, next);
+  if(conn_send_all(&conn->c, msg, T_HEADER) < 0)
+    goto out;
+  // idle senders are fine, dead ones are found by keepalive
+  set_socket_options(conn->c.fd, 0);
+
+  for(;;){
+    if(conn_recv_all(&conn->c, msg, T_HEADER) < 0)
+      break;
+    header_decode(msg, &h);
+    if(h.type != T_DATA || h.version != T_VERSION || h.length > r_conf.frame_size)
+      break;
+    if(h.length > conn->size){
+      buf = (uint8_t*)realloc(conn->buf, h.length);
+      if(!buf)
+        break;
+      conn->buf = buf;
+      conn->size = h.length;
+    }
+    if(conn_recv_all(&conn->c, conn->buf, h.length) < 0)
+      break;
+    if(receive_frame(conn, &h, &next) < 0)
+      break;
+    header_encode(msg, 0, T_ACK, 0, next);
+    if(conn_send_all(&conn->c, msg, T_HEADER) < 0)
+      break;
+  }
+out:
+  receive_release(conn);
+  if(conn->stream && r_receiver.closed)
+    r_receiver.closed(&conn->peer);
+  atomic_store(&conn->done, true);
+  return NULL;
+}
+
+static void receive_free(struct rconn* conn){
+  conn_close(&conn->c);
+  free(conn->buf);
+  free(conn);
+}
+
+/* r_lock held, join the connection threads that are done */
+static void __receive_reap(void){
+  struct rconn** p = &r_conns;
+  struct rconn* conn;
+
+  while(*p){
+    conn = *p;
+    if(!atomic_load(&conn->done)){
+      p = &conn->next;
+      continue;
+    }
+    *p = conn->next;
+    pthread_join(conn->thread, NULL);
+    receive_free(conn);
+    r_nconns--;
+  }
+}
+
+static void receive_accept(int fd, const struct sockaddr_storage* addr, socklen_t len){
+  char host[NI_MAXHOST];
+  char serv[NI_MAXSERV];
+  struct rconn* conn;
+
+  pthread_mutex_lock(&r_lock);
+  __receive_reap();
+  if(r_nconns >= r_conf.connections)
+    goto fail;
+  conn = (struct rconn*)calloc(1, sizeof(struct rconn));
+  if(!conn)
+    goto fail;
+  conn->c.fd = fd;
+  if(getnameinfo((const struct sockaddr*)addr, len, host, NI_MAXHOST, serv, NI_MAXSERV,
+                 NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+    snprintf(conn->address, sizeof(conn->address), "%s:%s", host, serv);
+  set_socket_options(fd, r_conf.timeout);
+  if(pthread_create(&conn->thread, NULL, receive_thread, conn)){
+    conn->c.fd = -1;
+    receive_free(conn);
+    goto fail;
+  }
+  conn->next = r_conns;
+  r_conns = conn;
+  r_nconns++;
+  pthread_mutex_unlock(&r_lock);
+  return;
+fail:
+  pthread_mutex_unlock(&r_lock);
+  close(fd);
+}
+
+static void* accept_thread(void* arg){
+  struct sockaddr_storage addr;
+  struct pollfd pfd[2];
+  socklen_t len;
+  int fd;
+
+  pfd[0].fd = r_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = r_wake;
+  pfd[1].events = POLLIN;
+  for(;;){
+    if(poll(pfd, 2, -1) < 0){
+      if(errno == EINTR)
+        continue;
+      break;
+    }
+    if(pfd[1].revents & POLLIN)
+      break;
+    if(!(pfd[0].revents & POLLIN))
+      continue;
+    len = sizeof(struct sockaddr_storage);
+    fd = accept4(r_fd, (struct sockaddr*)&addr, &len, SOCK_CLOEXEC);
+    if(fd < 0){
+      if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+        usleep(T_POLL_INTERVAL * 1000); // until a connection goes away
+      continue;
+    }
+    receive_accept(fd, &addr, len);
+  }
+  return NULL;
+}
+
+static int tcp_listen(const char* address, const char* port){
+  struct addrinfo hints;
+  struct addrinfo* res;
+  struct addrinfo* ai;
+  int one = 1;
+  int zero = 0;
+  int fd = -1;
+  int err = -EADDRNOTAVAIL;
+  int pass;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  if(getaddrinfo(address, port, &hints, &res))
+    return -EINVAL;
+  // the IPv6 wildcard first, it accepts IPv4 too, then whatever binds
+  for(pass=0; pass<2 && fd<0; pass++){
+    for(ai=res; ai; ai=ai->ai_next){
+      if(pass == 0 && (address || ai->ai_family != AF_INET6))
+        continue;
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+      if(fd < 0){
+        err = -errno;
+        continue;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+      if(ai->ai_family == AF_INET6)
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(int));
+      if(bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0)
+        break;
+      err = -errno;
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd >= 0 ? fd : err;
+}
+
+static void listen_free(void){
+  struct rstream* s;
+
+  while(r_streams){
+    s = r_streams;
+    r_streams = s->next;
+    receive_stream_free(s);
+  }
+  r_nstreams = 0;
+  if(r_fd >= 0)
+    close(r_fd);
+  r_fd = -1;
+  if(r_wake >= 0)
+    close(r_wake);
+  r_wake = -1;
+#ifdef HAVE_OPENSSL
+  if(r_tls)
+    SSL_CTX_free(r_tls);
+  r_tls = NULL;
+#endif
+}
+
+int transport_listen(const char* address, const char* port,
+                     const struct prov_transport_conf* conf,
+                     const struct prov_transport_receiver* receiver){
+  int rc;
+
+  pthread_mutex_lock(&r_lock);
+  if(r_running){
+    rc = -EBUSY;
+    goto out;
+  }
+  rc = conf_init(&r_conf, conf);
+  if(rc)
+    goto out;
+  if(!port || !receiver){
+    rc = -EINVAL;
+    goto out;
+  }
+  memcpy(&r_receiver, receiver, sizeof(struct prov_transport_receiver));
+#ifdef HAVE_OPENSSL
+  if(r_conf.tls){
+    r_tls = tls_context(&r_conf, true);
+    if(!r_tls){
+      rc = -EINVAL;
+      goto fail;
+    }
+  }
+#endif
+  r_conf.tls_cert = r_conf.tls_key = r_conf.tls_ca = r_conf.tls_server_name = NULL;
+  r_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(r_wake < 0){
+    rc = -errno;
+    goto fail;
+  }
+  rc = tcp_listen(address, port);
+  if(rc < 0)
+    goto fail;
+  r_fd = rc;
+  rc = -pthread_create(&r_thread, NULL, accept_thread, NULL);
+  if(rc)
+    goto fail;
+  r_running = true;
+  goto out;
+fail:
+  listen_free();
+out:
+  pthread_mutex_unlock(&r_lock);
+  return rc;
+}
+
+void transport_listen_stop(void){
+  struct rconn* conn;
+
+  pthread_mutex_lock(&r_lock);
+  if(!r_running){
+    pthread_mutex_unlock(&r_lock);
+    return;
+  }
+  pthread_mutex_unlock(&r_lock);
+  eventfd_signal(r_wake);
+  pthread_join(r_thread, NULL);
+
+  // no connection is added anymore, threads do not unlink themselves
+  pthread_mutex_lock(&r_lock);
+  for(conn=r_conns; conn; conn=conn->next)
+    shutdown(conn->c.fd, SHUT_RDWR);
+  pthread_mutex_unlock(&r_lock);
+  while(r_conns){
+    conn = r_conns;
+    pthread_join(conn->thread, NULL);
+    r_conns = conn->next;
+    receive_free(conn);
+  }
+  pthread_mutex_lock(&r_lock);
+  r_nconns = 0;
+  listen_free();
+  r_running = false;
+  pthread_mutex_unlock(&r_lock);
+}
+
+int transport_streams(struct prov_transport_stream* streams, size_t n){
+  struct rstream* s;
+  size_t i = 0;
+
+  pthread_mutex_lock(&r_lock);
+  for(s=r_streams; s; s=s->next, i++){
+    if(i >= n)
+      continue;
+    pthread_mutex_lock(&s->lock);
+    memcpy(&streams[i], &s->info, sizeof(struct prov_transport_stream));
+    pthread_mutex_unlock(&s->lock);
+  }
+  pthread_mutex_unlock(&r_lock);
+  return (int)i;
+}
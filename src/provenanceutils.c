@@ -17,35 +17,32 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "provenanceutils.h"
-
-static const char map[16+1] = "0123456789ABCDEF";
+#include "provenanceformat.h"
+#include "provenancearena.h"
 
 size_t hexify(uint8_t *in, size_t in_size, char *out, size_t out_size)
 {
     if (in_size == 0 || out_size == 0)
       return 0;
 
-    size_t bytes_written = 0;
+    size_t n = (out_size - 1) / 2; // bytes that fit with the terminating NUL
     size_t i = 0;
-    while(i < in_size && (i*2 + (2+1)) <= out_size)
-    {
-        uint8_t high_nibble = (in[i] & 0xF0) >> 4;
-        *out = map[high_nibble];
-        out++;
-
-        uint8_t low_nibble = in[i] & 0x0F;
-        *out = map[low_nibble];
-        out++;
+    if (n > in_size)
+      n = in_size;
 
-        i++;
-
-        bytes_written += 2;
+    for (; i + 16 <= n; i += 16, out += 32)
+      fmt_hex16(out, in + i, fmt_hex_upper);
+    for (; i < n; i++)
+    {
+        *out++ = fmt_hex_upper[in[i] >> 4];
+        *out++ = fmt_hex_upper[in[i] & 0x0F];
     }
     *out = '\0';
 
-    return bytes_written;
+    return n * 2;
 }
 
 static const char base64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -62,6 +59,13 @@ int base64encode(const void* data_buf, size_t dataLength, char* result, size_t r
    uint8_t n2;
    uint8_t n3;
 
+   /* large enough output, no need to check bounds as we go */
+   if (resultSize >= encode64Bound(dataLength))
+   {
+      result[fmt_base64(result, data, dataLength)] = 0;
+      return 0;
+   }
+
    /* increment over the length of the string, three characters at a time */
    for (x = 0; x < dataLength; x += 3)
    {
@@ -133,7 +137,60 @@ int base64encode(const void* data_buf, size_t dataLength, char* result, size_t r
    return 0;   /* indicate success */
 }
 
+/*
+ * Per thread direct-mapped cache of encoded identifiers, the same
+ * identifiers (e.g. relation ends) tend to be encoded again and again.
+ */
+#define ID_CACHE_SIZE 256 /* must be a power of two */
+
+struct id_cache_entry {
+  uint8_t id[PROV_IDENTIFIER_BUFFER_LENGTH];
+  char str[PROV_ID_STR_LEN]; /* empty if the entry is unused */
+};
+
+static __thread struct id_cache_entry id_cache[ID_CACHE_SIZE];
+static atomic_bool id_cache_enabled = false;
+
+void base64encode_id_cache(bool enable){
+  atomic_store_explicit(&id_cache_enabled, enable, memory_order_relaxed);
+}
+
+static inline size_t id_cache_slot(const uint8_t* id){
+  uint64_t h = 0;
+  uint64_t w;
+  size_t i;
+
+  for (i = 0; i + sizeof(uint64_t) <= PROV_IDENTIFIER_BUFFER_LENGTH; i += sizeof(uint64_t)) {
+    memcpy(&w, id + i, sizeof(uint64_t));
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+  }
+  return (h >> 32) & (ID_CACHE_SIZE - 1);
+}
+
+int base64encode_id(const void* data_buf, size_t dataLength, char* result, size_t resultSize){
+  const uint8_t *data = (const uint8_t *)data_buf;
+  struct id_cache_entry *entry;
+
+  if (dataLength != PROV_IDENTIFIER_BUFFER_LENGTH || resultSize < PROV_ID_STR_LEN)
+    return base64encode(data_buf, dataLength, result, resultSize);
+  if (!atomic_load_explicit(&id_cache_enabled, memory_order_relaxed)) {
+    result[fmt_base64(result, data, PROV_IDENTIFIER_BUFFER_LENGTH)] = 0;
+    return 0;
+  }
+  entry = &id_cache[id_cache_slot(data)];
+  if (entry->str[0] != 0 && memcmp(entry->id, data, PROV_IDENTIFIER_BUFFER_LENGTH) == 0) {
+    memcpy(result, entry->str, PROV_ID_STR_LEN);
+    return 0;
+  }
+  result[fmt_base64(result, data, PROV_IDENTIFIER_BUFFER_LENGTH)] = 0;
+  memcpy(entry->id, data, PROV_IDENTIFIER_BUFFER_LENGTH);
+  memcpy(entry->str, result, PROV_ID_STR_LEN);
+  return 0;
+}
+
 int compress64encode(const char* in, size_t inlen, char* out, size_t outlen){
+  struct arena* arena = arena_self();
+  struct arena_mark mark;
   uLongf len;
   char* buf;
 
@@ -142,10 +199,13 @@ int compress64encode(const char* in, size_t inlen, char* out, size_t outlen){
   }
 
   len = compressBound(inlen);
-  buf = (char*)malloc(len);
+  mark = arena_mark(arena);
+  buf = (char*)arena_alloc(arena, len);
+  if(!buf)
+    return -1;
   compress((Bytef*)buf, &len, (Bytef*)in, inlen);
   base64encode(buf, len, out, outlen);
-  free(buf);
+  arena_release(arena, mark);
 
   return 0;
 }
@@ -158,6 +218,16 @@ char *ulltoa (uint64_t value, char *string, int radix)
   int n;
 
   dst = string;
+  if (radix == DECIMAL)
+    {
+      string[fmt_u64_dec(string, value)] = 0;
+      return (string);
+    }
+  if (radix == HEX)
+    {
+      string[fmt_u64_hex(string, value)] = 0;
+      return (string);
+    }
   if (radix < 2 || radix > 36)
     {
       *dst = 0;
@@ -184,6 +254,16 @@ char *utoa (uint32_t value, char *string, int radix)
   int n;
 
   dst = string;
+  if (radix == DECIMAL)
+    {
+      string[fmt_u64_dec(string, value)] = 0;
+      return (string);
+    }
+  if (radix == HEX)
+    {
+      string[fmt_u64_hex(string, value)] = 0;
+      return (string);
+    }
   if (radix < 2 || radix > 36)
     {
       *dst = 0;
@@ -208,6 +288,10 @@ char *utoa (uint32_t value, char *string, int radix)
 * Released under GPLv3.
 */
 char* itoa(int32_t value, char* result, int base) {
+	if (base == DECIMAL) {
+		result[fmt_i64_dec(result, value)] = '\0';
+		return result;
+	}
 	// check that the base if valid
 	if (base < 2 || base > 36) { *result = '\0'; return result; }
 
@@ -234,6 +318,10 @@ char* itoa(int32_t value, char* result, int base) {
 }
 
 char* lltoa(int64_t value, char* result, int base) {
+	if (base == DECIMAL) {
+		result[fmt_i64_dec(result, value)] = '\0';
+		return result;
+	}
 	// check that the base if valid
 	if (base < 2 || base > 36) {
     *result = '\0';
@@ -16,6 +16,10 @@
 #define _GNU_SOURCE
 #include <sys/stat.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
 #include <stdlib.h>
@@ -30,84 +34,705 @@
 
 #include "thpool.h"
 #include "provenance.h"
+#include "provenancefilter.h"
+#include "provenanceW3CJSON.h"
+#include "provenanceSPADEJSON.h"
+#include "provenanceBinary.h"
+#include "provenancecompress.h"
+#include "provenancesink.h"
+#include "provenancetransport.h"
+#include "relayring.h"
+#include "provenancecache.h"
+#include "provenancestats.h"
+#include "provenancearena.h"
+#include "relaycpu.h"
+#include "relayoverload.h"
 
 #define RUN_PID_FILE "/run/provenance-service.pid"
-#define NUMBER_CPUS           256 /* support 256 core max */
 
 /* internal variables */
 static struct provenance_ops prov_ops;
-static uint8_t ncpus;
-/* per cpu variables */
-static int relay_file[NUMBER_CPUS];
-static int long_relay_file[NUMBER_CPUS];
+static _Atomic bool prov_ops_held = false; /* by the relay or a receiver, see ops_hold */
+static int ncpus; /* possible cpus, cpu ids are below */
+static int nnodes; /* possible NUMA nodes */
+
+/* capture files, named after the relay channels */
+#define CAPTURE_NAME      "provenance"
+#define LONG_CAPTURE_NAME "long_provenance"
 /* worker pool */
 static threadpool worker_thpool=NULL;
-static uint8_t running = 1;
+/*
+ * PROV_READER_POLL, pools the reader jobs run in. The first has a thread
+ * per channel of the cpus online at start, hotplug_job adds pools of
+ * READER_POOL_GROWTH threads when cpus coming online find them all busy.
+ */
+#define READER_POOL_GROWTH 2 /* the channels of a cpu */
+struct reader_pool {
+  threadpool pool;
+  int slots;
+  _Atomic int used; /* reader jobs queued or running */
+  struct reader_pool* next;
+};
+static struct reader_pool* reader_pools=NULL;
+static _Atomic bool running = true;
+/*
+ * Bumped when the stop deadline passes with workers still in a job. Jobs
+ * read it when they start; those of the abandoned pools then return as soon
+ * as they get back control, without running the callbacks again, and
+ * provenance_relay_register refuses to start until they have, see
+ * reap_abandoned.
+ */
+static _Atomic uint64_t relay_gen = 0;
+static threadpool abandoned_thpool = NULL;
+static struct reader_pool* abandoned_readers = NULL;
+static int wake_fd = -1; /* eventfd, readable once running is cleared, see relay_wait */
+static _Atomic int ndrainers = 0; /* readers and reactors still draining channels */
+static _Atomic uint64_t stop_deadline = UINT64_MAX; /* ms, pending_now clock */
 
 /* internal functions */
 static int open_files(void);
 static int close_files(void);
 static int create_worker_pool(void);
-static void destroy_worker_pool(void);
+static void destroy_worker_pool(uint64_t deadline);
+static int reap_abandoned(void);
+static void relay_halt(uint64_t deadline);
+static int overload_collect(struct overload_signals* signals);
+struct job_parameters;
+struct channel_group;
+static int alloc_channels(void);
+static void channel_close(struct job_parameters *params);
+static void free_groups(struct channel_group* groups, size_t n);
+static void free_read_buffer(uint8_t* buf, const size_t prov_size);
 
+static void relation_log(union prov_elt *msg);
 static void callback_job(void* data, const size_t prov_size);
 static void long_callback_job(void* data, const size_t prov_size);
+static void callback_batch_job(void* data, const size_t prov_size, const size_t n);
+static void long_callback_batch_job(void* data, const size_t prov_size, const size_t n);
 static void reader_job(void *data);
 static void long_reader_job(void *data);
+static void reactor_job(void *data);
+static void pipeline_job(void *data);
+static void hotplug_job(void *data);
+static void overload_job(void *data);
 
 struct nameentry {
     union prov_identifier id;
-    char str[PATH_MAX];
     UT_hash_handle hh; /* makes this structure hashable */
+    struct nameentry *clock_prev;
+    struct nameentry *clock_next;
+    uint8_t referenced; /* CLOCK reference bit, set by lookups */
+    _Atomic uint32_t refs; /* the table's and the threads' borrowing str, see name_id_to_str */
+    size_t len;
+    char str[]; /* len+1 bytes */
+};
+
+#define name_entry_size(len) (sizeof(struct nameentry)+(len)+1)
+
+/*
+ * The name table is split in NAME_SHARDS independently locked tables, so
+ * that worker threads resolving names rarely contend on the same lock.
+ * Each shard holds at most its share of the name cache size, entries are
+ * evicted following the CLOCK algorithm when it is exceeded. An evicted
+ * entry is freed once no thread borrows its name anymore.
+ */
+#define NAME_SHARDS 64 /* must be a power of two */
+
+struct nameshard {
+  pthread_rwlock_t lock;
+  struct nameentry *nhash;
+  struct nameentry *hand; /* next eviction candidate */
+  size_t entries;
+  size_t bytes;
+  _Atomic uint64_t hits;
+  _Atomic uint64_t misses;
+  uint64_t evictions;
+} __attribute__((aligned(64)));
+
+static struct nameshard nshards[NAME_SHARDS] = {
+  [0 ... NAME_SHARDS-1] = { .lock = PTHREAD_RWLOCK_INITIALIZER }
 };
 
-static struct nameentry *nhash = NULL;
-pthread_mutex_t nash_lock;
+static inline struct nameshard* name_shard(union prov_identifier *nameid)
+{
+  uint64_t h = nameid->node_id.id ^ ((uint64_t)nameid->node_id.boot_id << 32) ^ nameid->node_id.machine_id;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return &nshards[h & (NAME_SHARDS-1)];
+}
+
+static inline size_t name_shard_capacity(void)
+{
+  if(prov_ops.name_cache_size>0)
+    return prov_ops.name_cache_size/NAME_SHARDS;
+  return PROV_NAME_CACHE_SIZE/NAME_SHARDS;
+}
 
+/* shards are statically initialised, kept for compatibility */
 int nash_init(void) {
-  if (pthread_mutex_init(&nash_lock, NULL) != 0)
-    return -1;
   return 0;
 }
 
-bool name_exists_entry(union prov_identifier *nameid) {
+/* must be called with the shard lock held, read or write */
+static inline struct nameentry* __name_lookup_entry(struct nameshard *shard, union prov_identifier *nameid) {
   struct nameentry *te=NULL;
-  pthread_mutex_lock(&nash_lock);
-  HASH_FIND(hh, nhash, nameid, sizeof(union prov_identifier), te);
-  pthread_mutex_unlock(&nash_lock);
-  if(!te)
-    return false;
-  return true;
+  HASH_FIND(hh, shard->nhash, nameid, sizeof(union prov_identifier), te);
+  if(te){
+    if(!__atomic_load_n(&te->referenced, __ATOMIC_RELAXED))
+      __atomic_store_n(&te->referenced, 1, __ATOMIC_RELAXED);
+    atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+  }else
+    atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+  return te;
+}
+
+bool name_exists_entry(union prov_identifier *nameid) {
+  struct nameshard *shard = name_shard(nameid);
+  struct nameentry *te;
+  pthread_rwlock_rdlock(&shard->lock);
+  te = __name_lookup_entry(shard, nameid);
+  pthread_rwlock_unlock(&shard->lock);
+  return te!=NULL;
+}
+
+static inline void name_entry_put(struct nameentry *te)
+{
+  if(atomic_fetch_sub_explicit(&te->refs, 1, memory_order_acq_rel)==1)
+    free(te);
+}
+
+/* must be called with the shard write lock held */
+static void __name_evict(struct nameshard *shard, size_t needed)
+{
+  struct nameentry *te;
+  size_t capacity = name_shard_capacity();
+
+  while(shard->hand && shard->bytes+needed > capacity){
+    te = shard->hand;
+    if(te->referenced){ /* second chance */
+      te->referenced = 0;
+      shard->hand = te->clock_next;
+      continue;
+    }
+    if(te->clock_next==te)
+      shard->hand = NULL;
+    else{
+      te->clock_prev->clock_next = te->clock_next;
+      te->clock_next->clock_prev = te->clock_prev;
+      shard->hand = te->clock_next;
+    }
+    HASH_DEL(shard->nhash, te);
+    shard->entries--;
+    shard->bytes -= name_entry_size(te->len);
+    shard->evictions++;
+    name_entry_put(te);
+  }
 }
 
-static void name_add_entry(union prov_identifier *nameid, const char* name){
+/* insert the name if absent, the shard lock is taken once */
+void name_add_entry(union prov_identifier *nameid, const char* name){
+  struct nameshard *shard = name_shard(nameid);
   struct nameentry *te;
-  if( name_exists_entry(nameid) )
+  struct nameentry *prev=NULL;
+  size_t len = strnlen(name, PATH_MAX-1);
+
+  te = malloc(name_entry_size(len));
+  if(!te)
     return;
-  te = malloc(sizeof(struct nameentry));
   memcpy(&te->id, nameid, sizeof(union prov_identifier));
-  strncpy(te->str, name, PATH_MAX);
-  pthread_mutex_lock(&nash_lock);
-  HASH_ADD(hh, nhash, id, sizeof(union prov_identifier), te);
-  pthread_mutex_unlock(&nash_lock);
+  memcpy(te->str, name, len);
+  te->str[len] = '\0';
+  te->len = len;
+  te->referenced = 0;
+  atomic_init(&te->refs, 1);
+  pthread_rwlock_wrlock(&shard->lock);
+  HASH_FIND(hh, shard->nhash, nameid, sizeof(union prov_identifier), prev);
+  if(!prev){
+    __name_evict(shard, name_entry_size(len));
+    HASH_ADD(hh, shard->nhash, id, sizeof(union prov_identifier), te);
+    /* insert just behind the hand, i.e. last to be examined */
+    if(!shard->hand){
+      te->clock_next = te->clock_prev = te;
+      shard->hand = te;
+    }else{
+      te->clock_next = shard->hand;
+      te->clock_prev = shard->hand->clock_prev;
+      shard->hand->clock_prev->clock_next = te;
+      shard->hand->clock_prev = te;
+    }
+    shard->entries++;
+    shard->bytes += name_entry_size(len);
+  }
+  pthread_rwlock_unlock(&shard->lock);
+  if(prev)
+    free(te);
 }
 
+/* copying variant of name_id_to_str, name must be at least PATH_MAX long, only the name length is copied */
 bool name_find_entry(union prov_identifier *nameid, char* name) {
-  struct nameentry *te=NULL;
-  pthread_mutex_lock(&nash_lock);
-  HASH_FIND(hh, nhash, nameid, sizeof(union prov_identifier), te);
-  pthread_mutex_unlock(&nash_lock);
-  if(!te)
+  struct nameshard *shard = name_shard(nameid);
+  struct nameentry *te;
+  pthread_rwlock_rdlock(&shard->lock);
+  te = __name_lookup_entry(shard, nameid);
+  if(te)
+    memcpy(name, te->str, te->len+1);
+  pthread_rwlock_unlock(&shard->lock);
+  return te!=NULL;
+}
+
+/*
+ * The name is borrowed from the table, valid until the next call on the same
+ * thread: the entry looked up last is kept from being freed if evicted.
+ */
+static __thread struct nameentry *__name_borrowed = NULL;
+char* name_id_to_str(union prov_identifier* name_id) {
+  struct nameshard *shard = name_shard(name_id);
+  struct nameentry *te;
+
+  pthread_rwlock_rdlock(&shard->lock);
+  te = __name_lookup_entry(shard, name_id);
+  if(te)
+    atomic_fetch_add_explicit(&te->refs, 1, memory_order_relaxed);
+  pthread_rwlock_unlock(&shard->lock);
+  if(__name_borrowed)
+    name_entry_put(__name_borrowed);
+  __name_borrowed = te;
+  return te ? te->str : NULL;
+}
+
+void provenance_name_stats(struct prov_name_stats* stats)
+{
+  int i;
+  struct nameshard *shard;
+
+  memset(stats, 0, sizeof(struct prov_name_stats));
+  stats->capacity = name_shard_capacity()*NAME_SHARDS;
+  for(i=0; i<NAME_SHARDS; i++){
+    shard = &nshards[i];
+    pthread_rwlock_rdlock(&shard->lock);
+    stats->entries += shard->entries;
+    stats->bytes += shard->bytes;
+    stats->evictions += shard->evictions;
+    pthread_rwlock_unlock(&shard->lock);
+    stats->hits += atomic_load_explicit(&shard->hits, memory_order_relaxed);
+    stats->misses += atomic_load_explicit(&shard->misses, memory_order_relaxed);
+  }
+}
+
+/*
+ * Nodes referring to a name not yet received are parked here until the
+ * matching ENT_PATH element is recorded, or PROV_NAME_TIMEOUT expires, so
+ * that the serialisers find the name without waiting for it.
+ */
+#define PROV_NAME_TIMEOUT 250 /* ms */
+#define PENDING_MAX 65536 /* elements parked at most, recorded directly above */
+
+struct pendingelt {
+  struct pendingelt *next;
+  union prov_elt msg;
+};
+
+struct pendinggroup {
+  union prov_identifier id;
+  UT_hash_handle hh;
+  uint64_t deadline;
+  struct pendingelt *head;
+  struct pendingelt **tail;
+  /* groups in deadline order */
+  struct pendinggroup *older;
+  struct pendinggroup *newer;
+};
+
+static struct pendinggroup *pending_hash=NULL;
+static struct pendinggroup *pending_oldest=NULL;
+static struct pendinggroup *pending_newest=NULL;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic size_t npending = 0;
+static _Atomic uint64_t pending_parked = 0;
+static _Atomic uint64_t pending_released = 0;
+static _Atomic uint64_t pending_expired = 0;
+
+static inline uint64_t pending_now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+  return t.tv_sec*1000ULL + t.tv_nsec/1000000;
+}
+
+/* must be called with pending_lock held */
+static inline void __pending_unlink(struct pendinggroup *group)
+{
+  HASH_DEL(pending_hash, group);
+  if(group->older)
+    group->older->newer = group->newer;
+  else
+    pending_oldest = group->newer;
+  if(group->newer)
+    group->newer->older = group->older;
+  else
+    pending_newest = group->older;
+}
+
+/* record then free the elements of groups chained through newer, returns how many */
+static size_t pending_record(struct pendinggroup *group)
+{
+  struct pendinggroup *next;
+  struct pendingelt *pe;
+  struct pendingelt *tmp;
+  size_t n = 0;
+
+  while(group){
+    next = group->newer;
+    pe = group->head;
+    while(pe){
+      tmp = pe->next;
+      prov_record(&pe->msg);
+      free(pe);
+      atomic_fetch_sub_explicit(&npending, 1, memory_order_relaxed);
+      pe = tmp;
+      n++;
+    }
+    free(group);
+    group = next;
+  }
+  return n;
+}
+
+static inline bool pending_needed(union prov_elt *msg)
+{
+  if(prov_is_relation(msg) || prov_type(msg)==ENT_PACKET)
+    return false;
+  if(msg->node_info.name_id.node_id.type==0)
+    return false;
+  return !name_exists_entry(&(msg->node_info.name_id));
+}
+
+/**
+ * @brief Parks a copy of a node whose name is unknown.
+ *
+ * The name is checked again under pending_lock, as the ENT_PATH element may
+ * have been recorded meanwhile; pending_release takes the lock after adding
+ * the name, so the node is either parked or sees the name.
+ *
+ * @param msg node to park
+ *
+ * @return Returns true if the node was parked, false if it must be recorded now.
+ */
+static bool pending_park(union prov_elt *msg)
+{
+  struct pendinggroup *group;
+  struct pendingelt *pe;
+  union prov_identifier *id = &(msg->node_info.name_id);
+
+  if(atomic_load_explicit(&npending, memory_order_relaxed)>=PENDING_MAX)
     return false;
-  strncpy(name, te->str, PATH_MAX);
+  pe = malloc(sizeof(struct pendingelt));
+  if(!pe)
+    return false;
+  memcpy(&pe->msg, msg, sizeof(union prov_elt));
+  pe->next = NULL;
+  pthread_mutex_lock(&pending_lock);
+  if(name_exists_entry(id))
+    goto unlock_out;
+  HASH_FIND(hh, pending_hash, id, sizeof(union prov_identifier), group);
+  if(!group){
+    group = calloc(1, sizeof(struct pendinggroup));
+    if(!group)
+      goto unlock_out;
+    memcpy(&group->id, id, sizeof(union prov_identifier));
+    group->deadline = pending_now()+PROV_NAME_TIMEOUT;
+    group->tail = &group->head;
+    HASH_ADD(hh, pending_hash, id, sizeof(union prov_identifier), group);
+    group->older = pending_newest;
+    if(pending_newest)
+      pending_newest->newer = group;
+    else
+      pending_oldest = group;
+    pending_newest = group;
+  }
+  *(group->tail) = pe;
+  group->tail = &pe->next;
+  atomic_fetch_add_explicit(&npending, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&pending_parked, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&pending_lock);
   return true;
+
+unlock_out:
+  pthread_mutex_unlock(&pending_lock);
+  free(pe);
+  return false;
 }
 
-static __thread char __name_id[PATH_MAX];
-char* name_id_to_str(union prov_identifier* name_id) {
-  if (!name_find_entry(name_id, __name_id))
-    return NULL;
-  return __name_id;
+/* records the nodes waiting for a name, once it has been added */
+static void pending_release(union prov_identifier *id)
+{
+  struct pendinggroup *group;
+
+  if(atomic_load_explicit(&npending, memory_order_relaxed)==0)
+    return;
+  pthread_mutex_lock(&pending_lock);
+  HASH_FIND(hh, pending_hash, id, sizeof(union prov_identifier), group);
+  if(group){
+    __pending_unlink(group);
+    group->newer = NULL;
+  }
+  pthread_mutex_unlock(&pending_lock);
+  if(group)
+    atomic_fetch_add_explicit(&pending_released, pending_record(group), memory_order_relaxed);
+}
+
+/* per worker thread initialised variable */
+static __thread int initialised=0;
+
+/* prov_ops.init, once per thread recording elements */
+static inline void relay_thread_init(void)
+{
+  if(!initialised && prov_ops.init!=NULL){
+    prov_ops.init();
+    initialised=1;
+  }
+}
+
+/* records, without name, the nodes parked before now-PROV_NAME_TIMEOUT */
+static void pending_sweep(uint64_t now)
+{
+  struct pendinggroup *expired;
+
+  if(atomic_load_explicit(&npending, memory_order_relaxed)==0)
+    return;
+  pthread_mutex_lock(&pending_lock);
+  expired = pending_oldest;
+  while(pending_oldest && pending_oldest->deadline<=now){
+    HASH_DEL(pending_hash, pending_oldest);
+    pending_oldest = pending_oldest->newer;
+  }
+  if(expired==pending_oldest)
+    expired = NULL;
+  else if(pending_oldest){
+    pending_oldest->older->newer = NULL;
+    pending_oldest->older = NULL;
+  }else
+    pending_newest = NULL;
+  pthread_mutex_unlock(&pending_lock);
+  if(expired){
+    relay_thread_init(); // e.g. the thread stopping the relay
+    atomic_fetch_add_explicit(&pending_expired, pending_record(expired), memory_order_relaxed);
+  }
+}
+
+/* record a node, unless it has to wait for its name */
+static inline void record_or_park(union prov_elt *msg)
+{
+  if(pending_needed(msg) && pending_park(msg))
+    return;
+  prov_record(msg);
+}
+
+/*
+ * Relations repeated within coalesce_window are held here, see
+ * PROV_COALESCE_COUNT. The table is sharded as the name table is, each
+ * shard keeps its entries in deadline order so that expired ones are found
+ * at its head.
+ */
+#define COALESCE_SHARDS 16 /* must be a power of two */
+#define COALESCE_MAX 65536 /* relations held at most, recorded directly above */
+
+struct coalescekey {
+  uint64_t type;
+  union prov_identifier snd;
+  union prov_identifier rcv;
+  uint64_t flags;
+  uint8_t allowed;
+};
+
+struct coalesceentry {
+  struct coalescekey key; /* zeroed padding, hashed as bytes */
+  UT_hash_handle hh;
+  uint64_t deadline;
+  struct prov_coalesced info;
+  struct coalesceentry *older;
+  struct coalesceentry *newer;
+  union prov_elt msg;
+};
+
+struct coalesceshard {
+  pthread_mutex_t lock;
+  struct coalesceentry *hash;
+  struct coalesceentry *oldest;
+  struct coalesceentry *newest;
+} __attribute__((aligned(64)));
+
+static struct coalesceshard cshards[COALESCE_SHARDS] = {
+  [0 ... COALESCE_SHARDS-1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static _Atomic size_t ncoalesce = 0;
+static _Atomic uint64_t coalesce_merged = 0;
+/* relation being recorded by this thread, see provenance_relation_coalesced */
+static __thread const struct relation_struct *coalesce_rel = NULL;
+static __thread const struct prov_coalesced *coalesce_info = NULL;
+
+static inline struct coalesceshard* coalesce_shard(const struct coalescekey *key)
+{
+  uint64_t h = key->snd.node_id.id ^ (key->rcv.node_id.id << 1) ^ key->type;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return &cshards[h & (COALESCE_SHARDS-1)];
+}
+
+/* must be called with the shard lock held */
+static inline void __coalesce_unlink(struct coalesceshard *shard, struct coalesceentry *entry)
+{
+  HASH_DEL(shard->hash, entry);
+  if(entry->older)
+    entry->older->newer = entry->newer;
+  else
+    shard->oldest = entry->newer;
+  if(entry->newer)
+    entry->newer->older = entry->older;
+  else
+    shard->newest = entry->older;
+}
+
+/* record then free the entries chained through newer */
+static void coalesce_record(struct coalesceentry *entry)
+{
+  struct coalesceentry *next;
+
+  while(entry){
+    next = entry->newer;
+    relation_coalesced_seed(&entry->msg.relation_info, &entry->info);
+    relation_log(&entry->msg);
+    relation_coalesced_seed(NULL, NULL);
+    free(entry);
+    atomic_fetch_sub_explicit(&ncoalesce, 1, memory_order_relaxed);
+    entry = next;
+  }
+}
+
+void relation_coalesced_seed(const struct relation_struct* rel, const struct prov_coalesced* info)
+{
+  coalesce_rel = rel;
+  coalesce_info = info;
+}
+
+bool provenance_relation_coalesced(const struct relation_struct* rel, struct prov_coalesced* info)
+{
+  if(!coalesce_rel || coalesce_rel!=rel || coalesce_info->count<2)
+    return false;
+  if(info)
+    memcpy(info, coalesce_info, sizeof(struct prov_coalesced));
+  return true;
+}
+
+/**
+ * @brief Merges a relation into an identical one held, or holds it.
+ *
+ * The entry held is recorded as soon as coalesce_count relations were
+ * merged into it, otherwise by coalesce_sweep once its window expired.
+ *
+ * @param msg relation to merge
+ *
+ * @return Returns true if the relation was merged or held, false if it must be recorded now.
+ */
+static bool coalesce_hold(union prov_elt *msg)
+{
+  struct coalescekey key;
+  struct coalesceshard *shard;
+  struct coalesceentry *entry;
+  struct coalesceentry *full = NULL;
+  uint32_t count = prov_ops.coalesce_count>0 ? prov_ops.coalesce_count : PROV_COALESCE_COUNT;
+
+  memset(&key, 0, sizeof(struct coalescekey));
+  key.type = prov_type(msg);
+  memcpy(&key.snd, &msg->relation_info.snd, sizeof(union prov_identifier));
+  memcpy(&key.rcv, &msg->relation_info.rcv, sizeof(union prov_identifier));
+  key.flags = msg->relation_info.flags;
+  key.allowed = msg->relation_info.allowed;
+  shard = coalesce_shard(&key);
+  pthread_mutex_lock(&shard->lock);
+  HASH_FIND(hh, shard->hash, &key, sizeof(struct coalescekey), entry);
+  if(entry){
+    entry->info.count++;
+    entry->info.last_jiffies = msg->relation_info.jiffies;
+    provenance_taint_merge(prov_taint(&entry->msg), prov_taint(msg)); // the merged relations all propagate theirs
+    if(entry->info.count>=count){
+      __coalesce_unlink(shard, entry);
+      entry->newer = NULL;
+      full = entry;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add_explicit(&coalesce_merged, 1, memory_order_relaxed);
+    if(full)
+      coalesce_record(full);
+    return true;
+  }
+  if(count<2 || atomic_load_explicit(&ncoalesce, memory_order_relaxed)>=COALESCE_MAX)
+    goto unlock_out;
+  entry = malloc(sizeof(struct coalesceentry));
+  if(!entry)
+    goto unlock_out;
+  memcpy(&entry->key, &key, sizeof(struct coalescekey));
+  memcpy(&entry->msg, msg, sizeof(union prov_elt));
+  entry->deadline = pending_now()+prov_ops.coalesce_window;
+  entry->info.count = 1;
+  entry->info.first_jiffies = msg->relation_info.jiffies;
+  entry->info.last_jiffies = msg->relation_info.jiffies;
+  HASH_ADD(hh, shard->hash, key, sizeof(struct coalescekey), entry);
+  entry->older = shard->newest;
+  entry->newer = NULL;
+  if(shard->newest)
+    shard->newest->newer = entry;
+  else
+    shard->oldest = entry;
+  shard->newest = entry;
+  atomic_fetch_add_explicit(&ncoalesce, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&shard->lock);
+  return true;
+
+unlock_out:
+  pthread_mutex_unlock(&shard->lock);
+  return false;
+}
+
+/* records the relations held since before now-coalesce_window */
+static void coalesce_sweep(uint64_t now)
+{
+  struct coalesceshard *shard;
+  struct coalesceentry *expired;
+  size_t i;
+
+  if(atomic_load_explicit(&ncoalesce, memory_order_relaxed)==0)
+    return;
+  for(i=0; i<COALESCE_SHARDS; i++){
+    shard = &cshards[i];
+    pthread_mutex_lock(&shard->lock);
+    expired = shard->oldest;
+    while(shard->oldest && shard->oldest->deadline<=now){
+      HASH_DEL(shard->hash, shard->oldest);
+      shard->oldest = shard->oldest->newer;
+    }
+    if(expired==shard->oldest)
+      expired = NULL;
+    else if(shard->oldest){
+      shard->oldest->older->newer = NULL;
+      shard->oldest->older = NULL;
+    }else
+      shard->newest = NULL;
+    pthread_mutex_unlock(&shard->lock);
+    if(expired){
+      relay_thread_init();
+      coalesce_record(expired);
+    }
+  }
+}
+
+/* nodes waiting for a name, then relations held, parked before now */
+static inline void relay_sweep(uint64_t now)
+{
+  pending_sweep(now);
+  coalesce_sweep(now);
 }
 
 static inline void record_error(const char* fmt, ...){
@@ -121,6 +746,31 @@ static inline void record_error(const char* fmt, ...){
     prov_ops.log_error(tmp);
 }
 
+/*
+ * prov_ops is shared by the relay, replay and the receiver; the one using
+ * it holds it until stopped, so that another does not swap the callbacks
+ * under its threads. return 0, -EBUSY if held.
+ */
+static int ops_hold(const struct provenance_ops* ops)
+{
+  bool held = false;
+
+  if(!atomic_compare_exchange_strong(&prov_ops_held, &held, true))
+    return -EBUSY;
+  memcpy(&prov_ops, ops, sizeof(struct provenance_ops));
+  return 0;
+}
+
+static inline void ops_release(void)
+{
+  atomic_store(&prov_ops_held, false);
+}
+
+/* a log_* callback has been called */
+static inline void log_count(int callback){
+  stats_add(&stats_self()->records[callback], 1);
+}
+
 int provenance_record_pid( void ){
   int err;
   pid_t pid = getpid();
@@ -144,32 +794,50 @@ int provenance_record_pid( void ){
  * 
  * @param ops - A pointer to the structure containing the provenance operations
  * 
- * @return Returns 0 if the initialization is successful. Returns -1 if any step fails.
+ * @return Returns 0 if the initialization is successful. Returns -EBUSY while workers
+ * abandoned by a previous stop are still running, -1 if any other step fails.
  */
 int provenance_relay_register(struct provenance_ops* ops)
 {
   int err;
 
+  /* workers abandoned by a previous stop would run again */
+  err = reap_abandoned();
+  if(err)
+    return err;
+
   /* the provenance usher will not appear in trace */
   err = provenance_set_opaque(true);
   if(err)
     return err;
 
   /* copy ops function pointers */
-  memcpy(&prov_ops, ops, sizeof(struct provenance_ops));
+  err = ops_hold(ops);
+  if(err)
+    return err;
+  err = overload_init(prov_ops.overload);
+  if(err){
+    ops_release();
+    return err;
+  }
 
-  /* count how many CPU */
-  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
-  if(ncpus>NUMBER_CPUS)
-    return -1;
+  /* resolve type names once rather than in every worker */
+  type_cache_fill();
 
-  /* open relay files */
-  if(open_files())
+  /* one channel pair per possible CPU, opened while it is online */
+  ncpus = cpu_possible();
+  nnodes = cpu_nodes();
+  if(alloc_channels()){
+    destroy_worker_pool(UINT64_MAX);
+    ops_release();
     return -1;
+  }
 
-  /* create callback threads */
+  /* open relay files and create callback threads */
   if(create_worker_pool()){
-    close_files();
+    relay_halt(pending_now());
+    destroy_worker_pool(pending_now()+PROV_STOP_TIMEOUT);
+    ops_release();
     return -1;
   }
 
@@ -181,134 +849,886 @@ int provenance_relay_register(struct provenance_ops* ops)
   return 0;
 }
 
-void provenance_relay_stop()
+/**
+ * @brief Stops the worker threads, giving them until deadline to drain the channels.
+ *
+ * Threads waiting on wake_fd, see relay_wait, return at once; readers and
+ * reactors drain their channels one last time and pipeline workers empty
+ * the rings once the readers are done.
+ *
+ * @param deadline ms, on the pending_now clock
+ */
+static void relay_halt(uint64_t deadline)
+{
+  uint64_t one = 1;
+
+  atomic_store(&stop_deadline, deadline);
+  running = false;
+  if(wake_fd>=0 && write(wake_fd, &one, sizeof(one))<0)
+    record_error("Failed waking up workers (%d).", errno);
+}
+
+static inline bool relay_overdue(void)
+{
+  return pending_now() >= atomic_load_explicit(&stop_deadline, memory_order_relaxed);
+}
+
+/* ms left until deadline, on the pending_now clock */
+static inline uint32_t relay_time_left(uint64_t deadline)
 {
-  running = 0; // worker thread will stop
-  sleep(1); // give them a bit of times
-  close_files();
-  destroy_worker_pool();
+  uint64_t now = pending_now();
+
+  if(deadline<=now)
+    return 0;
+  return deadline-now < UINT32_MAX ? deadline-now : UINT32_MAX-1;
 }
 
 /**
- * @brief Opens the provenance relay files (channels) for reading.
- * 
- * This function opens two types of provenance relay files: relay and long relay.
- * There is one file per CPU, with the file name formed by appending the CPU number to a base path.
- * Example filename: provenance0 for cpu0, provenance1 for cpu1, etc.
- * 
- * @return Returns 0 if all files are successfully opened and -1 if any files cannot be opened.
+ * @brief Hands what the serialisers have batched, in any thread, to their callbacks.
+ *
+ * The compression and sink flushes wait for their thread until deadline at
+ * most, UINT64_MAX for no limit. Writers waiting on the transport window
+ * give up at deadline too.
+ *
+ * @param deadline ms, on the pending_now clock
  */
-static int open_files(void)
+static void relay_flush_output(uint64_t deadline)
 {
-  int i;
-  char tmp[PATH_MAX]; // to store file name
-  char *path;
-  char *long_path;
-
-  path = PROV_RELAY_NAME;
-  long_path = PROV_LONG_RELAY_NAME;
-
-  tmp[0]='\0';
-  for(i=0; i<ncpus; i++){
-    snprintf(tmp, PATH_MAX, "%s%d", path, i);
-    relay_file[i] = open(tmp, O_RDONLY | O_NONBLOCK);
-    if(relay_file[i]<0){
-      record_error("Could not open files %s (%d)\n", tmp, relay_file[i]);
-      return -1;
-    }
-    snprintf(tmp, PATH_MAX, "%s%d", PROV_LONG_RELAY_NAME, i);
-    long_relay_file[i] = open(tmp, O_RDONLY | O_NONBLOCK);
-    if(long_relay_file[i]<0){
-      record_error("Could not open files %s (%d)\n", tmp, long_relay_file[i]);
-      return -1;
-    }
+  if(deadline!=UINT64_MAX)
+    transport_deadline(relay_time_left(deadline));
+  flush_json();
+  flush_spade_json();
+  flush_binary();
+  if(deadline==UINT64_MAX){
+    compress_flush(); // the serialisers may write to it
+    sink_flush(); // any of the above may write to it
+  }else{
+    if(compress_flush_timeout(relay_time_left(deadline))<0)
+      record_error("Compression not flushed before the stop timeout.");
+    if(sink_flush_timeout(relay_time_left(deadline))<0)
+      record_error("Sink not flushed before the stop timeout.");
   }
-  return 0;
+  transport_flush(); // last, as the sink
+  if(deadline!=UINT64_MAX)
+    transport_deadline(PROV_TRANSPORT_NO_DEADLINE);
 }
 
-static int close_files(void)
+/**
+ * @brief Stops the relay once what the kernel has produced is recorded.
+ *
+ * Elements shed since the last overload disclosure are disclosed first. The
+ * kernel is asked to flush its provenance into the relay channels, which
+ * fails harmlessly if the module is absent or we are not allowed to. The
+ * worker threads drain the channels and are joined within stop_timeout ms,
+ * writers blocked on the transport giving up then; workers still in a
+ * callback are abandoned, they return without running the callbacks again. Nodes and relations
+ * still held are then recorded and the serialiser buffers flushed, for at
+ * most stop_timeout ms more.
+ */
+void provenance_relay_stop()
 {
-  int i;
-  for(i=0; i<ncpus;i++){
-    close(relay_file[i]);
-    close(long_relay_file[i]);
-  }
-  return 0;
+  uint32_t timeout = prov_ops.stop_timeout ? prov_ops.stop_timeout : PROV_STOP_TIMEOUT;
+  struct overload_signals signals;
+  uint64_t deadline;
+
+  if(prov_ops.overload && !overload_collect(&signals) && overload_disclose(&signals, false)<0)
+    record_error("Failed disclosing overload (%d).", errno);
+  provenance_flush();
+  deadline = pending_now()+timeout;
+  relay_halt(deadline);
+  transport_deadline(timeout); // callbacks blocked on the transport return in time
+  destroy_worker_pool(deadline);
+  relay_sweep(UINT64_MAX); // record nodes still waiting for a name and relations held
+  relay_flush_output(pending_now()+timeout);
+  ops_release();
 }
 
+/*
+ * Relay channels, two per possible cpu: channels[2*cpu] and the long one
+ * channels[2*cpu+1]. Channels are opened while their cpu is online, see
+ * hotplug_job, and closed by the thread draining them once it goes offline.
+ */
+#define CHANNEL_OFFLINE 0 /* files closed */
+#define CHANNEL_ACTIVE  1
+#define CHANNEL_CLOSING 2 /* cpu offline, to be closed by the thread draining it */
+
+struct channel_group;
+
 struct job_parameters {
   int cpu;
+  int node; /* NUMA node of cpu */
   void (*callback)(void*, const size_t);
+  void (*batch_callback)(void*, const size_t, const size_t);
   int fd;
+  int capture_fd; /* -1 unless capturing */
   size_t size;
+  _Atomic int state;
+  _Atomic bool opened; /* has been active, statistics are reported */
+  bool attached; /* to a reactor or pipeline worker, set by the thread opening channels */
+  struct channel_group* reactor; /* epoll engine, reactor draining the channel */
+  struct reader_pool* pool; /* poll engine, pool the reader job runs in */
+  uint8_t* buf; /* read buffer, allocated on first read */
+  struct relay_ring* ring; /* pipeline mode, channel drained into ring */
+  struct stats_channel stats; /* written by the thread draining the channel */
 };
 
-/**
- * @brief Initializes a thread pool and adds relayfs reader jobs to it.
- * 
- * Each reader job is defined by a set of parameters, including the CPU number,
- * a callback function, a file descriptor for the relay file associated with the CPU, 
- * and the size of the provenance element being read. 
- * 
- * @return Returns 0 on success
+static struct job_parameters** channels=NULL;
+static size_t nchannels=0;
+
+/*
+ * An epoll reactor, or a pipeline worker, and the channels it serves.
+ * Channels are only ever appended, by the thread opening them, channels
+ * has room for all of them.
  */
-static int create_worker_pool(void)
+struct channel_group {
+  int node; /* the thread is bound to the cpus of node, -1 if not bound */
+  int epfd; /* reactors only */
+  _Atomic size_t nchannels;
+  struct job_parameters** channels;
+};
+
+static struct channel_group* reactors=NULL;
+static size_t nreactors=0;
+static struct channel_group* workers=NULL;
+static size_t nworkers=0;
+
+static inline bool use_batch(void)
 {
-  int i;
-  struct job_parameters *params;
-  worker_thpool = thpool_init(ncpus*2);
-  /* set reader jobs */
-  for(i=0; i<ncpus; i++){
-    params = (struct job_parameters*)malloc(sizeof(struct job_parameters)); // will be freed in worker
-    params->cpu = i;
-    params->callback = callback_job;
-    params->fd = relay_file[i];
-    params->size = sizeof(union prov_elt);
-    thpool_add_work(worker_thpool, (void*)reader_job, (void*)params);
-    params = (struct job_parameters*)malloc(sizeof(struct job_parameters)); // will be freed in worker
-    params->cpu = i;
+  return prov_ops.received_prov_batch!=NULL || prov_ops.filter_prov_batch!=NULL;
+}
+
+static inline bool use_long_batch(void)
+{
+  return prov_ops.received_long_prov_batch!=NULL || prov_ops.filter_long_prov_batch!=NULL;
+}
+
+static struct job_parameters* alloc_job_parameters(int cpu, bool is_long)
+{
+  struct job_parameters *params;
+  params = (struct job_parameters*)calloc(1, sizeof(struct job_parameters)); // freed in destroy_worker_pool
+  if(!params)
+    return NULL;
+  params->cpu = cpu;
+  params->fd = -1;
+  params->capture_fd = -1;
+  atomic_init(&params->state, CHANNEL_OFFLINE);
+  atomic_init(&params->opened, false);
+  if(is_long){
     params->callback = long_callback_job;
-    params->fd = long_relay_file[i];
+    params->batch_callback = use_long_batch() ? long_callback_batch_job : NULL;
     params->size = sizeof(union long_prov_elt);
-    thpool_add_work(worker_thpool, (void*)reader_job, (void*)params);
+  }else{
+    params->callback = callback_job;
+    params->batch_callback = use_batch() ? callback_batch_job : NULL;
+    params->size = sizeof(union prov_elt);
+  }
+  return params;
+}
+
+static int alloc_channels(void)
+{
+  int cpu;
+
+  channels = calloc(2*ncpus, sizeof(struct job_parameters*));
+  if(!channels)
+    return -1;
+  nchannels = 2*ncpus;
+  for(cpu=0; cpu<ncpus; cpu++){
+    channels[2*cpu] = alloc_job_parameters(cpu, false);
+    channels[2*cpu+1] = alloc_job_parameters(cpu, true);
+    if(!channels[2*cpu] || !channels[2*cpu+1])
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Opens the relay file of a channel, and its capture file.
+ *
+ * The relay file name is formed by appending the CPU number to a base path,
+ * e.g. provenance0 for cpu0. In pipeline mode, the ring of the channel is
+ * allocated the first time it is opened.
+ *
+ * @param params the channel
+ *
+ * @return Returns 0 on success, -ENOENT if the relay file does not exist and -1 on other errors.
+ */
+static int channel_open(struct job_parameters *params)
+{
+  char tmp[PATH_MAX]; // to store file name
+  bool is_long = params->size==sizeof(union long_prov_elt);
+
+  snprintf(tmp, PATH_MAX, "%s%d", is_long ? PROV_LONG_RELAY_NAME : PROV_RELAY_NAME, params->cpu);
+  params->fd = open(tmp, O_RDONLY | O_NONBLOCK);
+  if(params->fd<0){
+    if(errno==ENOENT)
+      return -ENOENT;
+    record_error("Could not open files %s (%d)\n", tmp, errno);
+    return -1;
+  }
+  if(prov_ops.capture_dir){
+    snprintf(tmp, PATH_MAX, "%s/%s%d", prov_ops.capture_dir, is_long ? LONG_CAPTURE_NAME : CAPTURE_NAME, params->cpu);
+    params->capture_fd = open(tmp, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(params->capture_fd<0){
+      record_error("Could not open files %s (%d)\n", tmp, errno);
+      goto close_out;
+    }
+  }
+  if(prov_ops.pipeline_workers>0 && !params->ring){
+    if(is_long)
+      params->ring = ring_alloc(prov_ops.long_ring_depth ? prov_ops.long_ring_depth : PROV_LONG_RING_DEPTH, params->size);
+    else
+      params->ring = ring_alloc(prov_ops.ring_depth ? prov_ops.ring_depth : PROV_RING_DEPTH, params->size);
+    if(!params->ring){
+      record_error("Failed allocating ring %d (%d).", params->cpu, errno);
+      goto close_out;
+    }
   }
+  params->node = cpu_node(params->cpu);
   return 0;
+
+close_out:
+  channel_close(params);
+  return -1;
 }
 
-static void destroy_worker_pool(void)
+/* the read buffer is kept, it is freed with the channel or by its reader */
+static void channel_close(struct job_parameters *params)
 {
-  thpool_wait(worker_thpool); // wait for all jobs in queue to be finished
-  thpool_destroy(worker_thpool); // destory all worker threads
+  if(params->fd>=0)
+    close(params->fd);
+  if(params->capture_fd>=0)
+    close(params->capture_fd);
+  params->fd = -1;
+  params->capture_fd = -1;
+  atomic_store_explicit(&params->state, CHANNEL_OFFLINE, memory_order_release);
 }
 
-/* per worker thread initialised variable */
-static __thread int initialised=0;
+/* least loaded group bound to node, of all groups if none is */
+static struct channel_group* group_for(struct channel_group* groups, size_t n, int node)
+{
+  struct channel_group* best = NULL;
+  struct channel_group* any = NULL;
+  size_t i;
+
+  for(i=0; i<n; i++){
+    if(!any || groups[i].nchannels<any->nchannels)
+      any = &groups[i];
+    if(groups[i].node==node && (!best || groups[i].nchannels<best->nchannels))
+      best = &groups[i];
+  }
+  return best ? best : any;
+}
+
+static inline void group_add(struct channel_group* group, struct job_parameters *params)
+{
+  size_t n = atomic_load_explicit(&group->nchannels, memory_order_relaxed);
+
+  group->channels[n] = params;
+  atomic_store_explicit(&group->nchannels, n+1, memory_order_release);
+}
+
+static struct reader_pool* reader_pool_add(int slots)
+{
+  struct reader_pool** last = &reader_pools;
+  struct reader_pool* p = (struct reader_pool*)calloc(1, sizeof(struct reader_pool));
+
+  if(!p)
+    return NULL;
+  p->pool = thpool_init(slots);
+  if(!p->pool){
+    free(p);
+    return NULL;
+  }
+  p->slots = slots;
+  while(*last)
+    last = &(*last)->next;
+  *last = p;
+  return p;
+}
+
+/* a reader pool with an idle thread, grown if there is none */
+static struct reader_pool* reader_pool_get(void)
+{
+  struct reader_pool* p;
+
+  for(p=reader_pools; p; p=p->next){
+    if(atomic_load_explicit(&p->used, memory_order_acquire)<p->slots)
+      return p;
+  }
+  return reader_pool_add(READER_POOL_GROWTH);
+}
+
+static void reader_pool_free(void)
+{
+  struct reader_pool* p;
+
+  while((p=reader_pools)){
+    reader_pools = p->next;
+    thpool_wait(p->pool);
+    thpool_destroy(p->pool);
+    free(p);
+  }
+}
+
+/* threads of the pools running a job */
+static int pools_working(void)
+{
+  struct reader_pool* p;
+  int n = worker_thpool ? thpool_num_threads_working(worker_thpool) : 0;
+
+  for(p=reader_pools; p; p=p->next)
+    n += thpool_num_threads_working(p->pool);
+  return n;
+}
+
+/**
+ * @brief Activates a channel whose files have just been opened.
+ *
+ * The first time, the channel is assigned to the least loaded reactor and
+ * pipeline worker of the node of its cpu. With the epoll engine it is then
+ * registered with its reactor, otherwise a reader job is started for it.
+ * The channel is closed again on failure.
+ *
+ * @return Returns 0 on success and -1 on error.
+ */
+static int channel_start(struct job_parameters *params)
+{
+  struct epoll_event ev;
+
+  if(!params->attached){
+    if(nworkers>0)
+      group_add(group_for(workers, nworkers, params->node), params);
+    if(nreactors>0){
+      params->reactor = group_for(reactors, nreactors, params->node);
+      group_add(params->reactor, params);
+    }
+    params->attached = true;
+  }
+  if(params->reactor){
+    ev.events = EPOLLIN|EPOLLRDNORM;
+    ev.data.ptr = params;
+    if(epoll_ctl(params->reactor->epfd, EPOLL_CTL_ADD, params->fd, &ev)<0){
+      record_error("Failed registering relay channel %d (%d).", params->cpu, errno);
+      channel_close(params);
+      return -1;
+    }
+  }
+  atomic_store_explicit(&params->state, CHANNEL_ACTIVE, memory_order_release);
+  atomic_store_explicit(&params->opened, true, memory_order_release);
+  if(params->reactor)
+    return 0;
+  params->pool = reader_pool_get();
+  if(!params->pool){
+    record_error("Failed starting reader %d (%d).", params->cpu, errno);
+    channel_close(params);
+    return -1;
+  }
+  atomic_fetch_add(&params->pool->used, 1);
+  atomic_fetch_add(&ndrainers, 1);
+  if(thpool_add_work(params->pool->pool, (void*)reader_job, (void*)params)){
+    atomic_fetch_sub(&ndrainers, 1);
+    atomic_fetch_sub(&params->pool->used, 1);
+    record_error("Failed starting reader %d.", params->cpu);
+    channel_close(params);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Opens and starts the channels of the cpus online.
+ *
+ * Both channels of every online cpu must exist. Channels of offline cpus
+ * are opened by hotplug_job once they come online.
+ *
+ * @return Returns 0 if all files are successfully opened and -1 if any files cannot be opened.
+ */
+static int open_files(void)
+{
+  struct cpu_set online;
+  int cpu;
+  int i;
+  int rc = -1;
+
+  if(cpu_set_alloc(&online, ncpus))
+    return -1;
+  if(cpu_online(&online, -1)<=0)
+    goto out;
+  for(cpu=0; cpu<ncpus; cpu++){
+    if(!cpu_set_has(&online, cpu))
+      continue;
+    for(i=2*cpu; i<2*cpu+2; i++){
+      if(channel_open(channels[i])){
+        record_error("Could not open relay channel %d.\n", cpu);
+        goto out;
+      }
+      if(channel_start(channels[i]))
+        goto out;
+    }
+  }
+  rc = 0;
+out:
+  cpu_set_free(&online);
+  return rc;
+}
+
+static int close_files(void)
+{
+  size_t i;
+  for(i=0; i<nchannels; i++){
+    if(channels[i] && atomic_load_explicit(&channels[i]->state, memory_order_acquire)!=CHANNEL_OFFLINE)
+      channel_close(channels[i]);
+  }
+  return 0;
+}
+
+/* channels that have been opened, in pipeline mode */
+int provenance_relay_ring_stats(struct prov_ring_stats* stats, size_t n)
+{
+  size_t i;
+  size_t j = 0;
+  struct relay_ring *ring;
+
+  if(nworkers==0)
+    return -1;
+  for(i=0; i<nchannels && j<n; i++){
+    if(!atomic_load_explicit(&channels[i]->opened, memory_order_acquire) || !channels[i]->ring)
+      continue;
+    ring = channels[i]->ring;
+    stats[j].cpu = channels[i]->cpu;
+    stats[j].is_long = channels[i]->size==sizeof(union long_prov_elt);
+    stats[j].depth = ring_depth(ring);
+    stats[j].capacity = ring->mask+1;
+    stats[j].high_water = atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+    stats[j].overflows = atomic_load_explicit(&ring->overflows, memory_order_relaxed);
+    j++;
+  }
+  return j;
+}
+
+/* percent of the fullest ring in use, 0 if not in pipeline mode */
+static uint32_t ring_fill(void)
+{
+  struct relay_ring *ring;
+  uint32_t fill;
+  uint32_t max = 0;
+  size_t i;
+
+  for(i=0; i<nchannels; i++){
+    if(!atomic_load_explicit(&channels[i]->opened, memory_order_acquire) || !channels[i]->ring)
+      continue;
+    ring = channels[i]->ring;
+    fill = ring_depth(ring)*100/(ring->mask+1);
+    if(fill>max)
+      max = fill;
+  }
+  return max;
+}
+
+static void channel_stats(struct job_parameters *params, struct prov_channel_stats* stats)
+{
+  stats->cpu = params->cpu;
+  stats->is_long = params->size==sizeof(union long_prov_elt);
+  stats->elements = atomic_load_explicit(&params->stats.elements, memory_order_relaxed);
+  stats->bytes = atomic_load_explicit(&params->stats.bytes, memory_order_relaxed);
+  stats->reads = atomic_load_explicit(&params->stats.reads, memory_order_relaxed);
+  stats->eagain = atomic_load_explicit(&params->stats.eagain, memory_order_relaxed);
+  stats->errors = atomic_load_explicit(&params->stats.errors, memory_order_relaxed);
+  if(params->ring)
+    stats->overflows = atomic_load_explicit(&params->ring->overflows, memory_order_relaxed);
+  stats_histogram_sum(&params->stats.drain, &stats->drain);
+}
+
+int provenance_relay_stats(struct prov_relay_stats* stats, struct prov_channel_stats* channel_out, size_t n)
+{
+  struct prov_channel_stats channel;
+  struct dropped drop;
+  struct prov_channel_stats* c;
+  size_t i;
+  size_t j = 0;
+
+  memset(stats, 0, sizeof(struct prov_relay_stats));
+  for(i=0; i<nchannels; i++){
+    if(!atomic_load_explicit(&channels[i]->opened, memory_order_acquire))
+      continue;
+    c = j<n ? &channel_out[j] : &channel;
+    memset(c, 0, sizeof(struct prov_channel_stats));
+    channel_stats(channels[i], c);
+    stats->elements += c->elements;
+    stats->bytes += c->bytes;
+    stats->reads += c->reads;
+    stats->eagain += c->eagain;
+    stats->errors += c->errors;
+    stats->overflows += c->overflows;
+    stats_histogram_sum(&channels[i]->stats.drain, &stats->drain);
+    j++;
+  }
+  stats_collect(stats);
+  provenance_name_stats(&stats->names);
+  stats->parked = atomic_load_explicit(&pending_parked, memory_order_relaxed);
+  stats->released = atomic_load_explicit(&pending_released, memory_order_relaxed);
+  stats->expired = atomic_load_explicit(&pending_expired, memory_order_relaxed);
+  stats->coalesced = atomic_load_explicit(&coalesce_merged, memory_order_relaxed);
+  stats->overload = atomic_load_explicit(&overload_level, memory_order_relaxed);
+  if(provenance_dropped(&drop)>0){
+    stats->kernel = true;
+    stats->kernel_dropped = drop.s;
+    stats->kernel_long_dropped = drop.l;
+  }
+  return j<n ? j : n;
+}
+
+/* measures the overload signals, returns 0 or -1 */
+static int overload_collect(struct overload_signals* signals)
+{
+  struct prov_relay_stats* stats;
+
+  stats = (struct prov_relay_stats*)malloc(sizeof(struct prov_relay_stats));
+  if(!stats)
+    return -1;
+  provenance_relay_stats(stats, NULL, 0);
+  signals->ring = ring_fill();
+  signals->callbacks = stats->callback.count;
+  signals->callback_ns = stats->callback.sum;
+  signals->kernel_dropped = stats->kernel_dropped+stats->kernel_long_dropped;
+  signals->shed_packets = stats->shed_packets;
+  signals->shed_relations = stats->shed_relations;
+  free(stats);
+  return 0;
+}
+
+static inline uint32_t pipeline_workers(void)
+{
+  if(prov_ops.pipeline_workers>2*ncpus)
+    return 2*ncpus;
+  return prov_ops.pipeline_workers;
+}
+
+/**
+ * @brief Allocates n channel groups spread over the NUMA nodes.
+ *
+ * Nodes receive groups in proportion to their online cpus, each node with
+ * online cpus receiving one before any receives a second one.
+ *
+ * @param n number of groups
+ * @param node_cpus online cpus of each node
+ * @param with_epoll whether the groups are reactors
+ *
+ * @return Returns the groups, NULL on error.
+ */
+static struct channel_group* alloc_groups(size_t n, const int* node_cpus, bool with_epoll)
+{
+  struct channel_group* groups;
+  size_t* given;
+  size_t i;
+  int k;
+  int best;
+
+  groups = calloc(n, sizeof(struct channel_group));
+  given = calloc(nnodes, sizeof(size_t));
+  if(!groups || !given)
+    goto fail;
+  for(i=0; i<n; i++){
+    groups[i].epfd = -1;
+    atomic_init(&groups[i].nchannels, 0);
+    best = -1;
+    for(k=0; k<nnodes; k++){
+      if(node_cpus[k]<=0)
+        continue;
+      if(best<0 || (uint64_t)node_cpus[k]*(given[best]+1) > (uint64_t)node_cpus[best]*(given[k]+1))
+        best = k;
+    }
+    groups[i].node = best;
+    if(best>=0)
+      given[best]++;
+    groups[i].channels = calloc(nchannels, sizeof(struct job_parameters*));
+    if(!groups[i].channels)
+      goto fail;
+    if(with_epoll){
+      groups[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+      if(groups[i].epfd<0){
+        record_error("Failed creating reactor %d (%d).", (int)i, errno);
+        goto fail;
+      }
+    }
+  }
+  free(given);
+  return groups;
+
+fail:
+  free(given);
+  free_groups(groups, n);
+  return NULL;
+}
+
+static void free_groups(struct channel_group* groups, size_t n)
+{
+  size_t i;
+
+  if(!groups)
+    return;
+  for(i=0; i<n; i++){
+    if(groups[i].epfd>=0)
+      close(groups[i].epfd);
+    free(groups[i].channels);
+  }
+  free(groups);
+}
+
+/**
+ * @brief Sizes the epoll reactors, by default one per PROV_REACTOR_CPUS
+ * online cpus of each node.
+ */
+static size_t reactors_needed(const int* node_cpus, int online)
+{
+  size_t n = prov_ops.reactors;
+  int k;
+
+  if(n==0){
+    for(k=0; k<nnodes; k++)
+      n += (node_cpus[k]+PROV_REACTOR_CPUS-1)/PROV_REACTOR_CPUS;
+  }
+  if(n>online)
+    n = online;
+  return n>0 ? n : 1;
+}
+
+/**
+ * @brief Initializes a thread pool and adds the relay jobs to it.
+ *
+ * With PROV_READER_POLL there is one reader job per channel, bound to the
+ * cpu of the channel. With PROV_READER_EPOLL, channels are served by a few
+ * reactors bound to the cpus of a NUMA node, each channel being assigned to
+ * a reactor of the node of its cpu. In pipeline mode, pipeline workers are
+ * spread over the nodes in the same way and consume the rings of the
+ * channels of their node. hotplug_job opens the channels of cpus coming
+ * online, growing the reader pools if needed, see reader_pool_get; the
+ * reactors are sized for the cpus online at start.
+ *
+ * @return Returns 0 on success
+ */
+static int create_worker_pool(void)
+{
+  struct epoll_event ev;
+  struct cpu_set set;
+  int* node_cpus;
+  int online = 0;
+  int k;
+  size_t i;
+  size_t nthreads;
+  int rc = -1;
+
+  node_cpus = calloc(nnodes, sizeof(int));
+  if(!node_cpus || cpu_set_alloc(&set, ncpus)){
+    free(node_cpus);
+    return -1;
+  }
+  for(k=0; k<nnodes; k++){
+    node_cpus[k] = cpu_online(&set, k);
+    if(node_cpus[k]<0)
+      node_cpus[k] = 0;
+    online += node_cpus[k];
+  }
+  if(online==0)
+    online = cpu_online(&set, -1);
+  cpu_set_free(&set);
+
+  running = true;
+  atomic_store(&stop_deadline, UINT64_MAX);
+  wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if(wake_fd<0)
+    goto out;
+
+  if(prov_ops.reader_engine==PROV_READER_EPOLL){
+    nreactors = reactors_needed(node_cpus, online);
+    reactors = alloc_groups(nreactors, node_cpus, true);
+    if(!reactors){
+      nreactors = 0;
+      goto out;
+    }
+    nthreads = nreactors;
+  }else{
+    nthreads = 0;
+    if(!reader_pool_add(online>0 ? 2*online : READER_POOL_GROWTH))
+      goto out;
+  }
+  nworkers = pipeline_workers();
+  if(nworkers>0){
+    workers = alloc_groups(nworkers, node_cpus, false);
+    if(!workers){
+      nworkers = 0;
+      goto out;
+    }
+  }
+
+  for(i=0; i<nreactors; i++){
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, wake_fd, &ev)<0)
+      goto out;
+  }
+
+  worker_thpool = thpool_init(nthreads+nworkers+(prov_ops.overload ? 2 : 1));
+  if(!worker_thpool)
+    goto out;
+  if(open_files())
+    goto out;
+  for(i=0; i<nreactors; i++){
+    atomic_fetch_add(&ndrainers, 1);
+    if(thpool_add_work(worker_thpool, (void*)reactor_job, (void*)&reactors[i]))
+      atomic_fetch_sub(&ndrainers, 1);
+  }
+  for(i=0; i<nworkers; i++)
+    thpool_add_work(worker_thpool, (void*)pipeline_job, (void*)&workers[i]);
+  thpool_add_work(worker_thpool, (void*)hotplug_job, NULL);
+  if(prov_ops.overload)
+    thpool_add_work(worker_thpool, (void*)overload_job, NULL);
+  rc = 0;
+out:
+  free(node_cpus);
+  return rc;
+}
+
+/**
+ * @brief Joins the worker threads and frees what they used.
+ *
+ * Jobs are given until deadline to return, UINT64_MAX for no limit. Past
+ * it, the pool and everything its jobs may still touch is left allocated,
+ * so that a callback stuck e.g. writing to a file does not hold up the
+ * stop for ever nor see its memory go. The pools are kept aside until
+ * their jobs have returned, see reap_abandoned.
+ *
+ * @param deadline ms, on the pending_now clock
+ */
+static void destroy_worker_pool(uint64_t deadline)
+{
+  size_t i;
+  size_t n = nchannels;
+  const struct timespec poll = {0, 10*1000*1000};
+
+  if(worker_thpool || reader_pools){
+    while(deadline!=UINT64_MAX && pools_working()>0){
+      if(pending_now()>=deadline){
+        record_error("Stop deadline reached, %d workers abandoned.", pools_working());
+        atomic_fetch_add(&relay_gen, 1);
+        abandoned_thpool = worker_thpool;
+        abandoned_readers = reader_pools;
+        worker_thpool = NULL;
+        reader_pools = NULL;
+        channels = NULL; // still used by the readers
+        nchannels = 0;
+        reactors = NULL;
+        nreactors = 0;
+        workers = NULL;
+        nworkers = 0;
+        wake_fd = -1;
+        return;
+      }
+      nanosleep(&poll, NULL);
+    }
+    reader_pool_free();
+    if(worker_thpool){
+      thpool_wait(worker_thpool); // wait for all jobs in queue to be finished
+      thpool_destroy(worker_thpool); // destory all worker threads
+      worker_thpool = NULL;
+    }
+  }
+  if(channels)
+    close_files(); // no thread is reading them anymore
+  if(wake_fd>=0){
+    close(wake_fd);
+    wake_fd = -1;
+  }
+  free_groups(reactors, nreactors);
+  reactors = NULL;
+  nreactors = 0;
+  free_groups(workers, nworkers);
+  workers = NULL;
+  nworkers = 0;
+  nchannels = 0;
+  for(i=0; i<n && channels; i++){
+    if(!channels[i])
+      continue;
+    if(channels[i]->ring)
+      ring_free(channels[i]->ring);
+    if(channels[i]->buf)
+      free_read_buffer(channels[i]->buf, channels[i]->size);
+    free(channels[i]);
+  }
+  free(channels);
+  channels = NULL;
+}
+
+/**
+ * @brief Frees the pools abandoned by a previous stop once their jobs have returned.
+ *
+ * @return Returns 0, or -EBUSY while a job of theirs is still running.
+ */
+static int reap_abandoned(void)
+{
+  struct reader_pool* p;
+  int n = abandoned_thpool ? thpool_num_threads_working(abandoned_thpool) : 0;
+
+  for(p=abandoned_readers; p; p=p->next)
+    n += thpool_num_threads_working(p->pool);
+  if(n>0){
+    record_error("%d workers abandoned by the last stop still running.", n);
+    return -EBUSY;
+  }
+  while((p=abandoned_readers)){
+    abandoned_readers = p->next;
+    thpool_destroy(p->pool);
+    free(p);
+  }
+  if(abandoned_thpool){
+    thpool_destroy(abandoned_thpool);
+    abandoned_thpool = NULL;
+  }
+  return 0;
+}
 
 /**
  * @brief Record a provenance relation based on its type.
  * 
  * This function examines the type of a provenance relation element and calls 
- * the appropriate logging function.
+ * the appropriate logging function. If coalesce_window is set, the relation
+ * may instead be merged into an identical one held, see coalesce_hold.
  *
  * @param msg - A pointer to union prov_elt element
  */
 void relation_record(union prov_elt *msg){
+  if(prov_ops.coalesce_window>0 && coalesce_hold(msg))
+    return;
+  relation_log(msg);
+}
+
+/* calls the log_* callback of a relation */
+static void relation_log(union prov_elt *msg){
   uint64_t type = prov_type(msg);
 
-  if(prov_is_used(type) &&  prov_ops.log_used!=NULL)
+  if(prov_is_used(type) && prov_ops.log_used!=NULL){
     prov_ops.log_used(&(msg->relation_info));
-  else if(prov_is_informed(type) && prov_ops.log_informed!=NULL)
+    log_count(PROV_LOG_USED);
+  }else if(prov_is_informed(type) && prov_ops.log_informed!=NULL){
     prov_ops.log_informed(&(msg->relation_info));
-  else if(prov_is_generated(type) && prov_ops.log_generated!=NULL)
+    log_count(PROV_LOG_INFORMED);
+  }else if(prov_is_generated(type) && prov_ops.log_generated!=NULL){
     prov_ops.log_generated(&(msg->relation_info));
-  else if(prov_is_derived(type) && prov_ops.log_derived!=NULL)
+    log_count(PROV_LOG_GENERATED);
+  }else if(prov_is_derived(type) && prov_ops.log_derived!=NULL){
     prov_ops.log_derived(&(msg->relation_info));
-  else if(prov_is_influenced(type) && prov_ops.log_influenced!=NULL)
+    log_count(PROV_LOG_DERIVED);
+  }else if(prov_is_influenced(type) && prov_ops.log_influenced!=NULL){
     prov_ops.log_influenced(&(msg->relation_info));
-  else if(prov_is_associated(type) && prov_ops.log_associated!=NULL)
+    log_count(PROV_LOG_INFLUENCED);
+  }else if(prov_is_associated(type) && prov_ops.log_associated!=NULL){
     prov_ops.log_associated(&(msg->relation_info));
-  else
+    log_count(PROV_LOG_ASSOCIATED);
+  }else{
+    stats_add(&stats_self()->unknown, 1);
     record_error("Error: unknown relation type %llx\n", prov_type(msg));
+  }
 }
 
 /**
@@ -322,12 +1742,16 @@ void relation_record(union prov_elt *msg){
 void node_record(union prov_elt *msg){
   switch(prov_type(msg)){
     case ENT_PROC:
-      if(prov_ops.log_proc!=NULL)
+      if(prov_ops.log_proc!=NULL){
         prov_ops.log_proc(&(msg->proc_info));
+        log_count(PROV_LOG_PROC);
+      }
       break;
     case ACT_TASK:
-      if(prov_ops.log_task!=NULL)
+      if(prov_ops.log_task!=NULL){
         prov_ops.log_task(&(msg->task_info));
+        log_count(PROV_LOG_TASK);
+      }
       break;
     case ENT_INODE_UNKNOWN:
     case ENT_INODE_LINK:
@@ -337,26 +1761,37 @@ void node_record(union prov_elt *msg){
     case ENT_INODE_BLOCK:
     case ENT_INODE_PIPE:
     case ENT_INODE_SOCKET:
-      if(prov_ops.log_inode!=NULL)
+      if(prov_ops.log_inode!=NULL){
         prov_ops.log_inode(&(msg->inode_info));
+        log_count(PROV_LOG_INODE);
+      }
       break;
     case ENT_MSG:
-      if(prov_ops.log_msg!=NULL)
+      if(prov_ops.log_msg!=NULL){
         prov_ops.log_msg(&(msg->msg_msg_info));
+        log_count(PROV_LOG_MSG);
+      }
       break;
     case ENT_SHM:
-      if(prov_ops.log_shm!=NULL)
+      if(prov_ops.log_shm!=NULL){
         prov_ops.log_shm(&(msg->shm_info));
+        log_count(PROV_LOG_SHM);
+      }
       break;
     case ENT_PACKET:
-      if(prov_ops.log_packet!=NULL)
+      if(prov_ops.log_packet!=NULL){
         prov_ops.log_packet(&(msg->pck_info));
+        log_count(PROV_LOG_PACKET);
+      }
       break;
     case ENT_IATTR:
-      if(prov_ops.log_iattr!=NULL)
+      if(prov_ops.log_iattr!=NULL){
         prov_ops.log_iattr(&(msg->iattr_info));
+        log_count(PROV_LOG_IATTR);
+      }
       break;
     default:
+      stats_add(&stats_self()->unknown, 1);
       record_error("Error: unknown node type %llx\n", prov_type(msg));
       break;
   }
@@ -393,69 +1828,202 @@ static void callback_job(void* data, const size_t prov_size)
   }
   msg = (union prov_elt*)data;
   /* initialise per worker thread */
-  if(!initialised && prov_ops.init!=NULL){
-    prov_ops.init();
-    initialised=1;
-  }
+  relay_thread_init();
 
   if(prov_ops.received_prov!=NULL)
     prov_ops.received_prov(msg);
   if(prov_ops.is_query)
     return;
   // dealing with filter
-  if(prov_ops.filter==NULL)
-    goto out;
-  if(prov_ops.filter((prov_entry_t*)msg)) // message has been fitlered
+  if(provenance_filter((prov_entry_t*)msg)
+    || (prov_ops.filter!=NULL && prov_ops.filter((prov_entry_t*)msg))){ // message has been fitlered
+    stats_add(&stats_self()->filtered, 1);
     return;
-out:
-  prov_record(msg);
+  }
+  if(overload_shed((prov_entry_t*)msg))
+    return;
+  record_or_park(msg);
 }
 
-void long_prov_record(union long_prov_elt* msg){
-  switch(prov_type(msg)){
-    case ENT_STR:
-      if(prov_ops.log_str!=NULL)
-        prov_ops.log_str(&(msg->str_info));
-      break;
-    case ENT_PATH:
-      name_add_entry(&(msg->file_name_info.identifier), msg->file_name_info.name);
-      if(prov_ops.log_file_name!=NULL)
-        prov_ops.log_file_name(&(msg->file_name_info));
-      break;
-    case ENT_ADDR:
-      if(prov_ops.log_address!=NULL)
-        prov_ops.log_address(&(msg->address_info));
-      break;
-    case ENT_XATTR:
-      if(prov_ops.log_xattr!=NULL)
-        prov_ops.log_xattr(&(msg->xattr_info));
-      break;
-    case ENT_DISC:
-      if(prov_ops.log_ent_disc!=NULL)
-        prov_ops.log_ent_disc(&(msg->disc_node_info));
-      break;
-    case ACT_DISC:
-      if(prov_ops.log_act_disc!=NULL)
-        prov_ops.log_act_disc(&(msg->disc_node_info));
-      break;
-    case AGT_DISC:
-      if(prov_ops.log_agt_disc!=NULL)
-        prov_ops.log_agt_disc(&(msg->disc_node_info));
-      break;
+/**
+ * @brief Resolves the security contexts a batch refers to.
+ *
+ * Done once per batch so that cold secids are queried through a single
+ * file descriptor rather than one at a time while serialising.
+ *
+ * @param msgs Pointer to the first prov_elt union.
+ * @param n Number of elements in the array.
+ * @param filtered Elements flagged true are skipped.
+ */
+static inline void prefetch_secctx(union prov_elt* msgs, const size_t n, const bool* filtered)
+{
+  uint32_t secids[PROV_RELAY_BATCH_LENGTH];
+  size_t count = 0;
+  size_t i;
+
+  for(i=0; i<n; i++){
+    if(filtered[i])
+      continue;
+    switch(prov_type(&msgs[i])){
+      case ENT_PROC:
+        secids[count++] = msgs[i].proc_info.secid;
+        break;
+      case ACT_TASK:
+        secids[count++] = msgs[i].task_info.secid;
+        break;
+      case ENT_INODE_UNKNOWN:
+      case ENT_INODE_LINK:
+      case ENT_INODE_FILE:
+      case ENT_INODE_DIRECTORY:
+      case ENT_INODE_CHAR:
+      case ENT_INODE_BLOCK:
+      case ENT_INODE_PIPE:
+      case ENT_INODE_SOCKET:
+        secids[count++] = msgs[i].inode_info.secid;
+        break;
+      default:
+        break;
+    }
+  }
+  if(count>0)
+    provenance_secctx_prefetch(secids, count);
+}
+
+/**
+ * @brief Callback function executed on receiving an array of prov_elt union
+ *
+ * Batch counterpart of callback_job. The whole relay read is handed to the
+ * batch callbacks in one call, per element callbacks are used as fallback
+ * when their batch equivalent is not provided.
+ *
+ * @param data Pointer to the first prov_elt union.
+ * @param prov_size The size of the prov_elt union.
+ * @param n Number of elements in the array.
+ */
+static void callback_batch_job(void* data, const size_t prov_size, const size_t n)
+{
+  union prov_elt* msgs;
+  bool filtered[PROV_RELAY_BATCH_LENGTH];
+  size_t nfiltered = 0;
+  size_t kept = n;
+  size_t i;
+
+  if(prov_size!=sizeof(union prov_elt)){
+    record_error("Wrong size %d expected: %d.", prov_size, sizeof(union prov_elt));
+    return;
+  }
+  msgs = (union prov_elt*)data;
+  /* initialise per worker thread */
+  relay_thread_init();
+
+  if(prov_ops.received_prov_batch!=NULL)
+    prov_ops.received_prov_batch(msgs, n);
+  else if(prov_ops.received_prov!=NULL){
+    for(i=0; i<n; i++)
+      prov_ops.received_prov(&msgs[i]);
+  }
+  if(prov_ops.is_query)
+    return;
+  // dealing with filter, rule set first
+  provenance_filter_batch(msgs, n, filtered);
+  if(prov_ops.filter_prov_batch!=NULL){
+    // elements the rules dropped are left out, survivors moved to the front in order
+    kept = 0;
+    for(i=0; i<n; i++){
+      if(filtered[i]){
+        nfiltered++;
+        continue;
+      }
+      if(kept!=i)
+        memcpy(&msgs[kept], &msgs[i], sizeof(union prov_elt));
+      kept++;
+    }
+    memset(filtered, 0, kept*sizeof(bool));
+    if(kept>0)
+      prov_ops.filter_prov_batch(msgs, kept, filtered);
+  }else if(prov_ops.filter!=NULL){
+    for(i=0; i<n; i++){
+      if(!filtered[i])
+        filtered[i] = prov_ops.filter((prov_entry_t*)&msgs[i]);
+    }
+  }
+  prefetch_secctx(msgs, kept, filtered);
+  for(i=0; i<kept; i++){
+    if(filtered[i])
+      nfiltered++;
+    else if(!overload_shed((prov_entry_t*)&msgs[i])) // message has not been filtered nor shed
+      record_or_park(&msgs[i]);
+  }
+  stats_add(&stats_self()->filtered, nfiltered);
+}
+
+void long_prov_record(union long_prov_elt* msg){
+  switch(prov_type(msg)){
+    case ENT_STR:
+      if(prov_ops.log_str!=NULL){
+        prov_ops.log_str(&(msg->str_info));
+        log_count(PROV_LOG_STR);
+      }
+      break;
+    case ENT_PATH:
+      name_add_entry(&(msg->file_name_info.identifier), msg->file_name_info.name);
+      if(prov_ops.log_file_name!=NULL){
+        prov_ops.log_file_name(&(msg->file_name_info));
+        log_count(PROV_LOG_FILE_NAME);
+      }
+      pending_release(&(msg->file_name_info.identifier));
+      break;
+    case ENT_ADDR:
+      if(prov_ops.log_address!=NULL){
+        prov_ops.log_address(&(msg->address_info));
+        log_count(PROV_LOG_ADDRESS);
+      }
+      break;
+    case ENT_XATTR:
+      if(prov_ops.log_xattr!=NULL){
+        prov_ops.log_xattr(&(msg->xattr_info));
+        log_count(PROV_LOG_XATTR);
+      }
+      break;
+    case ENT_DISC:
+      if(prov_ops.log_ent_disc!=NULL){
+        prov_ops.log_ent_disc(&(msg->disc_node_info));
+        log_count(PROV_LOG_ENT_DISC);
+      }
+      break;
+    case ACT_DISC:
+      if(prov_ops.log_act_disc!=NULL){
+        prov_ops.log_act_disc(&(msg->disc_node_info));
+        log_count(PROV_LOG_ACT_DISC);
+      }
+      break;
+    case AGT_DISC:
+      if(prov_ops.log_agt_disc!=NULL){
+        prov_ops.log_agt_disc(&(msg->disc_node_info));
+        log_count(PROV_LOG_AGT_DISC);
+      }
+      break;
     case ENT_PCKCNT:
-      if(prov_ops.log_packet_content!=NULL)
+      if(prov_ops.log_packet_content!=NULL){
         prov_ops.log_packet_content(&(msg->pckcnt_info));
+        log_count(PROV_LOG_PACKET_CONTENT);
+      }
       break;
     case ENT_ARG:
     case ENT_ENV:
-      if(prov_ops.log_arg!=NULL)
+      if(prov_ops.log_arg!=NULL){
         prov_ops.log_arg(&(msg->arg_info));
+        log_count(PROV_LOG_ARG);
+      }
       break;
     case AGT_MACHINE:
-      if(prov_ops.log_machine!=NULL)
+      if(prov_ops.log_machine!=NULL){
         prov_ops.log_machine(&(msg->machine_info));
+        log_count(PROV_LOG_MACHINE);
+      }
       break;
     default:
+      stats_add(&stats_self()->unknown, 1);
       record_error("Error: unknown node long type %llx\n", prov_type(msg));
       break;
   }
@@ -472,90 +2040,354 @@ static void long_callback_job(void* data, const size_t prov_size)
   msg = (union long_prov_elt*)data;
 
   /* initialise per worker thread */
-  if(!initialised && prov_ops.init!=NULL){
-    prov_ops.init();
-    initialised=1;
-  }
+  relay_thread_init();
 
   if(prov_ops.received_long_prov!=NULL)
     prov_ops.received_long_prov(msg);
   if(prov_ops.is_query)
     return;
   // dealing with filter
-  if(prov_ops.filter==NULL)
-    goto out;
-  if(prov_ops.filter((prov_entry_t*)msg)) // message has been fitlered
+  if(provenance_filter((prov_entry_t*)msg)
+    || (prov_ops.filter!=NULL && prov_ops.filter((prov_entry_t*)msg))){ // message has been fitlered
+    stats_add(&stats_self()->filtered, 1);
+    return;
+  }
+  if(overload_shed((prov_entry_t*)msg))
     return;
-out:
   long_prov_record(msg);
 }
 
-/* buffer_size for each relayfs read, process 1000 prov_elt at each round */
-#define buffer_size(prov_size) (prov_size*1000)
+/* batch counterpart of long_callback_job, see callback_batch_job */
+static void long_callback_batch_job(void* data, const size_t prov_size, const size_t n)
+{
+  union long_prov_elt* msgs;
+  bool filtered[PROV_RELAY_BATCH_LENGTH];
+  size_t nfiltered = 0;
+  size_t kept = n;
+  size_t i;
+
+  if(prov_size!=sizeof(union long_prov_elt)){
+    record_error("Wrong size %d expected: %d.", prov_size, sizeof(union long_prov_elt));
+    return;
+  }
+  msgs = (union long_prov_elt*)data;
+
+  /* initialise per worker thread */
+  relay_thread_init();
+
+  if(prov_ops.received_long_prov_batch!=NULL)
+    prov_ops.received_long_prov_batch(msgs, n);
+  else if(prov_ops.received_long_prov!=NULL){
+    for(i=0; i<n; i++)
+      prov_ops.received_long_prov(&msgs[i]);
+  }
+  if(prov_ops.is_query)
+    return;
+  // dealing with filter, rule set first
+  provenance_filter_long_batch(msgs, n, filtered);
+  if(prov_ops.filter_long_prov_batch!=NULL){
+    // elements the rules dropped are left out, survivors moved to the front in order
+    kept = 0;
+    for(i=0; i<n; i++){
+      if(filtered[i]){
+        nfiltered++;
+        continue;
+      }
+      if(kept!=i)
+        memcpy(&msgs[kept], &msgs[i], sizeof(union long_prov_elt));
+      kept++;
+    }
+    memset(filtered, 0, kept*sizeof(bool));
+    if(kept>0)
+      prov_ops.filter_long_prov_batch(msgs, kept, filtered);
+  }else if(prov_ops.filter!=NULL){
+    for(i=0; i<n; i++){
+      if(!filtered[i])
+        filtered[i] = prov_ops.filter((prov_entry_t*)&msgs[i]);
+    }
+  }
+  for(i=0; i<kept; i++){
+    if(filtered[i])
+      nfiltered++;
+    else if(!overload_shed((prov_entry_t*)&msgs[i])) // message has not been filtered nor shed
+      long_prov_record(&msgs[i]);
+  }
+  stats_add(&stats_self()->filtered, nfiltered);
+}
+
+/* buffer_size for each relayfs read, process PROV_RELAY_BATCH_LENGTH prov_elt at each round */
+#define buffer_size(prov_size) (prov_size*PROV_RELAY_BATCH_LENGTH)
+
+/**
+ * @brief Allocates the buffer a reader job reads relayfs data into.
+ *
+ * The buffer is mapped once per reader and reused for every read, so that
+ * the multi-megabyte buffer needed for union long_prov_elt is not
+ * allocated, faulted in and freed at each poll wakeup.
+ *
+ * @param prov_size size of the elements read, i.e. size of union prov_elt
+ *
+ * @return Returns a pointer to the buffer or NULL on failure.
+ */
+static uint8_t* alloc_read_buffer(const size_t prov_size)
+{
+  void* buf = mmap(NULL, buffer_size(prov_size), PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  if(buf==MAP_FAILED)
+    return NULL;
+  return (uint8_t*)buf;
+}
+
+static void free_read_buffer(uint8_t* buf, const size_t prov_size)
+{
+  munmap(buf, buffer_size(prov_size));
+}
+
+/**
+ * @brief Appends the bytes read from a relay channel to its capture file.
+ *
+ * Called before the callbacks run, so that the capture holds the data as
+ * produced by the kernel.
+ *
+ * @param capture_fd the capture file, nothing is done if negative
+ * @param buf the data read
+ * @param size number of bytes read, a whole number of elements
+ */
+static void capture_relay(const int capture_fd, const uint8_t* buf, size_t size)
+{
+  int rc;
+
+  if(capture_fd<0)
+    return;
+  while(size>0){
+    rc = write(capture_fd, buf, size);
+    if(rc<0){
+      if(errno==EINTR)
+        continue;
+      record_error("Failed while capturing (%d).", errno);
+      return;
+    }
+    buf += rc;
+    size -= rc;
+  }
+}
+
+/**
+ * @brief Runs the callbacks on n elements, timing them as a whole.
+ *
+ * Scratch memory the callbacks took from the thread arena is reclaimed
+ * once they have returned.
+ * @param buf the first element
+ * @param prov_size size of the elements, i.e. size of union prov_elt
+ * @param n number of elements
+ * @param callback called for each element if batch_callback is NULL
+ * @param batch_callback if not NULL, called once with all the elements
+ */
+static void run_callbacks(uint8_t* buf,
+                          const size_t prov_size,
+                          const size_t n,
+                          void (*callback)(void*, const size_t),
+                          void (*batch_callback)(void*, const size_t, const size_t)){
+  struct stats_thread* self = stats_self();
+  uint64_t start = stats_now();
+  size_t i;
+
+  if(batch_callback!=NULL)
+    batch_callback(buf, prov_size, n);
+  else{
+    for(i=0; i<n; i++)
+      callback(buf+i*prov_size, prov_size);
+  }
+  stats_record(&self->callback, stats_now()-start);
+  arena_reset(arena_self()); // scratch memory only lasts a chunk
+}
 
 /**
  * @brief This function ___read_relay reads data from a file descriptor, processes
  * the data in chunks of prov_elt size, and then calls a callback function with
  * each processed chunk.
  *
+ * Callbacks receive pointers directly into buf, buf is only reused for the
+ * next read once all the callbacks have returned.
+ *
  * @param relay_file representing the file descriptor of relay file
+ * @param capture_fd capture file the data read is appended to, -1 if none
+ * @param stats counters of the channel
+ * @param buf reader buffer of buffer_size(prov_size) bytes
  * @param prov_size size of data chunks to be processed, i.e. size of union prov_elt
  * @param callback function pointer that will be called for each processed data chunk
+ * @param batch_callback if not NULL, called once with all the chunks read instead of callback
+ *
+ * @return Returns the number of bytes processed.
  */
-static void ___read_relay(const int relay_file, const size_t prov_size, void (*callback)(void*, const size_t)){
-	uint8_t *buf;
-	uint8_t* entry;
+static size_t ___read_relay(const int relay_file,
+                          const int capture_fd,
+                          struct stats_channel* stats,
+                          uint8_t* buf,
+                          const size_t prov_size,
+                          void (*callback)(void*, const size_t),
+                          void (*batch_callback)(void*, const size_t, const size_t)){
   size_t size=0;
-  size_t i=0;
   int rc;
-	buf = (uint8_t*)malloc(buffer_size(prov_size));
 	do{
 		rc = read(relay_file, buf+size, buffer_size(prov_size)-size);
+    stats_add(&stats->reads, 1);
 		if(rc<0){
 			record_error("Failed while reading (%d).", errno);
-			if(errno==EAGAIN) // retry
+			if(errno==EAGAIN){ // retry
+        stats_add(&stats->eagain, 1);
 				continue;
-			free(buf);
-			return;
+      }
+      stats_add(&stats->errors, 1);
+			return 0;
 		}
 		size += rc;
 	}while(size%prov_size!=0);
+  if(size==0)
+    return 0;
+  stats_add(&stats->bytes, size);
+  stats_add(&stats->elements, size/prov_size);
+  capture_relay(capture_fd, buf, size);
 
-  /**
-   * The while loop processes the data in chunks of size prov_size. For each chunk,
-   * it sets the entry pointer to the current position in the buffer, updates the
-   * size and i variables, and calls the callback function with the current chunk
-   * and its size, each buffer should contains 1000 prov_elt.
-   */
-	while(size>0){
-		entry = buf+i;
-		size-=prov_size;
-		i+=prov_size;
-		callback(entry, prov_size);
-	}
-	free(buf);
+  /* each buffer should contains up to PROV_RELAY_BATCH_LENGTH prov_elt */
+  run_callbacks(buf, prov_size, size/prov_size, callback, batch_callback);
+  return size;
 }
 
 /**
- * @brief Sets the CPU affinity of the current thread.
+ * @brief Pipeline counterpart of ___read_relay, reads relayfs data directly
+ * into the free slots of a ring and publishes them to the consumer.
  *
- * @param core_id The ID of the core to which the current thread should be bound.
- * This value should be between 0 and (ncpus - 1), where ncpus is the total number of available cpus.
+ * At most two reads are needed to fill the ring, one up to its end and one
+ * after wrapping around. A full ring is counted as an overflow and the
+ * remaining data is left in relayfs.
+ *
+ * @param relay_file representing the file descriptor of relay file
+ * @param capture_fd capture file the data read is appended to, -1 if none
+ * @param stats counters of the channel
+ * @param ring ring the channel is drained into
+ * @param prov_size size of the elements read, i.e. size of union prov_elt
+ * @param full set to true if more data is likely pending in relayfs
+ * @param stalled set to true if the ring was found full
+ *
+ * @return Returns the number of bytes queued.
+ */
+static size_t ___queue_relay(const int relay_file,
+                            const int capture_fd,
+                            struct stats_channel* stats,
+                            struct relay_ring* ring,
+                            const size_t prov_size,
+                            bool* full,
+                            bool* stalled){
+  uint8_t* buf;
+  size_t n;
+  size_t size;
+  size_t total=0;
+  int rc;
+
+  do{
+    buf = ring_reserve(ring, &n);
+    if(n==0){
+      atomic_fetch_add_explicit(&ring->overflows, 1, memory_order_relaxed);
+      *stalled = true;
+      return total;
+    }
+    size=0;
+    do{
+      rc = read(relay_file, buf+size, n*prov_size-size);
+      stats_add(&stats->reads, 1);
+      if(rc<0){
+        record_error("Failed while reading (%d).", errno);
+        if(errno==EAGAIN){ // retry
+          stats_add(&stats->eagain, 1);
+          continue;
+        }
+        stats_add(&stats->errors, 1);
+        return total;
+      }
+      size += rc;
+    }while(size%prov_size!=0);
+    capture_relay(capture_fd, buf, size);
+    if(size>0){
+      stats_add(&stats->bytes, size);
+      stats_add(&stats->elements, size/prov_size);
+      ring_publish(ring, size/prov_size);
+    }
+    total += size;
+  }while(size==n*prov_size && size>0);
+  if(total>=buffer_size(prov_size))
+    *full = true;
+  return total;
+}
+
+/* drain a relay channel, either into its ring or through the callbacks */
+static inline size_t relay_drain(struct job_parameters *params, bool *full, bool *stalled)
+{
+  uint64_t start = stats_now();
+  size_t rc;
+  if(params->ring)
+    rc = ___queue_relay(params->fd, params->capture_fd, &params->stats, params->ring, params->size, full, stalled);
+  else{
+    if(!params->buf){
+      params->buf = alloc_read_buffer(params->size);
+      if(!params->buf){
+        record_error("Failed allocating read buffer (%d).", errno);
+        return 0;
+      }
+    }
+    rc = ___read_relay(params->fd, params->capture_fd, &params->stats, params->buf, params->size, params->callback, params->batch_callback);
+    if(rc==buffer_size(params->size))
+      *full = true;
+    relay_sweep(pending_now());
+  }
+  if(rc>0)
+    stats_record(&params->stats.drain, stats_now()-start);
+  return rc;
+}
+
+/**
+ * @brief Binds the current thread to a cpu, or to its node if the cpu is offline.
+ *
+ * @param cpu The ID of the cpu to which the current thread should be bound.
+ * @param node The NUMA node of cpu.
  *
  * @return Returns 0 on success and -1 on error.
  */
-static int set_thread_affinity(int core_id)
+static int set_thread_affinity(int cpu, int node)
 {
-  cpu_set_t cpuset;
-  pthread_t current;
+  struct cpu_set set;
+  int rc;
 
-  if (core_id < 0 || core_id >= ncpus)
+  if (cpu < 0 || cpu >= ncpus || cpu_set_alloc(&set, ncpus))
     return -1;
-  CPU_ZERO(&cpuset);
-  CPU_SET(core_id, &cpuset);
+  CPU_SET_S(cpu, set.size, set.set);
+  rc = cpu_bind(&set);
+  if (rc && cpu_online(&set, node) > 0)
+    rc = cpu_bind(&set);
+  cpu_set_free(&set);
+  return rc;
+}
+
+/**
+ * @brief Binds the current thread to the online cpus of a NUMA node.
+ *
+ * @param node The node, nothing is done if negative.
+ *
+ * @return Returns 0 on success and -1 on error.
+ */
+static int set_thread_node(int node)
+{
+  struct cpu_set set;
+  int rc = -1;
 
-  current = pthread_self();
-  return pthread_setaffinity_np(current, sizeof(cpu_set_t), &cpuset);
+  if (node < 0)
+    return 0;
+  if (cpu_set_alloc(&set, ncpus))
+    return -1;
+  if (cpu_online(&set, node) > 0)
+    rc = cpu_bind(&set);
+  cpu_set_free(&set);
+  return rc;
 }
 
 #define TIME_US 1000L
@@ -564,12 +2396,86 @@ static int set_thread_affinity(int core_id)
 #define POL_FLAG (POLLIN|POLLRDNORM|POLLERR)
 #define RELAY_POLL_TIMEOUT 1000L
 
+/* pipeline worker wait when its rings are empty, doubling up to the max, in us */
+#define PIPELINE_MIN_WAIT 50L
+#define PIPELINE_MAX_WAIT 5000L
+
+/* whether a job started at gen is to keep going */
+static inline bool relay_live(uint64_t gen)
+{
+  return running && atomic_load_explicit(&relay_gen, memory_order_relaxed)==gen;
+}
+
+/* whether the pool of a job started at gen was abandoned */
+static inline bool relay_abandoned(uint64_t gen)
+{
+  return atomic_load_explicit(&relay_gen, memory_order_relaxed)!=gen;
+}
+
+/* sleep for s at most, returns as soon as running is cleared */
+static inline void relay_wait(const struct timespec* s)
+{
+  struct pollfd pollfd;
+
+  pollfd.fd = wake_fd;
+  pollfd.events = POLLIN;
+  ppoll(&pollfd, 1, s, NULL);
+}
+
+/**
+ * @brief Drains a channel until it is empty, once running is cleared.
+ *
+ * In pipeline mode a full ring is retried until the workers have made room.
+ * Gives up once the stop deadline has passed, the rest is lost, or at
+ * once if the pool of the job was abandoned.
+ */
+static void channel_final_drain(struct job_parameters *params, uint64_t gen)
+{
+  struct timespec s = { 0, PIPELINE_MIN_WAIT * TIME_US };
+  bool full;
+  bool stalled;
+
+  if(relay_abandoned(gen))
+    return;
+  do{
+    full = false;
+    stalled = false;
+    relay_drain(params, &full, &stalled);
+    if(stalled)
+      nanosleep(&s, NULL);
+  }while((full || stalled) && !relay_overdue() && !relay_abandoned(gen));
+  if(full || stalled)
+    record_error("Stop deadline reached, channel %d not drained.", params->cpu);
+}
+
+/**
+ * @brief Closes a channel whose cpu went offline.
+ *
+ * Called by the thread draining the channel, what the cpu wrote before going
+ * offline is read first. Data left in relayfs, e.g. because the ring is
+ * full, is read once the channel is opened again.
+ */
+static void channel_retire(struct job_parameters *params)
+{
+  bool full;
+  bool stalled;
+
+  relay_drain(params, &full, &stalled);
+  if(params->buf){
+    free_read_buffer(params->buf, params->size);
+    params->buf = NULL;
+  }
+  channel_close(params);
+}
+
 /**
  *  @brief This function continuously monitors a relayfs file descriptor for POL_FLAG events, and processes the I/O when available.
  *
  *  It first sets CPU affinity of the current thread to the specified CPU, then enters a loop where it
  *  waits for a specific time interval, polls a file descriptor for the occurrence of a specified event, and
- *  processes the data using ___read_relay function. The loop continues until running set to false. 
+ *  processes the data using ___read_relay function. The loop continues until running set to false,
+ *  the channel being then drained one last time, or until the CPU goes offline, the channel
+ *  being then closed, see channel_retire.
  * 
  *  @param data: a point to reader job parameter, including fields: relayfs fd, prov_elt size, callback function that processes each prov_elt
  */
@@ -577,30 +2483,563 @@ static void reader_job(void *data)
 {
   int rc;
   struct job_parameters *params = (struct job_parameters*)data;
-  struct pollfd pollfd;
+  struct pollfd pollfd[2];
   struct timespec s;
+  bool full;
+  bool stalled;
+  uint64_t gen = atomic_load(&relay_gen);
 
   s.tv_sec = 0;
   s.tv_nsec = 5 * TIME_MS;
 
-  rc = set_thread_affinity(params->cpu);
-  if (rc) {
+  rc = set_thread_affinity(params->cpu, params->node);
+  if (rc)
     record_error("Failed setting cpu affinity (%d).", rc);
-    exit(-1);
-  }
 
   do{
-    nanosleep(&s, NULL);
+    relay_wait(&s);
     /* file to look on */
-    pollfd.fd = params->fd;
+    pollfd[0].fd = params->fd;
     /* something to read */
-		pollfd.events = POL_FLAG;
-    /* one file, timeout */
-    rc = poll(&pollfd, 1, RELAY_POLL_TIMEOUT);
+		pollfd[0].events = POL_FLAG;
+    /* or stop */
+    pollfd[1].fd = wake_fd;
+    pollfd[1].events = POLLIN;
+    rc = poll(pollfd, 2, RELAY_POLL_TIMEOUT);
     if(rc<0){
       record_error("Failed while polling (%d).", rc);
       continue; /* something bad happened */
     }
-    ___read_relay(params->fd, params->size, params->callback);
-  }while(running);
+    relay_drain(params, &full, &stalled);
+    if(atomic_load_explicit(&params->state, memory_order_acquire)==CHANNEL_CLOSING){
+      channel_retire(params);
+      atomic_fetch_sub_explicit(&ndrainers, 1, memory_order_release);
+      atomic_fetch_sub_explicit(&params->pool->used, 1, memory_order_release);
+      return;
+    }
+  }while(relay_live(gen));
+  channel_final_drain(params, gen);
+  if (params->buf) {
+    free_read_buffer(params->buf, params->size);
+    params->buf = NULL;
+  }
+  atomic_fetch_sub_explicit(&ndrainers, 1, memory_order_release);
+  atomic_fetch_sub_explicit(&params->pool->used, 1, memory_order_release);
+}
+
+/* reactor wait after a round that read some data, lets small amounts accumulate */
+#define REACTOR_MIN_WAIT 1
+#define REACTOR_MAX_EVENTS 64
+
+/**
+ * @brief Chooses how long a reactor waits before its next round.
+ *
+ * The decision is based on the fill rate observed during the last round:
+ * a channel filling a whole read buffer means more data is pending and the
+ * reactor busy-polls, some data means a short wait, no data at all doubles
+ * the previous wait up to RELAY_POLL_TIMEOUT. A full pipeline ring is
+ * treated as activity, leaving the workers a short time to catch up.
+ *
+ * @param timeout wait used for the last round, in ms
+ * @param read number of bytes read during the last round
+ * @param full whether a channel filled its read buffer during the last round
+ * @param stalled whether a channel ring was found full during the last round
+ *
+ * @return Returns the epoll_wait timeout to use, in ms.
+ */
+static inline int reactor_backoff(int timeout, size_t read, bool full, bool stalled)
+{
+  if(full && !stalled)
+    return 0;
+  if(read>0 || stalled || timeout<REACTOR_MIN_WAIT)
+    return REACTOR_MIN_WAIT;
+  if(timeout*2 > RELAY_POLL_TIMEOUT)
+    return RELAY_POLL_TIMEOUT;
+  return timeout*2;
+}
+
+/**
+ *  @brief Event loop of an epoll reactor serving several relay channels.
+ *
+ *  The reactor is bound to the cpus of the NUMA node whose channels it serves.
+ *  Channels reported ready by epoll are drained. After a busy or timed out round
+ *  all channels are drained, as relayfs only wakes readers up once a sub-buffer
+ *  is complete. The wait between rounds adapts to the observed load, see
+ *  reactor_backoff. Channels whose cpu went offline are closed after the round.
+ *  Once running is cleared, all the channels are drained one last time.
+ *
+ *  @param data: a pointer to the reactor channel group
+ */
+static void reactor_job(void *data)
+{
+  int rc;
+  int i;
+  size_t j;
+  size_t n;
+  int timeout = RELAY_POLL_TIMEOUT;
+  size_t read;
+  bool full;
+  bool stalled;
+  struct channel_group *reactor = (struct channel_group*)data;
+  struct job_parameters *params;
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  uint64_t gen = atomic_load(&relay_gen);
+
+  rc = set_thread_node(reactor->node);
+  if (rc)
+    record_error("Failed setting cpu affinity (%d).", rc);
+
+  do{
+    rc = epoll_wait(reactor->epfd, events, REACTOR_MAX_EVENTS, timeout);
+    if(rc<0){
+      if(errno!=EINTR)
+        record_error("Failed while polling (%d).", errno);
+      continue;
+    }
+    read = 0;
+    full = false;
+    stalled = false;
+    n = atomic_load_explicit(&reactor->nchannels, memory_order_acquire);
+    if(rc==0 || timeout==0){
+      for(j=0; j<n; j++){
+        if(atomic_load_explicit(&reactor->channels[j]->state, memory_order_acquire)==CHANNEL_ACTIVE)
+          read += relay_drain(reactor->channels[j], &full, &stalled);
+      }
+    }else{
+      for(i=0; i<rc; i++){
+        if(events[i].data.ptr) // NULL for wake_fd
+          read += relay_drain((struct job_parameters*)events[i].data.ptr, &full, &stalled);
+      }
+    }
+    for(j=0; j<n; j++){
+      params = reactor->channels[j];
+      if(atomic_load_explicit(&params->state, memory_order_acquire)!=CHANNEL_CLOSING)
+        continue;
+      epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, params->fd, NULL);
+      channel_retire(params);
+    }
+    timeout = reactor_backoff(timeout, read, full, stalled);
+  }while(relay_live(gen));
+
+  n = atomic_load_explicit(&reactor->nchannels, memory_order_acquire);
+  for(j=0; j<n; j++){
+    if(atomic_load_explicit(&reactor->channels[j]->state, memory_order_acquire)!=CHANNEL_OFFLINE)
+      channel_final_drain(reactor->channels[j], gen);
+  }
+  atomic_fetch_sub_explicit(&ndrainers, 1, memory_order_release);
+}
+
+/* run the callbacks on up to PROV_RELAY_BATCH_LENGTH elements queued in a ring */
+static size_t pipeline_consume(struct job_parameters *params)
+{
+  uint8_t* entry;
+  size_t n;
+
+  entry = ring_peek(params->ring, &n);
+  if(n==0)
+    return 0;
+  if(n>PROV_RELAY_BATCH_LENGTH)
+    n = PROV_RELAY_BATCH_LENGTH;
+  run_callbacks(entry, params->size, n, params->callback, params->batch_callback);
+  ring_consume(params->ring, n);
+  return n;
+}
+
+/**
+ *  @brief Event loop of a pipeline worker.
+ *
+ *  The worker is bound to the cpus of the NUMA node whose channels it serves.
+ *  It runs the callbacks on the elements queued in its rings, in place, and
+ *  releases the slots to the readers afterwards. When all its rings are empty
+ *  it sleeps, the sleep doubling while nothing is queued. Once running is
+ *  cleared, the rings are emptied until the readers have finished their last
+ *  drain, or the stop deadline has passed.
+ *
+ *  @param data: a pointer to the pipeline worker channel group
+ */
+static void pipeline_job(void *data)
+{
+  int rc;
+  size_t i;
+  size_t n;
+  size_t nrings;
+  bool drained;
+  struct channel_group *worker = (struct channel_group*)data;
+  struct timespec s;
+  long wait = PIPELINE_MIN_WAIT;
+  uint64_t gen = atomic_load(&relay_gen);
+
+  rc = set_thread_node(worker->node);
+  if (rc)
+    record_error("Failed setting cpu affinity (%d).", rc);
+
+  s.tv_sec = 0;
+  do{
+    n = 0;
+    nrings = atomic_load_explicit(&worker->nchannels, memory_order_acquire);
+    for(i=0; i<nrings; i++)
+      n += pipeline_consume(worker->channels[i]);
+    relay_sweep(pending_now());
+    if(n>0){
+      wait = PIPELINE_MIN_WAIT;
+      continue;
+    }
+    s.tv_nsec = wait * TIME_US;
+    relay_wait(&s);
+    if(wait*2 <= PIPELINE_MAX_WAIT)
+      wait *= 2;
+  }while(relay_live(gen));
+
+  s.tv_nsec = PIPELINE_MIN_WAIT * TIME_US;
+  while(!relay_abandoned(gen)){
+    /* once no reader is left, one more pass empties the rings */
+    drained = atomic_load_explicit(&ndrainers, memory_order_acquire)==0;
+    n = 0;
+    nrings = atomic_load_explicit(&worker->nchannels, memory_order_acquire);
+    for(i=0; i<nrings; i++)
+      n += pipeline_consume(worker->channels[i]);
+    if(n==0){
+      if(drained)
+        break;
+      nanosleep(&s, NULL);
+    }
+    if(relay_overdue())
+      break;
+  }
+}
+
+/**
+ *  @brief Follows cpu hotplug, every hotplug_interval ms.
+ *
+ *  Channels of cpus that came online are opened and started; relayfs
+ *  creates them when the cpu first comes up, the open is retried until they
+ *  appear. Channels of cpus that went offline are marked closing, the thread
+ *  draining them closes them, see channel_retire.
+ *
+ *  @param data: unused
+ */
+static void hotplug_job(void *data)
+{
+  struct cpu_set online;
+  struct job_parameters *params;
+  struct timespec s;
+  uint64_t next;
+  uint32_t interval = prov_ops.hotplug_interval ? prov_ops.hotplug_interval : PROV_HOTPLUG_INTERVAL;
+  int expected;
+  int cpu;
+  int i;
+  uint64_t gen = atomic_load(&relay_gen);
+
+  if(cpu_set_alloc(&online, ncpus))
+    return;
+  s.tv_sec = 0;
+  s.tv_nsec = 100 * TIME_MS;
+  next = pending_now()+interval;
+  do{
+    relay_wait(&s);
+    if(!relay_live(gen))
+      break;
+    if(pending_now()<next)
+      continue;
+    next = pending_now()+interval;
+    if(cpu_online(&online, -1)<=0)
+      continue;
+    for(cpu=0; cpu<ncpus; cpu++){
+      for(i=2*cpu; i<2*cpu+2; i++){
+        params = channels[i];
+        if(!cpu_set_has(&online, cpu)){
+          expected = CHANNEL_ACTIVE;
+          atomic_compare_exchange_strong(&params->state, &expected, CHANNEL_CLOSING);
+          continue;
+        }
+        if(atomic_load_explicit(&params->state, memory_order_acquire)!=CHANNEL_OFFLINE)
+          continue;
+        if(channel_open(params))
+          continue;
+        channel_start(params);
+      }
+    }
+  }while(relay_live(gen));
+  cpu_set_free(&online);
+}
+
+/**
+ *  @brief Overload control monitor, every overload interval ms.
+ *
+ *  Measures the ring fill, callback latency and kernel drops and moves the
+ *  overload level accordingly, see overload_check. Level changes are
+ *  disclosed with the counts of elements shed.
+ *
+ *  @param data: unused
+ */
+static void overload_job(void *data)
+{
+  struct overload_signals signals;
+  struct timespec s;
+  uint64_t next;
+  uint32_t interval = overload_interval();
+  bool changed;
+  uint64_t gen = atomic_load(&relay_gen);
+
+  s.tv_sec = 0;
+  s.tv_nsec = 100 * TIME_MS;
+  next = pending_now();
+  do{
+    if(pending_now()>=next){
+      next = pending_now()+interval;
+      if(overload_collect(&signals))
+        continue;
+      changed = overload_check(&signals);
+      if(changed && overload_disclose(&signals, true)<0)
+        record_error("Failed disclosing overload (%d).", errno);
+    }
+    relay_wait(&s);
+  }while(relay_live(gen));
+}
+
+/**
+ *  @brief Replays a capture file through the callbacks.
+ *
+ *  The file is mapped privately, callbacks receive pointers into the mapping
+ *  and may modify the elements as they would the relay read buffer. Elements
+ *  are delivered in chunks of PROV_RELAY_BATCH_LENGTH, as a relay read would.
+ *
+ *  @param data: a pointer to the job parameters of the file, freed on exit
+ */
+static void replay_job(void *data)
+{
+  struct job_parameters *params = (struct job_parameters*)data;
+  struct stat st;
+  uint8_t* map;
+  size_t size;
+  size_t off;
+  size_t n;
+
+  if(fstat(params->fd, &st)<0){
+    record_error("Failed reading capture %d (%d).", params->cpu, errno);
+    goto out;
+  }
+  size = st.st_size - st.st_size%params->size;
+  if(size!=st.st_size)
+    record_error("Capture %d truncated, %zu trailing bytes ignored.", params->cpu, (size_t)(st.st_size-size));
+  if(size==0)
+    goto out;
+  map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE, params->fd, 0);
+  if(map==MAP_FAILED){
+    record_error("Failed mapping capture %d (%d).", params->cpu, errno);
+    goto out;
+  }
+  madvise(map, size, MADV_SEQUENTIAL);
+  for(off=0; off<size; off+=n*params->size){
+    n = (size-off)/params->size;
+    if(n>PROV_RELAY_BATCH_LENGTH)
+      n = PROV_RELAY_BATCH_LENGTH;
+    run_callbacks(map+off, params->size, n, params->callback, params->batch_callback);
+    relay_sweep(pending_now());
+  }
+  munmap(map, size);
+out:
+  close(params->fd);
+  free(params);
+}
+
+/* capture file of a channel, name is CAPTURE_NAME or LONG_CAPTURE_NAME followed by the cpu */
+static struct job_parameters* open_capture(const char* dir, const char* name)
+{
+  struct job_parameters *params;
+  char tmp[PATH_MAX];
+  char* end;
+  bool is_long;
+  long cpu;
+  int fd;
+
+  if(strncmp(name, CAPTURE_NAME, strlen(CAPTURE_NAME))==0){
+    is_long = false;
+    name += strlen(CAPTURE_NAME);
+  }else if(strncmp(name, LONG_CAPTURE_NAME, strlen(LONG_CAPTURE_NAME))==0){
+    is_long = true;
+    name += strlen(LONG_CAPTURE_NAME);
+  }else
+    return NULL;
+  if(*name<'0' || *name>'9')
+    return NULL;
+  cpu = strtol(name, &end, 10);
+  if(*end!='\0' || cpu>INT_MAX)
+    return NULL;
+  snprintf(tmp, PATH_MAX, "%s/%s%ld", dir, is_long ? LONG_CAPTURE_NAME : CAPTURE_NAME, cpu);
+  fd = open(tmp, O_RDONLY | O_CLOEXEC);
+  if(fd<0)
+    return NULL;
+  params = alloc_job_parameters(cpu, is_long); // will be freed in worker
+  if(!params){
+    close(fd);
+    return NULL;
+  }
+  params->fd = fd;
+  return params;
+}
+
+int provenance_relay_replay(struct provenance_ops* ops, const char* dir)
+{
+  struct job_parameters **params = NULL;
+  struct job_parameters **tmp;
+  struct job_parameters *p;
+  struct dirent *e;
+  threadpool pool;
+  DIR *d;
+  size_t n = 0;
+  size_t i;
+  int err;
+
+  err = ops_hold(ops);
+  if(err){
+    record_error("Callbacks in use by a running relay or receiver.");
+    return err;
+  }
+  prov_ops.capture_dir = NULL;
+
+  d = opendir(dir);
+  if(!d){
+    record_error("Could not open %s (%d).", dir, errno);
+    ops_release();
+    return -1;
+  }
+  while((e = readdir(d))){
+    p = open_capture(dir, e->d_name);
+    if(!p)
+      continue;
+    tmp = realloc(params, (n+1)*sizeof(struct job_parameters*));
+    if(!tmp){
+      close(p->fd);
+      free(p);
+      break;
+    }
+    params = tmp;
+    params[n++] = p;
+  }
+  closedir(d);
+  if(n==0){
+    record_error("No capture found in %s.", dir);
+    free(params);
+    ops_release();
+    return -1;
+  }
+
+  pool = thpool_init(n);
+  if(!pool){
+    for(i=0; i<n; i++){
+      close(params[i]->fd);
+      free(params[i]);
+    }
+    free(params);
+    ops_release();
+    return -1;
+  }
+  for(i=0; i<n; i++)
+    thpool_add_work(pool, (void*)replay_job, (void*)params[i]);
+  thpool_wait(pool);
+  thpool_destroy(pool);
+  free(params);
+  relay_sweep(UINT64_MAX); // record nodes still waiting for a name and relations held
+  relay_flush_output(UINT64_MAX);
+  ops_release();
+  return 0;
+}
+
+/*
+ * Elements received by a connection thread, delivered as relay reads would
+ * be. Long batches are shorter, there may be a connection per host.
+ */
+#define RECEIVE_LONG_BATCH_LENGTH 64
+
+static const size_t receive_batch[2] = {PROV_RELAY_BATCH_LENGTH, RECEIVE_LONG_BATCH_LENGTH};
+static __thread uint8_t* receive_buf[2];
+static __thread size_t receive_count[2];
+
+static void receive_flush(bool is_long)
+{
+  if(receive_count[is_long]==0)
+    return;
+  if(is_long)
+    run_callbacks(receive_buf[1], sizeof(union long_prov_elt), receive_count[1],
+                  long_callback_job, use_long_batch() ? long_callback_batch_job : NULL);
+  else
+    run_callbacks(receive_buf[0], sizeof(union prov_elt), receive_count[0],
+                  callback_job, use_batch() ? callback_batch_job : NULL);
+  receive_count[is_long] = 0;
+}
+
+static void receive_element(const struct prov_transport_peer* peer, prov_entry_t* msg, bool is_long)
+{
+  const size_t size = is_long ? sizeof(union long_prov_elt) : sizeof(union prov_elt);
+
+  if(!receive_buf[is_long]){
+    receive_buf[is_long] = (uint8_t*)malloc(receive_batch[is_long]*size);
+    if(!receive_buf[is_long]){
+      record_error("Failed allocating receive buffer (%d).", errno);
+      return;
+    }
+  }
+  memcpy(receive_buf[is_long]+receive_count[is_long]*size, msg, size);
+  if(++receive_count[is_long]==receive_batch[is_long])
+    receive_flush(is_long);
+}
+
+/**
+ *  @brief Runs the callbacks on the elements of a frame once it is decoded.
+ *
+ *  Long elements go first, so that nodes seldom wait for the name they
+ *  refer to, see record_or_park.
+ *
+ *  @param peer: sender of the frame
+ */
+static void receive_frame(const struct prov_transport_peer* peer)
+{
+  receive_flush(true);
+  receive_flush(false);
+  relay_sweep(pending_now());
+}
+
+static void receive_closed(const struct prov_transport_peer* peer)
+{
+  int i;
+
+  receive_frame(peer);
+  for(i=0; i<2; i++){
+    free(receive_buf[i]);
+    receive_buf[i] = NULL;
+  }
+}
+
+int provenance_relay_receive(struct provenance_ops* ops, const char* address,
+                             const char* port, const struct prov_transport_conf* conf)
+{
+  struct prov_transport_receiver receiver;
+  int err;
+
+  err = ops_hold(ops);
+  if(err){
+    record_error("Callbacks in use by a running relay or receiver.");
+    return err;
+  }
+  prov_ops.capture_dir = NULL;
+
+  memset(&receiver, 0, sizeof(struct prov_transport_receiver));
+  receiver.element = receive_element;
+  receiver.frame = receive_frame;
+  receiver.closed = receive_closed;
+  err = transport_listen(address, port, conf, &receiver);
+  if(err){
+    record_error("Could not listen on %s:%s (%d).", address ? address : "*", port, -err);
+    ops_release();
+  }
+  return err;
+}
+
+void provenance_relay_receive_stop(void)
+{
+  transport_listen_stop();
+  relay_sweep(UINT64_MAX); // record nodes still waiting for a name and relations held
+  relay_flush_output(UINT64_MAX);
+  ops_release();
 }
@@ -0,0 +1,189 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "relaycpu.h"
+
+#define CPU_SYSFS  "/sys/devices/system/cpu"
+#define NODE_SYSFS "/sys/devices/system/node"
+
+/**
+ * @brief Parses a sysfs cpu or node list, e.g. "0-3,8,10-11".
+ *
+ * @param path file holding the list
+ * @param fn called for every id of the list
+ * @param arg passed to fn
+ *
+ * @return Returns the highest id + 1, 0 if the list is empty or -1 if it could not be read.
+ */
+static int __list_parse(const char* path, void (*fn)(int id, void* arg), void* arg)
+{
+  char buf[4096];
+  char* p = buf;
+  char* end;
+  long first, last, id;
+  int max = 0;
+  FILE* f = fopen(path, "re");
+
+  if(!f)
+    return -1;
+  if(!fgets(buf, sizeof(buf), f)){
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  while(*p && *p!='\n'){
+    first = strtol(p, &end, 10);
+    if(end==p || first<0)
+      return -1;
+    last = first;
+    p = end;
+    if(*p=='-'){
+      last = strtol(p+1, &end, 10);
+      if(end==p+1 || last<first)
+        return -1;
+      p = end;
+    }
+    for(id=first; id<=last; id++){
+      if(fn)
+        fn(id, arg);
+    }
+    if(last+1>max)
+      max = last+1;
+    if(*p==',')
+      p++;
+  }
+  return max;
+}
+
+static void __set_cpu(int id, void* arg)
+{
+  struct cpu_set* set = (struct cpu_set*)arg;
+
+  if((size_t)id < set->size*8)
+    CPU_SET_S(id, set->size, set->set);
+}
+
+int cpu_possible(void)
+{
+  int n = __list_parse(CPU_SYSFS "/possible", NULL, NULL);
+  long conf;
+
+  if(n>0)
+    return n;
+  conf = sysconf(_SC_NPROCESSORS_CONF);
+  return conf>0 ? conf : 1;
+}
+
+int cpu_nodes(void)
+{
+  int n = __list_parse(NODE_SYSFS "/possible", NULL, NULL);
+
+  return n>0 ? n : 1;
+}
+
+int cpu_node(int cpu)
+{
+  char path[64];
+  struct dirent* e;
+  DIR* d;
+  int node = 0;
+
+  snprintf(path, sizeof(path), CPU_SYSFS "/cpu%d", cpu);
+  d = opendir(path);
+  if(!d)
+    return 0;
+  while((e = readdir(d))){
+    if(strncmp(e->d_name, "node", 4)==0 && e->d_name[4]>='0' && e->d_name[4]<='9'){
+      node = atoi(e->d_name+4);
+      break;
+    }
+  }
+  closedir(d);
+  return node;
+}
+
+int cpu_set_alloc(struct cpu_set* set, int ncpus)
+{
+  set->set = CPU_ALLOC(ncpus);
+  if(!set->set)
+    return -1;
+  set->size = CPU_ALLOC_SIZE(ncpus);
+  CPU_ZERO_S(set->size, set->set);
+  return 0;
+}
+
+void cpu_set_free(struct cpu_set* set)
+{
+  if(set->set)
+    CPU_FREE(set->set);
+  set->set = NULL;
+  set->size = 0;
+}
+
+static int __cpu_online_all(struct cpu_set* set)
+{
+  long n;
+  int i;
+
+  CPU_ZERO_S(set->size, set->set);
+  if(__list_parse(CPU_SYSFS "/online", __set_cpu, set)<0){
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n<=0)
+      return -1;
+    for(i=0; i<n; i++)
+      __set_cpu(i, set);
+  }
+  return CPU_COUNT_S(set->size, set->set);
+}
+
+int cpu_online(struct cpu_set* set, int node)
+{
+  struct cpu_set online;
+  char path[64];
+  int rc;
+
+  rc = __cpu_online_all(set);
+  if(node<0 || rc<0)
+    return rc;
+  if(cpu_set_alloc(&online, set->size*8))
+    return -1;
+  CPU_OR_S(online.size, online.set, online.set, set->set);
+  CPU_ZERO_S(set->size, set->set);
+  snprintf(path, sizeof(path), NODE_SYSFS "/node%d/cpulist", node);
+  if(__list_parse(path, __set_cpu, set)<0){
+    /* no NUMA information, everything is on node 0 */
+    if(node==0)
+      CPU_OR_S(set->size, set->set, set->set, online.set);
+  }
+  CPU_AND_S(set->size, set->set, set->set, online.set);
+  cpu_set_free(&online);
+  return CPU_COUNT_S(set->size, set->set);
+}
+
+int cpu_bind(const struct cpu_set* set)
+{
+  if(CPU_COUNT_S(set->size, set->set)==0)
+    return -1;
+  return pthread_setaffinity_np(pthread_self(), set->size, set->set);
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __RELAYCPU_H
+#define __RELAYCPU_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * CPU and NUMA topology, read from sysfs. The cpu sets are allocated with
+ * CPU_ALLOC for the possible cpus, so that hosts with more than CPU_SETSIZE
+ * cpus are supported. On systems without the sysfs files, cpus 0 to
+ * _SC_NPROCESSORS_ONLN-1 are online and all on node 0.
+ */
+struct cpu_set {
+  cpu_set_t* set;
+  size_t size; /* bytes, for the CPU_*_S macros */
+};
+
+/* highest possible cpu id + 1 */
+int cpu_possible(void);
+/* highest possible node id + 1 */
+int cpu_nodes(void);
+/* node of cpu, 0 if not known */
+int cpu_node(int cpu);
+
+int cpu_set_alloc(struct cpu_set* set, int ncpus);
+void cpu_set_free(struct cpu_set* set);
+
+static inline bool cpu_set_has(const struct cpu_set* set, int cpu)
+{
+  return CPU_ISSET_S(cpu, set->size, set->set)!=0;
+}
+
+/* fill set with the online cpus, of node if node>=0, returns their number or -1 */
+int cpu_online(struct cpu_set* set, int node);
+/* bind the calling thread to the cpus of set */
+int cpu_bind(const struct cpu_set* set);
+
+#endif /* __RELAYCPU_H */
@@ -0,0 +1,194 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/provenance_types.h>
+
+#include "provenance.h"
+#include "relayoverload.h"
+
+_Atomic int overload_level = PROV_OVERLOAD_NONE;
+
+/* set on register, read only while the relay runs */
+static struct prov_overload_policy policy;
+static uint64_t sampled[PROV_OVERLOAD_TYPES];
+static const uint64_t default_sampled[] = {RL_READ, RL_WRITE, RL_PERM_READ, RL_PERM_WRITE, RL_SND, RL_RCV};
+
+/* monitor state, only used by the thread calling overload_check */
+static struct overload_signals last;
+static bool primed = false;
+static uint32_t calm = 0; /* consecutive checks below half the thresholds */
+static uint64_t disclosed_packets = 0;
+static uint64_t disclosed_relations = 0;
+
+int overload_init(const struct prov_overload_policy* p)
+{
+  atomic_store(&overload_level, PROV_OVERLOAD_NONE);
+  primed = false;
+  calm = 0;
+  disclosed_packets = 0;
+  disclosed_relations = 0;
+  memset(&policy, 0, sizeof(struct prov_overload_policy));
+  if(!p)
+    return 0;
+  if(p->sampled && p->nsampled>PROV_OVERLOAD_TYPES)
+    return -EINVAL;
+  memcpy(&policy, p, sizeof(struct prov_overload_policy));
+  if(!policy.interval)
+    policy.interval = PROV_OVERLOAD_INTERVAL;
+  if(!policy.ring_high)
+    policy.ring_high = PROV_OVERLOAD_RING_HIGH;
+  if(!policy.latency_high)
+    policy.latency_high = PROV_OVERLOAD_LATENCY_HIGH;
+  if(!policy.recover)
+    policy.recover = PROV_OVERLOAD_RECOVER;
+  if(!policy.sample)
+    policy.sample = PROV_OVERLOAD_SAMPLE_RATE;
+  if(p->sampled){
+    memcpy(sampled, p->sampled, p->nsampled*sizeof(uint64_t));
+  }else{
+    policy.nsampled = sizeof(default_sampled)/sizeof(uint64_t);
+    memcpy(sampled, default_sampled, sizeof(default_sampled));
+  }
+  policy.sampled = sampled;
+  return 0;
+}
+
+uint32_t overload_interval(void)
+{
+  return policy.interval;
+}
+
+/**
+ * @brief Decides whether a relation of a sampled type is dropped.
+ *
+ * The decision hashes the relation identifier, so that one in sample is kept
+ * whichever thread records it.
+ */
+bool __overload_sampled_out(prov_entry_t* msg)
+{
+  uint64_t type = prov_type(msg);
+  uint64_t h;
+  size_t i;
+
+  for(i=0; i<policy.nsampled; i++){
+    if(sampled[i]==type)
+      break;
+  }
+  if(i==policy.nsampled)
+    return false;
+  h = msg->relation_info.identifier.relation_id.id * 0x9e3779b97f4a7c15ULL;
+  return (h>>32) % policy.sample != 0;
+}
+
+static inline bool __overload_above(uint64_t v, uint32_t high)
+{
+  return high!=UINT32_MAX && v>=high;
+}
+
+static inline bool __overload_below(uint64_t v, uint32_t high)
+{
+  return high==UINT32_MAX || v<high/2;
+}
+
+/**
+ * @brief Moves the overload level according to the signals measured.
+ *
+ * The level goes one up at each check a threshold is crossed, and one down
+ * after recover consecutive checks with all the signals below half their
+ * threshold. The first check only records the counters.
+ *
+ * @param now signals measured, counters are cumulative
+ *
+ * @return Returns true if the level changed.
+ */
+bool overload_check(const struct overload_signals* now)
+{
+  int level = atomic_load_explicit(&overload_level, memory_order_relaxed);
+  int prev = level;
+  uint64_t latency = 0; /* us */
+  uint64_t dropped = 0;
+  bool hot;
+  bool cool;
+
+  if(!primed){
+    last = *now;
+    primed = true;
+    return false;
+  }
+  if(now->callbacks>last.callbacks)
+    latency = (now->callback_ns-last.callback_ns)/(now->callbacks-last.callbacks)/1000;
+  if(now->kernel_dropped>last.kernel_dropped)
+    dropped = now->kernel_dropped-last.kernel_dropped;
+  last = *now;
+
+  hot = __overload_above(now->ring, policy.ring_high)
+    || __overload_above(latency, policy.latency_high)
+    || (!policy.ignore_kernel_drops && dropped>0);
+  cool = __overload_below(now->ring, policy.ring_high)
+    && __overload_below(latency, policy.latency_high)
+    && (policy.ignore_kernel_drops || dropped==0);
+  if(hot){
+    calm = 0;
+    if(level<PROV_OVERLOAD_SAMPLE)
+      level++;
+  }else if(!cool || level==PROV_OVERLOAD_NONE)
+    calm = 0;
+  else if(++calm>=policy.recover){
+    calm = 0;
+    level--;
+  }
+  if(level==prev)
+    return false;
+  atomic_store_explicit(&overload_level, level, memory_order_relaxed);
+  return true;
+}
+
+/**
+ * @brief Discloses the overload level and the elements shed so far.
+ *
+ * The ENT_DISC node goes through the kernel, see provenance_disclose_node,
+ * and lands in the graph next to the elements it accounts for.
+ *
+ * @param now signals measured, for the shed counts
+ * @param changed whether the level just changed
+ *
+ * @return Returns 0 if disclosed or nothing new to disclose, <0 on error.
+ */
+int overload_disclose(const struct overload_signals* now, bool changed)
+{
+  struct disc_node_struct node;
+  int rc;
+
+  if(!changed && now->shed_packets==disclosed_packets && now->shed_relations==disclosed_relations)
+    return 0;
+  memset(&node, 0, sizeof(struct disc_node_struct));
+  node.identifier.node_id.type = ENT_DISC;
+  snprintf(node.content, PATH_MAX,
+    "\"cf:overload\":\"%d\",\"cf:shed_packet_content\":\"%llu\",\"cf:shed_relations\":\"%llu\",\"cf:kernel_dropped\":\"%llu\"",
+    atomic_load_explicit(&overload_level, memory_order_relaxed),
+    (unsigned long long)now->shed_packets,
+    (unsigned long long)now->shed_relations,
+    (unsigned long long)now->kernel_dropped);
+  node.length = strnlen(node.content, PATH_MAX);
+  rc = provenance_disclose_node(&node);
+  if(rc<0)
+    return rc;
+  disclosed_packets = now->shed_packets;
+  disclosed_relations = now->shed_relations;
+  return 0;
+}
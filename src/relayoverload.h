@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __RELAYOVERLOAD_H
+#define __RELAYOVERLOAD_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/provenance_types.h>
+
+#include "provenance.h"
+#include "provenancestats.h"
+
+/*
+ * Overload control, see prov_overload_policy. The relay monitor calls
+ * overload_check every interval with the signals it measured, the level
+ * decided is applied to every element by overload_shed. Counters in the
+ * signals are cumulative, overload_check works on their variation.
+ */
+struct overload_signals {
+  uint32_t ring; /* percent of the fullest pipeline ring in use */
+  uint64_t callbacks; /* chunks the callbacks ran on */
+  uint64_t callback_ns; /* time spent in the callbacks */
+  uint64_t kernel_dropped; /* both channels */
+  uint64_t shed_packets;
+  uint64_t shed_relations;
+};
+
+extern _Atomic int overload_level;
+
+/* NULL disables overload control, returns -EINVAL on a policy out of bounds */
+int overload_init(const struct prov_overload_policy* policy);
+uint32_t overload_interval(void);
+/* returns true if the level changed */
+bool overload_check(const struct overload_signals* signals);
+/* discloses the level and counts if changed or if more was shed since the last time, returns 0 or <0 on error */
+int overload_disclose(const struct overload_signals* signals, bool changed);
+
+bool __overload_sampled_out(prov_entry_t* msg);
+
+/* true if msg is to be dropped, counted in the per thread statistics */
+static inline bool overload_shed(prov_entry_t* msg)
+{
+  int level = atomic_load_explicit(&overload_level, memory_order_relaxed);
+
+  if(__builtin_expect(level==PROV_OVERLOAD_NONE, 1))
+    return false;
+  if(prov_type(msg)==ENT_PCKCNT){
+    stats_add(&stats_self()->shed_packets, 1);
+    return true;
+  }
+  if(level>=PROV_OVERLOAD_SAMPLE && prov_is_relation(msg) && __overload_sampled_out(msg)){
+    stats_add(&stats_self()->shed_relations, 1);
+    return true;
+  }
+  return false;
+}
+
+#endif /* __RELAYOVERLOAD_H */
@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2015-2016 University of Cambridge,
+ * Copyright (C) 2016-2017 Harvard University,
+ * Copyright (C) 2017-2018 University of Cambridge,
+ * Copyright (C) 2018-2021 University of Bristol,
+ * Copyright (C) 2021-2022 University of British Columbia
+ *
+ * Author: Thomas Pasquier <tfjmp@cs.ubc.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ */
+#ifndef __RELAYRING_H
+#define __RELAYRING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define RING_CACHE_LINE 64
+
+/*
+ * Single-producer/single-consumer ring of fixed size provenance elements.
+ * The producer is the thread draining a relay channel, the consumer the
+ * pipeline worker the channel is assigned to. head and tail count elements
+ * and only ever grow, slot of position p is p & mask.
+ */
+struct relay_ring {
+  _Atomic size_t head __attribute__((aligned(RING_CACHE_LINE)));
+  _Atomic size_t tail __attribute__((aligned(RING_CACHE_LINE)));
+  /* statistics, only written by the producer */
+  _Atomic uint64_t overflows __attribute__((aligned(RING_CACHE_LINE)));
+  _Atomic uint64_t high_water;
+  size_t mask;
+  size_t elt_size;
+  uint8_t* slots;
+};
+
+static inline size_t ring_round_depth(size_t depth)
+{
+  size_t v = 1;
+  while (v < depth)
+    v <<= 1;
+  return v;
+}
+
+static inline struct relay_ring* ring_alloc(size_t depth, size_t elt_size)
+{
+  struct relay_ring* ring;
+  void* slots;
+
+  depth = ring_round_depth(depth);
+  if (posix_memalign((void**)&ring, RING_CACHE_LINE, sizeof(struct relay_ring)))
+    return NULL;
+  slots = mmap(NULL, depth*elt_size, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  if (slots == MAP_FAILED) {
+    free(ring);
+    return NULL;
+  }
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->overflows, 0);
+  atomic_init(&ring->high_water, 0);
+  ring->mask = depth-1;
+  ring->elt_size = elt_size;
+  ring->slots = (uint8_t*)slots;
+  return ring;
+}
+
+static inline void ring_free(struct relay_ring* ring)
+{
+  munmap(ring->slots, (ring->mask+1)*ring->elt_size);
+  free(ring);
+}
+
+static inline size_t ring_depth(struct relay_ring* ring)
+{
+  return atomic_load_explicit(&ring->head, memory_order_acquire)
+    - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/*
+ * Producer side: contiguous free slots starting at the head.
+ * @n set to the number of slots available (0 if the ring is full)
+ * return a pointer to the first free slot
+ */
+static inline uint8_t* ring_reserve(struct relay_ring* ring, size_t* n)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t free_slots = ring->mask + 1 - (head - tail);
+  size_t contiguous = ring->mask + 1 - (head & ring->mask);
+
+  *n = free_slots < contiguous ? free_slots : contiguous;
+  return ring->slots + (head & ring->mask)*ring->elt_size;
+}
+
+/* producer side: make n slots previously reserved visible to the consumer */
+static inline void ring_publish(struct relay_ring* ring, size_t n)
+{
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed) + n;
+  size_t depth = head - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  atomic_store_explicit(&ring->head, head, memory_order_release);
+  if (depth > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+    atomic_store_explicit(&ring->high_water, depth, memory_order_relaxed);
+}
+
+/*
+ * Consumer side: contiguous queued elements starting at the tail.
+ * @n set to the number of elements available (0 if the ring is empty)
+ * return a pointer to the first queued element
+ */
+static inline uint8_t* ring_peek(struct relay_ring* ring, size_t* n)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t contiguous = ring->mask + 1 - (tail & ring->mask);
+  size_t queued = head - tail;
+
+  *n = queued < contiguous ? queued : contiguous;
+  return ring->slots + (tail & ring->mask)*ring->elt_size;
+}
+
+/* consumer side: release n elements once they have been processed */
+static inline void ring_consume(struct relay_ring* ring, size_t n)
+{
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
+
+#endif /* __RELAYRING_H */